@@ -0,0 +1,156 @@
+#include "admission.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+const char *const KIND_NAMES[] = {"read", "write"};
+
+std::int64_t nanoseconds(std::chrono::milliseconds duration)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+        .count();
+}
+
+} // namespace
+
+constexpr std::chrono::milliseconds AdmissionControl::PROBE_PERIOD;
+
+AdmissionControl::AdmissionControl(std::chrono::milliseconds readTarget,
+                                   std::chrono::milliseconds writeTarget,
+                                   std::chrono::milliseconds interval) :
+    m_start(std::chrono::steady_clock::now()),
+    m_interval(nanoseconds(interval))
+{
+    m_controllers[READ].target = nanoseconds(readTarget);
+    m_controllers[WRITE].target = nanoseconds(writeTarget);
+}
+
+bool AdmissionControl::enabled() const
+{
+    return m_controllers[READ].target != 0 ||
+           m_controllers[WRITE].target != 0;
+}
+
+std::int64_t AdmissionControl::now() const
+{
+    // Never 0, which marks unset times.
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - m_start)
+               .count() +
+           1;
+}
+
+void AdmissionControl::above(Controller &controller, std::int64_t at) const
+{
+    std::int64_t until = controller.aboveUntil.load();
+    if (until == 0)
+    {
+        controller.aboveUntil.compare_exchange_strong(until, at + m_interval);
+    }
+    else if (at >= until)
+    {
+        controller.shedding = true;
+    }
+}
+
+void AdmissionControl::sample(std::int64_t delay, std::int64_t at)
+{
+    for (Controller &controller : m_controllers)
+    {
+        if (controller.target == 0)
+        {
+            continue;
+        }
+        if (delay < controller.target)
+        {
+            controller.aboveUntil = 0;
+            controller.shedding = false;
+            continue;
+        }
+        above(controller, at);
+    }
+}
+
+void AdmissionControl::probe()
+{
+    const std::int64_t at = now();
+    const std::int64_t last = m_lastProbe.exchange(at);
+    if (last == 0)
+    {
+        return;
+    }
+    const std::int64_t delay =
+        std::max<std::int64_t>(at - last - nanoseconds(PROBE_PERIOD), 0);
+    m_delay = delay;
+    sample(delay, at);
+}
+
+bool AdmissionControl::admit(Kind kind)
+{
+    Controller &controller = m_controllers[kind];
+    if (controller.target == 0)
+    {
+        return true;
+    }
+    // A probe stuck behind the queue is late by at least this much
+    // already, which is news only if it breaks this kind's target.  Only
+    // probes, which see the whole delay, bring it back below.
+    const std::int64_t at = now();
+    const std::int64_t last = m_lastProbe.load();
+    const std::int64_t overdue = at - last - nanoseconds(PROBE_PERIOD);
+    if (last != 0 && overdue >= controller.target)
+    {
+        above(controller, at);
+    }
+    if (controller.shedding.load(std::memory_order_relaxed))
+    {
+        ++controller.shed;
+        return false;
+    }
+    ++controller.admitted;
+    return true;
+}
+
+unsigned AdmissionControl::retryAfterSeconds() const
+{
+    return static_cast<unsigned>(
+        std::max<std::int64_t>((m_interval + 999999999) / 1000000000, 1));
+}
+
+std::string AdmissionControl::toJson() const
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("queue_delay_ms");
+    writer.Double(static_cast<double>(m_delay.load()) / 1e6);
+    writer.Key("interval_ms");
+    writer.Double(static_cast<double>(m_interval) / 1e6);
+    for (int kind = 0; kind < NUM_KINDS; ++kind)
+    {
+        const Controller &controller = m_controllers[kind];
+        writer.Key(KIND_NAMES[kind]);
+        writer.StartObject();
+        writer.Key("target_ms");
+        writer.Double(static_cast<double>(controller.target) / 1e6);
+        writer.Key("shedding");
+        writer.Bool(controller.shedding.load());
+        writer.Key("admitted");
+        writer.Uint64(controller.admitted.load());
+        writer.Key("shed");
+        writer.Uint64(controller.shed.load());
+        writer.EndObject();
+    }
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+} // namespace comicsdb
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace comicsdb
+{
+
+// CoDel-style load shedding.  restbed queues work for its worker threads
+// out of sight, so the queueing delay is measured with a probe task the
+// service runs every PROBE_PERIOD: how late it runs is how long work waits
+// for a worker.  As in CoDel, a kind of request is only shed once the delay
+// has stayed above its target for a whole interval, so bursts pass but a
+// standing queue doesn't, and shedding stops as soon as a probe sees the
+// delay below the target again.  Reads and writes have targets of their
+// own; a target of zero never sheds.
+class AdmissionControl
+{
+  public:
+    enum Kind
+    {
+        READ,
+        WRITE,
+        NUM_KINDS
+    };
+
+    static constexpr std::chrono::milliseconds PROBE_PERIOD{5};
+
+    AdmissionControl(std::chrono::milliseconds readTarget,
+                     std::chrono::milliseconds writeTarget,
+                     std::chrono::milliseconds interval);
+
+    bool enabled() const;
+    // Called every PROBE_PERIOD from the service's scheduler.
+    void probe();
+    // False if a request of this kind should be shed.
+    bool admit(Kind kind);
+    // When a shed client should try again.
+    unsigned retryAfterSeconds() const;
+
+    std::string toJson() const;
+
+  private:
+    struct Controller
+    {
+        std::int64_t target{}; // nanoseconds
+        // When the delay will have been above target for an interval, or 0
+        // while it is below.
+        std::atomic<std::int64_t> aboveUntil{0};
+        std::atomic<bool> shedding{false};
+        std::atomic<std::uint64_t> admitted{0};
+        std::atomic<std::uint64_t> shed{0};
+    };
+
+    std::int64_t now() const;
+    // Records that the delay was above controller's target at at.
+    void above(Controller &controller, std::int64_t at) const;
+    void sample(std::int64_t delay, std::int64_t at);
+
+    const std::chrono::steady_clock::time_point m_start;
+    const std::int64_t m_interval; // nanoseconds
+    std::atomic<std::int64_t> m_lastProbe{0};
+    std::atomic<std::int64_t> m_delay{0}; // the last probe's
+    std::array<Controller, NUM_KINDS> m_controllers;
+};
+
+} // namespace comicsdb
@@ -0,0 +1,157 @@
+#include "backend.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <stdexcept>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+// Idle connections older than this are dropped rather than reused, since
+// restbed closes a quiet keep-alive connection after five seconds and a
+// write sent on one it is closing can't safely be repeated.
+constexpr std::chrono::seconds IDLE_LIMIT{2};
+
+} // namespace
+
+Backend::Backend(const std::string &address, std::size_t poolSize) :
+    m_address(address),
+    m_host(address.substr(0, address.rfind(':'))),
+    m_port(static_cast<std::uint16_t>(
+        std::stoul(address.substr(address.rfind(':') + 1)))),
+    m_poolSize(poolSize)
+{
+}
+
+Backend::~Backend()
+{
+    for (Connection &connection : m_idle)
+    {
+        restbed::Http::close(connection.request);
+    }
+}
+
+std::shared_ptr<restbed::Request> Backend::acquire(bool &reused)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        const Clock::time_point now = Clock::now();
+        while (!m_idle.empty())
+        {
+            Connection connection = std::move(m_idle.back());
+            m_idle.pop_back();
+            if (now - connection.idleSince < IDLE_LIMIT &&
+                restbed::Http::is_open(connection.request))
+            {
+                reused = true;
+                return connection.request;
+            }
+            restbed::Http::close(connection.request);
+        }
+    }
+    reused = false;
+    ++m_connections;
+    return std::make_shared<restbed::Request>(restbed::Uri(
+        "http://" + m_host + ':' + std::to_string(m_port) + '/'));
+}
+
+void Backend::release(const std::shared_ptr<restbed::Request> &request)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_idle.size() < m_poolSize)
+    {
+        m_idle.push_back({request, Clock::now()});
+        return;
+    }
+    lock.unlock();
+    restbed::Http::close(request);
+}
+
+Backend::Reply Backend::exchange(const std::string &method,
+                                 const std::string &path,
+                                 const std::string &body,
+                                 const Headers &headers)
+{
+    ++m_requests;
+    for (int attempt = 0;; ++attempt)
+    {
+        bool reused = false;
+        const auto request = acquire(reused);
+        Headers all = headers;
+        all.emplace("Host", m_host);
+        all.emplace("Connection", "keep-alive");
+        all.emplace("Content-Length", std::to_string(body.size()));
+        request->set_method(method);
+        request->set_path(path);
+        request->set_headers(all);
+        request->set_body(body);
+        try
+        {
+            const auto response = restbed::Http::sync(request);
+            Reply reply;
+            const std::size_t length =
+                response->get_header("Content-Length", std::size_t{0});
+            if (length > 0)
+            {
+                restbed::Http::fetch(length, response);
+            }
+            reply.status = response->get_status_code();
+            reply.headers = response->get_headers();
+            const restbed::Bytes &bytes = response->get_body();
+            reply.body.assign(bytes.begin(), bytes.end());
+            if (restbed::String::lowercase(response->get_header(
+                    "Connection")) == "keep-alive")
+            {
+                release(request);
+            }
+            else
+            {
+                restbed::Http::close(request);
+            }
+            return reply;
+        }
+        catch (const std::exception &bang)
+        {
+            restbed::Http::close(request);
+            // The backend may have closed a pooled connection just as it
+            // was reused; only a read is safe to send again.
+            if (reused && attempt == 0 && method == "GET")
+            {
+                continue;
+            }
+            ++m_errors;
+            throw std::runtime_error("Backend " + m_address + ": " +
+                                     bang.what());
+        }
+    }
+}
+
+std::string Backend::toJson() const
+{
+    std::size_t idle;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        idle = m_idle.size();
+    }
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("address");
+    writer.String(m_address.c_str());
+    writer.Key("idle_connections");
+    writer.Uint64(idle);
+    writer.Key("connections_opened");
+    writer.Uint64(m_connections.load());
+    writer.Key("requests");
+    writer.Uint64(m_requests.load());
+    writer.Key("errors");
+    writer.Uint64(m_errors.load());
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+} // namespace comicsdb
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <restbed>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace comicsdb
+{
+
+// A comicsdb server the router forwards requests to.  Idle keep-alive
+// connections are pooled, so a forwarded request normally costs no TCP
+// handshake; any number of threads may send requests at once, each on a
+// connection of its own.
+class Backend
+{
+  public:
+    using Headers = std::multimap<std::string, std::string>;
+
+    struct Reply
+    {
+        int status{};
+        Headers headers;
+        std::string body;
+    };
+
+    // address is HOST:PORT; at most poolSize idle connections are kept.
+    Backend(const std::string &address, std::size_t poolSize);
+    ~Backend();
+    Backend(const Backend &) = delete;
+    Backend &operator=(const Backend &) = delete;
+
+    const std::string &address() const { return m_address; }
+
+    // Sends a request and waits for the whole reply.  Throws
+    // std::runtime_error if the backend can't be reached.
+    Reply exchange(const std::string &method, const std::string &path,
+                   const std::string &body = "", const Headers &headers = {});
+
+    std::string toJson() const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Connection
+    {
+        std::shared_ptr<restbed::Request> request;
+        Clock::time_point idleSince;
+    };
+
+    std::shared_ptr<restbed::Request> acquire(bool &reused);
+    void release(const std::shared_ptr<restbed::Request> &request);
+
+    const std::string m_address;
+    const std::string m_host;
+    const std::uint16_t m_port;
+    const std::size_t m_poolSize;
+
+    mutable std::mutex m_mutex;
+    std::vector<Connection> m_idle; // most recently used last
+
+    std::atomic<std::uint64_t> m_requests{0};
+    std::atomic<std::uint64_t> m_connections{0}; // opened
+    std::atomic<std::uint64_t> m_errors{0};
+};
+
+} // namespace comicsdb
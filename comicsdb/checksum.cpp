@@ -0,0 +1,76 @@
+#include "checksum.h"
+
+#include <cstring>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+constexpr std::uint32_t POLYNOMIAL = 0x82f63b78; // reflected Castagnoli
+
+// Tables for processing eight bytes per step: entry [k][b] is the CRC of
+// byte b followed by k zero bytes.
+struct Tables
+{
+    Tables()
+    {
+        for (std::uint32_t b = 0; b < 256; ++b)
+        {
+            std::uint32_t crc = b;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                crc = (crc >> 1) ^ (POLYNOMIAL & (0U - (crc & 1)));
+            }
+            table[0][b] = crc;
+        }
+        for (std::uint32_t b = 0; b < 256; ++b)
+        {
+            for (int k = 1; k < 8; ++k)
+            {
+                const std::uint32_t previous = table[k - 1][b];
+                table[k][b] = (previous >> 8) ^ table[0][previous & 0xff];
+            }
+        }
+    }
+
+    std::uint32_t table[8][256];
+};
+
+const Tables &tables()
+{
+    static const Tables instance;
+    return instance;
+}
+
+} // namespace
+
+std::uint32_t crc32c(const void *data, std::size_t size, std::uint32_t crc)
+{
+    const std::uint32_t(&table)[8][256] = tables().table;
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    while (size >= 8)
+    {
+        std::uint32_t low;
+        std::uint32_t high;
+        std::memcpy(&low, bytes, sizeof(low));
+        std::memcpy(&high, bytes + 4, sizeof(high));
+        // Little-endian words put the first byte in the low bits.
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+              table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+              table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+              table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+        bytes += 8;
+        size -= 8;
+    }
+    while (size-- != 0)
+    {
+        crc = (crc >> 8) ^ table[0][(crc ^ *bytes++) & 0xff];
+    }
+    return ~crc;
+}
+
+} // namespace comicsdb
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace comicsdb
+{
+
+// CRC-32C (Castagnoli) of size bytes at data, continuing from crc so a
+// checksum can be computed over several pieces.
+std::uint32_t crc32c(const void *data, std::size_t size, std::uint32_t crc = 0);
+
+} // namespace comicsdb
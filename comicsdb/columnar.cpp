@@ -0,0 +1,399 @@
+#include "columnar.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+const char *const COLUMN_NAMES[] = {"title",    "issue", "writer",
+                                    "penciler", "inker", "letterer",
+                                    "colorist"};
+
+// The most counters a query keeps in an array indexed by group; sparser
+// groupings count in a hash map instead.
+constexpr std::size_t DENSE_LIMIT = std::size_t{1} << 20;
+
+using Clock = std::chrono::steady_clock;
+
+const std::string &field(const Comic &comic, ColumnarSnapshot::Column column)
+{
+    switch (column)
+    {
+    case ColumnarSnapshot::TITLE:
+        return comic.title;
+    case ColumnarSnapshot::WRITER:
+        return comic.writer;
+    case ColumnarSnapshot::PENCILER:
+        return comic.penciler;
+    case ColumnarSnapshot::INKER:
+        return comic.inker;
+    case ColumnarSnapshot::LETTERER:
+        return comic.letterer;
+    default:
+        return comic.colorist;
+    }
+}
+
+std::chrono::microseconds since(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        Clock::now() - start);
+}
+
+} // namespace
+
+const char *ColumnarSnapshot::columnName(Column column)
+{
+    return COLUMN_NAMES[column];
+}
+
+bool ColumnarSnapshot::parseColumn(const std::string &name, Column &column)
+{
+    for (int c = 0; c < COLUMNS; ++c)
+    {
+        if (name == COLUMN_NAMES[c])
+        {
+            column = static_cast<Column>(c);
+            return true;
+        }
+    }
+    return false;
+}
+
+ColumnarSnapshot::ColumnarSnapshot(const StorageEngine &engine)
+{
+    const Clock::time_point start = Clock::now();
+    engine.scan(
+        [this](std::size_t, const Comic &comic)
+        {
+            m_issues.push_back(comic.issue);
+            for (int c = 0; c < COLUMNS; ++c)
+            {
+                if (c == ISSUE)
+                {
+                    continue;
+                }
+                Strings &column = m_strings[c];
+                const std::string &value =
+                    field(comic, static_cast<Column>(c));
+                const auto code = column.lookup.emplace(
+                    value, static_cast<std::uint32_t>(column.values.size()));
+                if (code.second)
+                {
+                    column.values.push_back(value);
+                }
+                column.codes.push_back(code.first->second);
+            }
+        });
+    if (!m_issues.empty())
+    {
+        const auto range =
+            std::minmax_element(m_issues.begin(), m_issues.end());
+        m_minIssue = *range.first;
+        m_maxIssue = *range.second;
+    }
+    m_built = Clock::now();
+    m_buildTime = since(start);
+}
+
+const ColumnarSnapshot::Strings &ColumnarSnapshot::strings(Column column) const
+{
+    if (column == ISSUE)
+    {
+        throw std::runtime_error("The issue column holds numbers");
+    }
+    return m_strings[column];
+}
+
+const std::uint32_t *
+ColumnarSnapshot::groupKeys(Column column, int bucket,
+                            std::vector<std::uint32_t> &buffer,
+                            std::size_t &groups) const
+{
+    if (column != ISSUE)
+    {
+        const Strings &values = strings(column);
+        groups = values.values.size();
+        return values.codes.data();
+    }
+    const std::int64_t width = std::max(bucket, 1);
+    const std::int64_t base = m_minIssue;
+    groups = static_cast<std::size_t>(
+        (static_cast<std::int64_t>(m_maxIssue) - base) / width + 1);
+    buffer.resize(m_issues.size());
+    const std::int32_t *issues = m_issues.data();
+    std::uint32_t *keys = buffer.data();
+    if (width == 1)
+    {
+        // Without the division, which has no vector instruction.
+        for (std::size_t i = 0; i < m_issues.size(); ++i)
+        {
+            keys[i] = static_cast<std::uint32_t>(issues[i] - base);
+        }
+        return keys;
+    }
+    for (std::size_t i = 0; i < m_issues.size(); ++i)
+    {
+        keys[i] = static_cast<std::uint32_t>((issues[i] - base) / width);
+    }
+    return keys;
+}
+
+ColumnarSnapshot::Result ColumnarSnapshot::count(const Query &query) const
+{
+    if (query.by.empty() || query.by.size() > 2)
+    {
+        throw std::runtime_error("Group by one or two columns");
+    }
+    const Clock::time_point start = Clock::now();
+    const std::size_t rows = m_issues.size();
+
+    // One flag per comic, cleared by each filter it fails.
+    std::vector<std::uint8_t> matches(rows, 1);
+    std::uint8_t *match = matches.data();
+    for (const auto &filter : query.equals)
+    {
+        const Strings &column = strings(filter.first);
+        const auto found = column.lookup.find(filter.second);
+        if (found == column.lookup.end())
+        {
+            std::fill(matches.begin(), matches.end(), 0);
+            continue;
+        }
+        const std::uint32_t code = found->second;
+        const std::uint32_t *codes = column.codes.data();
+        for (std::size_t i = 0; i < rows; ++i)
+        {
+            match[i] &= static_cast<std::uint8_t>(codes[i] == code);
+        }
+    }
+    if (query.minIssue != INT_MIN || query.maxIssue != INT_MAX)
+    {
+        const std::int32_t low = query.minIssue;
+        const std::int32_t high = query.maxIssue;
+        const std::int32_t *issues = m_issues.data();
+        for (std::size_t i = 0; i < rows; ++i)
+        {
+            match[i] &= static_cast<std::uint8_t>((issues[i] >= low) &
+                                                  (issues[i] <= high));
+        }
+    }
+
+    Result result;
+    result.rows = std::accumulate(matches.begin(), matches.end(),
+                                  std::size_t{0});
+    if (rows == 0)
+    {
+        // Nothing to group, and a string column has no values to size the
+        // counters by.
+        result.elapsed = since(start);
+        return result;
+    }
+    std::vector<std::uint32_t> firstBuffer;
+    std::vector<std::uint32_t> secondBuffer;
+    std::size_t firstGroups{};
+    std::size_t secondGroups = 1;
+    const std::uint32_t *first =
+        groupKeys(query.by[0], query.bucket, firstBuffer, firstGroups);
+    const std::uint32_t *second =
+        query.by.size() == 2
+            ? groupKeys(query.by[1], query.bucket, secondBuffer, secondGroups)
+            : nullptr;
+    auto addGroup = [&](std::uint64_t cell, std::uint64_t count)
+    {
+        Group group;
+        const std::uint64_t keys[] = {cell / secondGroups,
+                                      cell % secondGroups};
+        for (std::size_t k = 0; k < query.by.size(); ++k)
+        {
+            group.keys[k] =
+                query.by[k] == ISSUE
+                    ? m_minIssue + static_cast<std::int64_t>(keys[k]) *
+                                       std::max(query.bucket, 1)
+                    : static_cast<std::int64_t>(keys[k]);
+        }
+        group.count = count;
+        result.groups.push_back(group);
+    };
+
+    if (firstGroups <= DENSE_LIMIT / secondGroups)
+    {
+        // Every comic adds its flag to its group's counter.
+        std::vector<std::uint64_t> counts(firstGroups * secondGroups);
+        std::uint64_t *counter = counts.data();
+        if (second == nullptr)
+        {
+            for (std::size_t i = 0; i < rows; ++i)
+            {
+                counter[first[i]] += match[i];
+            }
+        }
+        else
+        {
+            for (std::size_t i = 0; i < rows; ++i)
+            {
+                counter[std::size_t{first[i]} * secondGroups + second[i]] +=
+                    match[i];
+            }
+        }
+        for (std::size_t cell = 0; cell < counts.size(); ++cell)
+        {
+            if (counts[cell] != 0)
+            {
+                addGroup(cell, counts[cell]);
+            }
+        }
+    }
+    else
+    {
+        std::unordered_map<std::uint64_t, std::uint64_t> counts;
+        for (std::size_t i = 0; i < rows; ++i)
+        {
+            if (match[i] != 0)
+            {
+                ++counts[std::uint64_t{first[i]} * secondGroups +
+                         (second == nullptr ? 0 : second[i])];
+            }
+        }
+        for (const auto &entry : counts)
+        {
+            addGroup(entry.first, entry.second);
+        }
+    }
+
+    // By key, strings in order rather than by code.
+    std::sort(result.groups.begin(), result.groups.end(),
+              [this, &query](const Group &lhs, const Group &rhs)
+              {
+                  for (std::size_t k = 0; k < query.by.size(); ++k)
+                  {
+                      if (lhs.keys[k] == rhs.keys[k])
+                      {
+                          continue;
+                      }
+                      if (query.by[k] == ISSUE)
+                      {
+                          return lhs.keys[k] < rhs.keys[k];
+                      }
+                      const auto &values = m_strings[query.by[k]].values;
+                      return values[lhs.keys[k]] < values[rhs.keys[k]];
+                  }
+                  return false;
+              });
+    result.elapsed = since(start);
+    return result;
+}
+
+std::string ColumnarSnapshot::toJson(const Query &query,
+                                     const Result &result) const
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("by");
+    writer.StartArray();
+    for (const Column column : query.by)
+    {
+        writer.String(COLUMN_NAMES[column]);
+    }
+    writer.EndArray();
+    writer.Key("rows");
+    writer.Uint64(result.rows);
+    writer.Key("groups");
+    writer.StartArray();
+    for (const Group &group : result.groups)
+    {
+        writer.StartObject();
+        writer.Key("key");
+        writer.StartArray();
+        for (std::size_t k = 0; k < query.by.size(); ++k)
+        {
+            if (query.by[k] == ISSUE)
+            {
+                writer.Int64(group.keys[k]);
+            }
+            else
+            {
+                const std::string &value =
+                    m_strings[query.by[k]].values[group.keys[k]];
+                writer.String(value.c_str(),
+                              static_cast<rapidjson::SizeType>(value.size()));
+            }
+        }
+        writer.EndArray();
+        writer.Key("count");
+        writer.Uint64(group.count);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.Key("snapshot_rows");
+    writer.Uint64(rows());
+    writer.Key("snapshot_age_s");
+    writer.Int64(std::chrono::duration_cast<std::chrono::seconds>(
+                     Clock::now() - m_built)
+                     .count());
+    writer.Key("build_us");
+    writer.Int64(m_buildTime.count());
+    writer.Key("query_us");
+    writer.Int64(result.elapsed.count());
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+AnalyticsCache::AnalyticsCache(const StorageEngine &engine,
+                               std::chrono::seconds maxAge) :
+    m_engine(engine),
+    m_maxAge(maxAge)
+{
+}
+
+std::shared_ptr<const ColumnarSnapshot> AnalyticsCache::latest() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_snapshot;
+}
+
+bool AnalyticsCache::fresh(
+    const std::shared_ptr<const ColumnarSnapshot> &snapshot) const
+{
+    return snapshot != nullptr && Clock::now() - snapshot->built() < m_maxAge;
+}
+
+std::shared_ptr<const ColumnarSnapshot> AnalyticsCache::current()
+{
+    std::shared_ptr<const ColumnarSnapshot> snapshot = latest();
+    if (fresh(snapshot))
+    {
+        return snapshot;
+    }
+    std::unique_lock<std::mutex> build(m_build, std::try_to_lock);
+    if (!build.owns_lock())
+    {
+        if (snapshot != nullptr)
+        {
+            return snapshot;
+        }
+        // The first build; wait for it.
+        build.lock();
+        snapshot = latest();
+        if (fresh(snapshot))
+        {
+            return snapshot;
+        }
+    }
+    snapshot = std::make_shared<const ColumnarSnapshot>(m_engine);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_snapshot = snapshot;
+    return snapshot;
+}
+
+} // namespace comicsdb
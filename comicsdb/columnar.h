@@ -0,0 +1,136 @@
+#pragma once
+
+#include "storage.h"
+
+#include <array>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+// A read-only copy of the catalog laid out by column for analytical
+// queries.  Each string field is dictionary encoded, one 32-bit code per
+// comic into a table of its distinct values, and the issues are a packed
+// array of ints, so a query reads a few bytes per comic from arrays it
+// walks in order rather than every string of every comic.
+//
+// Queries count the comics matching some filters, grouped by one or two
+// columns.  Filters and grouping are branch-free loops over the columns
+// that compilers turn into SIMD code, and counting adds the match flag of
+// every comic to its group's counter rather than testing it.
+class ColumnarSnapshot
+{
+  public:
+    enum Column
+    {
+        TITLE,
+        ISSUE,
+        WRITER,
+        PENCILER,
+        INKER,
+        LETTERER,
+        COLORIST,
+        COLUMNS
+    };
+
+    struct Query
+    {
+        std::vector<Column> by; // one or two columns
+        int bucket{1};          // issues per group when grouping by issue
+        // Values string columns must equal.
+        std::vector<std::pair<Column, std::string>> equals;
+        int minIssue{INT_MIN};
+        int maxIssue{INT_MAX};
+    };
+
+    struct Group
+    {
+        // A code for string columns, the first issue of the bucket for
+        // ISSUE.
+        std::array<std::int64_t, 2> keys{};
+        std::uint64_t count{};
+    };
+
+    struct Result
+    {
+        std::size_t rows{}; // comics matching the filters
+        std::vector<Group> groups;
+        std::chrono::microseconds elapsed{};
+    };
+
+    static const char *columnName(Column column);
+    // False if name isn't a column's name.
+    static bool parseColumn(const std::string &name, Column &column);
+
+    // Copies every comic of engine, a shard at a time as scan() does, so
+    // writers aren't stopped; comics changed meanwhile may or may not be
+    // seen.
+    explicit ColumnarSnapshot(const StorageEngine &engine);
+
+    std::size_t rows() const { return m_issues.size(); }
+    std::chrono::steady_clock::time_point built() const { return m_built; }
+    std::chrono::microseconds buildTime() const { return m_buildTime; }
+
+    // Throws std::runtime_error for a query without one or two columns to
+    // group by, or with a filter on the issue column.
+    Result count(const Query &query) const;
+    // {"by":[...],"rows":N,"groups":[{"key":[...],"count":N}],...}, the
+    // groups ordered by key.
+    std::string toJson(const Query &query, const Result &result) const;
+
+  private:
+    struct Strings
+    {
+        std::vector<std::uint32_t> codes; // per comic
+        std::vector<std::string> values;  // by code
+        std::unordered_map<std::string, std::uint32_t> lookup;
+    };
+
+    // The string column of column, which mustn't be ISSUE.
+    const Strings &strings(Column column) const;
+    // The group of each comic in column, in buffer if they had to be
+    // computed, and how many groups there are.
+    const std::uint32_t *groupKeys(Column column, int bucket,
+                                   std::vector<std::uint32_t> &buffer,
+                                   std::size_t &groups) const;
+
+    std::array<Strings, COLUMNS> m_strings; // ISSUE unused
+    std::vector<std::int32_t> m_issues;
+    std::int32_t m_minIssue{};
+    std::int32_t m_maxIssue{};
+    std::chrono::steady_clock::time_point m_built;
+    std::chrono::microseconds m_buildTime{};
+};
+
+// Keeps the latest ColumnarSnapshot, building a new one when a query finds
+// it older than maxAge, so the cost of a build is paid at most once per
+// maxAge however many queries arrive.  Queries arriving during a build use
+// the previous snapshot if there is one.
+class AnalyticsCache
+{
+  public:
+    AnalyticsCache(const StorageEngine &engine, std::chrono::seconds maxAge);
+
+    std::shared_ptr<const ColumnarSnapshot> current();
+
+  private:
+    std::shared_ptr<const ColumnarSnapshot> latest() const;
+    bool fresh(const std::shared_ptr<const ColumnarSnapshot> &snapshot) const;
+
+    const StorageEngine &m_engine;
+    const std::chrono::seconds m_maxAge;
+    std::mutex m_build; // held while building
+    mutable std::mutex m_mutex;
+    std::shared_ptr<const ColumnarSnapshot> m_snapshot;
+};
+
+} // namespace comicsdb
@@ -1,14 +1,53 @@
 #include "comic.h"
 
+#include "varint.h"
+
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
 #include <restbed>
 
+#include <cctype>
+#include <cstdint>
+#include <stdexcept>
+
 namespace comicsdb
 {
 
+namespace
+{
+
+std::uint64_t readNumber(const char *&pos, const char *end)
+{
+    std::uint64_t value;
+    if (!readVarint(pos, end, value))
+    {
+        throw std::runtime_error("Invalid comic encoding");
+    }
+    return value;
+}
+
+void appendString(const std::string &value, std::string &out)
+{
+    appendVarint(value.size(), out);
+    out += value;
+}
+
+std::string readString(const char *&pos, const char *end)
+{
+    const std::uint64_t size = readNumber(pos, end);
+    if (size > static_cast<std::uint64_t>(end - pos))
+    {
+        throw std::runtime_error("Invalid comic encoding");
+    }
+    std::string value{pos, static_cast<std::size_t>(size)};
+    pos += size;
+    return value;
+}
+
+} // namespace
+
 std::string toJson(const Comic &comic)
 {
     rapidjson::Document doc;
@@ -31,14 +70,56 @@ std::string toJson(const Comic &comic)
     return buffer.GetString();
 }
 
+std::string toJson(std::size_t id, const Comic &comic)
+{
+    const std::string json = toJson(comic);
+    return "{\"id\":" + std::to_string(id) + ',' + json.substr(1);
+}
+
 Comic fromJson(const std::string &json)
 {
     rapidjson::Document doc;
-    doc.Parse(json.c_str());
+    doc.Parse(json.c_str(), json.size());
+    if (doc.HasParseError())
+    {
+        throw std::runtime_error("Invalid comic JSON");
+    }
+    return fromJson(doc);
+}
+
+Comic fromJson(const rapidjson::Value &value)
+{
+    if (!value.IsObject())
+    {
+        throw std::runtime_error("Invalid comic JSON");
+    }
     Comic comic{};
-    auto getString = [&doc](const char *key) { return doc[key].GetString(); };
+    auto getMember = [&value](const char *key) -> const rapidjson::Value &
+    {
+        const auto it = value.FindMember(key);
+        if (it == value.MemberEnd())
+        {
+            throw std::runtime_error(std::string{"Comic JSON missing "} + key);
+        }
+        return it->value;
+    };
+    auto getString = [&getMember](const char *key)
+    {
+        const rapidjson::Value &member = getMember(key);
+        if (!member.IsString())
+        {
+            throw std::runtime_error(std::string{"Comic JSON "} + key +
+                                     " isn't a string");
+        }
+        return std::string{member.GetString(), member.GetStringLength()};
+    };
     comic.title = getString("title");
-    comic.issue = doc["issue"].GetInt();
+    const rapidjson::Value &issue = getMember("issue");
+    if (!issue.IsInt())
+    {
+        throw std::runtime_error("Comic JSON issue isn't an integer");
+    }
+    comic.issue = issue.GetInt();
     comic.writer = getString("writer");
     comic.penciler = getString("penciler");
     comic.inker = getString("inker");
@@ -47,4 +128,80 @@ Comic fromJson(const std::string &json)
     return comic;
 }
 
+bool isValid(const Comic &comic)
+{
+    return !comic.title.empty() && comic.issue >= 1 &&
+           !comic.writer.empty() && !comic.penciler.empty() &&
+           !comic.inker.empty() && !comic.letterer.empty() &&
+           !comic.colorist.empty();
+}
+
+std::string normalizeTitle(const std::string &title)
+{
+    std::string result;
+    result.reserve(title.size());
+    bool space = false;
+    for (const char c : title)
+    {
+        if (std::isspace(static_cast<unsigned char>(c)))
+        {
+            space = !result.empty();
+            continue;
+        }
+        if (space)
+        {
+            result += ' ';
+            space = false;
+        }
+        result +=
+            static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    return result;
+}
+
+void appendBinary(const Comic &comic, std::string &out)
+{
+    const auto issue = static_cast<std::int64_t>(comic.issue);
+    appendVarint((static_cast<std::uint64_t>(issue) << 1) ^
+                     static_cast<std::uint64_t>(issue >> 63),
+                 out);
+    appendString(comic.title, out);
+    appendString(comic.writer, out);
+    appendString(comic.penciler, out);
+    appendString(comic.inker, out);
+    appendString(comic.letterer, out);
+    appendString(comic.colorist, out);
+}
+
+std::string toBinary(const Comic &comic)
+{
+    std::string out;
+    out.reserve(8 + comic.title.size() + comic.writer.size() +
+                comic.penciler.size() + comic.inker.size() +
+                comic.letterer.size() + comic.colorist.size());
+    appendBinary(comic, out);
+    return out;
+}
+
+Comic fromBinary(const char *data, std::size_t size)
+{
+    const char *pos = data;
+    const char *const end = data + size;
+    Comic comic;
+    const std::uint64_t zigzag = readNumber(pos, end);
+    comic.issue = static_cast<int>(static_cast<std::int64_t>(zigzag >> 1) ^
+                                   -static_cast<std::int64_t>(zigzag & 1));
+    comic.title = readString(pos, end);
+    comic.writer = readString(pos, end);
+    comic.penciler = readString(pos, end);
+    comic.inker = readString(pos, end);
+    comic.letterer = readString(pos, end);
+    comic.colorist = readString(pos, end);
+    if (pos != end)
+    {
+        throw std::runtime_error("Invalid comic encoding");
+    }
+    return comic;
+}
+
 } // namespace comicsdb
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <rapidjson/fwd.h>
+
+#include <cstddef>
 #include <string>
 
 namespace comicsdb
@@ -21,6 +24,22 @@ struct Comic
 };
 
 std::string toJson(const Comic &comic);
+// The comic's JSON with its id as an extra first member, as exported.
+std::string toJson(std::size_t id, const Comic &comic);
+// Throws std::runtime_error when json isn't a comic object.
 Comic fromJson(const std::string &json);
+Comic fromJson(const rapidjson::Value &value);
+bool isValid(const Comic &comic);
+// The title in lower case with runs of spaces collapsed and the ends
+// trimmed, for comparing titles as readers would.
+std::string normalizeTitle(const std::string &title);
+
+// Compact binary encoding used by the on-disk storage engines: the issue
+// as a zigzag varint followed by each string as a varint length and its
+// bytes.  appendBinary appends to out so records can be built in place.
+void appendBinary(const Comic &comic, std::string &out);
+std::string toBinary(const Comic &comic);
+// Throws std::runtime_error when the bytes aren't exactly one comic.
+Comic fromBinary(const char *data, std::size_t size);
 
 } // namespace comicsdb
@@ -1,53 +1,129 @@
+#include "admission.h"
+#include "backend.h"
+#include "columnar.h"
 #include "comic.h"
+#include "creators.h"
+#include "http.h"
+#include "idempotency.h"
+#include "indexed_store.h"
+#include "lock_profile.h"
+#include "logger.h"
+#include "options.h"
+#include "process_group.h"
+#include "rate_limit.h"
+#include "replication.h"
+#include "series.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "storage.h"
+#include "trace.h"
+#include "transaction.h"
 
 #include <restbed>
 
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
-#include <mutex>
+#include <map>
+#include <stdexcept>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 namespace comicsdb
 {
 
-std::mutex g_dbMutex;
-using ComicDb = std::vector<Comic>;
-using SessionPtr = std::shared_ptr<restbed::Session>;
-
-class CustomLogger : public restbed::Logger
+// Parses one line of the JSON lines import format, throwing
+// std::runtime_error for anything that isn't a valid comic.
+Comic parseComicLine(const std::string &line)
 {
-  public:
-    void stop() override {}
-
-    void start(const std::shared_ptr<const restbed::Settings> &) override {}
-
-    void log(const Level, const char *format, ...) override
+    Comic comic = fromJson(line);
+    if (!isValid(comic))
     {
-        std::va_list arguments;
-        va_start(arguments, format);
+        throw std::runtime_error("invalid comic");
+    }
+    return comic;
+}
 
-        vfprintf(stderr, format, arguments);
-        fprintf(stderr, "\n");
+std::vector<Comic> preload(const std::string &path, AsyncLogger &logger)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        throw std::runtime_error("Couldn't open " + path);
+    }
 
-        va_end(arguments);
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<Comic> comics;
+    std::string line;
+    for (std::size_t lineNumber = 1; std::getline(in, line); ++lineNumber)
+    {
+        if (line.empty())
+        {
+            continue;
+        }
+        try
+        {
+            comics.push_back(parseComicLine(line));
+        }
+        catch (const std::exception &bang)
+        {
+            throw std::runtime_error(path + ':' + std::to_string(lineNumber) +
+                                     ": " + bang.what());
+        }
+        if (comics.size() % 1000000 == 0)
+        {
+            logger.log(restbed::Logger::INFO, "Preloaded %zu comics",
+                       comics.size());
+        }
     }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    logger.log(restbed::Logger::INFO, "Preloaded %zu comics from %s in %.1fs",
+               comics.size(), path.c_str(), elapsed.count());
+    return comics;
+}
 
-    void log_if(bool expression, const Level level, const char *format,
-                ...) override
+// The keys in path, one a line, or none without a path.
+std::unordered_set<std::string> loadApiKeys(const std::string &path)
+{
+    std::unordered_set<std::string> keys;
+    if (path.empty())
+    {
+        return keys;
+    }
+    std::ifstream in(path);
+    if (!in)
     {
-        if (expression)
+        throw std::runtime_error("Couldn't open " + path);
+    }
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (!line.empty())
         {
-            std::va_list arguments;
-            va_start(arguments, format);
-            log(level, format, arguments);
-            va_end(arguments);
+            keys.insert(line);
         }
     }
-};
+    return keys;
+}
 
-ComicDb load()
+std::vector<Comic> load(const Options &options, AsyncLogger &logger)
 {
-    ComicDb db;
+    if (!options.preload.empty())
+    {
+        return preload(options.preload, logger);
+    }
+
+    std::vector<Comic> db;
+    if (options.empty)
+    {
+        return db;
+    }
     db.emplace_back(fromJson(
         R"json({"title":"The Fantastic Four","issue":1,"writer":"Stan Lee","penciler":"Jack Kirby","inker":"George Klein","letterer":"Artie Simek","colorist":"Stan Goldberg"})json"));
     {
@@ -64,176 +140,1463 @@ ComicDb load()
     return db;
 }
 
-std::shared_ptr<restbed::Settings> getSettings()
+std::shared_ptr<restbed::Settings> getSettings(const Options &options)
 {
     auto settings = std::make_shared<restbed::Settings>();
-    settings->set_default_header("Connection", "close");
+    settings->set_port(
+        static_cast<std::uint16_t>(options.port + options.processIndex));
+    settings->set_worker_limit(options.workers);
     return settings;
 }
 
 void notAcceptable(const SessionPtr &session, const std::string &msg)
 {
-    session->close(restbed::NOT_ACCEPTABLE, msg,
-                   {{"Content-Type", "text/plain"},
-                    {"Content-Length", std::to_string(msg.size())}});
+    sendText(session, restbed::NOT_ACCEPTABLE, msg);
 }
 
-bool validId(const SessionPtr &session, const ComicDb &db, std::size_t &id)
+bool parseId(const SessionPtr &session, std::size_t &id)
 {
     const auto &request = session->get_request();
     if (request->has_path_parameter("id"))
     {
-        id = request->get_path_parameter("id", 0);
-        if (id < db.size() && db[id].issue != Comic::DELETED_ISSUE)
-        {
-            return true;
-        }
-        notAcceptable(session, "Not Acceptable, id out of range");
+        id = request->get_path_parameter("id", std::size_t{0});
+        return true;
     }
-    else
+    notAcceptable(session, "Not Acceptable, missing id");
+    return false;
+}
+
+bool validId(const SessionPtr &session, const StorageEngine &store,
+             std::size_t &id)
+{
+    if (!parseId(session, id))
+    {
+        return false;
+    }
+    if (store.contains(id))
     {
-        notAcceptable(session, "Not Acceptable, missing id");
+        return true;
     }
+    notAcceptable(session, "Not Acceptable, id out of range");
     return false;
 }
 
-void readComic(const SessionPtr &session, const ComicDb &db)
+bool parseComic(const SessionPtr &session, const restbed::Bytes &data,
+                Comic &comic)
 {
+    try
+    {
+        comic = fromJson(
+            std::string{reinterpret_cast<const char *>(data.data()),
+                        data.size()});
+    }
+    catch (const std::exception &)
+    {
+        comic = Comic{};
+    }
+    if (!isValid(comic))
+    {
+        notAcceptable(session, "Not Acceptable, invalid JSON");
+        return false;
+    }
+    return true;
+}
+
+void conflict(const SessionPtr &session, const DuplicateComic &duplicate)
+{
+    std::multimap<std::string, std::string> headers{
+        {"Content-Type", "text/plain"}};
+    if (duplicate.existing() != DuplicateComic::NONE)
+    {
+        headers.emplace("Location",
+                        "/comic/" + std::to_string(duplicate.existing()));
+    }
+    const std::string msg = std::string{"Conflict, "} + duplicate.what();
+    reply(session, restbed::CONFLICT, msg, headers);
+}
+
+void readComic(const SessionPtr &session, const StorageEngine &store,
+               Tracer &tracer)
+{
+    const TracePtr trace = tracer.start("GET /comic/{id}");
     std::size_t id{};
-    if (validId(session, db, id))
+    if (!parseId(session, id))
     {
-        const std::string json = toJson(db[id]);
-        session->close(restbed::OK, json,
-                       {{"Content-Type", "application/json"},
-                        {"Content-Length", std::to_string(json.size())}});
+        return;
     }
+    Comic comic;
+    if (!store.get(id, comic, trace))
+    {
+        notAcceptable(session, "Not Acceptable, id out of range");
+        return;
+    }
+    TraceSpan serialize(trace, "serialize");
+    const std::string json = toJson(comic);
+    serialize.end();
+    TraceSpan respond(trace, "respond");
+    sendJson(session, json);
+}
+
+// GET /comic?title=T&issue=N, the comics with that title and issue in the
+// export format.
+void findComics(const SessionPtr &session, const IndexedStore &index)
+{
+    const auto &request = session->get_request();
+    const std::string title = request->get_query_parameter("title");
+    const std::string issue = request->get_query_parameter("issue");
+    if (title.empty() || issue.empty() || issue.size() > 9 ||
+        issue.find_first_not_of("0123456789") != std::string::npos)
+    {
+        notAcceptable(session, "Not Acceptable, title and issue required");
+        return;
+    }
+    std::string body;
+    for (const auto &entry : index.find(title, std::stoi(issue)))
+    {
+        body += toJson(entry.first, entry.second);
+        body += '\n';
+    }
+    reply(session, restbed::OK, body,
+          {{"Content-Type", "application/x-ndjson"}});
+}
+
+void listSeries(const SessionPtr &session, const SeriesCatalog &series)
+{
+    sendJson(session, toJson(series.list()));
 }
 
-void deleteComic(const SessionPtr &session, ComicDb &db)
+// GET /series/{title}, every comic of the series ordered by issue.
+void readSeries(const SessionPtr &session, const SeriesCatalog &catalog)
+{
+    const std::string title =
+        session->get_request()->get_path_parameter("title");
+    SeriesCatalog::Series series;
+    if (!catalog.find(title, series))
+    {
+        notAcceptable(session, "Not Acceptable, no such series");
+        return;
+    }
+    sendJson(session, toJson(series));
+}
+
+void listCreators(const SessionPtr &session, const CreatorCatalog &creators)
+{
+    sendJson(session, toJson(creators.list()));
+}
+
+void readCreator(const SessionPtr &session, const CreatorCatalog &creators)
 {
     std::size_t id{};
-    if (validId(session, db, id))
+    if (!parseId(session, id))
     {
+        return;
+    }
+    CreatorCatalog::Summary creator;
+    if (!creators.find(id, creator))
+    {
+        notAcceptable(session, "Not Acceptable, no such creator");
+        return;
+    }
+    sendJson(session, toJson(creator));
+}
+
+// GET /creator/{id}/comics[?role=R], the comics crediting the creator, in
+// the role if given, in the export format and ordered by id.
+void readCreatorComics(const SessionPtr &session, const StorageEngine &store,
+                       const CreatorCatalog &creators)
+{
+    std::size_t id{};
+    if (!parseId(session, id))
+    {
+        return;
+    }
+    const std::string name =
+        session->get_request()->get_query_parameter("role");
+    CreatorCatalog::Role role = CreatorCatalog::ROLES;
+    if (!name.empty() && !CreatorCatalog::parseRole(name, role))
+    {
+        notAcceptable(session, "Not Acceptable, unknown role");
+        return;
+    }
+    std::vector<std::size_t> ids;
+    if (!creators.comics(id, role, ids))
+    {
+        notAcceptable(session, "Not Acceptable, no such creator");
+        return;
+    }
+    std::string body;
+    Comic comic;
+    for (const std::size_t comicId : ids)
+    {
+        if (store.get(comicId, comic))
         {
-            std::unique_lock<std::mutex> lock(g_dbMutex);
-            db[id] = Comic{};
+            body += toJson(comicId, comic);
+            body += '\n';
         }
-        session->close(restbed::OK);
     }
+    reply(session, restbed::OK, body,
+          {{"Content-Type", "application/x-ndjson"}});
 }
 
-void updateComic(const SessionPtr &session, ComicDb &db)
+void readSeriesStats(const SessionPtr &session, const IndexedStore &index)
 {
+    const std::string title =
+        session->get_request()->get_path_parameter("title");
+    std::string json;
+    if (!seriesStats(index, title, json))
+    {
+        notAcceptable(session, "Not Acceptable, no such series");
+        return;
+    }
+    sendJson(session, json);
+}
+
+void deleteComic(const SessionPtr &session, StorageEngine &store,
+                 Tracer &tracer)
+{
+    const TracePtr trace = tracer.start("DELETE /comic/{id}");
     std::size_t id{};
-    if (!validId(session, db, id))
+    if (!parseId(session, id))
+    {
         return;
+    }
+    if (!store.erase(id, trace))
+    {
+        notAcceptable(session, "Not Acceptable, id out of range");
+        return;
+    }
+    TraceSpan respond(trace, "respond");
+    reply(session, restbed::OK, "");
+}
 
+void updateComic(const SessionPtr &session, StorageEngine &store,
+                 Tracer &tracer, std::size_t maxBody)
+{
+    const TracePtr trace = tracer.start("PUT /comic/{id}");
     auto &request = session->get_request();
+    // If-None-Match: * creates the comic under this id instead, for a
+    // router that hands out ids itself.
+    const bool insert = request->get_header("If-None-Match") == "*";
+    std::size_t id{};
+    {
+        TraceSpan validate(trace, "validate");
+        if (insert ? !parseId(session, id) : !validId(session, store, id))
+            return;
+    }
+
     std::size_t length{};
-    length = request->get_header("Content-Length", length);
+    if (!bodyLength(session, maxBody, length))
+    {
+        return;
+    }
     if (length == 0)
     {
         notAcceptable(session, "Not Acceptable, empty request body");
         return;
     }
 
+    const std::uint64_t fetchStart = tracer.now();
+    session->fetch(
+        length,
+        [&store, &tracer, insert, id, trace,
+         fetchStart](const SessionPtr &session, const restbed::Bytes &data)
+        {
+            if (trace)
+            {
+                trace->add("fetch", fetchStart, tracer.now());
+            }
+            Comic comic;
+            {
+                TraceSpan parse(trace, "parse");
+                if (!parseComic(session, data, comic))
+                {
+                    return;
+                }
+            }
+
+            try
+            {
+                if (insert)
+                {
+                    if (!store.insert(id, comic, trace))
+                    {
+                        sendText(session, restbed::PRECONDITION_FAILED,
+                                 "Precondition Failed, id " +
+                                     std::to_string(id) + " exists");
+                        return;
+                    }
+                    TraceSpan respond(trace, "respond");
+                    reply(session, restbed::CREATED, "");
+                    return;
+                }
+                if (!store.update(id, comic, trace))
+                {
+                    notAcceptable(session, "Not Acceptable, id out of range");
+                    return;
+                }
+            }
+            catch (const DuplicateComic &duplicate)
+            {
+                conflict(session, duplicate);
+                return;
+            }
+            TraceSpan respond(trace, "respond");
+            reply(session, restbed::OK, "");
+        });
+}
+
+void createComic(const SessionPtr &session, StorageEngine &store,
+                 Tracer &tracer, IdempotencyCache &idempotency,
+                 std::size_t maxBody)
+{
+    const TracePtr trace = tracer.start("POST /comic");
+    std::string key;
+    if (!idempotencyKey(session, idempotency, key))
+    {
+        return;
+    }
+    std::size_t length{};
+    if (!bodyLength(session, maxBody, length))
+    {
+        return;
+    }
+    if (length == 0)
+    {
+        notAcceptable(session, "Not Acceptable, empty body");
+        return;
+    }
+
+    const std::uint64_t fetchStart = tracer.now();
     session->fetch(
         length,
-        [&db, id](const SessionPtr &session, const restbed::Bytes &data)
+        [&store, &tracer, &idempotency, key, trace,
+         fetchStart](const SessionPtr &session, const restbed::Bytes &data)
         {
-            const std::string json{reinterpret_cast<const char *>(data.data()),
-                                   data.size()};
-            Comic comic = fromJson(json);
-            if (comic.title.empty() || comic.issue < 1 ||
-                comic.writer.empty() || comic.penciler.empty() ||
-                comic.inker.empty() || comic.letterer.empty() ||
-                comic.colorist.empty())
+            if (trace)
+            {
+                trace->add("fetch", fetchStart, tracer.now());
+            }
+            Comic comic;
+            {
+                TraceSpan parse(trace, "parse");
+                if (!parseComic(session, data, comic))
+                {
+                    return;
+                }
+            }
+            if (!key.empty() && !beginCreate(session, idempotency, key,
+                                             data.data(), data.size()))
             {
-                notAcceptable(session, "Not Acceptable, invalid JSON");
                 return;
             }
 
+            std::size_t id{};
+            try
             {
-                std::unique_lock<std::mutex> lock(g_dbMutex);
-                db[id] = comic;
+                id = store.create(comic, trace);
+            }
+            catch (const DuplicateComic &duplicate)
+            {
+                if (!key.empty())
+                {
+                    idempotency.abandon(key);
+                }
+                conflict(session, duplicate);
+                return;
             }
-            session->close(restbed::OK);
+            catch (...)
+            {
+                if (!key.empty())
+                {
+                    idempotency.abandon(key);
+                }
+                throw;
+            }
+            const IdempotencyCache::Result result{
+                restbed::CREATED, "/comic/" + std::to_string(id),
+                "{\"id\":" + std::to_string(id) + "}"};
+            if (!key.empty())
+            {
+                idempotency.finish(key, result);
+            }
+            TraceSpan respond(trace, "respond");
+            sendCreated(session, result, false);
         });
 }
 
-void createComic(const SessionPtr &session, ComicDb &db)
+void exportComics(const SessionPtr &session, const StorageEngine &store)
 {
-    auto &request = session->get_request();
+    std::string body;
+    for (const auto &entry : store.snapshot())
+    {
+        // the import format ignores the extra id member
+        body += toJson(entry.first, entry.second);
+        body += '\n';
+    }
+    reply(session, restbed::OK, body,
+          {{"Content-Type", "application/x-ndjson"}});
+}
+
+// An import read and parsed a chunk at a time, so what's held is the
+// comics parsed so far and at most a chunk of their JSON lines rather than
+// the whole body.
+struct Import
+{
+    static constexpr std::size_t CHUNK = 64 * 1024;
+
+    std::vector<Comic> comics;
+    std::string partial; // lines not parsed yet, the last maybe incomplete
+    std::size_t remaining{};
+    std::size_t lineNumber{};
+
+    // Parses the complete lines, and the incomplete last one at the end of
+    // the body.  Returns false on an invalid comic, at lineNumber.
+    bool parse()
+    {
+        std::size_t begin = 0;
+        while (begin < partial.size())
+        {
+            std::size_t end = partial.find('\n', begin);
+            if (end == std::string::npos)
+            {
+                if (remaining != 0)
+                {
+                    break;
+                }
+                end = partial.size();
+            }
+            ++lineNumber;
+            const std::string line = partial.substr(begin, end - begin);
+            begin = end + 1;
+            if (line.empty())
+            {
+                continue;
+            }
+            try
+            {
+                comics.push_back(parseComicLine(line));
+            }
+            catch (const std::exception &)
+            {
+                return false;
+            }
+        }
+        partial.erase(0, begin);
+        return true;
+    }
+};
+
+void fetchImportChunk(const SessionPtr &session, StorageEngine &store,
+                      const std::shared_ptr<Import> &import)
+{
+    session->fetch(
+        std::min(import->remaining, Import::CHUNK),
+        [&store, import](const SessionPtr &session, const restbed::Bytes &data)
+        {
+            if (data.empty())
+            {
+                rejectBody(session, restbed::BAD_REQUEST,
+                           "Bad Request, body shorter than Content-Length");
+                return;
+            }
+            import->remaining -= std::min(import->remaining, data.size());
+            import->partial.append(data.begin(), data.end());
+            if (!import->parse())
+            {
+                rejectBody(session, restbed::NOT_ACCEPTABLE,
+                           "Not Acceptable, invalid comic on line " +
+                               std::to_string(import->lineNumber));
+                return;
+            }
+            if (import->remaining != 0)
+            {
+                fetchImportChunk(session, store, import);
+                return;
+            }
+
+            const std::size_t count = import->comics.size();
+            std::size_t first{};
+            try
+            {
+                first = store.importBatch(std::move(import->comics));
+            }
+            catch (const DuplicateComic &duplicate)
+            {
+                conflict(session, duplicate);
+                return;
+            }
+            sendJson(session, "{\"first\":" + std::to_string(first) +
+                                  ",\"count\":" + std::to_string(count) + "}");
+        });
+}
+
+void importComics(const SessionPtr &session, StorageEngine &store,
+                  std::size_t maxImport)
+{
+    auto import = std::make_shared<Import>();
+    if (!bodyLength(session, maxImport, import->remaining))
+    {
+        return;
+    }
+    if (import->remaining == 0)
+    {
+        notAcceptable(session, "Not Acceptable, empty body");
+        return;
+    }
+    fetchImportChunk(session, store, import);
+}
+
+void applyTransaction(const SessionPtr &session, StorageEngine &store,
+                      Tracer &tracer, AsyncLogger &logger, std::size_t maxBody)
+{
+    const TracePtr trace = tracer.start("POST /transactions");
     std::size_t length{};
-    length = request->get_header("Content-Length", length);
+    if (!bodyLength(session, maxBody, length))
+    {
+        return;
+    }
     if (length == 0)
     {
         notAcceptable(session, "Not Acceptable, empty body");
         return;
     }
 
+    const std::uint64_t fetchStart = tracer.now();
     session->fetch(
         length,
-        [&db](const SessionPtr &session, const restbed::Bytes &data)
+        [&store, &tracer, &logger, trace,
+         fetchStart](const SessionPtr &session, const restbed::Bytes &data)
         {
-            const std::string json{reinterpret_cast<const char *>(data.data()),
-                                   data.size()};
-            Comic comic = fromJson(json);
-            if (comic.title.empty() || comic.issue < 1 ||
-                comic.writer.empty() || comic.penciler.empty() ||
-                comic.inker.empty() || comic.letterer.empty() ||
-                comic.colorist.empty())
+            if (trace)
+            {
+                trace->add("fetch", fetchStart, tracer.now());
+            }
+            std::vector<TransactionOp> ops;
+            {
+                TraceSpan parse(trace, "parse");
+                try
+                {
+                    ops = parseTransaction(std::string{
+                        reinterpret_cast<const char *>(data.data()),
+                        data.size()});
+                }
+                catch (const std::exception &bang)
+                {
+                    notAcceptable(session,
+                                  std::string{"Not Acceptable, "} +
+                                      bang.what());
+                    return;
+                }
+            }
+
+            std::size_t failed{};
+            bool applied{};
+            try
+            {
+                applied = store.applyTransaction(ops, failed, trace);
+            }
+            catch (const DuplicateComic &duplicate)
+            {
+                conflict(session, duplicate);
+                return;
+            }
+            if (!applied)
             {
-                notAcceptable(session, "Not Acceptable, invalid JSON");
+                const std::string msg =
+                    "Conflict, operation " + std::to_string(failed) +
+                    ": id " + std::to_string(ops[failed].id) + " not found";
+                sendText(session, restbed::CONFLICT, msg);
                 return;
             }
 
+            std::size_t counts[3]{};
+            std::string ids;
+            for (const TransactionOp &op : ops)
             {
-                std::unique_lock<std::mutex> lock(g_dbMutex);
-                db.push_back(comic);
+                ++counts[op.kind];
+                if (op.kind == TransactionOp::CREATE)
+                {
+                    ids += (ids.empty() ? "" : ",") + std::to_string(op.id);
+                }
             }
-            session->close(restbed::OK);
+            logger.log(restbed::Logger::INFO,
+                       "transaction committed: %zu operations (%zu creates, "
+                       "%zu updates, %zu deletes)",
+                       ops.size(), counts[TransactionOp::CREATE],
+                       counts[TransactionOp::UPDATE],
+                       counts[TransactionOp::ERASE]);
+
+            TraceSpan respond(trace, "respond");
+            sendJson(session, "{\"operations\":" + std::to_string(ops.size()) +
+                                  ",\"created\":[" + ids + "]}");
+        });
+}
+
+void readTraces(const SessionPtr &session, const Tracer &tracer)
+{
+    sendJson(session, tracer.chromeTrace());
+}
+
+void readLockProfile(const SessionPtr &session, const LockProfiler &profiler)
+{
+    sendJson(session, profiler.toJson());
+}
+
+void readStorageStatus(const SessionPtr &session, const StorageEngine &store)
+{
+    std::string json = std::string{"{\"engine\":\""} + store.name() +
+                       "\",\"next_id\":" + std::to_string(store.nextId());
+    for (const auto &count : store.usage())
+    {
+        json += std::string{",\""} + count.first +
+                "\":" + std::to_string(count.second);
+    }
+    sendJson(session, json + "}");
+}
+
+void startSnapshot(const SessionPtr &session, BackgroundSaver &saver,
+                   AsyncLogger &logger)
+{
+    bool started{};
+    try
+    {
+        started = saver.start();
+    }
+    catch (const std::exception &bang)
+    {
+        logger.log(restbed::Logger::ERROR, "Snapshot failed to start: %s",
+                   bang.what());
+        const std::string msg = std::string{"Internal Server Error, "} +
+                                bang.what();
+        sendText(session, restbed::INTERNAL_SERVER_ERROR, msg);
+        return;
+    }
+    if (!started)
+    {
+        const std::string msg = "Conflict, a snapshot is already running";
+        sendText(session, restbed::CONFLICT, msg);
+        return;
+    }
+    const std::string json = saver.toJson();
+    reply(session, restbed::ACCEPTED, json,
+          {{"Content-Type", "application/json"}});
+}
+
+void readSnapshotStatus(const SessionPtr &session,
+                        const BackgroundSaver &saver)
+{
+    sendJson(session, saver.toJson());
+}
+
+void publishSnapshotResource(restbed::Service &service, BackgroundSaver &saver,
+                             AsyncLogger &logger)
+{
+    auto snapshotResource = std::make_shared<restbed::Resource>();
+    snapshotResource->set_path("/admin/snapshot");
+    snapshotResource->set_method_handler(
+        "POST", [&saver, &logger](const SessionPtr &session)
+        { return startSnapshot(session, saver, logger); });
+    snapshotResource->set_method_handler(
+        "GET", [&saver](const SessionPtr &session)
+        { return readSnapshotStatus(session, saver); });
+    service.publish(snapshotResource);
+}
+
+void readChanges(const SessionPtr &session, const StorageEngine &store,
+                 const ChangeFeed &feed)
+{
+    const auto &request = session->get_request();
+    const std::uint64_t after =
+        request->get_query_parameter("after", std::uint64_t{0});
+    const std::uint64_t epoch =
+        request->get_query_parameter("epoch", std::uint64_t{0});
+    const std::size_t limit = std::min<std::size_t>(
+        request->get_query_parameter("limit", std::size_t{10000}), 100000);
+    std::vector<std::size_t> ids;
+    std::uint64_t through{};
+    if (epoch != feed.epoch() || !feed.since(after, limit, ids, through))
+    {
+        const std::string msg =
+            "Gone, copy the catalog from /replication/snapshot again";
+        sendText(session, restbed::GONE, msg);
+        return;
+    }
+    const std::uint64_t head = feed.last();
+
+    // The current state of each comic, which is at least as new as the
+    // change that put it in the feed.
+    std::string body;
+    Comic comic;
+    for (std::size_t id : ids)
+    {
+        if (store.get(id, comic))
+        {
+            body += toJson(id, comic);
+        }
+        else
+        {
+            body += "{\"id\":" + std::to_string(id) + ",\"deleted\":true}";
+        }
+        body += '\n';
+    }
+    reply(session, restbed::OK, body,
+          {{"Content-Type", "application/x-ndjson"},
+           {"X-Replication-Sequence", std::to_string(through)},
+           {"X-Replication-Head", std::to_string(head)},
+           {"X-Replication-Next-Id", std::to_string(store.nextId())}});
+}
+
+void readReplicaSnapshot(const SessionPtr &session, const StorageEngine &store,
+                         const ChangeFeed &feed)
+{
+    // Changes after sequence may or may not be in the copy; replaying them
+    // on top brings it up to date either way.
+    const std::uint64_t sequence = feed.last();
+    std::string body;
+    for (const auto &entry : store.snapshot())
+    {
+        body += toJson(entry.first, entry.second);
+        body += '\n';
+    }
+    reply(session, restbed::OK, body,
+          {{"Content-Type", "application/x-ndjson"},
+           {"X-Replication-Epoch", std::to_string(feed.epoch())},
+           {"X-Replication-Sequence", std::to_string(sequence)},
+           {"X-Replication-Next-Id", std::to_string(store.nextId())}});
+}
+
+void publishReplicationResources(restbed::Service &service,
+                                 const StorageEngine &store,
+                                 const ChangeFeed &feed)
+{
+    auto changesResource = std::make_shared<restbed::Resource>();
+    changesResource->set_path("/replication/changes");
+    changesResource->set_method_handler(
+        "GET", [&store, &feed](const SessionPtr &session)
+        { return readChanges(session, store, feed); });
+    service.publish(changesResource);
+
+    auto snapshotResource = std::make_shared<restbed::Resource>();
+    snapshotResource->set_path("/replication/snapshot");
+    snapshotResource->set_method_handler(
+        "GET", [&store, &feed](const SessionPtr &session)
+        { return readReplicaSnapshot(session, store, feed); });
+    service.publish(snapshotResource);
+
+    auto statusResource = std::make_shared<restbed::Resource>();
+    statusResource->set_path("/admin/replication");
+    statusResource->set_method_handler(
+        "GET",
+        [&feed](const SessionPtr &session)
+        {
+            sendJson(session, "{\"role\":\"leader\",\"epoch\":" +
+                                  std::to_string(feed.epoch()) +
+                                  ",\"head\":" + std::to_string(feed.last()) +
+                                  "}");
         });
+    service.publish(statusResource);
 }
 
-void publishResources(restbed::Service &service, ComicDb &db)
+// Refuses changes on a follower, whose replica only the leader's changes
+// may write, and reports the replication lag on every response.
+class FollowerRule : public restbed::Rule
+{
+  public:
+    explicit FollowerRule(const Follower &follower) : m_follower(follower) {}
+
+    bool condition(const SessionPtr) final override { return true; }
+
+    void action(const SessionPtr session,
+                const std::function<void(const SessionPtr)> &callback)
+        final override
+    {
+        char lag[32];
+        std::snprintf(lag, sizeof(lag), "%.3f", m_follower.lagSeconds());
+        session->set_header("X-Replication-Lag", lag);
+        const auto request = session->get_request();
+        if (request->get_method() != "GET" &&
+            request->get_path().rfind("/admin/", 0) != 0)
+        {
+            const std::string msg = "Forbidden, this is a read-only follower";
+            sendText(session, restbed::FORBIDDEN, msg);
+            return;
+        }
+        callback(session);
+    }
+
+  private:
+    const Follower &m_follower;
+};
+
+void publishFollowerResources(restbed::Service &service,
+                              const Follower &follower)
+{
+    auto statusResource = std::make_shared<restbed::Resource>();
+    statusResource->set_path("/admin/replication");
+    statusResource->set_method_handler(
+        "GET", [&follower](const SessionPtr &session)
+        { return sendJson(session, follower.toJson()); });
+    service.publish(statusResource);
+    service.add_rule(std::make_shared<FollowerRule>(follower));
+}
+
+// Passes changes sent to a reader process on to the writer process, so
+// clients may send anything to any of them, and lookups by title and issue,
+// series and creator and the statistics too, since only the writer's
+// indexes see its changes.
+class WriterRule : public restbed::Rule
+{
+  public:
+    WriterRule(std::uint16_t writerPort, std::size_t maxBody) :
+        m_writer("127.0.0.1:" + std::to_string(writerPort), 16),
+        m_maxBody(maxBody)
+    {
+    }
+
+    bool condition(const SessionPtr session) final override
+    {
+        const auto request = session->get_request();
+        if (request->get_method() == "GET")
+        {
+            const std::string path = request->get_path();
+            return path == "/comic" || path == "/series" ||
+                   path.rfind("/series/", 0) == 0 || path == "/creators" ||
+                   path.rfind("/creator/", 0) == 0 ||
+                   path.rfind("/stats", 0) == 0 ||
+                   path == "/admin/stats/verify";
+        }
+        return request->get_path().rfind("/admin/", 0) != 0;
+    }
+
+    void action(const SessionPtr session,
+                const std::function<void(const SessionPtr)> &) final override
+    {
+        const auto request = session->get_request();
+        // Deletes have no body.
+        std::size_t length{};
+        if (request->has_header("Content-Length") &&
+            !bodyLength(session, m_maxBody, length))
+        {
+            return;
+        }
+        session->fetch(
+            length,
+            [this](const SessionPtr &session, const restbed::Bytes &data)
+            {
+                const auto request = session->get_request();
+                Backend::Headers headers;
+                for (const char *name : {"Content-Type", "If-None-Match",
+                                         "Idempotency-Key", "X-API-Key"})
+                {
+                    const std::string value = request->get_header(name);
+                    if (!value.empty())
+                    {
+                        headers.emplace(name, value);
+                    }
+                }
+                // For the writer to scope Idempotency-Keys by client.
+                headers.emplace("X-Forwarded-For", addressOf(session));
+                try
+                {
+                    const Backend::Reply answer = m_writer.exchange(
+                        request->get_method(), target(*request),
+                        std::string{data.begin(), data.end()}, headers);
+                    std::multimap<std::string, std::string> replyHeaders;
+                    for (const char *name :
+                         {"Content-Type", "Location", "Idempotent-Replayed"})
+                    {
+                        const auto header = answer.headers.find(name);
+                        if (header != answer.headers.end())
+                        {
+                            replyHeaders.insert(*header);
+                        }
+                    }
+                    reply(session, answer.status, answer.body, replyHeaders);
+                }
+                catch (const std::exception &bang)
+                {
+                    sendText(session, restbed::BAD_GATEWAY,
+                             std::string{"Bad Gateway, "} + bang.what());
+                }
+            });
+    }
+
+  private:
+    // The path restbed has decoded, with the query string it has taken
+    // apart, encoded again.
+    static std::string target(const restbed::Request &request)
+    {
+        std::string path = request.get_path();
+        for (const std::string series : {"/series/", "/stats/series/"})
+        {
+            if (path.rfind(series, 0) == 0)
+            {
+                path = series +
+                       restbed::Uri::encode(path.substr(series.size()));
+            }
+        }
+        char separator = '?';
+        for (const auto &parameter : request.get_query_parameters())
+        {
+            path += separator + restbed::Uri::encode(parameter.first) + '=' +
+                    restbed::Uri::encode(parameter.second);
+            separator = '&';
+        }
+        return path;
+    }
+
+    Backend m_writer;
+    const std::size_t m_maxBody;
+};
+
+// Turns requests away before they reach a handler while the queue for the
+// workers is standing, which keeps latency near the target for those let
+// in.  The admin resources are always served, to watch the shedding.
+class AdmissionRule : public restbed::Rule
+{
+  public:
+    explicit AdmissionRule(AdmissionControl &admission) :
+        m_admission(admission)
+    {
+    }
+
+    bool condition(const SessionPtr session) final override
+    {
+        return session->get_request()->get_path().rfind("/admin/", 0) != 0;
+    }
+
+    void action(const SessionPtr session,
+                const std::function<void(const SessionPtr)> &callback)
+        final override
+    {
+        const bool read = session->get_request()->get_method() == "GET";
+        if (!m_admission.admit(read ? AdmissionControl::READ
+                                    : AdmissionControl::WRITE))
+        {
+            reply(session, restbed::SERVICE_UNAVAILABLE,
+                  "Service Unavailable, overloaded",
+                  {{"Content-Type", "text/plain"},
+                   {"Retry-After",
+                    std::to_string(m_admission.retryAfterSeconds())}});
+            return;
+        }
+        callback(session);
+    }
+
+  private:
+    AdmissionControl &m_admission;
+};
+
+void publishAdmissionResources(restbed::Service &service,
+                               AdmissionControl &admission)
+{
+    auto admissionResource = std::make_shared<restbed::Resource>();
+    admissionResource->set_path("/admin/admission");
+    admissionResource->set_method_handler(
+        "GET", [&admission](const SessionPtr &session)
+        { return sendJson(session, admission.toJson()); });
+    service.publish(admissionResource);
+    if (admission.enabled())
+    {
+        // First, so shed requests cost as little as possible.
+        service.add_rule(std::make_shared<AdmissionRule>(admission));
+        service.schedule([&admission] { admission.probe(); },
+                         AdmissionControl::PROBE_PERIOD);
+    }
+}
+
+// Who sent the request: their X-API-Key if it's one of keys, since anyone
+// can make up a key, and otherwise their address.
+std::string clientOf(const SessionPtr &session,
+                     const std::unordered_set<std::string> &keys)
+{
+    const std::string key = session->get_request()->get_header("X-API-Key");
+    if (!key.empty() && keys.count(key) != 0)
+    {
+        return key;
+    }
+    return addressOf(session);
+}
+
+// Refuses requests beyond their client's rate limit with 429.  Clients are
+// told apart as clientOf() does.
+class RateLimitRule : public restbed::Rule
+{
+  public:
+    RateLimitRule(RateLimiter &limiter,
+                  const std::unordered_set<std::string> &apiKeys) :
+        m_limiter(limiter),
+        m_apiKeys(apiKeys)
+    {
+    }
+
+    bool condition(const SessionPtr) final override { return true; }
+
+    void action(const SessionPtr session,
+                const std::function<void(const SessionPtr)> &callback)
+        final override
+    {
+        const RateLimiter::Decision decision = m_limiter.take(
+            session->get_request()->get_path(), clientOf(session, m_apiKeys));
+        if (!decision.limited)
+        {
+            callback(session);
+            return;
+        }
+        const std::string limit = std::to_string(decision.limit);
+        const std::string remaining = std::to_string(decision.remaining);
+        if (!decision.allowed)
+        {
+            const std::string reset = std::to_string(decision.resetSeconds);
+            reply(session, restbed::TOO_MANY_REQUESTS,
+                  "Too Many Requests, retry in " + reset + "s",
+                  {{"Content-Type", "text/plain"},
+                   {"RateLimit-Limit", limit},
+                   {"RateLimit-Remaining", remaining},
+                   {"RateLimit-Reset", reset},
+                   {"Retry-After", reset}});
+            return;
+        }
+        session->set_header("RateLimit-Limit", limit);
+        session->set_header("RateLimit-Remaining", remaining);
+        callback(session);
+    }
+
+  private:
+    RateLimiter &m_limiter;
+    const std::unordered_set<std::string> &m_apiKeys;
+};
+
+void publishRateLimitResources(restbed::Service &service,
+                               RateLimiter &limiter,
+                               const std::unordered_set<std::string> &apiKeys)
+{
+    auto limitsResource = std::make_shared<restbed::Resource>();
+    limitsResource->set_path("/admin/rate-limits");
+    limitsResource->set_method_handler(
+        "GET", [&limiter](const SessionPtr &session)
+        { return sendJson(session, limiter.toJson()); });
+    service.publish(limitsResource);
+    if (limiter.enabled())
+    {
+        service.add_rule(std::make_shared<RateLimitRule>(limiter, apiKeys));
+        service.schedule([&limiter] { limiter.sweep(); },
+                         std::chrono::seconds(1));
+    }
+}
+
+// Reads a signed number of at most 9 digits.
+bool parseIssue(const std::string &text, int &issue)
+{
+    const std::size_t digits = text.size() - (text.rfind('-', 0) == 0);
+    if (digits == 0 || digits > 9 ||
+        text.find_first_not_of("0123456789", text.size() - digits) !=
+            std::string::npos)
+    {
+        return false;
+    }
+    issue = std::stoi(text);
+    return true;
+}
+
+// GET /analytics/count?by=C[,C]&bucket=N&C=V&issue_min=N&issue_max=N
+bool parseAnalyticsQuery(const SessionPtr &session,
+                         ColumnarSnapshot::Query &query)
+{
+    const auto &request = session->get_request();
+    const std::string by = request->get_query_parameter("by");
+    std::size_t begin = 0;
+    while (begin <= by.size() && !by.empty())
+    {
+        std::size_t end = by.find(',', begin);
+        end = end == std::string::npos ? by.size() : end;
+        ColumnarSnapshot::Column column;
+        if (!ColumnarSnapshot::parseColumn(by.substr(begin, end - begin),
+                                           column))
+        {
+            notAcceptable(session, "Not Acceptable, unknown column");
+            return false;
+        }
+        query.by.push_back(column);
+        begin = end + 1;
+    }
+    if (query.by.empty() || query.by.size() > 2)
+    {
+        notAcceptable(session, "Not Acceptable, group by one or two columns");
+        return false;
+    }
+    const std::string bucket = request->get_query_parameter("bucket");
+    if (!bucket.empty() && (!parseIssue(bucket, query.bucket) ||
+                            query.bucket < 1))
+    {
+        notAcceptable(session, "Not Acceptable, invalid bucket");
+        return false;
+    }
+    for (int c = 0; c < ColumnarSnapshot::COLUMNS; ++c)
+    {
+        const auto column = static_cast<ColumnarSnapshot::Column>(c);
+        const std::string name = ColumnarSnapshot::columnName(column);
+        if (column != ColumnarSnapshot::ISSUE &&
+            request->has_query_parameter(name))
+        {
+            query.equals.emplace_back(column,
+                                      request->get_query_parameter(name));
+        }
+    }
+    const std::string issue = request->get_query_parameter("issue");
+    const std::string low = request->get_query_parameter("issue_min");
+    const std::string high = request->get_query_parameter("issue_max");
+    if ((!issue.empty() && (!parseIssue(issue, query.minIssue) ||
+                            !parseIssue(issue, query.maxIssue))) ||
+        (!low.empty() && !parseIssue(low, query.minIssue)) ||
+        (!high.empty() && !parseIssue(high, query.maxIssue)))
+    {
+        notAcceptable(session, "Not Acceptable, invalid issue");
+        return false;
+    }
+    return true;
+}
+
+void countAnalytics(const SessionPtr &session, AnalyticsCache &analytics)
+{
+    ColumnarSnapshot::Query query;
+    if (!parseAnalyticsQuery(session, query))
+    {
+        return;
+    }
+    const auto snapshot = analytics.current();
+    sendJson(session, snapshot->toJson(query, snapshot->count(query)));
+}
+
+void publishAnalyticsResources(restbed::Service &service,
+                               AnalyticsCache &analytics)
+{
+    auto countResource = std::make_shared<restbed::Resource>();
+    countResource->set_path("/analytics/count");
+    countResource->set_method_handler(
+        "GET", [&analytics](const SessionPtr &session)
+        { return countAnalytics(session, analytics); });
+    service.publish(countResource);
+}
+
+// The series, creator and statistics resources, which only a store keeping
+// the catalogs can answer.
+void publishCatalogResources(restbed::Service &service,
+                             const StorageEngine &store,
+                             const IndexedStore &index)
+{
+    auto seriesResource = std::make_shared<restbed::Resource>();
+    seriesResource->set_path("/series");
+    seriesResource->set_method_handler(
+        "GET", [&index](const SessionPtr &session)
+        { return listSeries(session, index.series()); });
+    service.publish(seriesResource);
+
+    auto seriesRunResource = std::make_shared<restbed::Resource>();
+    seriesRunResource->set_path("/series/{title: .+}");
+    seriesRunResource->set_method_handler(
+        "GET", [&index](const SessionPtr &session)
+        { return readSeries(session, index.series()); });
+    service.publish(seriesRunResource);
+
+    auto creatorsResource = std::make_shared<restbed::Resource>();
+    creatorsResource->set_path("/creators");
+    creatorsResource->set_method_handler(
+        "GET", [&index](const SessionPtr &session)
+        { return listCreators(session, index.creators()); });
+    service.publish(creatorsResource);
+
+    auto creatorResource = std::make_shared<restbed::Resource>();
+    creatorResource->set_path("/creator/{id: [[:digit:]]+}");
+    creatorResource->set_method_handler(
+        "GET", [&index](const SessionPtr &session)
+        { return readCreator(session, index.creators()); });
+    service.publish(creatorResource);
+
+    auto creatorComicsResource = std::make_shared<restbed::Resource>();
+    creatorComicsResource->set_path("/creator/{id: [[:digit:]]+}/comics");
+    creatorComicsResource->set_method_handler(
+        "GET", [&store, &index](const SessionPtr &session)
+        { return readCreatorComics(session, store, index.creators()); });
+    service.publish(creatorComicsResource);
+
+    auto statsResource = std::make_shared<restbed::Resource>();
+    statsResource->set_path("/stats");
+    statsResource->set_method_handler(
+        "GET", [&index](const SessionPtr &session)
+        { return sendJson(session, toJson(currentStats(index))); });
+    service.publish(statsResource);
+
+    auto seriesStatsResource = std::make_shared<restbed::Resource>();
+    seriesStatsResource->set_path("/stats/series/{title: .+}");
+    seriesStatsResource->set_method_handler(
+        "GET", [&index](const SessionPtr &session)
+        { return readSeriesStats(session, index); });
+    service.publish(seriesStatsResource);
+
+    auto creatorStatsResource = std::make_shared<restbed::Resource>();
+    creatorStatsResource->set_path("/stats/creator/{id: [[:digit:]]+}");
+    creatorStatsResource->set_method_handler(
+        "GET", [&index](const SessionPtr &session)
+        { return readCreator(session, index.creators()); });
+    service.publish(creatorStatsResource);
+
+    auto verifyStatsResource = std::make_shared<restbed::Resource>();
+    verifyStatsResource->set_path("/admin/stats/verify");
+    verifyStatsResource->set_method_handler(
+        "GET", [&index](const SessionPtr &session)
+        { return sendJson(session, verifyStats(index)); });
+    service.publish(verifyStatsResource);
+}
+
+void publishResources(restbed::Service &service, StorageEngine &store,
+                      Tracer &tracer, const LockProfiler &profiler,
+                      const IndexedStore &index, AsyncLogger &logger,
+                      IdempotencyCache &idempotency, std::size_t maxBody,
+                      std::size_t maxImport)
 {
     auto comicResource = std::make_shared<restbed::Resource>();
     comicResource->set_path("/comic/{id: [[:digit:]]+}");
-    comicResource->set_method_handler("GET", [&db](const SessionPtr &session)
-                                      { return readComic(session, db); });
-    comicResource->set_method_handler("DELETE", [&db](const SessionPtr &session)
-                                      { return deleteComic(session, db); });
-    comicResource->set_method_handler("PUT", [&db](const SessionPtr &session)
-                                      { return updateComic(session, db); });
+    comicResource->set_method_handler(
+        "GET", [&store, &tracer](const SessionPtr &session)
+        { return readComic(session, store, tracer); });
+    comicResource->set_method_handler(
+        "DELETE", [&store, &tracer](const SessionPtr &session)
+        { return deleteComic(session, store, tracer); });
+    comicResource->set_method_handler(
+        "PUT", [&store, &tracer, maxBody](const SessionPtr &session)
+        { return updateComic(session, store, tracer, maxBody); });
     service.publish(comicResource);
 
     auto createComicResource = std::make_shared<restbed::Resource>();
     createComicResource->set_path("/comic");
-    auto createComicCallback = [&db](const SessionPtr &session)
-    { return createComic(session, db); };
+    auto createComicCallback =
+        [&store, &tracer, &idempotency, maxBody](const SessionPtr &session)
+    { return createComic(session, store, tracer, idempotency, maxBody); };
     createComicResource->set_method_handler("PUT", createComicCallback);
     createComicResource->set_method_handler("POST", createComicCallback);
+    createComicResource->set_method_handler(
+        "GET", [&index](const SessionPtr &session)
+        { return findComics(session, index); });
     service.publish(createComicResource);
+
+    auto comicsResource = std::make_shared<restbed::Resource>();
+    comicsResource->set_path("/comics");
+    comicsResource->set_method_handler("GET",
+                                       [&store](const SessionPtr &session)
+                                       { return exportComics(session, store); });
+    comicsResource->set_method_handler(
+        "POST", [&store, maxImport](const SessionPtr &session)
+        { return importComics(session, store, maxImport); });
+    service.publish(comicsResource);
+
+    auto transactionsResource = std::make_shared<restbed::Resource>();
+    transactionsResource->set_path("/transactions");
+    transactionsResource->set_method_handler(
+        "POST",
+        [&store, &tracer, &logger, maxBody](const SessionPtr &session)
+        { return applyTransaction(session, store, tracer, logger, maxBody); });
+    service.publish(transactionsResource);
+
+    auto tracesResource = std::make_shared<restbed::Resource>();
+    tracesResource->set_path("/admin/traces");
+    tracesResource->set_method_handler("GET",
+                                       [&tracer](const SessionPtr &session)
+                                       { return readTraces(session, tracer); });
+    service.publish(tracesResource);
+
+    auto locksResource = std::make_shared<restbed::Resource>();
+    locksResource->set_path("/admin/locks");
+    locksResource->set_method_handler(
+        "GET", [&profiler](const SessionPtr &session)
+        { return readLockProfile(session, profiler); });
+    service.publish(locksResource);
+
+    auto idempotencyResource = std::make_shared<restbed::Resource>();
+    idempotencyResource->set_path("/admin/idempotency");
+    idempotencyResource->set_method_handler(
+        "GET", [&idempotency](const SessionPtr &session)
+        { return sendJson(session, idempotency.toJson()); });
+    service.publish(idempotencyResource);
+
+    auto storageResource = std::make_shared<restbed::Resource>();
+    storageResource->set_path("/admin/storage");
+    storageResource->set_method_handler(
+        "GET", [&store](const SessionPtr &session)
+        { return readStorageStatus(session, store); });
+    service.publish(storageResource);
 }
 
-void runService()
+void runService(const Options &options)
 {
-    ComicDb db = load();
+    auto logger = std::make_shared<AsyncLogger>(
+        options.logLevel, options.logFormat, options.logFile);
+    LockProfiler profiler;
+    // Reader processes serve the writer's shared engine.
+    const bool reader = options.processIndex != 0;
+    std::unique_ptr<StorageEngine> engine;
+    ShardedStore *replica = nullptr;
+    if (!options.follow.empty())
+    {
+        // A follower starts empty and copies the leader's catalog.
+        if (options.engine != EngineKind::MEMORY)
+        {
+            throw std::runtime_error(
+                "A follower keeps its replica in the memory engine");
+        }
+        auto store = std::make_unique<ShardedStore>(options.shards, profiler);
+        replica = store.get();
+        engine = std::move(store);
+    }
+    else
+    {
+        engine = openStorageEngine(
+            {options.engine, options.shards, options.dataDir,
+             options.memtableMegabytes << 20,
+             [&logger](const std::string &message)
+             { logger->log(restbed::Logger::INFO, "%s", message.c_str()); },
+             options.sharedMegabytes << 20, reader},
+            profiler);
+        // A persistent engine keeps what it recovered unless told to
+        // preload.
+        if (!reader && (engine->nextId() == 0 || !options.preload.empty()))
+        {
+            engine->importBatch(load(options, *logger));
+        }
+    }
+    // Changes made through the leader's handlers are fed to followers.
+    IndexedStore indexed(*engine, options.uniqueTitles, !reader);
+    if (indexed.unique() && indexed.duplicates() != 0)
+    {
+        logger->log(restbed::Logger::WARNING,
+                    "%zu comics share their title and issue with another",
+                    indexed.duplicates());
+    }
+    ChangeFeed feed(options.replicationBuffer);
+    ReplicatedStore replicated(indexed, feed);
+    StorageEngine &store =
+        replica ? static_cast<StorageEngine &>(indexed) : replicated;
+    logger->log(restbed::Logger::INFO, "Using the %s storage engine",
+                store.name());
+    Tracer tracer(options.traceSampleEvery, options.traceCapacity);
+
+    // The memory engine is saved by forked children, which the saver waits
+    // for when it's destroyed after the service.
+    std::unique_ptr<BackgroundSaver> saver;
+    if (options.engine == EngineKind::MEMORY)
+    {
+        saver = std::make_unique<BackgroundSaver>(
+            store,
+            (std::filesystem::path{options.dataDir} / SNAPSHOT_FILE).string(),
+            *logger);
+    }
+
+    std::unique_ptr<ProcessGroup> readers;
+    if (options.processes > 1 && !reader)
+    {
+        readers = std::make_unique<ProcessGroup>(
+            options.arguments, options.processes - 1, *logger);
+        logger->log(restbed::Logger::INFO,
+                    "Serving from %u processes on ports %u to %u",
+                    options.processes, unsigned{options.port},
+                    options.port + options.processes - 1);
+    }
+
+    using std::chrono::milliseconds;
+    AdmissionControl admission(milliseconds(options.readTargetMs),
+                               milliseconds(options.writeTargetMs),
+                               milliseconds(options.shedIntervalMs));
+    RateLimiter limiter(options.rateLimits);
+    const std::unordered_set<std::string> apiKeys =
+        loadApiKeys(options.apiKeys);
 
+    std::unique_ptr<Follower> follower;
     restbed::Service service;
-    publishResources(service, db);
-    service.set_logger(std::make_shared<CustomLogger>());
-    service.start(getSettings());
+    publishAdmissionResources(service, admission);
+    publishRateLimitResources(service, limiter, apiKeys);
+    const std::size_t maxBody = std::size_t{options.maxBodyKilobytes} << 10;
+    const std::size_t maxImport = std::size_t{options.maxImportMegabytes}
+                                  << 20;
+    IdempotencyCache idempotency(
+        options.idempotencyKeys,
+        std::chrono::seconds(options.idempotencySeconds));
+    publishResources(service, store, tracer, profiler, indexed, *logger,
+                     idempotency, maxBody, maxImport);
+    if (indexed.cataloged())
+    {
+        publishCatalogResources(service, store, indexed);
+    }
+    // Built from the engine itself, as readers and followers hold it too.
+    AnalyticsCache analytics(
+        *engine, std::chrono::seconds(options.analyticsMaxAgeSeconds));
+    publishAnalyticsResources(service, analytics);
+    if (replica)
+    {
+        follower = std::make_unique<Follower>(*replica, indexed,
+                                              options.follow, *logger);
+        publishFollowerResources(service, *follower);
+        logger->log(restbed::Logger::INFO, "Following leader %s",
+                    options.follow.c_str());
+    }
+    else if (reader)
+    {
+        service.add_rule(std::make_shared<WriterRule>(
+            options.port, std::max(maxBody, maxImport)));
+    }
+    else
+    {
+        publishReplicationResources(service, store, feed);
+    }
+    service.set_logger(logger);
+    service.schedule([&store] { store.maintain(); }, std::chrono::seconds(1));
+    service.schedule([&idempotency] { idempotency.expire(); },
+                     std::chrono::seconds(1));
+    if (readers)
+    {
+        service.schedule([&readers] { readers->poll(); },
+                         std::chrono::seconds(1));
+    }
+    if (saver)
+    {
+        publishSnapshotResource(service, *saver, *logger);
+        service.schedule([&saver] { saver->poll(); }, std::chrono::seconds(1));
+    }
+    if (saver && options.snapshotSeconds != 0)
+    {
+        service.schedule(
+            [&saver, &logger]
+            {
+                try
+                {
+                    saver->start();
+                }
+                catch (const std::exception &bang)
+                {
+                    logger->log(restbed::Logger::ERROR,
+                                "Snapshot failed to start: %s", bang.what());
+                }
+            },
+            std::chrono::seconds(options.snapshotSeconds));
+    }
+    auto stop = [&service](const int) { service.stop(); };
+    service.set_signal_handler(SIGINT, stop);
+    service.set_signal_handler(SIGTERM, stop);
+    service.start(getSettings(options));
+
+    for (const std::string &line : profiler.summary())
+    {
+        logger->log(restbed::Logger::INFO, "%s", line.c_str());
+    }
+    logger->flush();
 }
 
 } // namespace comicsdb
 
-int main()
+int main(int argc, char *argv[])
 {
     try
     {
-        comicsdb::runService();
+        comicsdb::runService(comicsdb::parseCommandLine(argc, argv));
     }
     catch (const std::exception &bang)
     {
@@ -0,0 +1,1212 @@
+// Front router for a catalog partitioned across several comicsdb servers.
+//
+// Each comic lives on the backend its id hashes to on a consistent hash
+// ring, so /comic/{id} requests are forwarded to that backend over pooled
+// keep-alive connections.  The router hands out the ids of new comics
+// itself and creates them on their backend with PUT and If-None-Match: *.
+// GET /comics, lookups by title and issue, series, creators, statistics and
+// analytics are sent to every backend at once and the replies are merged.
+#include "backend.h"
+#include "comic.h"
+#include "creators.h"
+#include "hash_ring.h"
+#include "http.h"
+#include "idempotency.h"
+#include "logger.h"
+#include "stats.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <restbed>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace comicsdb
+{
+namespace
+{
+
+// Ids tried for one create before giving up, in case some were taken by
+// writes that bypassed the router.
+constexpr int CREATE_ATTEMPTS = 16;
+
+const char *const USAGE =
+    "Usage: comicsdb_router [options] --backend HOST:PORT ...\n"
+    "  --port PORT          listen on PORT (default 80)\n"
+    "  --workers N          request threads (default 4)\n"
+    "  --backend HOST:PORT  a comicsdb server; repeat for each one\n"
+    "  --points N           ring points per backend (default 160)\n"
+    "  --pool N             idle connections kept per backend (default 64)\n"
+    "  --max-body-kb N      largest comic forwarded (default 64)\n"
+    "  --idempotency-keys N Idempotency-Keys remembered, 0 ignores them\n"
+    "                       (default 100000)\n"
+    "  --idempotency-ttl S  how long each is remembered (default 86400)\n"
+    "  --log-level LEVEL    debug, info, warning, security, error or fatal\n"
+    "  --log-file PATH      log to PATH instead of stderr\n";
+
+struct RouterOptions
+{
+    std::uint16_t port{80};
+    unsigned workers{4};
+    std::vector<std::string> backends;
+    unsigned points{160};
+    std::size_t poolSize{64};
+    unsigned maxBodyKilobytes{64};
+    std::size_t idempotencyKeys{100000};
+    unsigned idempotencySeconds{86400};
+    restbed::Logger::Level logLevel{restbed::Logger::INFO};
+    std::string logFile;
+};
+
+std::string value(int argc, char *argv[], int &i)
+{
+    if (i + 1 >= argc)
+    {
+        throw std::runtime_error(std::string{"Missing value for "} + argv[i] +
+                                 "\n" + USAGE);
+    }
+    return argv[++i];
+}
+
+unsigned long number(int argc, char *argv[], int &i, unsigned long max)
+{
+    const std::string option = argv[i];
+    const std::string text = value(argc, argv, i);
+    std::size_t end{};
+    unsigned long result{};
+    try
+    {
+        result = std::stoul(text, &end);
+    }
+    catch (const std::exception &)
+    {
+        end = 0;
+    }
+    if (end != text.size() || result > max)
+    {
+        throw std::runtime_error("Invalid value " + text + " for " + option +
+                                 "\n" + USAGE);
+    }
+    return result;
+}
+
+RouterOptions parseCommandLine(int argc, char *argv[])
+{
+    RouterOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--port")
+        {
+            options.port =
+                static_cast<std::uint16_t>(number(argc, argv, i, 65535));
+        }
+        else if (arg == "--workers")
+        {
+            options.workers =
+                static_cast<unsigned>(std::max(1UL, number(argc, argv, i, 1024)));
+        }
+        else if (arg == "--backend")
+        {
+            const std::string address = value(argc, argv, i);
+            const std::size_t colon = address.rfind(':');
+            if (colon == 0 || colon == std::string::npos ||
+                colon + 1 == address.size() || colon + 6 < address.size() ||
+                address.find_first_not_of("0123456789", colon + 1) !=
+                    std::string::npos ||
+                std::stoul(address.substr(colon + 1)) > 65535)
+            {
+                throw std::runtime_error("Invalid backend " + address +
+                                         ", expected HOST:PORT\n" + USAGE);
+            }
+            if (std::find(options.backends.begin(), options.backends.end(),
+                          address) != options.backends.end())
+            {
+                throw std::runtime_error("Backend " + address +
+                                         " given twice");
+            }
+            options.backends.push_back(address);
+        }
+        else if (arg == "--points")
+        {
+            options.points = static_cast<unsigned>(
+                std::max(1UL, number(argc, argv, i, 65536)));
+        }
+        else if (arg == "--pool")
+        {
+            options.poolSize = number(argc, argv, i, 65536);
+        }
+        else if (arg == "--max-body-kb")
+        {
+            options.maxBodyKilobytes = static_cast<unsigned>(
+                std::max(1UL, number(argc, argv, i, 1UL << 20)));
+        }
+        else if (arg == "--idempotency-keys")
+        {
+            options.idempotencyKeys = number(argc, argv, i, 1UL << 30);
+        }
+        else if (arg == "--idempotency-ttl")
+        {
+            options.idempotencySeconds = static_cast<unsigned>(
+                std::max(1UL, number(argc, argv, i, 86400 * 30)));
+        }
+        else if (arg == "--log-level")
+        {
+            options.logLevel = parseLogLevel(value(argc, argv, i));
+        }
+        else if (arg == "--log-file")
+        {
+            options.logFile = value(argc, argv, i);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg + "\n" + USAGE);
+        }
+    }
+    if (options.backends.empty())
+    {
+        throw std::runtime_error(std::string{"No backends\n"} + USAGE);
+    }
+    return options;
+}
+
+// The backends and which ids each one owns.
+class Cluster
+{
+  public:
+    explicit Cluster(const RouterOptions &options) :
+        m_ring(options.backends, options.points)
+    {
+        for (const std::string &address : options.backends)
+        {
+            m_backends.push_back(
+                std::make_unique<Backend>(address, options.poolSize));
+        }
+    }
+
+    const std::vector<std::unique_ptr<Backend>> &backends() const
+    {
+        return m_backends;
+    }
+    Backend &owner(std::size_t id) const
+    {
+        return *m_backends[m_ring.owner(id)];
+    }
+
+    // Starts handing out ids after the highest any backend has used, so
+    // catalogs created before the router keep their ids.  Throws
+    // std::runtime_error if a backend can't be reached.
+    void discoverNextId()
+    {
+        std::size_t nextId = 0;
+        for (const std::unique_ptr<Backend> &backend : m_backends)
+        {
+            const Backend::Reply reply = backend->exchange("GET",
+                                                           "/admin/storage");
+            rapidjson::Document document;
+            document.Parse(reply.body.c_str());
+            if (reply.status != restbed::OK || !document.IsObject() ||
+                !document.HasMember("next_id") ||
+                !document["next_id"].IsUint64())
+            {
+                throw std::runtime_error("Backend " + backend->address() +
+                                         " didn't report its next id");
+            }
+            nextId = std::max<std::size_t>(nextId,
+                                           document["next_id"].GetUint64());
+        }
+        m_nextId = nextId;
+    }
+    std::size_t allocateId() { return m_nextId++; }
+
+    std::string toJson() const
+    {
+        const std::vector<double> shares = m_ring.shares();
+        std::string json = "{\"next_id\":" + std::to_string(m_nextId.load()) +
+                           ",\"backends\":[";
+        for (std::size_t i = 0; i < m_backends.size(); ++i)
+        {
+            // Splice the ring share into the backend's own report.
+            std::string backend = m_backends[i]->toJson();
+            backend.pop_back();
+            json += (i == 0 ? "" : ",") + backend +
+                    ",\"ring_share\":" + std::to_string(shares[i]) + '}';
+        }
+        return json + "]}";
+    }
+
+  private:
+    HashRing m_ring;
+    std::vector<std::unique_ptr<Backend>> m_backends;
+    std::atomic<std::size_t> m_nextId{0};
+};
+
+void badGateway(const SessionPtr &session, const std::exception &bang)
+{
+    sendText(session, restbed::BAD_GATEWAY,
+             std::string{"Bad Gateway, "} + bang.what());
+}
+
+// Passes a backend's reply on to the client.
+void relay(const SessionPtr &session, const Backend::Reply &backendReply)
+{
+    std::multimap<std::string, std::string> headers;
+    const auto type = backendReply.headers.find("Content-Type");
+    if (type != backendReply.headers.end())
+    {
+        headers.emplace("Content-Type", type->second);
+    }
+    reply(session, backendReply.status, backendReply.body, headers);
+}
+
+// Reads the request body, then calls handle with it.  Bodies without a
+// Content-Length or larger than limit are refused before they're read, and
+// the connection closed since the body is left unread.
+void withBody(const SessionPtr &session, std::size_t limit,
+              const std::function<void(const SessionPtr &,
+                                       const std::string &)> &handle)
+{
+    std::size_t length{};
+    if (!bodyLength(session, limit, length))
+    {
+        return;
+    }
+    if (length == 0)
+    {
+        sendText(session, restbed::NOT_ACCEPTABLE,
+                 "Not Acceptable, empty body");
+        return;
+    }
+    session->fetch(length,
+                   [handle](const SessionPtr &session,
+                            const restbed::Bytes &data)
+                   {
+                       handle(session,
+                              std::string{reinterpret_cast<const char *>(
+                                              data.data()),
+                                          data.size()});
+                   });
+}
+
+void forwardComic(const SessionPtr &session, Cluster &cluster,
+                  std::size_t maxBody)
+{
+    const auto &request = session->get_request();
+    const std::size_t id = request->get_path_parameter("id", std::size_t{0});
+    const std::string method = request->get_method();
+    const std::string path = "/comic/" + std::to_string(id);
+    Backend &backend = cluster.owner(id);
+    if (method != "PUT")
+    {
+        try
+        {
+            relay(session, backend.exchange(method, path));
+        }
+        catch (const std::exception &bang)
+        {
+            badGateway(session, bang);
+        }
+        return;
+    }
+
+    Backend::Headers headers{{"Content-Type", "application/json"}};
+    const std::string precondition = request->get_header("If-None-Match");
+    if (!precondition.empty())
+    {
+        headers.emplace("If-None-Match", precondition);
+    }
+    withBody(session, maxBody,
+             [&backend, path, headers](const SessionPtr &session,
+                                       const std::string &body)
+             {
+                 try
+                 {
+                     relay(session,
+                           backend.exchange("PUT", path, body, headers));
+                 }
+                 catch (const std::exception &bang)
+                 {
+                     badGateway(session, bang);
+                 }
+             });
+}
+
+void createComic(const SessionPtr &session, Cluster &cluster,
+                 IdempotencyCache &idempotency, std::size_t maxBody)
+{
+    std::string key;
+    if (!idempotencyKey(session, idempotency, key))
+    {
+        return;
+    }
+    withBody(
+        session, maxBody,
+        [&cluster, &idempotency, key](const SessionPtr &session,
+                                      const std::string &body)
+        {
+            // Checked here so invalid comics don't use up ids.
+            Comic comic;
+            try
+            {
+                comic = fromJson(body);
+            }
+            catch (const std::exception &)
+            {
+                comic = Comic{};
+            }
+            if (!isValid(comic))
+            {
+                sendText(session, restbed::NOT_ACCEPTABLE,
+                         "Not Acceptable, invalid JSON");
+                return;
+            }
+            if (!key.empty() && !beginCreate(session, idempotency, key,
+                                             body.data(), body.size()))
+            {
+                return;
+            }
+
+            try
+            {
+                for (int attempt = 0; attempt < CREATE_ATTEMPTS; ++attempt)
+                {
+                    const std::size_t id = cluster.allocateId();
+                    const Backend::Reply created = cluster.owner(id).exchange(
+                        "PUT", "/comic/" + std::to_string(id), body,
+                        {{"Content-Type", "application/json"},
+                         {"If-None-Match", "*"}});
+                    if (created.status == restbed::CREATED)
+                    {
+                        const IdempotencyCache::Result result{
+                            restbed::CREATED, "/comic/" + std::to_string(id),
+                            "{\"id\":" + std::to_string(id) + "}"};
+                        if (!key.empty())
+                        {
+                            idempotency.finish(key, result);
+                        }
+                        sendCreated(session, result, false);
+                        return;
+                    }
+                    if (created.status != restbed::PRECONDITION_FAILED)
+                    {
+                        if (!key.empty())
+                        {
+                            idempotency.abandon(key);
+                        }
+                        relay(session, created);
+                        return;
+                    }
+                }
+                if (!key.empty())
+                {
+                    idempotency.abandon(key);
+                }
+                sendText(session, restbed::CONFLICT,
+                         "Conflict, no free id found");
+            }
+            catch (const std::exception &bang)
+            {
+                // The backend may or may not have created it; a retry
+                // creates it again at worst, as without a key.
+                if (!key.empty())
+                {
+                    idempotency.abandon(key);
+                }
+                badGateway(session, bang);
+            }
+        });
+}
+
+// The id at the start of a line of the export format, {"id":N,...}.
+std::size_t lineId(const std::string &body, std::size_t begin)
+{
+    return std::strtoull(body.c_str() + begin + 6, nullptr, 10);
+}
+
+// Sends GET path to every backend at once and collects their replies, in
+// the order of the backends; false, having answered, if one can't be
+// reached.
+bool fanOut(const SessionPtr &session, const Cluster &cluster,
+            const std::string &path, std::vector<Backend::Reply> &parts)
+{
+    std::vector<std::future<Backend::Reply>> pending;
+    for (const std::unique_ptr<Backend> &backend : cluster.backends())
+    {
+        Backend *target = backend.get();
+        pending.push_back(std::async(
+            std::launch::async,
+            [target, path] { return target->exchange("GET", path); }));
+    }
+    try
+    {
+        for (std::future<Backend::Reply> &part : pending)
+        {
+            parts.push_back(part.get());
+        }
+    }
+    catch (const std::exception &bang)
+    {
+        badGateway(session, bang);
+        return false;
+    }
+    return true;
+}
+
+// Drops the replies of backends that don't know what was asked for, such
+// as a creator none of their comics credit, as they have nothing to add.
+// False, having answered, if one failed otherwise or none knew it.
+bool known(const SessionPtr &session, std::vector<Backend::Reply> &parts)
+{
+    std::vector<Backend::Reply> found;
+    for (Backend::Reply &part : parts)
+    {
+        if (part.status == restbed::OK)
+        {
+            found.push_back(std::move(part));
+        }
+        else if (part.status != restbed::NOT_ACCEPTABLE)
+        {
+            relay(session, part);
+            return false;
+        }
+    }
+    if (found.empty() && !parts.empty())
+    {
+        relay(session, parts.front());
+        return false;
+    }
+    parts = std::move(found);
+    return true;
+}
+
+// Drops the lines of body, in the export format, whose ids backend doesn't
+// own, such as the sample comics every backend starts with unless given
+// --empty, so each comic is listed once.
+void keepOwned(const Cluster &cluster, const Backend &backend,
+               std::string &body)
+{
+    std::string owned;
+    for (std::size_t begin = 0; begin < body.size();)
+    {
+        std::size_t end = body.find('\n', begin);
+        end = end == std::string::npos ? body.size() : end + 1;
+        if (&cluster.owner(lineId(body, begin)) == &backend)
+        {
+            owned.append(body, begin, end - begin);
+        }
+        begin = end;
+    }
+    body = std::move(owned);
+}
+
+// Sends GET path to every backend at once and merges the comics they
+// answer with, each in the export format and in id order.
+void gatherComics(const SessionPtr &session, const Cluster &cluster,
+                  const std::string &path)
+{
+    std::vector<Backend::Reply> parts;
+    if (!fanOut(session, cluster, path, parts))
+    {
+        return;
+    }
+    for (std::size_t i = 0; i < parts.size(); ++i)
+    {
+        if (parts[i].status == restbed::OK)
+        {
+            keepOwned(cluster, *cluster.backends()[i], parts[i].body);
+        }
+    }
+    if (!known(session, parts))
+    {
+        return;
+    }
+
+    // Every backend lists its comics in id order; merge the lists.
+    std::string body;
+    std::vector<std::size_t> offsets(parts.size());
+    while (true)
+    {
+        std::size_t next = parts.size();
+        for (std::size_t i = 0; i < parts.size(); ++i)
+        {
+            if (offsets[i] < parts[i].body.size() &&
+                (next == parts.size() ||
+                 lineId(parts[i].body, offsets[i]) <
+                     lineId(parts[next].body, offsets[next])))
+            {
+                next = i;
+            }
+        }
+        if (next == parts.size())
+        {
+            break;
+        }
+        const std::string &part = parts[next].body;
+        std::size_t end = part.find('\n', offsets[next]);
+        end = end == std::string::npos ? part.size() : end + 1;
+        body.append(part, offsets[next], end - offsets[next]);
+        offsets[next] = end;
+    }
+    reply(session, restbed::OK, body,
+          {{"Content-Type", "application/x-ndjson"}});
+}
+
+void exportComics(const SessionPtr &session, const Cluster &cluster)
+{
+    gatherComics(session, cluster, "/comics");
+}
+
+// Any backend may hold comics with a given title and issue, so uniqueness
+// is only enforced within each.
+void findComics(const SessionPtr &session, const Cluster &cluster)
+{
+    const auto &request = session->get_request();
+    const std::string title = request->get_query_parameter("title");
+    const std::string issue = request->get_query_parameter("issue");
+    gatherComics(session, cluster,
+                 "/comic?title=" + restbed::Uri::encode(title) +
+                     "&issue=" + restbed::Uri::encode(issue));
+}
+
+// Adds up the counts of each series in the backends' lists, by
+// normalized title, keeping the first spelling of each title.
+bool mergeSeries(
+    const SessionPtr &session, const std::vector<Backend::Reply> &parts,
+    std::map<std::string, std::pair<std::string, std::uint64_t>> &series)
+{
+    for (const Backend::Reply &part : parts)
+    {
+        rapidjson::Document document;
+        document.Parse(part.body.c_str());
+        if (document.HasParseError() || !document.IsObject() ||
+            !document.HasMember("series") || !document["series"].IsArray())
+        {
+            sendText(session, restbed::BAD_GATEWAY,
+                     "Bad Gateway, invalid series list");
+            return false;
+        }
+        const rapidjson::Value &list = document["series"];
+        for (rapidjson::SizeType i = 0; i < list.Size(); ++i)
+        {
+            const rapidjson::Value &entry = list[i];
+            if (!entry.IsObject() || !entry.HasMember("title") ||
+                !entry["title"].IsString() || !entry.HasMember("issues") ||
+                !entry["issues"].IsUint64())
+            {
+                continue;
+            }
+            const std::string title = entry["title"].GetString();
+            auto &merged = series[normalizeTitle(title)];
+            if (merged.first.empty())
+            {
+                merged.first = title;
+            }
+            merged.second += entry["issues"].GetUint64();
+        }
+    }
+    return true;
+}
+
+// A series' comics may be on any backend, so each lists its own part and
+// the counts are added up by title.
+void listSeries(const SessionPtr &session, const Cluster &cluster)
+{
+    std::vector<Backend::Reply> parts;
+    std::map<std::string, std::pair<std::string, std::uint64_t>> series;
+    if (!fanOut(session, cluster, "/series", parts) ||
+        !known(session, parts) || !mergeSeries(session, parts, series))
+    {
+        return;
+    }
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("series");
+    writer.StartArray();
+    for (const auto &entry : series)
+    {
+        writer.StartObject();
+        writer.Key("title");
+        writer.String(entry.second.first.c_str());
+        writer.Key("issues");
+        writer.Uint64(entry.second.second);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    sendJson(session, buffer.GetString());
+}
+
+// The run of a series, merged from the part on each backend by issue.
+void readSeries(const SessionPtr &session, const Cluster &cluster)
+{
+    const std::string title =
+        session->get_request()->get_path_parameter("title");
+    std::vector<Backend::Reply> parts;
+    if (!fanOut(session, cluster, "/series/" + restbed::Uri::encode(title),
+                parts) ||
+        !known(session, parts))
+    {
+        return;
+    }
+    std::vector<rapidjson::Document> documents(parts.size());
+    std::vector<const rapidjson::Value *> issues;
+    std::string name;
+    for (std::size_t i = 0; i < parts.size(); ++i)
+    {
+        rapidjson::Document &document = documents[i];
+        document.Parse(parts[i].body.c_str());
+        if (document.HasParseError() || !document.IsObject() ||
+            !document.HasMember("title") || !document["title"].IsString() ||
+            !document.HasMember("issues") || !document["issues"].IsArray())
+        {
+            sendText(session, restbed::BAD_GATEWAY,
+                     "Bad Gateway, invalid series");
+            return;
+        }
+        if (name.empty())
+        {
+            name = document["title"].GetString();
+        }
+        const rapidjson::Value &run = document["issues"];
+        for (rapidjson::SizeType j = 0; j < run.Size(); ++j)
+        {
+            const rapidjson::Value &issue = run[j];
+            if (issue.IsObject() && issue.HasMember("issue") &&
+                issue["issue"].IsInt() && issue.HasMember("id") &&
+                issue["id"].IsUint64())
+            {
+                issues.push_back(&issue);
+            }
+        }
+    }
+    std::sort(issues.begin(), issues.end(),
+              [](const rapidjson::Value *lhs, const rapidjson::Value *rhs)
+              {
+                  const int left = (*lhs)["issue"].GetInt();
+                  const int right = (*rhs)["issue"].GetInt();
+                  return left != right ? left < right
+                                       : (*lhs)["id"].GetUint64() <
+                                             (*rhs)["id"].GetUint64();
+              });
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("title");
+    writer.String(name.c_str());
+    writer.Key("issues");
+    writer.StartArray();
+    for (const rapidjson::Value *issue : issues)
+    {
+        issue->Accept(writer);
+    }
+    writer.EndArray();
+    writer.EndObject();
+    sendJson(session, buffer.GetString());
+}
+
+// Adds up the credits of each creator in the backends' replies, each
+// either a list of creators or, with !list, a single one.  Creator ids
+// come from their names, so every backend gives a creator the same id.
+bool mergeCreators(const SessionPtr &session,
+                   const std::vector<Backend::Reply> &parts, bool list,
+                   std::map<std::uint64_t, CreatorCatalog::Summary> &merged)
+{
+    for (const Backend::Reply &part : parts)
+    {
+        rapidjson::Document document;
+        document.Parse(part.body.c_str());
+        const bool valid = !document.HasParseError() &&
+                           document.IsObject() &&
+                           (!list || (document.HasMember("creators") &&
+                                      document["creators"].IsArray()));
+        if (!valid)
+        {
+            sendText(session, restbed::BAD_GATEWAY,
+                     "Bad Gateway, invalid creators");
+            return false;
+        }
+        const rapidjson::Value *creators = &document;
+        rapidjson::SizeType count = 1;
+        if (list)
+        {
+            creators = &document["creators"];
+            count = creators->Size();
+        }
+        for (rapidjson::SizeType i = 0; i < count; ++i)
+        {
+            const rapidjson::Value &creator = list ? (*creators)[i] : document;
+            if (!creator.IsObject() || !creator.HasMember("id") ||
+                !creator["id"].IsUint64() || !creator.HasMember("name") ||
+                !creator["name"].IsString() ||
+                !creator.HasMember("credits") ||
+                !creator["credits"].IsObject())
+            {
+                continue;
+            }
+            CreatorCatalog::Summary &summary =
+                merged[creator["id"].GetUint64()];
+            summary.id = creator["id"].GetUint64();
+            summary.name = creator["name"].GetString();
+            const rapidjson::Value &credits = creator["credits"];
+            for (int r = 0; r < CreatorCatalog::ROLES; ++r)
+            {
+                const char *role = CreatorCatalog::roleName(
+                    static_cast<CreatorCatalog::Role>(r));
+                if (credits.HasMember(role) && credits[role].IsUint64())
+                {
+                    summary.credits[r] += credits[role].GetUint64();
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void listCreators(const SessionPtr &session, const Cluster &cluster)
+{
+    std::vector<Backend::Reply> parts;
+    std::map<std::uint64_t, CreatorCatalog::Summary> merged;
+    if (!fanOut(session, cluster, "/creators", parts) ||
+        !known(session, parts) || !mergeCreators(session, parts, true, merged))
+    {
+        return;
+    }
+    std::vector<CreatorCatalog::Summary> creators;
+    creators.reserve(merged.size());
+    for (auto &entry : merged)
+    {
+        creators.push_back(std::move(entry.second));
+    }
+    std::sort(creators.begin(), creators.end(),
+              [](const CreatorCatalog::Summary &lhs,
+                 const CreatorCatalog::Summary &rhs)
+              {
+                  return lhs.name != rhs.name ? lhs.name < rhs.name
+                                              : lhs.id < rhs.id;
+              });
+    sendJson(session, toJson(creators));
+}
+
+// GET prefix{id}, a creator as /creator/{id} and /stats/creator/{id}
+// show them.
+void readCreator(const SessionPtr &session, const Cluster &cluster,
+                 const std::string &prefix)
+{
+    const std::string id = session->get_request()->get_path_parameter("id");
+    std::vector<Backend::Reply> parts;
+    std::map<std::uint64_t, CreatorCatalog::Summary> merged;
+    if (!fanOut(session, cluster, prefix + id, parts) ||
+        !known(session, parts) ||
+        !mergeCreators(session, parts, false, merged))
+    {
+        return;
+    }
+    if (merged.size() != 1)
+    {
+        sendText(session, restbed::BAD_GATEWAY,
+                 "Bad Gateway, invalid creator");
+        return;
+    }
+    sendJson(session, toJson(merged.begin()->second));
+}
+
+void readCreatorComics(const SessionPtr &session, const Cluster &cluster)
+{
+    const auto &request = session->get_request();
+    std::string path =
+        "/creator/" + request->get_path_parameter("id") + "/comics";
+    const std::string role = request->get_query_parameter("role");
+    if (!role.empty())
+    {
+        path += "?role=" + restbed::Uri::encode(role);
+    }
+    gatherComics(session, cluster, path);
+}
+
+// The comics and credits add up across backends, but a series or creator
+// may span several, so those are counted from the merged lists.
+void readStats(const SessionPtr &session, const Cluster &cluster)
+{
+    std::vector<Backend::Reply> parts;
+    std::vector<Backend::Reply> seriesParts;
+    std::vector<Backend::Reply> creatorParts;
+    std::map<std::string, std::pair<std::string, std::uint64_t>> series;
+    std::map<std::uint64_t, CreatorCatalog::Summary> creators;
+    if (!fanOut(session, cluster, "/stats", parts) ||
+        !known(session, parts) ||
+        !fanOut(session, cluster, "/series", seriesParts) ||
+        !known(session, seriesParts) ||
+        !mergeSeries(session, seriesParts, series) ||
+        !fanOut(session, cluster, "/creators", creatorParts) ||
+        !known(session, creatorParts) ||
+        !mergeCreators(session, creatorParts, true, creators))
+    {
+        return;
+    }
+    CatalogStats stats;
+    stats.series = series.size();
+    stats.creators = creators.size();
+    for (const Backend::Reply &part : parts)
+    {
+        rapidjson::Document document;
+        document.Parse(part.body.c_str());
+        if (document.HasParseError() || !document.IsObject() ||
+            !document.HasMember("comics") || !document["comics"].IsUint64() ||
+            !document.HasMember("credits") || !document["credits"].IsObject())
+        {
+            sendText(session, restbed::BAD_GATEWAY,
+                     "Bad Gateway, invalid statistics");
+            return;
+        }
+        stats.comics += document["comics"].GetUint64();
+        const rapidjson::Value &credits = document["credits"];
+        for (int r = 0; r < CreatorCatalog::ROLES; ++r)
+        {
+            const char *role = CreatorCatalog::roleName(
+                static_cast<CreatorCatalog::Role>(r));
+            if (credits.HasMember(role) && credits[role].IsUint64())
+            {
+                stats.credits[r] += credits[role].GetUint64();
+            }
+        }
+    }
+    sendJson(session, toJson(stats));
+}
+
+void readSeriesStats(const SessionPtr &session, const Cluster &cluster)
+{
+    const std::string title =
+        session->get_request()->get_path_parameter("title");
+    std::vector<Backend::Reply> parts;
+    if (!fanOut(session, cluster,
+                "/stats/series/" + restbed::Uri::encode(title), parts) ||
+        !known(session, parts))
+    {
+        return;
+    }
+    std::uint64_t comics = 0;
+    for (const Backend::Reply &part : parts)
+    {
+        rapidjson::Document document;
+        document.Parse(part.body.c_str());
+        if (document.HasParseError() || !document.IsObject() ||
+            !document.HasMember("comics") || !document["comics"].IsUint64())
+        {
+            sendText(session, restbed::BAD_GATEWAY,
+                     "Bad Gateway, invalid statistics");
+            return;
+        }
+        comics += document["comics"].GetUint64();
+    }
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("title");
+    writer.String(title.c_str());
+    writer.Key("comics");
+    writer.Uint64(comics);
+    writer.EndObject();
+    sendJson(session, buffer.GetString());
+}
+
+// Each backend counts its own comics, so the counts of each group add up.
+void countAnalytics(const SessionPtr &session, const Cluster &cluster)
+{
+    std::string path = "/analytics/count";
+    char separator = '?';
+    for (const auto &parameter :
+         session->get_request()->get_query_parameters())
+    {
+        path += separator + restbed::Uri::encode(parameter.first) + '=' +
+                restbed::Uri::encode(parameter.second);
+        separator = '&';
+    }
+    std::vector<Backend::Reply> parts;
+    if (!fanOut(session, cluster, path, parts) || !known(session, parts))
+    {
+        return;
+    }
+    // Each key as numbers, or strings with a 0 before them, which orders
+    // the groups as a backend does since each position holds one kind.
+    using Key = std::vector<std::pair<std::int64_t, std::string>>;
+    std::map<Key, std::uint64_t> groups;
+    std::uint64_t rows = 0;
+    std::vector<std::string> by;
+    for (const Backend::Reply &part : parts)
+    {
+        rapidjson::Document document;
+        document.Parse(part.body.c_str());
+        if (document.HasParseError() || !document.IsObject() ||
+            !document.HasMember("by") || !document["by"].IsArray() ||
+            !document.HasMember("rows") || !document["rows"].IsUint64() ||
+            !document.HasMember("groups") || !document["groups"].IsArray())
+        {
+            sendText(session, restbed::BAD_GATEWAY,
+                     "Bad Gateway, invalid analytics");
+            return;
+        }
+        if (by.empty())
+        {
+            const rapidjson::Value &columns = document["by"];
+            for (rapidjson::SizeType i = 0; i < columns.Size(); ++i)
+            {
+                by.push_back(columns[i].IsString() ? columns[i].GetString()
+                                                   : "");
+            }
+        }
+        rows += document["rows"].GetUint64();
+        const rapidjson::Value &list = document["groups"];
+        for (rapidjson::SizeType i = 0; i < list.Size(); ++i)
+        {
+            const rapidjson::Value &group = list[i];
+            if (!group.IsObject() || !group.HasMember("key") ||
+                !group["key"].IsArray() || !group.HasMember("count") ||
+                !group["count"].IsUint64())
+            {
+                continue;
+            }
+            Key key;
+            const rapidjson::Value &values = group["key"];
+            for (rapidjson::SizeType k = 0; k < values.Size(); ++k)
+            {
+                if (values[k].IsInt64())
+                {
+                    key.emplace_back(values[k].GetInt64(), "");
+                }
+                else if (values[k].IsString())
+                {
+                    key.emplace_back(0, values[k].GetString());
+                }
+            }
+            groups[key] += group["count"].GetUint64();
+        }
+    }
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("by");
+    writer.StartArray();
+    for (const std::string &column : by)
+    {
+        writer.String(column.c_str());
+    }
+    writer.EndArray();
+    writer.Key("rows");
+    writer.Uint64(rows);
+    writer.Key("groups");
+    writer.StartArray();
+    for (const auto &group : groups)
+    {
+        writer.StartObject();
+        writer.Key("key");
+        writer.StartArray();
+        for (std::size_t k = 0; k < group.first.size(); ++k)
+        {
+            if (k < by.size() && by[k] == "issue")
+            {
+                writer.Int64(group.first[k].first);
+            }
+            else
+            {
+                writer.String(group.first[k].second.c_str());
+            }
+        }
+        writer.EndArray();
+        writer.Key("count");
+        writer.Uint64(group.second);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    sendJson(session, buffer.GetString());
+}
+
+void notRouted(const SessionPtr &session)
+{
+    sendText(session, restbed::NOT_IMPLEMENTED,
+             "Not Implemented, the router can't apply writes spanning "
+             "backends atomically");
+}
+
+void publishResources(restbed::Service &service, Cluster &cluster,
+                      IdempotencyCache &idempotency, std::size_t maxBody)
+{
+    auto comicResource = std::make_shared<restbed::Resource>();
+    comicResource->set_path("/comic/{id: [[:digit:]]+}");
+    for (const char *method : {"GET", "PUT", "DELETE"})
+    {
+        comicResource->set_method_handler(
+            method, [&cluster, maxBody](const SessionPtr &session)
+            { return forwardComic(session, cluster, maxBody); });
+    }
+    service.publish(comicResource);
+
+    auto createComicResource = std::make_shared<restbed::Resource>();
+    createComicResource->set_path("/comic");
+    createComicResource->set_method_handler(
+        "POST", [&cluster, &idempotency, maxBody](const SessionPtr &session)
+        { return createComic(session, cluster, idempotency, maxBody); });
+    createComicResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return findComics(session, cluster); });
+    service.publish(createComicResource);
+
+    auto seriesResource = std::make_shared<restbed::Resource>();
+    seriesResource->set_path("/series");
+    seriesResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return listSeries(session, cluster); });
+    service.publish(seriesResource);
+
+    auto seriesRunResource = std::make_shared<restbed::Resource>();
+    seriesRunResource->set_path("/series/{title: .+}");
+    seriesRunResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return readSeries(session, cluster); });
+    service.publish(seriesRunResource);
+
+    auto creatorsResource = std::make_shared<restbed::Resource>();
+    creatorsResource->set_path("/creators");
+    creatorsResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return listCreators(session, cluster); });
+    service.publish(creatorsResource);
+
+    auto creatorResource = std::make_shared<restbed::Resource>();
+    creatorResource->set_path("/creator/{id: [[:digit:]]+}");
+    creatorResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return readCreator(session, cluster, "/creator/"); });
+    service.publish(creatorResource);
+
+    auto creatorComicsResource = std::make_shared<restbed::Resource>();
+    creatorComicsResource->set_path("/creator/{id: [[:digit:]]+}/comics");
+    creatorComicsResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return readCreatorComics(session, cluster); });
+    service.publish(creatorComicsResource);
+
+    auto statsResource = std::make_shared<restbed::Resource>();
+    statsResource->set_path("/stats");
+    statsResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return readStats(session, cluster); });
+    service.publish(statsResource);
+
+    auto seriesStatsResource = std::make_shared<restbed::Resource>();
+    seriesStatsResource->set_path("/stats/series/{title: .+}");
+    seriesStatsResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return readSeriesStats(session, cluster); });
+    service.publish(seriesStatsResource);
+
+    auto creatorStatsResource = std::make_shared<restbed::Resource>();
+    creatorStatsResource->set_path("/stats/creator/{id: [[:digit:]]+}");
+    creatorStatsResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return readCreator(session, cluster, "/stats/creator/"); });
+    service.publish(creatorStatsResource);
+
+    auto analyticsResource = std::make_shared<restbed::Resource>();
+    analyticsResource->set_path("/analytics/count");
+    analyticsResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return countAnalytics(session, cluster); });
+    service.publish(analyticsResource);
+
+    auto comicsResource = std::make_shared<restbed::Resource>();
+    comicsResource->set_path("/comics");
+    comicsResource->set_method_handler(
+        "GET", [&cluster](const SessionPtr &session)
+        { return exportComics(session, cluster); });
+    comicsResource->set_method_handler("POST", notRouted);
+    service.publish(comicsResource);
+
+    auto transactionsResource = std::make_shared<restbed::Resource>();
+    transactionsResource->set_path("/transactions");
+    transactionsResource->set_method_handler("POST", notRouted);
+    service.publish(transactionsResource);
+
+    auto routerResource = std::make_shared<restbed::Resource>();
+    routerResource->set_path("/admin/router");
+    routerResource->set_method_handler(
+        "GET",
+        [&cluster](const SessionPtr &session)
+        {
+            sendJson(session, cluster.toJson());
+        });
+    service.publish(routerResource);
+}
+
+void runRouter(const RouterOptions &options)
+{
+    auto logger = std::make_shared<AsyncLogger>(
+        options.logLevel, LogFormat::TEXT, options.logFile);
+    Cluster cluster(options);
+    cluster.discoverNextId();
+    for (const std::unique_ptr<Backend> &backend : cluster.backends())
+    {
+        logger->log(restbed::Logger::INFO, "Routing to %s",
+                    backend->address().c_str());
+    }
+
+    IdempotencyCache idempotency(
+        options.idempotencyKeys,
+        std::chrono::seconds(options.idempotencySeconds));
+    restbed::Service service;
+    publishResources(service, cluster, idempotency,
+                     std::size_t{options.maxBodyKilobytes} << 10);
+    service.schedule([&idempotency] { idempotency.expire(); },
+                     std::chrono::seconds(1));
+    service.set_logger(logger);
+    auto stop = [&service](const int) { service.stop(); };
+    service.set_signal_handler(SIGINT, stop);
+    service.set_signal_handler(SIGTERM, stop);
+
+    auto settings = std::make_shared<restbed::Settings>();
+    settings->set_port(options.port);
+    settings->set_worker_limit(options.workers);
+    service.start(settings);
+    logger->flush();
+}
+
+} // namespace
+} // namespace comicsdb
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        comicsdb::runRouter(comicsdb::parseCommandLine(argc, argv));
+    }
+    catch (const std::exception &bang)
+    {
+        std::cerr << bang.what() << '\n';
+        return 1;
+    }
+    catch (...)
+    {
+        return 1;
+    }
+
+    return 0;
+}
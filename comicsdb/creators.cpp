@@ -0,0 +1,373 @@
+#include "creators.h"
+
+#include "hash.h"
+#include "varint.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+const char *const ROLE_NAMES[] = {"writer", "penciler", "inker", "letterer",
+                                  "colorist"};
+
+// Ids stay below 2^53 so JavaScript clients can hold them exactly.
+constexpr std::uint64_t ID_MASK = (std::uint64_t{1} << 53) - 1;
+
+// Names whose hashes collide for one salt almost surely don't for the
+// next.  Salt 0 is the plain hash.
+std::uint64_t hashName(const std::string &name, std::uint64_t salt)
+{
+    return mix64(fnv1a(name, salt * 0x9e3779b97f4a7c15ULL)) & ID_MASK;
+}
+
+const std::string &credited(const Comic &comic, CreatorCatalog::Role role)
+{
+    switch (role)
+    {
+    case CreatorCatalog::WRITER:
+        return comic.writer;
+    case CreatorCatalog::PENCILER:
+        return comic.penciler;
+    case CreatorCatalog::INKER:
+        return comic.inker;
+    case CreatorCatalog::LETTERER:
+        return comic.letterer;
+    default:
+        return comic.colorist;
+    }
+}
+
+void writeCreator(rapidjson::Writer<rapidjson::StringBuffer> &writer,
+                  const CreatorCatalog::Summary &creator)
+{
+    writer.StartObject();
+    writer.Key("id");
+    writer.Uint64(creator.id);
+    writer.Key("name");
+    writer.String(creator.name.c_str(),
+                  static_cast<rapidjson::SizeType>(creator.name.size()));
+    writer.Key("credits");
+    writer.StartObject();
+    for (int r = 0; r < CreatorCatalog::ROLES; ++r)
+    {
+        writer.Key(ROLE_NAMES[r]);
+        writer.Uint64(creator.credits[r]);
+    }
+    writer.EndObject();
+    writer.EndObject();
+}
+
+} // namespace
+
+const char *CreatorCatalog::roleName(Role role)
+{
+    return ROLE_NAMES[role];
+}
+
+bool CreatorCatalog::parseRole(const std::string &name, Role &role)
+{
+    for (int r = 0; r < ROLES; ++r)
+    {
+        if (name == ROLE_NAMES[r])
+        {
+            role = static_cast<Role>(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CreatorCatalog::Postings::add(std::size_t id)
+{
+    if (count == 0 || id > last)
+    {
+        appendVarint(id - (count == 0 ? 0 : last), gaps);
+        last = id;
+        ++count;
+        return true;
+    }
+    std::vector<std::size_t> ids;
+    decode(ids);
+    const auto at = std::lower_bound(ids.begin(), ids.end(), id);
+    if (at != ids.end() && *at == id)
+    {
+        return false;
+    }
+    ids.insert(at, id);
+    encode(ids);
+    return true;
+}
+
+bool CreatorCatalog::Postings::remove(std::size_t id)
+{
+    if (count == 0 || id > last)
+    {
+        return false;
+    }
+    std::vector<std::size_t> ids;
+    decode(ids);
+    const auto at = std::lower_bound(ids.begin(), ids.end(), id);
+    if (at == ids.end() || *at != id)
+    {
+        return false;
+    }
+    ids.erase(at);
+    encode(ids);
+    return true;
+}
+
+void CreatorCatalog::Postings::decode(std::vector<std::size_t> &ids) const
+{
+    ids.reserve(ids.size() + count);
+    const char *pos = gaps.data();
+    const char *const end = pos + gaps.size();
+    std::size_t id = 0;
+    std::uint64_t gap;
+    while (pos != end && readVarint(pos, end, gap))
+    {
+        id += gap;
+        ids.push_back(id);
+    }
+}
+
+void CreatorCatalog::Postings::encode(const std::vector<std::size_t> &ids)
+{
+    gaps.clear();
+    std::size_t previous = 0;
+    for (const std::size_t id : ids)
+    {
+        appendVarint(id - previous, gaps);
+        previous = id;
+    }
+    last = previous;
+    count = ids.size();
+}
+
+CreatorCatalog::CreatorCatalog(const StorageEngine &engine)
+{
+    // Comics are scanned in no particular order, so each list is sorted
+    // once and encoded rather than built by insertion.
+    using Lists = std::array<std::vector<std::size_t>, ROLES>;
+    std::unordered_map<std::uint64_t, Lists> lists;
+    engine.scan(
+        [this, &lists](std::size_t id, const Comic &comic)
+        {
+            Credits &credits = m_credits[id];
+            for (int r = 0; r < ROLES; ++r)
+            {
+                credits[r] = intern(credited(comic, static_cast<Role>(r)));
+                lists[credits[r]][r].push_back(id);
+            }
+        });
+    for (auto &entry : lists)
+    {
+        Creator &creator = m_creators[entry.first];
+        for (int r = 0; r < ROLES; ++r)
+        {
+            std::vector<std::size_t> &ids = entry.second[r];
+            std::sort(ids.begin(), ids.end());
+            creator.roles[r].encode(ids);
+            m_totals[r] += ids.size();
+        }
+    }
+}
+
+std::uint64_t CreatorCatalog::intern(const std::string &name)
+{
+    const auto known = m_ids.find(name);
+    if (known != m_ids.end())
+    {
+        return known->second;
+    }
+    // Rehashing rather than probing the next ids keeps a collision from
+    // moving the names whose ids are near it.
+    std::uint64_t salt = 0;
+    std::uint64_t id = hashName(name, salt);
+    while (m_creators.count(id) != 0)
+    {
+        id = hashName(name, ++salt);
+    }
+    m_creators[id].name = name;
+    m_ids.emplace(name, id);
+    return id;
+}
+
+void CreatorCatalog::place(std::size_t id, const Comic *comic)
+{
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    const auto previous = m_credits.find(id);
+    Credits credits{};
+    for (int r = 0; r < ROLES; ++r)
+    {
+        if (comic != nullptr)
+        {
+            credits[r] = intern(credited(*comic, static_cast<Role>(r)));
+        }
+        const bool had = previous != m_credits.end();
+        if (had && (comic == nullptr || previous->second[r] != credits[r]))
+        {
+            Postings &postings = m_creators[previous->second[r]].roles[r];
+            m_totals[r] -= postings.remove(id) ? 1 : 0;
+        }
+        if (comic != nullptr && (!had || previous->second[r] != credits[r]))
+        {
+            Postings &postings = m_creators[credits[r]].roles[r];
+            m_totals[r] += postings.add(id) ? 1 : 0;
+        }
+    }
+    if (previous == m_credits.end())
+    {
+        if (comic != nullptr)
+        {
+            m_credits.emplace(id, credits);
+        }
+        return;
+    }
+
+    // Creators left without credits are forgotten.
+    for (const std::uint64_t creator : previous->second)
+    {
+        const auto it = m_creators.find(creator);
+        if (it == m_creators.end())
+        {
+            continue;
+        }
+        const auto &roles = it->second.roles;
+        if (std::all_of(roles.begin(), roles.end(),
+                        [](const Postings &postings)
+                        { return postings.count == 0; }))
+        {
+            m_ids.erase(it->second.name);
+            m_creators.erase(it);
+        }
+    }
+    if (comic != nullptr)
+    {
+        previous->second = credits;
+    }
+    else
+    {
+        m_credits.erase(previous);
+    }
+}
+
+CreatorCatalog::Summary
+CreatorCatalog::summarize(std::uint64_t id, const Creator &creator) const
+{
+    Summary summary;
+    summary.id = id;
+    summary.name = creator.name;
+    for (int r = 0; r < ROLES; ++r)
+    {
+        summary.credits[r] = creator.roles[r].count;
+    }
+    return summary;
+}
+
+bool CreatorCatalog::find(std::uint64_t creator, Summary &summary) const
+{
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    const auto it = m_creators.find(creator);
+    if (it == m_creators.end())
+    {
+        return false;
+    }
+    summary = summarize(it->first, it->second);
+    return true;
+}
+
+bool CreatorCatalog::comics(std::uint64_t creator, Role role,
+                            std::vector<std::size_t> &ids) const
+{
+    ids.clear();
+    {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        const auto it = m_creators.find(creator);
+        if (it == m_creators.end())
+        {
+            return false;
+        }
+        for (int r = 0; r < ROLES; ++r)
+        {
+            if (role == ROLES || role == r)
+            {
+                it->second.roles[r].decode(ids);
+            }
+        }
+    }
+    // A creator may hold several roles on one comic.
+    if (role == ROLES)
+    {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+    return true;
+}
+
+std::vector<CreatorCatalog::Summary> CreatorCatalog::list() const
+{
+    std::vector<Summary> result;
+    {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        result.reserve(m_creators.size());
+        for (const auto &entry : m_creators)
+        {
+            result.push_back(summarize(entry.first, entry.second));
+        }
+    }
+    std::sort(result.begin(), result.end(),
+              [](const Summary &lhs, const Summary &rhs)
+              {
+                  return std::tie(lhs.name, lhs.id) <
+                         std::tie(rhs.name, rhs.id);
+              });
+    return result;
+}
+
+std::size_t CreatorCatalog::size() const
+{
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    return m_creators.size();
+}
+
+std::array<std::size_t, CreatorCatalog::ROLES> CreatorCatalog::credits() const
+{
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    return m_totals;
+}
+
+std::string toJson(const CreatorCatalog::Summary &creator)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writeCreator(writer, creator);
+    return buffer.GetString();
+}
+
+std::string toJson(const std::vector<CreatorCatalog::Summary> &list)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("creators");
+    writer.StartArray();
+    for (const CreatorCatalog::Summary &creator : list)
+    {
+        writeCreator(writer, creator);
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+} // namespace comicsdb
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "storage.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace comicsdb
+{
+
+// The creators credited on the comics, each with a numeric id and, for
+// every role, a posting list of the comics crediting them in it.
+//
+// A creator's id is a hash of their name, so every server, replica and
+// restart gives a name the same id and the router can merge what each
+// backend knows.  Two names get the same 53-bit hash about once in 2^53
+// pairs; the second one seen is then rehashed with a salt until its id is
+// free, so only the ids of colliding names depend on the order names
+// were seen in, and may differ between servers.
+// Posting lists hold the comic ids in ascending order as varint gaps from
+// the previous id, which is a byte or two per credit when a creator's
+// comics are close together.  Comics are mostly created in id order, so
+// adding a credit usually appends to the list; other changes rewrite it.
+//
+// As for SeriesCatalog, the store places each comic it writes after
+// reading it back from the engine.
+class CreatorCatalog
+{
+  public:
+    enum Role
+    {
+        WRITER,
+        PENCILER,
+        INKER,
+        LETTERER,
+        COLORIST,
+        ROLES
+    };
+
+    struct Summary
+    {
+        std::uint64_t id{};
+        std::string name;
+        std::array<std::size_t, ROLES> credits{}; // comics per role
+    };
+
+    static const char *roleName(Role role);
+    // False if name isn't one of the roles' names.
+    static bool parseRole(const std::string &name, Role &role);
+
+    // Catalogs everything in engine.
+    explicit CreatorCatalog(const StorageEngine &engine);
+
+    // Credits the creators of comic with comic id instead of those it had,
+    // or none if comic is null.  Calls for one id must not overlap.
+    void place(std::size_t id, const Comic *comic);
+
+    // False if there's no creator with this id.
+    bool find(std::uint64_t creator, Summary &summary) const;
+    // The comics crediting creator in role, or in any role with ROLES,
+    // ordered by id; false if there's no creator with this id.
+    bool comics(std::uint64_t creator, Role role,
+                std::vector<std::size_t> &ids) const;
+    // Every creator, ordered by name.
+    std::vector<Summary> list() const;
+    // How many creators there are, and credits in each role, kept as
+    // comics are placed.
+    std::size_t size() const;
+    std::array<std::size_t, ROLES> credits() const;
+
+  private:
+    struct Postings
+    {
+        std::string gaps;
+        std::size_t last{};
+        std::size_t count{};
+
+        // Both false if there was nothing to do.
+        bool add(std::size_t id);
+        bool remove(std::size_t id);
+        void decode(std::vector<std::size_t> &ids) const;
+        void encode(const std::vector<std::size_t> &ids);
+    };
+
+    struct Creator
+    {
+        std::string name;
+        std::array<Postings, ROLES> roles;
+    };
+
+    using Credits = std::array<std::uint64_t, ROLES>;
+
+    // The id of name, assigning one if it's new.  With m_mutex held.
+    std::uint64_t intern(const std::string &name);
+    Summary summarize(std::uint64_t id, const Creator &creator) const;
+
+    mutable std::shared_mutex m_mutex;
+    std::unordered_map<std::uint64_t, Creator> m_creators;
+    std::unordered_map<std::string, std::uint64_t> m_ids; // by name
+    // The creator in each role of each comic.
+    std::unordered_map<std::size_t, Credits> m_credits;
+    std::array<std::size_t, ROLES> m_totals{};
+};
+
+// {"id":N,"name":S,"credits":{"writer":N,...}}
+std::string toJson(const CreatorCatalog::Summary &creator);
+// {"creators":[...]}
+std::string toJson(const std::vector<CreatorCatalog::Summary> &list);
+
+} // namespace comicsdb
@@ -0,0 +1,48 @@
+#include "file_io.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace comicsdb
+{
+
+std::string errorText(const std::string &what, const std::string &path)
+{
+    return what + ' ' + path + ": " + std::strerror(errno);
+}
+
+void readFully(int fd, char *data, std::size_t size, std::uint64_t offset,
+               const std::string &path)
+{
+    std::size_t done = 0;
+    while (done < size)
+    {
+        const ssize_t count = ::pread(fd, data + done, size - done,
+                                      static_cast<off_t>(offset + done));
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            throw std::runtime_error(errorText("Couldn't read", path));
+        }
+        done += static_cast<std::size_t>(count);
+    }
+}
+
+void syncDirectory(const std::string &dir)
+{
+    const int fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+} // namespace comicsdb
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace comicsdb
+{
+
+// File helpers shared by the engines that keep comics on disk.
+
+// what, path and the message for errno, as in "Couldn't open PATH: ...".
+std::string errorText(const std::string &what, const std::string &path);
+
+// Reads exactly size bytes at offset of fd, the file at path, retrying
+// short reads.  Throws std::runtime_error if the file ends first or the
+// read fails.
+void readFully(int fd, char *data, std::size_t size, std::uint64_t offset,
+               const std::string &path);
+
+// Flushes dir's entries, so files just created or renamed in it survive a
+// crash.  Errors are ignored, as not every file system can sync a
+// directory.
+void syncDirectory(const std::string &dir);
+
+} // namespace comicsdb
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace comicsdb
+{
+
+// FNV-1a of data from the standard offset basis xored with seed, so
+// different seeds give independent hashes of the same bytes.  Nearby
+// strings differ only in their last bytes' contribution, so pass the
+// result through mix64() before using its high bits.
+inline std::uint64_t fnv1a(const std::string &data, std::uint64_t seed = 0)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+    for (const char c : data)
+    {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// The splitmix64 finalizer, which spreads every input bit over the result.
+inline std::uint64_t mix64(std::uint64_t value)
+{
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+} // namespace comicsdb
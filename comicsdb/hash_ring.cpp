@@ -0,0 +1,59 @@
+#include "hash_ring.h"
+
+#include "hash.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace comicsdb
+{
+
+HashRing::HashRing(const std::vector<std::string> &nodes, unsigned points) :
+    m_nodes(nodes.size())
+{
+    if (nodes.empty() || points == 0)
+    {
+        throw std::runtime_error("A hash ring needs at least one point");
+    }
+    m_points.reserve(nodes.size() * points);
+    for (std::size_t node = 0; node < nodes.size(); ++node)
+    {
+        for (unsigned point = 0; point < points; ++point)
+        {
+            m_points.push_back(
+                {mix64(fnv1a(nodes[node] + '#' + std::to_string(point))),
+                 node});
+        }
+    }
+    std::sort(m_points.begin(), m_points.end(),
+              [](const Point &lhs, const Point &rhs)
+              { return lhs.hash < rhs.hash; });
+}
+
+std::size_t HashRing::owner(std::size_t id) const
+{
+    // Mixed so consecutive ids spread over the ring.
+    const std::uint64_t hash = mix64(id);
+    const auto it = std::lower_bound(
+        m_points.begin(), m_points.end(), hash,
+        [](const Point &point, std::uint64_t value)
+        { return point.hash < value; });
+    return it == m_points.end() ? m_points.front().node : it->node;
+}
+
+std::vector<double> HashRing::shares() const
+{
+    // Each point owns the arc back to the point before it, and the first
+    // point also owns the wrap-around past the last.
+    std::vector<double> shares(m_nodes);
+    std::uint64_t previous = m_points.back().hash;
+    for (const Point &point : m_points)
+    {
+        shares[point.node] +=
+            static_cast<double>(point.hash - previous) / 18446744073709551616.0;
+        previous = point.hash;
+    }
+    return shares;
+}
+
+} // namespace comicsdb
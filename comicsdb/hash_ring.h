@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace comicsdb
+{
+
+// Consistent hashing of comic ids onto nodes.  Each node is placed at many
+// pseudo-random points on a 64-bit ring and an id belongs to the node of
+// the first point at or after the id's own hash, so adding or removing a
+// node only moves the ids next to its points, about 1/N of them, and the
+// points spread each node's share evenly around the ring.
+class HashRing
+{
+  public:
+    // Places each of nodes, named by address, at points points.  A node's
+    // points depend only on its name, so the order of nodes doesn't matter.
+    HashRing(const std::vector<std::string> &nodes, unsigned points);
+
+    // The index in nodes of the node owning id.
+    std::size_t owner(std::size_t id) const;
+    // The fraction of the ring each node owns.
+    std::vector<double> shares() const;
+
+  private:
+    struct Point
+    {
+        std::uint64_t hash;
+        std::size_t node;
+    };
+
+    std::size_t m_nodes;
+    std::vector<Point> m_points; // sorted by hash
+};
+
+} // namespace comicsdb
@@ -0,0 +1,144 @@
+#include "http.h"
+
+#include "checksum.h"
+
+#include <algorithm>
+
+namespace comicsdb
+{
+
+void reply(const SessionPtr &session, int status, const std::string &body,
+           std::multimap<std::string, std::string> headers)
+{
+    headers.emplace("Content-Length", std::to_string(body.size()));
+    const std::string connection =
+        session->get_request()->get_header("Connection");
+    if (headers.count("Connection") == 0 &&
+        restbed::String::lowercase(connection) == "keep-alive")
+    {
+        headers.emplace("Connection", "keep-alive");
+        session->yield(status, body, headers);
+        return;
+    }
+    headers.emplace("Connection", "close");
+    session->close(status, body, headers);
+}
+
+void sendText(const SessionPtr &session, int status, const std::string &msg)
+{
+    reply(session, status, msg, {{"Content-Type", "text/plain"}});
+}
+
+void sendJson(const SessionPtr &session, const std::string &json)
+{
+    reply(session, restbed::OK, json, {{"Content-Type", "application/json"}});
+}
+
+void rejectBody(const SessionPtr &session, int status, const std::string &msg)
+{
+    reply(session, status, msg,
+          {{"Content-Type", "text/plain"}, {"Connection", "close"}});
+}
+
+bool bodyLength(const SessionPtr &session, std::size_t limit,
+                std::size_t &length)
+{
+    const std::string header =
+        session->get_request()->get_header("Content-Length");
+    if (header.empty() || header.size() > 18 ||
+        header.find_first_not_of("0123456789") != std::string::npos)
+    {
+        rejectBody(session, restbed::LENGTH_REQUIRED,
+                   "Length Required, send a valid Content-Length");
+        return false;
+    }
+    length = std::stoull(header);
+    if (length > limit)
+    {
+        rejectBody(session, restbed::REQUEST_ENTITY_TOO_LARGE,
+                   "Payload Too Large, at most " + std::to_string(limit) +
+                       " bytes");
+        return false;
+    }
+    return true;
+}
+
+std::string addressOf(const SessionPtr &session)
+{
+    std::string address = session->get_origin();
+    address.erase(std::min(address.rfind(':'), address.size()));
+    return address;
+}
+
+std::string requester(const SessionPtr &session)
+{
+    const auto request = session->get_request();
+    const std::string key = request->get_header("X-API-Key");
+    if (!key.empty())
+    {
+        return "key " + key;
+    }
+    const std::string address = addressOf(session);
+    const std::string forwarded = request->get_header("X-Forwarded-For");
+    return address == "127.0.0.1" && !forwarded.empty() ? forwarded
+                                                        : address;
+}
+
+bool idempotencyKey(const SessionPtr &session,
+                    const IdempotencyCache &idempotency, std::string &key)
+{
+    // Without a cache the key is ignored, as if it weren't sent.
+    key = idempotency.enabled()
+              ? session->get_request()->get_header("Idempotency-Key")
+              : std::string{};
+    if (key.size() > IdempotencyCache::MAX_KEY_LENGTH)
+    {
+        rejectBody(session, restbed::BAD_REQUEST,
+                   "Bad Request, Idempotency-Key too long");
+        return false;
+    }
+    if (!key.empty())
+    {
+        key = IdempotencyCache::scoped(requester(session), key);
+    }
+    return true;
+}
+
+void sendCreated(const SessionPtr &session,
+                 const IdempotencyCache::Result &result, bool replayed)
+{
+    std::multimap<std::string, std::string> headers{
+        {"Content-Type", "application/json"}, {"Location", result.location}};
+    if (replayed)
+    {
+        headers.emplace("Idempotent-Replayed", "true");
+    }
+    reply(session, result.status, result.body, headers);
+}
+
+bool beginCreate(const SessionPtr &session, IdempotencyCache &idempotency,
+                 const std::string &key, const void *body, std::size_t size)
+{
+    IdempotencyCache::Result result;
+    switch (idempotency.begin(key, crc32c(body, size), result))
+    {
+    case IdempotencyCache::NEW:
+        return true;
+    case IdempotencyCache::REPLAY:
+        sendCreated(session, result, true);
+        return false;
+    case IdempotencyCache::IN_PROGRESS:
+        sendText(session, restbed::CONFLICT,
+                 "Conflict, a request with this Idempotency-Key is in "
+                 "progress");
+        return false;
+    case IdempotencyCache::MISMATCH:
+        break;
+    }
+    sendText(session, restbed::UNPROCESSABLE_ENTITY,
+             "Unprocessable Entity, Idempotency-Key reused with another "
+             "body");
+    return false;
+}
+
+} // namespace comicsdb
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "idempotency.h"
+
+#include <restbed>
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace comicsdb
+{
+
+// Helpers for answering requests shared by the server and the router.
+
+using SessionPtr = std::shared_ptr<restbed::Session>;
+
+// Sends the response and closes the connection, unless the client asked to
+// keep it open for more requests, as the router's pooled connections do.
+void reply(const SessionPtr &session, int status, const std::string &body,
+           std::multimap<std::string, std::string> headers = {});
+void sendText(const SessionPtr &session, int status, const std::string &msg);
+void sendJson(const SessionPtr &session, const std::string &json);
+// Refuses a request whose body is left unread, closing the connection even
+// if it was to be kept alive, since the rest of the body would be taken for
+// the next request.
+void rejectBody(const SessionPtr &session, int status, const std::string &msg);
+
+// Reads Content-Length into length before any of the body is read, so a
+// client can't make the server hold more than limit bytes of it: 411
+// without one, 413 if it's larger.
+bool bodyLength(const SessionPtr &session, std::size_t limit,
+                std::size_t &length);
+
+// The address the request came from, without its port.
+std::string addressOf(const SessionPtr &session);
+// Whose Idempotency-Keys the request's is one of: the X-API-Key it was
+// sent with, or else the address it came from, which a process on the
+// same host passing it on gives in X-Forwarded-For.
+std::string requester(const SessionPtr &session);
+
+// The request's Idempotency-Key scoped to its requester in key, empty if
+// it has none or idempotency is off.  Answers 400 and returns false if the
+// key is too long.
+bool idempotencyKey(const SessionPtr &session,
+                    const IdempotencyCache &idempotency, std::string &key);
+// Answers a create with the new comic's id and where to find it.
+void sendCreated(const SessionPtr &session,
+                 const IdempotencyCache::Result &result, bool replayed);
+// Returns true if the create with this key and body should go ahead,
+// having answered the request otherwise.
+bool beginCreate(const SessionPtr &session, IdempotencyCache &idempotency,
+                 const std::string &key, const void *body, std::size_t size);
+
+} // namespace comicsdb
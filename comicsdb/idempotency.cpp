@@ -0,0 +1,146 @@
+#include "idempotency.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+constexpr std::size_t IdempotencyCache::MAX_KEY_LENGTH;
+
+IdempotencyCache::IdempotencyCache(std::size_t capacity,
+                                   std::chrono::seconds ttl) :
+    m_capacity(capacity),
+    m_ttl(std::chrono::duration_cast<std::chrono::nanoseconds>(ttl).count()),
+    m_start(std::chrono::steady_clock::now())
+{
+}
+
+std::string IdempotencyCache::scoped(const std::string &client,
+                                     const std::string &key)
+{
+    // Header values can't hold a newline, so none is ambiguous.
+    return client + '\n' + key;
+}
+
+std::int64_t IdempotencyCache::now() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - m_start)
+        .count();
+}
+
+void IdempotencyCache::evict(std::int64_t at)
+{
+    // Forgetting a running request's key would let a retry run it again,
+    // so those are queued again as if just seen.
+    std::vector<Expiry> running;
+    while (!m_order.empty() &&
+           (m_order.front().expires <= at ||
+            m_order.size() + running.size() > m_capacity))
+    {
+        Expiry &oldest = m_order.front();
+        const auto it = m_entries.find(oldest.key);
+        // The key may have been abandoned and seen again since.
+        if (it != m_entries.end() && it->second.serial == oldest.serial)
+        {
+            if (it->second.done)
+            {
+                m_entries.erase(it);
+            }
+            else
+            {
+                oldest.expires = at + m_ttl;
+                running.push_back(std::move(oldest));
+            }
+        }
+        m_order.pop_front();
+    }
+    for (Expiry &expiry : running)
+    {
+        m_order.push_back(std::move(expiry));
+    }
+}
+
+IdempotencyCache::Outcome IdempotencyCache::begin(const std::string &key,
+                                                  std::uint32_t fingerprint,
+                                                  Result &result)
+{
+    const std::int64_t at = now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    evict(at);
+    const auto found = m_entries.find(key);
+    if (found != m_entries.end())
+    {
+        const Entry &entry = found->second;
+        if (entry.fingerprint != fingerprint)
+        {
+            return MISMATCH;
+        }
+        if (!entry.done)
+        {
+            return IN_PROGRESS;
+        }
+        result = entry.result;
+        ++m_replays;
+        return REPLAY;
+    }
+    Entry &entry = m_entries[key];
+    entry.serial = ++m_serial;
+    entry.fingerprint = fingerprint;
+    m_order.push_back({key, entry.serial, at + m_ttl});
+    evict(at);
+    return NEW;
+}
+
+void IdempotencyCache::finish(const std::string &key, const Result &result)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto it = m_entries.find(key);
+    // Gone if it was evicted while the request ran.
+    if (it != m_entries.end())
+    {
+        it->second.done = true;
+        it->second.result = result;
+    }
+}
+
+void IdempotencyCache::abandon(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto it = m_entries.find(key);
+    if (it != m_entries.end() && !it->second.done)
+    {
+        m_entries.erase(it);
+    }
+}
+
+void IdempotencyCache::expire()
+{
+    const std::int64_t at = now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    evict(at);
+}
+
+std::string IdempotencyCache::toJson() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("capacity");
+    writer.Uint64(m_capacity);
+    writer.Key("ttl_seconds");
+    writer.Int64(m_ttl / 1000000000);
+    writer.Key("keys");
+    writer.Uint64(m_entries.size());
+    writer.Key("replays");
+    writer.Uint64(m_replays);
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+} // namespace comicsdb
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace comicsdb
+{
+
+// Remembers the outcome of requests sent with an Idempotency-Key, so a
+// client retrying after a timeout gets the original result instead of
+// creating a duplicate.  Keys are scoped by client with scoped(), so one
+// client can neither replay nor block another's.  At most capacity
+// finished keys are kept, each for ttl after it was first seen; the
+// oldest are forgotten first, but never while their request is running.
+// A key reused with a different body is a client error, and a retry
+// arriving while the original is still running is told to wait.
+class IdempotencyCache
+{
+  public:
+    static constexpr std::size_t MAX_KEY_LENGTH = 255;
+
+    struct Result
+    {
+        int status{};
+        std::string location;
+        std::string body;
+    };
+
+    enum Outcome
+    {
+        NEW,         // go ahead, then call finish or abandon
+        REPLAY,      // result holds the original outcome
+        IN_PROGRESS, // the original hasn't finished
+        MISMATCH     // the key was used with another body
+    };
+
+    IdempotencyCache(std::size_t capacity, std::chrono::seconds ttl);
+
+    // The key to use for client's Idempotency-Key key.
+    static std::string scoped(const std::string &client,
+                              const std::string &key);
+
+    bool enabled() const { return m_capacity != 0; }
+    // fingerprint identifies the request body.
+    Outcome begin(const std::string &key, std::uint32_t fingerprint,
+                  Result &result);
+    void finish(const std::string &key, const Result &result);
+    // Forgets a request that failed, so it may be retried.
+    void abandon(const std::string &key);
+    // Forgets the keys past their ttl.
+    void expire();
+
+    std::string toJson() const;
+
+  private:
+    struct Entry
+    {
+        std::uint64_t serial{};
+        std::uint32_t fingerprint{};
+        bool done{};
+        Result result;
+    };
+
+    // A key with the serial of the entry it was first seen for.
+    struct Expiry
+    {
+        std::string key;
+        std::uint64_t serial;
+        std::int64_t expires;
+    };
+
+    std::int64_t now() const;
+    void evict(std::int64_t at); // with m_mutex held
+
+    const std::size_t m_capacity;
+    const std::int64_t m_ttl; // nanoseconds
+    const std::chrono::steady_clock::time_point m_start;
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string, Entry> m_entries;
+    std::deque<Expiry> m_order; // oldest first
+    std::uint64_t m_serial{};
+    std::uint64_t m_replays{};
+};
+
+} // namespace comicsdb
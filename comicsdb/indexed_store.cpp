@@ -0,0 +1,499 @@
+#include "indexed_store.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+constexpr std::size_t NONE = DuplicateComic::NONE;
+
+std::string indexKey(const std::string &title, int issue)
+{
+    // The issue first, so no title can run into it.
+    return std::to_string(issue) + ' ' + normalizeTitle(title);
+}
+
+} // namespace
+
+DuplicateComic::DuplicateComic(std::size_t existing) :
+    std::runtime_error("comic " + std::to_string(existing) +
+                       " has that title and issue"),
+    m_existing(existing)
+{
+}
+
+DuplicateComic::DuplicateComic(const std::string &message) :
+    std::runtime_error(message),
+    m_existing(NONE)
+{
+}
+
+constexpr std::size_t DuplicateComic::NONE;
+
+constexpr std::size_t IndexedStore::STRIPES;
+constexpr std::size_t IndexedStore::ID_STRIPES;
+
+IndexedStore::IndexedStore(StorageEngine &engine, bool unique,
+                           bool catalogs) :
+    m_engine(engine),
+    m_unique(unique)
+{
+    if (catalogs)
+    {
+        m_series = std::make_unique<SeriesCatalog>(engine);
+        m_creators = std::make_unique<CreatorCatalog>(engine);
+    }
+    m_engine.scan(
+        [this](std::size_t id, const Comic &comic)
+        {
+            const std::string k = key(comic);
+            Ids &ids = stripe(k).ids[k];
+            ids.push_back(id);
+            m_duplicates += ids.size() == 2 ? 2 : ids.size() > 2 ? 1 : 0;
+        });
+}
+
+std::string IndexedStore::key(const Comic &comic)
+{
+    return indexKey(comic.title, comic.issue);
+}
+
+IndexedStore::Stripe &IndexedStore::stripe(const std::string &key) const
+{
+    return m_stripes[std::hash<std::string>{}(key) % STRIPES];
+}
+
+bool IndexedStore::holds(std::size_t id, const std::string &key) const
+{
+    Comic comic;
+    return m_engine.get(id, comic) && IndexedStore::key(comic) == key;
+}
+
+std::size_t IndexedStore::live(Stripe &stripe, const std::string &key,
+                               std::size_t self) const
+{
+    const auto it = stripe.ids.find(key);
+    if (it == stripe.ids.end())
+    {
+        return NONE;
+    }
+    Ids &ids = it->second;
+    std::size_t found = NONE;
+    for (std::size_t i = 0; i < ids.size() && found == NONE;)
+    {
+        if (ids[i] == self)
+        {
+            ++i;
+        }
+        else if (holds(ids[i], key))
+        {
+            found = ids[i];
+        }
+        else
+        {
+            ids.erase(ids.begin() + i);
+        }
+    }
+    if (ids.empty())
+    {
+        stripe.ids.erase(it);
+    }
+    return found;
+}
+
+void IndexedStore::add(Stripe &stripe, const std::string &key,
+                       std::size_t id) const
+{
+    Ids &ids = stripe.ids[key];
+    if (std::find(ids.begin(), ids.end(), id) == ids.end())
+    {
+        ids.push_back(id);
+    }
+}
+
+void IndexedStore::forget(std::size_t id, const std::string &key) const
+{
+    Stripe &s = stripe(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    // A racing write may have given id this key back, under this lock.
+    if (holds(id, key))
+    {
+        return;
+    }
+    const auto it = s.ids.find(key);
+    if (it == s.ids.end())
+    {
+        return;
+    }
+    Ids &ids = it->second;
+    ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+    if (ids.empty())
+    {
+        s.ids.erase(it);
+    }
+}
+
+std::vector<std::unique_lock<std::mutex>> IndexedStore::lockAll() const
+{
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(STRIPES);
+    for (Stripe &s : m_stripes)
+    {
+        locks.emplace_back(s.mutex);
+    }
+    return locks;
+}
+
+std::vector<std::unique_lock<std::mutex>>
+IndexedStore::lockKeys(const std::vector<std::string> &keys) const
+{
+    std::vector<std::size_t> held;
+    for (const std::string &k : keys)
+    {
+        if (!k.empty())
+        {
+            held.push_back(static_cast<std::size_t>(&stripe(k) -
+                                                    m_stripes.data()));
+        }
+    }
+    std::sort(held.begin(), held.end());
+    held.erase(std::unique(held.begin(), held.end()), held.end());
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(held.size());
+    for (const std::size_t i : held)
+    {
+        locks.emplace_back(m_stripes[i].mutex);
+    }
+    return locks;
+}
+
+void IndexedStore::changed(std::size_t id)
+{
+    if (!cataloged())
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_idLocks[id % ID_STRIPES]);
+    Comic comic;
+    const Comic *live =
+        m_engine.get(id, comic) && comic.issue != Comic::DELETED_ISSUE
+            ? &comic
+            : nullptr;
+    m_series->place(id, live);
+    m_creators->place(id, live);
+}
+
+bool IndexedStore::get(std::size_t id, Comic &comic,
+                       const TracePtr &trace) const
+{
+    return m_engine.get(id, comic, trace);
+}
+
+bool IndexedStore::contains(std::size_t id) const
+{
+    return m_engine.contains(id);
+}
+
+std::size_t IndexedStore::create(const Comic &comic, const TracePtr &trace)
+{
+    const std::string k = key(comic);
+    Stripe &s = stripe(k);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (m_unique)
+    {
+        const std::size_t existing = live(s, k, NONE);
+        if (existing != NONE)
+        {
+            throw DuplicateComic(existing);
+        }
+    }
+    const std::size_t id = m_engine.create(comic, trace);
+    add(s, k, id);
+    changed(id);
+    return id;
+}
+
+bool IndexedStore::insert(std::size_t id, const Comic &comic,
+                          const TracePtr &trace)
+{
+    const std::string k = key(comic);
+    Stripe &s = stripe(k);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (m_unique)
+    {
+        const std::size_t existing = live(s, k, NONE);
+        if (existing != NONE)
+        {
+            throw DuplicateComic(existing);
+        }
+    }
+    if (!m_engine.insert(id, comic, trace))
+    {
+        return false;
+    }
+    add(s, k, id);
+    changed(id);
+    return true;
+}
+
+bool IndexedStore::update(std::size_t id, const Comic &comic,
+                          const TracePtr &trace)
+{
+    Comic old;
+    const bool existed = m_engine.get(id, old);
+    const std::string k = key(comic);
+    {
+        Stripe &s = stripe(k);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (m_unique)
+        {
+            const std::size_t existing = live(s, k, id);
+            if (existing != NONE)
+            {
+                throw DuplicateComic(existing);
+            }
+        }
+        if (!m_engine.update(id, comic, trace))
+        {
+            return false;
+        }
+        add(s, k, id);
+    }
+    if (existed && key(old) != k)
+    {
+        forget(id, key(old));
+    }
+    changed(id);
+    return true;
+}
+
+bool IndexedStore::erase(std::size_t id, const TracePtr &trace)
+{
+    Comic old;
+    const bool existed = m_engine.get(id, old);
+    if (!m_engine.erase(id, trace))
+    {
+        return false;
+    }
+    if (existed)
+    {
+        forget(id, key(old));
+    }
+    changed(id);
+    return true;
+}
+
+void IndexedStore::scan(
+    const std::function<void(std::size_t, const Comic &)> &visit) const
+{
+    m_engine.scan(visit);
+}
+
+std::vector<std::pair<std::size_t, Comic>> IndexedStore::snapshot() const
+{
+    return m_engine.snapshot();
+}
+
+std::size_t IndexedStore::importBatch(std::vector<Comic> comics)
+{
+    std::vector<std::string> keys;
+    keys.reserve(comics.size());
+    for (const Comic &comic : comics)
+    {
+        keys.push_back(key(comic));
+    }
+    const auto locks = lockAll();
+    if (m_unique)
+    {
+        std::unordered_map<std::string, std::size_t> batch;
+        for (const std::string &k : keys)
+        {
+            const std::size_t existing = live(stripe(k), k, NONE);
+            if (existing != NONE)
+            {
+                throw DuplicateComic(existing);
+            }
+            if (!batch.emplace(k, 0).second)
+            {
+                throw DuplicateComic(
+                    "two comics in the batch have the same title and issue");
+            }
+        }
+    }
+    const std::size_t first = m_engine.importBatch(std::move(comics));
+    for (std::size_t i = 0; i < keys.size(); ++i)
+    {
+        add(stripe(keys[i]), keys[i], first + i);
+        changed(first + i);
+    }
+    return first;
+}
+
+bool IndexedStore::applyTransaction(std::vector<TransactionOp> &ops,
+                                    std::size_t &failed,
+                                    const TracePtr &trace)
+{
+    // With every stripe held nothing else writes, so the comics the
+    // operations replace stay put while they're checked.  Without
+    // uniqueness nothing is checked, and a comic a racing write moves
+    // before its key is locked leaves an entry that forget() and live()
+    // drop, as for single writes.
+    std::vector<std::unique_lock<std::mutex>> locks;
+    if (m_unique)
+    {
+        locks = lockAll();
+    }
+    // The engine may move the comics out of ops.
+    std::vector<std::string> oldKeys(ops.size());
+    std::vector<std::string> newKeys(ops.size());
+    for (std::size_t i = 0; i < ops.size(); ++i)
+    {
+        Comic old;
+        if (ops[i].kind != TransactionOp::CREATE &&
+            m_engine.get(ops[i].id, old))
+        {
+            oldKeys[i] = key(old);
+        }
+        if (ops[i].kind != TransactionOp::ERASE)
+        {
+            newKeys[i] = key(ops[i].comic);
+        }
+    }
+    if (!m_unique)
+    {
+        std::vector<std::string> keys = oldKeys;
+        keys.insert(keys.end(), newKeys.begin(), newKeys.end());
+        locks = lockKeys(keys);
+    }
+
+    if (m_unique)
+    {
+        // The key each id touched so far will have once committed, empty
+        // if deleted, and the id holding each key written so far.
+        std::unordered_map<std::size_t, std::string> moved;
+        std::unordered_map<std::string, std::size_t> claimed;
+        for (std::size_t i = 0; i < ops.size(); ++i)
+        {
+            const TransactionOp &op = ops[i];
+            const std::size_t self =
+                op.kind == TransactionOp::CREATE ? NONE : op.id;
+            const auto previous = moved.find(self);
+            const std::string &from =
+                previous != moved.end() ? previous->second : oldKeys[i];
+            if (self != NONE && claimed.count(from) != 0 &&
+                claimed[from] == self)
+            {
+                claimed.erase(from);
+            }
+            if (op.kind == TransactionOp::ERASE)
+            {
+                moved[self] = "";
+                continue;
+            }
+            const std::string &k = newKeys[i];
+            const auto holder = claimed.find(k);
+            if (holder != claimed.end())
+            {
+                throw DuplicateComic("operation " + std::to_string(i) +
+                                     " repeats the title and issue of an "
+                                     "earlier one");
+            }
+            // A comic already holding k counts unless an earlier
+            // operation moves it away.
+            Stripe &s = stripe(k);
+            const auto it = s.ids.find(k);
+            if (it != s.ids.end())
+            {
+                for (const std::size_t other : it->second)
+                {
+                    const auto away = moved.find(other);
+                    if (other != self && holds(other, k) &&
+                        (away == moved.end() || away->second == k))
+                    {
+                        throw DuplicateComic(other);
+                    }
+                }
+            }
+            claimed[k] = self;
+            if (self != NONE)
+            {
+                moved[self] = k;
+            }
+        }
+    }
+
+    if (!m_engine.applyTransaction(ops, failed, trace))
+    {
+        return false;
+    }
+    for (std::size_t i = 0; i < ops.size(); ++i)
+    {
+        const TransactionOp &op = ops[i];
+        changed(op.id);
+        if (op.kind != TransactionOp::ERASE)
+        {
+            add(stripe(newKeys[i]), newKeys[i], op.id);
+        }
+        if (oldKeys[i].empty() || holds(op.id, oldKeys[i]))
+        {
+            continue;
+        }
+        Stripe &s = stripe(oldKeys[i]);
+        const auto it = s.ids.find(oldKeys[i]);
+        if (it != s.ids.end())
+        {
+            Ids &ids = it->second;
+            ids.erase(std::remove(ids.begin(), ids.end(), op.id), ids.end());
+            if (ids.empty())
+            {
+                s.ids.erase(it);
+            }
+        }
+    }
+    return true;
+}
+
+std::vector<std::pair<std::size_t, Comic>>
+IndexedStore::find(const std::string &title, int issue) const
+{
+    const std::string k = indexKey(title, issue);
+    Ids ids;
+    {
+        Stripe &s = stripe(k);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        const auto it = s.ids.find(k);
+        if (it != s.ids.end())
+        {
+            ids = it->second;
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    std::vector<std::pair<std::size_t, Comic>> comics;
+    Comic comic;
+    for (const std::size_t id : ids)
+    {
+        if (m_engine.get(id, comic) && key(comic) == k)
+        {
+            comics.emplace_back(id, comic);
+        }
+    }
+    return comics;
+}
+
+void IndexedStore::reindex(std::size_t id, const Comic &comic)
+{
+    if (comic.issue != Comic::DELETED_ISSUE)
+    {
+        const std::string k = key(comic);
+        Stripe &s = stripe(k);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        add(s, k, id);
+    }
+    changed(id);
+}
+
+} // namespace comicsdb
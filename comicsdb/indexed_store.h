@@ -0,0 +1,149 @@
+#pragma once
+
+#include "creators.h"
+#include "series.h"
+#include "storage.h"
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+// Thrown by IndexedStore for a write that would give a second comic the
+// title and issue of an existing one, whose id existing() is.
+class DuplicateComic : public std::runtime_error
+{
+  public:
+    // existing() when the other comic has no id yet.
+    static constexpr std::size_t NONE = static_cast<std::size_t>(-1);
+
+    explicit DuplicateComic(std::size_t existing);
+    // For two new comics of one batch, neither of which has an id yet.
+    explicit DuplicateComic(const std::string &message);
+
+    std::size_t existing() const { return m_existing; }
+
+  private:
+    std::size_t m_existing;
+};
+
+// An engine with a hash index on (title, issue), the title compared
+// ignoring case and runs of spaces, so finding a comic by them or checking
+// that it's unique takes one lookup instead of a scan.
+//
+// The index is split into stripes by key, each locked independently, and
+// every write holds the stripe of the key it writes while the engine
+// applies it, so two writes of the same key are never checked at once.
+// Entries are removed when a comic changes key or is deleted, and any left
+// behind by racing writes are recognized because every hit is checked
+// against the engine, then dropped.
+//
+// With catalogs it also keeps the series and creator catalogs, placing
+// every comic it writes in them.
+class IndexedStore : public StorageEngine
+{
+  public:
+    // Indexes everything in engine.  With unique, writes that would
+    // duplicate a title and issue throw DuplicateComic instead.  Reader
+    // processes, which forward the requests the catalogs answer, do
+    // without them.
+    IndexedStore(StorageEngine &engine, bool unique, bool catalogs);
+
+    const char *name() const override { return m_engine.name(); }
+
+    bool get(std::size_t id, Comic &comic,
+             const TracePtr &trace = nullptr) const override;
+    bool contains(std::size_t id) const override;
+    std::size_t create(const Comic &comic,
+                       const TracePtr &trace = nullptr) override;
+    bool update(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+    bool erase(std::size_t id, const TracePtr &trace = nullptr) override;
+    bool insert(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+
+    void scan(const std::function<void(std::size_t, const Comic &)> &visit)
+        const override;
+    std::vector<std::pair<std::size_t, Comic>> snapshot() const override;
+    // Takes every stripe.
+    std::size_t importBatch(std::vector<Comic> comics) override;
+    // Takes every stripe if unique, since any key may be checked against
+    // the whole batch, and otherwise the stripes of the keys it writes.
+    bool applyTransaction(std::vector<TransactionOp> &ops, std::size_t &failed,
+                          const TracePtr &trace = nullptr) override;
+
+    std::size_t nextId() const override { return m_engine.nextId(); }
+    void maintain() override { m_engine.maintain(); }
+    pid_t saveInBackground(const std::string &path) const override
+    {
+        return m_engine.saveInBackground(path);
+    }
+
+    // The comics with this title and issue, ordered by id.
+    std::vector<std::pair<std::size_t, Comic>> find(const std::string &title,
+                                                    int issue) const;
+    // Indexes a comic written to the engine directly, as a follower's
+    // replica is, or drops it from its series if it was deleted.
+    void reindex(std::size_t id, const Comic &comic);
+    // The comics grouped by series and by creator, kept up to date by
+    // every write.  Only if cataloged().
+    bool cataloged() const { return m_series != nullptr; }
+    const SeriesCatalog &series() const { return *m_series; }
+    const CreatorCatalog &creators() const { return *m_creators; }
+
+    bool unique() const { return m_unique; }
+    // How many comics shared a title and issue with another when the
+    // store was opened.
+    std::size_t duplicates() const { return m_duplicates; }
+
+  private:
+    using Ids = std::vector<std::size_t>;
+
+    struct alignas(64) Stripe
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, Ids> ids;
+    };
+
+    static constexpr std::size_t STRIPES = 64;
+    static constexpr std::size_t ID_STRIPES = 64;
+
+    static std::string key(const Comic &comic);
+    Stripe &stripe(const std::string &key) const;
+    // Whether id is live with this key.
+    bool holds(std::size_t id, const std::string &key) const;
+    // The first live comic other than self with key, dropping stale ids.
+    // The stripe of key must be held.
+    std::size_t live(Stripe &stripe, const std::string &key,
+                     std::size_t self) const;
+    void add(Stripe &stripe, const std::string &key, std::size_t id) const;
+    // Drops id from key after a write that may have moved it elsewhere.
+    void forget(std::size_t id, const std::string &key) const;
+    std::vector<std::unique_lock<std::mutex>> lockAll() const;
+    // Takes the stripes of the non-empty keys, in the order lockAll()
+    // takes them.
+    std::vector<std::unique_lock<std::mutex>>
+    lockKeys(const std::vector<std::string> &keys) const;
+    // Places comic id in the catalogs as the engine now has it.  Writes of
+    // one id place it one at a time, so the last always leaves it as the
+    // engine has it.
+    void changed(std::size_t id);
+
+    StorageEngine &m_engine;
+    const bool m_unique;
+    std::size_t m_duplicates{};
+    mutable std::array<Stripe, STRIPES> m_stripes;
+    std::array<std::mutex, ID_STRIPES> m_idLocks;
+    std::unique_ptr<SeriesCatalog> m_series;
+    std::unique_ptr<CreatorCatalog> m_creators;
+};
+
+} // namespace comicsdb
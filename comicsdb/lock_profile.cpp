@@ -0,0 +1,334 @@
+#include "lock_profile.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <cstdio>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+constexpr std::size_t NUM_SITES = static_cast<std::size_t>(LockSite::NUM_SITES);
+
+std::atomic<std::uint64_t> g_nextInstance{1};
+
+std::uint64_t nanoseconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+        .count();
+}
+
+std::size_t bucket(std::uint64_t wait)
+{
+    std::size_t i = 0;
+    for (std::uint64_t micros = wait / 1000; micros > 0 &&
+                                             i < LOCK_HISTOGRAM_BUCKETS - 1;
+         micros >>= 1)
+    {
+        ++i;
+    }
+    return i;
+}
+
+// Only the owning thread writes a counter, so a relaxed load and store is
+// enough and avoids a locked read-modify-write.
+void add(std::atomic<std::uint64_t> &counter, std::uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+}
+
+void raise(std::atomic<std::uint64_t> &counter, std::uint64_t value)
+{
+    if (value > counter.load(std::memory_order_relaxed))
+    {
+        counter.store(value, std::memory_order_relaxed);
+    }
+}
+
+} // namespace
+
+const char *lockSiteName(LockSite site)
+{
+    switch (site)
+    {
+    case LockSite::READ_COMIC:
+        return "read";
+    case LockSite::CREATE_COMIC:
+        return "create";
+    case LockSite::UPDATE_COMIC:
+        return "update";
+    case LockSite::DELETE_COMIC:
+        return "delete";
+    case LockSite::EXPORT_COMICS:
+        return "export";
+    case LockSite::IMPORT_COMICS:
+        return "import";
+    case LockSite::TRANSACTION:
+        return "transaction";
+    case LockSite::MAINTENANCE:
+        return "maintenance";
+    case LockSite::NUM_SITES:
+        break;
+    }
+    return "unknown";
+}
+
+struct LockProfiler::ThreadStats
+{
+    struct Site
+    {
+        std::atomic<std::uint64_t> acquisitions{};
+        std::atomic<std::uint64_t> contended{};
+        std::atomic<std::uint64_t> waitTotal{};
+        std::atomic<std::uint64_t> waitMax{};
+        std::atomic<std::uint64_t> holdTotal{};
+        std::atomic<std::uint64_t> holdMax{};
+        std::array<std::atomic<std::uint64_t>, LOCK_HISTOGRAM_BUCKETS>
+            waitHistogram{};
+    };
+
+    std::array<Site, NUM_SITES> sites;
+    std::atomic<std::uint64_t> batches{};
+    std::atomic<std::uint64_t> batchedOperations{};
+};
+
+LockProfiler::LockProfiler() : m_instance(g_nextInstance++)
+{
+}
+
+LockProfiler::ThreadStats &LockProfiler::local()
+{
+    struct Local
+    {
+        std::uint64_t instance{};
+        std::shared_ptr<ThreadStats> stats;
+    };
+    thread_local Local local;
+    if (local.instance != m_instance)
+    {
+        local.stats = std::make_shared<ThreadStats>();
+        local.instance = m_instance;
+        std::unique_lock<std::mutex> lock(m_threadsMutex);
+        m_threads.push_back(local.stats);
+    }
+    return *local.stats;
+}
+
+void LockProfiler::record(LockSite site, bool contended, std::uint64_t wait,
+                          std::uint64_t hold)
+{
+    ThreadStats::Site &stats = local().sites[static_cast<std::size_t>(site)];
+    add(stats.acquisitions, 1);
+    add(stats.contended, contended ? 1 : 0);
+    add(stats.waitTotal, wait);
+    raise(stats.waitMax, wait);
+    add(stats.holdTotal, hold);
+    raise(stats.holdMax, hold);
+    add(stats.waitHistogram[bucket(wait)], 1);
+}
+
+void LockProfiler::recordBatch(std::size_t operations)
+{
+    ThreadStats &stats = local();
+    add(stats.batches, 1);
+    add(stats.batchedOperations, operations);
+}
+
+std::pair<std::uint64_t, std::uint64_t> LockProfiler::batches() const
+{
+    std::pair<std::uint64_t, std::uint64_t> result{};
+    std::unique_lock<std::mutex> lock(m_threadsMutex);
+    for (const std::shared_ptr<ThreadStats> &thread : m_threads)
+    {
+        result.first += thread->batches.load();
+        result.second += thread->batchedOperations.load();
+    }
+    return result;
+}
+
+std::array<LockSiteStats, NUM_SITES> LockProfiler::stats() const
+{
+    std::array<LockSiteStats, NUM_SITES> result{};
+    std::unique_lock<std::mutex> lock(m_threadsMutex);
+    for (const std::shared_ptr<ThreadStats> &thread : m_threads)
+    {
+        for (std::size_t i = 0; i < NUM_SITES; ++i)
+        {
+            const ThreadStats::Site &site = thread->sites[i];
+            LockSiteStats &total = result[i];
+            total.acquisitions += site.acquisitions.load();
+            total.contended += site.contended.load();
+            total.waitTotal += site.waitTotal.load();
+            total.waitMax = std::max(total.waitMax, site.waitMax.load());
+            total.holdTotal += site.holdTotal.load();
+            total.holdMax = std::max(total.holdMax, site.holdMax.load());
+            for (std::size_t b = 0; b < LOCK_HISTOGRAM_BUCKETS; ++b)
+            {
+                total.waitHistogram[b] += site.waitHistogram[b].load();
+            }
+        }
+    }
+    return result;
+}
+
+std::string LockProfiler::toJson() const
+{
+    const auto all = stats();
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("sites");
+    writer.StartObject();
+    for (std::size_t i = 0; i < NUM_SITES; ++i)
+    {
+        const LockSiteStats &site = all[i];
+        writer.Key(lockSiteName(static_cast<LockSite>(i)));
+        writer.StartObject();
+        writer.Key("acquisitions");
+        writer.Uint64(site.acquisitions);
+        writer.Key("contended");
+        writer.Uint64(site.contended);
+        writer.Key("wait_ns");
+        writer.StartObject();
+        writer.Key("total");
+        writer.Uint64(site.waitTotal);
+        writer.Key("max");
+        writer.Uint64(site.waitMax);
+        writer.Key("histogram_us");
+        writer.StartArray();
+        for (std::uint64_t count : site.waitHistogram)
+        {
+            writer.Uint64(count);
+        }
+        writer.EndArray();
+        writer.EndObject();
+        writer.Key("hold_ns");
+        writer.StartObject();
+        writer.Key("total");
+        writer.Uint64(site.holdTotal);
+        writer.Key("max");
+        writer.Uint64(site.holdMax);
+        writer.EndObject();
+        writer.EndObject();
+    }
+    writer.EndObject();
+    const auto combined = batches();
+    writer.Key("combining");
+    writer.StartObject();
+    writer.Key("batches");
+    writer.Uint64(combined.first);
+    writer.Key("operations");
+    writer.Uint64(combined.second);
+    writer.EndObject();
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+std::vector<std::string> LockProfiler::summary() const
+{
+    std::vector<std::string> lines;
+    const auto all = stats();
+    for (std::size_t i = 0; i < NUM_SITES; ++i)
+    {
+        const LockSiteStats &site = all[i];
+        if (site.acquisitions == 0)
+        {
+            continue;
+        }
+        char line[256];
+        std::snprintf(
+            line, sizeof(line),
+            "lock %s: %llu acquisitions, %.1f%% contended, wait mean %.1fus "
+            "max %.1fus, hold mean %.1fus max %.1fus",
+            lockSiteName(static_cast<LockSite>(i)),
+            static_cast<unsigned long long>(site.acquisitions),
+            100.0 * site.contended / site.acquisitions,
+            site.waitTotal / 1000.0 / site.acquisitions, site.waitMax / 1000.0,
+            site.holdTotal / 1000.0 / site.acquisitions,
+            site.holdMax / 1000.0);
+        lines.emplace_back(line);
+    }
+    const auto combined = batches();
+    if (combined.first > 0)
+    {
+        char line[128];
+        std::snprintf(line, sizeof(line),
+                      "combining: %llu batches applied %llu writes",
+                      static_cast<unsigned long long>(combined.first),
+                      static_cast<unsigned long long>(combined.second));
+        lines.emplace_back(line);
+    }
+    return lines;
+}
+
+template <bool Shared>
+BasicProfiledLock<Shared>::BasicProfiledLock(ProfiledMutex &mutex,
+                                             LockSite site,
+                                             const TracePtr &trace) :
+    m_mutex(mutex),
+    m_site(site),
+    m_requested(Clock::now())
+{
+    if (Shared ? !m_mutex.m_mutex.try_lock_shared()
+               : !m_mutex.m_mutex.try_lock())
+    {
+        m_contended = true;
+        if (Shared)
+        {
+            m_mutex.m_mutex.lock_shared();
+        }
+        else
+        {
+            m_mutex.m_mutex.lock();
+        }
+    }
+    m_acquired = Clock::now();
+    if (trace)
+    {
+        trace->add("lock_wait", m_requested, m_acquired);
+    }
+}
+
+template <bool Shared>
+BasicProfiledLock<Shared>::BasicProfiledLock(ProfiledMutex &mutex,
+                                             LockSite site,
+                                             std::try_to_lock_t) :
+    m_mutex(mutex),
+    m_site(site),
+    m_requested(Clock::now())
+{
+    m_owns = Shared ? m_mutex.m_mutex.try_lock_shared()
+                    : m_mutex.m_mutex.try_lock();
+    m_acquired = m_requested;
+}
+
+template <bool Shared>
+BasicProfiledLock<Shared>::~BasicProfiledLock()
+{
+    if (!m_owns)
+    {
+        return;
+    }
+    const Clock::time_point released = Clock::now();
+    if (Shared)
+    {
+        m_mutex.m_mutex.unlock_shared();
+    }
+    else
+    {
+        m_mutex.m_mutex.unlock();
+    }
+    m_mutex.m_profiler.record(m_site, m_contended,
+                              nanoseconds(m_acquired - m_requested),
+                              nanoseconds(released - m_acquired));
+}
+
+template class BasicProfiledLock<false>;
+template class BasicProfiledLock<true>;
+
+} // namespace comicsdb
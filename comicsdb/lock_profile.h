@@ -0,0 +1,126 @@
+#pragma once
+
+#include "trace.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+// Where a profiled lock was taken.
+enum class LockSite
+{
+    READ_COMIC,
+    CREATE_COMIC,
+    UPDATE_COMIC,
+    DELETE_COMIC,
+    EXPORT_COMICS,
+    IMPORT_COMICS,
+    TRANSACTION,
+    MAINTENANCE,
+    NUM_SITES
+};
+
+const char *lockSiteName(LockSite site);
+
+constexpr std::size_t LOCK_HISTOGRAM_BUCKETS = 24;
+
+// Totals for one call site, summed over all threads.
+struct LockSiteStats
+{
+    std::uint64_t acquisitions{};
+    std::uint64_t contended{}; // try_lock failed and the thread had to wait
+    std::uint64_t waitTotal{}; // nanoseconds
+    std::uint64_t waitMax{};
+    std::uint64_t holdTotal{};
+    std::uint64_t holdMax{};
+    // waitHistogram[i] counts waits below 2^i microseconds; the last bucket
+    // counts everything longer.
+    std::array<std::uint64_t, LOCK_HISTOGRAM_BUCKETS> waitHistogram{};
+};
+
+// Collects wait and hold times of profiled locks.  Each thread accumulates
+// into its own counters, which only it writes, so recording never contends;
+// readers sum the per-thread counters on demand.
+class LockProfiler
+{
+  public:
+    LockProfiler();
+
+    void record(LockSite site, bool contended, std::uint64_t wait,
+                std::uint64_t hold);
+    // Records a flat-combining pass that applied several queued writes
+    // under one acquisition.
+    void recordBatch(std::size_t operations);
+    std::array<LockSiteStats, static_cast<std::size_t>(LockSite::NUM_SITES)>
+    stats() const;
+    // Number of combining passes and the writes they applied.
+    std::pair<std::uint64_t, std::uint64_t> batches() const;
+    std::string toJson() const;
+    std::vector<std::string> summary() const;
+
+  private:
+    struct ThreadStats;
+
+    ThreadStats &local();
+
+    const std::uint64_t m_instance;
+    mutable std::mutex m_threadsMutex;
+    std::vector<std::shared_ptr<ThreadStats>> m_threads;
+};
+
+// A reader-writer mutex whose acquisitions are timed by a LockProfiler.
+class ProfiledMutex
+{
+  public:
+    explicit ProfiledMutex(LockProfiler &profiler) : m_profiler(profiler) {}
+
+  private:
+    template <bool Shared>
+    friend class BasicProfiledLock;
+
+    LockProfiler &m_profiler;
+    std::shared_mutex m_mutex;
+};
+
+// Scoped exclusive or shared lock of a ProfiledMutex that reports how long
+// it waited for the mutex and how long it held it.  When given a trace, the
+// wait is also recorded as its lock_wait stage.
+template <bool Shared>
+class BasicProfiledLock
+{
+  public:
+    BasicProfiledLock(ProfiledMutex &mutex, LockSite site,
+                      const TracePtr &trace = nullptr);
+    // Only takes the lock if it is free; nothing is recorded otherwise.
+    BasicProfiledLock(ProfiledMutex &mutex, LockSite site, std::try_to_lock_t);
+    BasicProfiledLock(const BasicProfiledLock &) = delete;
+    BasicProfiledLock &operator=(const BasicProfiledLock &) = delete;
+    ~BasicProfiledLock();
+
+    bool owns_lock() const { return m_owns; }
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    ProfiledMutex &m_mutex;
+    LockSite m_site;
+    bool m_owns{true};
+    bool m_contended{};
+    Clock::time_point m_requested;
+    Clock::time_point m_acquired;
+};
+
+using ProfiledLock = BasicProfiledLock<false>;
+using ProfiledSharedLock = BasicProfiledLock<true>;
+
+} // namespace comicsdb
@@ -0,0 +1,647 @@
+#include "log_store.h"
+
+#include "checksum.h"
+#include "file_io.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+// Appends go to a new segment once the current one reaches this size.
+constexpr std::uint64_t SEGMENT_BYTES = 64 << 20;
+// How much is appended between checkpoints of the index.
+constexpr std::uint64_t CHECKPOINT_BYTES = 256 << 20;
+
+// A checkpoint is CHECKPOINT_MAGIC, the next id, the number of segments it
+// covers and the number of slots, then the slots and a CRC-32C of
+// everything before it, all in native byte order.
+constexpr char CHECKPOINT_MAGIC[8] = {'C', 'D', 'B', 'C', 'K', 'P', 'T', '1'};
+constexpr const char *CHECKPOINT_FILE = "index.ckpt";
+
+} // namespace
+
+struct LogStore::Checkpoint
+{
+    std::uint64_t nextId{};
+    std::uint64_t segments{}; // covered completely, and only appended to
+    std::vector<Slot> index;
+};
+
+LogStore::LogStore(const std::string &dir, LockProfiler &profiler,
+                   const Progress &progress) :
+    m_dir(dir),
+    m_progress(progress),
+    m_mutex(profiler)
+{
+    std::error_code error;
+    std::filesystem::create_directories(m_dir, error);
+    if (error)
+    {
+        throw std::runtime_error("Couldn't create " + m_dir + ": " +
+                                 error.message());
+    }
+
+    // Segments are numbered from 1 and never removed.
+    std::size_t count = 0;
+    for (const auto &entry : std::filesystem::directory_iterator(m_dir))
+    {
+        const std::filesystem::path file = entry.path();
+        if (file.extension() == ".tmp")
+        {
+            std::filesystem::remove(file, error);
+        }
+        else if (file.extension() == ".seg")
+        {
+            ++count;
+        }
+    }
+    for (std::size_t segment = 0; segment < count; ++segment)
+    {
+        if (!std::filesystem::exists(segmentPath(segment)))
+        {
+            throw std::runtime_error("Missing log segment " +
+                                     segmentPath(segment));
+        }
+    }
+
+    Checkpoint checkpoint;
+    if (!readCheckpoint(checkpoint) || checkpoint.segments > count ||
+        checkpoint.nextId == 0)
+    {
+        replay(0, count);
+        return;
+    }
+
+    // Serve the checkpoint while the segments after it are replayed.
+    m_index = std::move(checkpoint.index);
+    m_nextId = static_cast<std::size_t>(checkpoint.nextId);
+    m_sealed = static_cast<std::size_t>(checkpoint.segments);
+    for (std::size_t segment = 0; segment < m_sealed; ++segment)
+    {
+        m_segments.push_back(
+            std::make_unique<RecordLog>(segmentPath(segment), nullptr));
+    }
+    if (m_sealed == count)
+    {
+        return;
+    }
+    report("Serving reads from the checkpoint while replaying " +
+           std::to_string(count - m_sealed) + " log segments");
+    m_recovering = true;
+    m_recovery = std::thread([this, first = m_sealed, count]
+                             { recover(first, count); });
+}
+
+LogStore::~LogStore()
+{
+    if (m_recovery.joinable())
+    {
+        m_recovery.join();
+    }
+    if (m_checkpointer.joinable())
+    {
+        m_checkpointer.join();
+    }
+    // A clean shutdown leaves nothing to replay.
+    if (!m_recoveryFailed && m_sealed != m_segments.size())
+    {
+        try
+        {
+            writeCheckpoint(takeCheckpoint());
+        }
+        catch (const std::exception &bang)
+        {
+            report(std::string{"Couldn't checkpoint the log: "} + bang.what());
+        }
+    }
+}
+
+std::string LogStore::segmentPath(std::size_t segment) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%06llu.seg",
+                  static_cast<unsigned long long>(segment + 1));
+    return (std::filesystem::path{m_dir} / name).string();
+}
+
+void LogStore::report(const std::string &message) const
+{
+    if (m_progress)
+    {
+        m_progress(message);
+    }
+}
+
+void LogStore::replay(std::size_t first, std::size_t count)
+{
+    const auto started = std::chrono::steady_clock::now();
+    const std::size_t segments = count - first;
+    std::vector<std::unique_ptr<RecordLog>> logs(segments);
+    std::vector<std::vector<RecordLog::Entry>> entries(segments);
+    std::vector<std::exception_ptr> errors(segments);
+    std::atomic<std::size_t> next{0};
+    std::atomic<std::size_t> done{0};
+    const auto work = [&]
+    {
+        for (std::size_t i = next++; i < segments; i = next++)
+        {
+            try
+            {
+                // Only the last segment can end in a torn append.
+                std::vector<RecordLog::Entry> &found = entries[i];
+                logs[i] = std::make_unique<RecordLog>(
+                    segmentPath(first + i),
+                    [&found](const RecordLog::Entry &entry)
+                    { found.push_back(entry); },
+                    0, first + i + 1 < count, m_progress);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+            report("Replayed log segment " + std::to_string(++done) + " of " +
+                   std::to_string(segments));
+        }
+    };
+    const std::size_t threads = std::min<std::size_t>(
+        segments, std::max(1U, std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < threads; ++i)
+    {
+        workers.emplace_back(work);
+    }
+    work();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    for (const std::exception_ptr &error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Later segments override earlier ones, so apply them in order.
+    std::size_t records = 0;
+    ProfiledLock lock(m_mutex, LockSite::MAINTENANCE);
+    std::size_t nextId = m_nextId;
+    for (std::size_t i = 0; i < segments; ++i)
+    {
+        for (const RecordLog::Entry &entry : entries[i])
+        {
+            if (!entry.erase)
+            {
+                place(entry.id, entry.location, first + i);
+            }
+            else if (entry.id < m_index.size())
+            {
+                m_index[entry.id] = Slot{};
+            }
+            nextId = std::max(nextId, entry.id + 1);
+        }
+        records += entries[i].size();
+        m_segments.push_back(std::move(logs[i]));
+    }
+    m_nextId = nextId;
+    if (segments != 0)
+    {
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - started;
+        char seconds[32];
+        std::snprintf(seconds, sizeof(seconds), "%.2f", elapsed.count());
+        report("Replayed " + std::to_string(records) + " records from " +
+               std::to_string(segments) + " log segments on " +
+               std::to_string(threads) + " threads in " + seconds + "s");
+    }
+}
+
+void LogStore::recover(std::size_t first, std::size_t count)
+{
+    std::string failure;
+    try
+    {
+        replay(first, count);
+    }
+    catch (const std::exception &bang)
+    {
+        failure = bang.what();
+        report("Log replay failed, writes are refused: " + failure);
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_recoveryMutex);
+        m_recoveryFailure = failure;
+        m_recoveryFailed = !failure.empty();
+        m_recovering = false;
+    }
+    m_recovered.notify_all();
+}
+
+void LogStore::waitForRecovery() const
+{
+    if (!m_recovering.load() && !m_recoveryFailed.load())
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m_recoveryMutex);
+    m_recovered.wait(lock, [this] { return !m_recovering.load(); });
+    if (m_recoveryFailed)
+    {
+        throw std::runtime_error("Log replay failed: " + m_recoveryFailure);
+    }
+}
+
+bool LogStore::readCheckpoint(Checkpoint &checkpoint) const
+{
+    const std::string path =
+        (std::filesystem::path{m_dir} / CHECKPOINT_FILE).string();
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        return false;
+    }
+    const std::string bytes{std::istreambuf_iterator<char>(in),
+                            std::istreambuf_iterator<char>()};
+
+    constexpr std::size_t HEADER = sizeof(CHECKPOINT_MAGIC) + 3 * 8;
+    std::uint64_t fields[3]{};
+    std::uint32_t crc{};
+    if (bytes.size() >= HEADER + sizeof(crc))
+    {
+        std::memcpy(fields, bytes.data() + sizeof(CHECKPOINT_MAGIC),
+                    sizeof(fields));
+        std::memcpy(&crc, bytes.data() + bytes.size() - sizeof(crc),
+                    sizeof(crc));
+    }
+    if (bytes.size() < HEADER + sizeof(crc) ||
+        std::memcmp(bytes.data(), CHECKPOINT_MAGIC,
+                    sizeof(CHECKPOINT_MAGIC)) != 0 ||
+        fields[2] != (bytes.size() - HEADER - sizeof(crc)) / sizeof(Slot) ||
+        bytes.size() != HEADER + fields[2] * sizeof(Slot) + sizeof(crc) ||
+        crc32c(bytes.data(), bytes.size() - sizeof(crc)) != crc)
+    {
+        report("Ignoring the corrupt checkpoint " + path);
+        return false;
+    }
+    checkpoint.nextId = fields[0];
+    checkpoint.segments = fields[1];
+    checkpoint.index.resize(static_cast<std::size_t>(fields[2]));
+    std::memcpy(checkpoint.index.data(), bytes.data() + HEADER,
+                checkpoint.index.size() * sizeof(Slot));
+    return true;
+}
+
+void LogStore::writeCheckpoint(const Checkpoint &checkpoint) const
+{
+    const std::string path =
+        (std::filesystem::path{m_dir} / CHECKPOINT_FILE).string();
+    const std::string temp = path + ".tmp";
+    std::FILE *out = std::fopen(temp.c_str(), "wb");
+    if (out == nullptr)
+    {
+        throw std::runtime_error(errorText("Couldn't create", temp));
+    }
+    const std::uint64_t fields[3] = {checkpoint.nextId, checkpoint.segments,
+                                     checkpoint.index.size()};
+    std::uint32_t crc = crc32c(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    crc = crc32c(fields, sizeof(fields), crc);
+    crc = crc32c(checkpoint.index.data(),
+                 checkpoint.index.size() * sizeof(Slot), crc);
+    std::fwrite(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC), 1, out);
+    std::fwrite(fields, sizeof(fields), 1, out);
+    std::fwrite(checkpoint.index.data(), sizeof(Slot),
+                checkpoint.index.size(), out);
+    std::fwrite(&crc, sizeof(crc), 1, out);
+    const bool failed = std::ferror(out) != 0 || std::fflush(out) != 0 ||
+                        ::fsync(::fileno(out)) != 0;
+    std::fclose(out);
+    if (failed || std::rename(temp.c_str(), path.c_str()) != 0)
+    {
+        const std::string error = errorText("Couldn't write", path);
+        std::remove(temp.c_str());
+        throw std::runtime_error(error);
+    }
+    syncDirectory(m_dir);
+}
+
+LogStore::Checkpoint LogStore::takeCheckpoint()
+{
+    Checkpoint checkpoint;
+    RecordLog *last = nullptr;
+    {
+        // Appends after this go to a new segment, so the checkpoint covers
+        // whole segments.
+        ProfiledLock lock(m_mutex, LockSite::MAINTENANCE);
+        checkpoint.nextId = m_nextId;
+        checkpoint.segments = m_segments.size();
+        checkpoint.index = m_index;
+        if (m_sealed != m_segments.size())
+        {
+            last = m_segments.back().get();
+        }
+        m_sealed = m_segments.size();
+        m_appended = 0;
+    }
+    // Earlier segments were synced when appends moved on from them.
+    if (last != nullptr)
+    {
+        last->sync();
+    }
+    return checkpoint;
+}
+
+void LogStore::maintain()
+{
+    if (m_recovering || m_recoveryFailed || m_checkpointing)
+    {
+        return;
+    }
+    {
+        ProfiledSharedLock lock(m_mutex, LockSite::MAINTENANCE);
+        if (m_appended < CHECKPOINT_BYTES)
+        {
+            return;
+        }
+    }
+    if (m_checkpointer.joinable())
+    {
+        m_checkpointer.join();
+    }
+    m_checkpointing = true;
+    m_checkpointer = std::thread(
+        [this]
+        {
+            try
+            {
+                writeCheckpoint(takeCheckpoint());
+            }
+            catch (const std::exception &bang)
+            {
+                report(std::string{"Couldn't checkpoint the log: "} +
+                       bang.what());
+            }
+            m_checkpointing = false;
+        });
+}
+
+bool LogStore::live(std::size_t id) const
+{
+    return id < m_index.size() && m_index[id].offset != 0;
+}
+
+void LogStore::place(std::size_t id, const RecordLog::Location &location,
+                     std::size_t segment)
+{
+    if (id >= m_index.size())
+    {
+        m_index.resize(id + 1);
+    }
+    m_index[id] = {location.offset, location.size,
+                   static_cast<std::uint32_t>(segment)};
+}
+
+RecordLog &LogStore::appendable()
+{
+    if (m_sealed == m_segments.size() ||
+        m_segments.back()->size() >= SEGMENT_BYTES)
+    {
+        if (m_sealed != m_segments.size())
+        {
+            m_segments.back()->sync();
+        }
+        auto segment = std::make_unique<RecordLog>(
+            segmentPath(m_segments.size()), nullptr);
+        syncDirectory(m_dir);
+        m_segments.push_back(std::move(segment));
+    }
+    return *m_segments.back();
+}
+
+bool LogStore::get(std::size_t id, Comic &comic, const TracePtr &trace) const
+{
+    Slot slot;
+    const RecordLog *segment;
+    {
+        ProfiledSharedLock lock(m_mutex, LockSite::READ_COMIC, trace);
+        if (!live(id))
+        {
+            return false;
+        }
+        slot = m_index[id];
+        segment = m_segments[slot.segment].get();
+    }
+    // Records are never rewritten, so the read needs no lock.
+    TraceSpan span(trace, "read");
+    comic = segment->read({slot.offset, slot.size});
+    return true;
+}
+
+bool LogStore::contains(std::size_t id) const
+{
+    ProfiledSharedLock lock(m_mutex, LockSite::READ_COMIC);
+    return live(id);
+}
+
+std::size_t LogStore::create(const Comic &comic, const TracePtr &trace)
+{
+    waitForRecovery();
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::CREATE_COMIC, trace);
+    RecordLog &log = appendable();
+    const std::uint64_t size = log.size();
+    const std::size_t id = m_nextId;
+    place(id, log.put(id, comic), m_segments.size() - 1);
+    m_appended += log.size() - size;
+    m_nextId = id + 1;
+    return id;
+}
+
+bool LogStore::update(std::size_t id, const Comic &comic,
+                      const TracePtr &trace)
+{
+    waitForRecovery();
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::UPDATE_COMIC, trace);
+    if (!live(id))
+    {
+        return false;
+    }
+    RecordLog &log = appendable();
+    const std::uint64_t size = log.size();
+    place(id, log.put(id, comic), m_segments.size() - 1);
+    m_appended += log.size() - size;
+    return true;
+}
+
+bool LogStore::erase(std::size_t id, const TracePtr &trace)
+{
+    waitForRecovery();
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::DELETE_COMIC, trace);
+    if (!live(id))
+    {
+        return false;
+    }
+    RecordLog &log = appendable();
+    const std::uint64_t size = log.size();
+    log.erase(id);
+    m_appended += log.size() - size;
+    m_index[id] = Slot{};
+    return true;
+}
+
+bool LogStore::insert(std::size_t id, const Comic &comic,
+                      const TracePtr &trace)
+{
+    waitForRecovery();
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::CREATE_COMIC, trace);
+    if (live(id))
+    {
+        return false;
+    }
+    RecordLog &log = appendable();
+    const std::uint64_t size = log.size();
+    place(id, log.put(id, comic), m_segments.size() - 1);
+    m_appended += log.size() - size;
+    m_nextId = std::max<std::size_t>(m_nextId, id + 1);
+    return true;
+}
+
+void LogStore::scan(
+    const std::function<void(std::size_t, const Comic &)> &visit) const
+{
+    std::vector<Slot> index;
+    std::vector<const RecordLog *> segments;
+    {
+        ProfiledSharedLock lock(m_mutex, LockSite::EXPORT_COMICS);
+        index = m_index;
+        for (const std::unique_ptr<RecordLog> &segment : m_segments)
+        {
+            segments.push_back(segment.get());
+        }
+    }
+    for (std::size_t id = 0; id < index.size(); ++id)
+    {
+        const Slot &slot = index[id];
+        if (slot.offset != 0)
+        {
+            visit(id, segments[slot.segment]->read({slot.offset, slot.size}));
+        }
+    }
+}
+
+std::vector<std::pair<std::size_t, Comic>> LogStore::snapshot() const
+{
+    // A copy of the index is a consistent cut of the append-only log.
+    std::vector<std::pair<std::size_t, Comic>> comics;
+    scan([&comics](std::size_t id, const Comic &comic)
+         { comics.emplace_back(id, comic); });
+    return comics;
+}
+
+std::size_t LogStore::importBatch(std::vector<Comic> comics)
+{
+    waitForRecovery();
+    ProfiledLock lock(m_mutex, LockSite::IMPORT_COMICS);
+    RecordLog &log = appendable();
+    const std::uint64_t size = log.size();
+    const std::size_t first = m_nextId;
+    RecordLog::Batch batch(log.size());
+    std::vector<RecordLog::Location> locations;
+    locations.reserve(comics.size());
+    for (std::size_t i = 0; i < comics.size(); ++i)
+    {
+        locations.push_back(batch.put(first + i, comics[i]));
+    }
+    log.append(batch);
+    m_appended += log.size() - size;
+
+    m_index.reserve(first + comics.size());
+    for (std::size_t i = 0; i < locations.size(); ++i)
+    {
+        place(first + i, locations[i], m_segments.size() - 1);
+    }
+    m_nextId = first + comics.size();
+    return first;
+}
+
+bool LogStore::applyTransaction(std::vector<TransactionOp> &ops,
+                                std::size_t &failed, const TracePtr &trace)
+{
+    waitForRecovery();
+    ProfiledLock lock(m_mutex, LockSite::TRANSACTION, trace);
+    TraceSpan apply(trace, "apply");
+
+    // Check every step against the state left by the steps before it.
+    std::size_t nextId = m_nextId;
+    std::unordered_map<std::size_t, bool> exists;
+    for (std::size_t i = 0; i < ops.size(); ++i)
+    {
+        TransactionOp &op = ops[i];
+        if (op.kind == TransactionOp::CREATE)
+        {
+            op.id = nextId++;
+            exists[op.id] = true;
+            continue;
+        }
+        auto it = exists.find(op.id);
+        if (it == exists.end())
+        {
+            it = exists.emplace(op.id, live(op.id)).first;
+        }
+        if (!it->second)
+        {
+            failed = i;
+            return false;
+        }
+        it->second = op.kind != TransactionOp::ERASE;
+    }
+
+    RecordLog &log = appendable();
+    const std::uint64_t size = log.size();
+    RecordLog::Batch batch(log.size());
+    std::vector<RecordLog::Location> locations;
+    locations.reserve(ops.size());
+    for (const TransactionOp &op : ops)
+    {
+        if (op.kind == TransactionOp::ERASE)
+        {
+            batch.erase(op.id);
+            locations.emplace_back();
+        }
+        else
+        {
+            locations.push_back(batch.put(op.id, op.comic));
+        }
+    }
+    log.append(batch);
+    m_appended += log.size() - size;
+
+    for (std::size_t i = 0; i < ops.size(); ++i)
+    {
+        place(ops[i].id, locations[i], m_segments.size() - 1);
+    }
+    m_nextId = nextId;
+    return true;
+}
+
+} // namespace comicsdb
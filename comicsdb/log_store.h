@@ -0,0 +1,120 @@
+#pragma once
+
+#include "record_log.h"
+#include "storage.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace comicsdb
+{
+
+// Persistent engine keeping every change in an append-only log, with only
+// the location of each comic's latest version held in memory.  Opening the
+// store replays the log to rebuild that index, so the data survives
+// restarts while the memory cost is a few bytes per comic.
+//
+// The log is split into checksummed segment files of about 64 MiB, which
+// are verified and replayed in parallel on startup.  The index is also
+// checkpointed on shutdown and after every 256 MiB of appends; if a
+// checkpoint is found, reads are served from it at once while the
+// segments written after it are replayed in the background, and writes
+// wait for that replay to finish.
+//
+// Each write reaches the operating system before it returns, so it
+// survives the process crashing but not the machine.  Space taken by
+// replaced and deleted comics is never reclaimed.
+class LogStore : public StorageEngine
+{
+  public:
+    using Progress = std::function<void(const std::string &message)>;
+
+    // Opens or creates the log in dir, reporting replay progress.  Throws
+    // std::runtime_error if it can't be opened or is corrupt.
+    LogStore(const std::string &dir, LockProfiler &profiler,
+             const Progress &progress = nullptr);
+    ~LogStore() override;
+    LogStore(const LogStore &) = delete;
+    LogStore &operator=(const LogStore &) = delete;
+
+    const char *name() const override { return "log"; }
+
+    bool get(std::size_t id, Comic &comic,
+             const TracePtr &trace = nullptr) const override;
+    bool contains(std::size_t id) const override;
+    std::size_t create(const Comic &comic,
+                       const TracePtr &trace = nullptr) override;
+    bool update(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+    bool erase(std::size_t id, const TracePtr &trace = nullptr) override;
+    bool insert(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+
+    void scan(const std::function<void(std::size_t, const Comic &)> &visit)
+        const override;
+    std::vector<std::pair<std::size_t, Comic>> snapshot() const override;
+    std::size_t importBatch(std::vector<Comic> comics) override;
+    bool applyTransaction(std::vector<TransactionOp> &ops, std::size_t &failed,
+                          const TracePtr &trace = nullptr) override;
+
+    std::size_t nextId() const override { return m_nextId.load(); }
+
+    // Starts writing a checkpoint once enough has been appended.
+    void maintain() override;
+
+  private:
+    // Where a comic's latest version is; offset 0 marks an id that was
+    // never created or has been deleted.
+    struct Slot
+    {
+        std::uint64_t offset;
+        std::uint32_t size;
+        std::uint32_t segment;
+    };
+
+    struct Checkpoint;
+
+    std::string segmentPath(std::size_t segment) const;
+    bool readCheckpoint(Checkpoint &checkpoint) const;
+    void writeCheckpoint(const Checkpoint &checkpoint) const;
+    Checkpoint takeCheckpoint();
+    void replay(std::size_t first, std::size_t count);
+    void recover(std::size_t first, std::size_t count);
+    void waitForRecovery() const;
+    void report(const std::string &message) const;
+
+    bool live(std::size_t id) const;
+    void place(std::size_t id, const RecordLog::Location &location,
+               std::size_t segment);
+    RecordLog &appendable();
+
+    const std::string m_dir;
+    const Progress m_progress;
+
+    mutable ProfiledMutex m_mutex;
+    std::vector<Slot> m_index;
+    std::atomic<std::size_t> m_nextId{0}; // written under m_mutex
+    std::vector<std::unique_ptr<RecordLog>> m_segments;
+    std::size_t m_sealed{};     // segments covered by the last checkpoint
+    std::uint64_t m_appended{}; // bytes since the last checkpoint
+
+    // Replay of the segments after a checkpoint.
+    mutable std::mutex m_recoveryMutex;
+    mutable std::condition_variable m_recovered;
+    std::atomic<bool> m_recovering{false}; // written under m_recoveryMutex
+    std::atomic<bool> m_recoveryFailed{false};
+    std::string m_recoveryFailure;
+    std::thread m_recovery;
+
+    std::atomic<bool> m_checkpointing{false};
+    std::thread m_checkpointer;
+};
+
+} // namespace comicsdb
@@ -0,0 +1,354 @@
+#include "logger.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <ctime>
+#include <stdexcept>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+constexpr std::size_t RING_CAPACITY = 1024; // must be a power of two
+constexpr std::size_t MESSAGE_CAPACITY = 480;
+
+std::atomic<std::uint64_t> g_nextInstance{1};
+
+int severity(restbed::Logger::Level level)
+{
+    switch (level)
+    {
+    case restbed::Logger::DEBUG:
+        return 0;
+    case restbed::Logger::INFO:
+        return 1;
+    case restbed::Logger::WARNING:
+        return 2;
+    case restbed::Logger::SECURITY:
+        return 3;
+    case restbed::Logger::ERROR:
+        return 4;
+    case restbed::Logger::FATAL:
+        return 5;
+    }
+    return 5;
+}
+
+std::uint64_t nowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+} // namespace
+
+struct LogRecord
+{
+    std::uint64_t timestamp;
+    restbed::Logger::Level level;
+    std::uint32_t length;
+    char text[MESSAGE_CAPACITY];
+};
+
+struct AsyncLogger::Ring
+{
+    explicit Ring(std::uint32_t index) : index(index) {}
+
+    const std::uint32_t index;
+    alignas(64) std::atomic<std::size_t> head{0}; // written by the producer
+    alignas(64) std::atomic<std::size_t> tail{0}; // written by the consumer
+    alignas(64) std::atomic<std::uint64_t> dropped{0};
+    std::array<LogRecord, RING_CAPACITY> records;
+};
+
+AsyncLogger::AsyncLogger(Level minLevel, LogFormat format,
+                         const std::string &path) :
+    m_instance(g_nextInstance++),
+    m_minSeverity(severity(minLevel)),
+    m_format(format),
+    m_out(stderr),
+    m_ownsOut(false)
+{
+    if (!path.empty())
+    {
+        m_out = std::fopen(path.c_str(), format == LogFormat::BINARY ? "ab" : "a");
+        if (m_out == nullptr)
+        {
+            throw std::runtime_error("Couldn't open log file " + path);
+        }
+        m_ownsOut = true;
+    }
+    if (m_format == LogFormat::BINARY)
+    {
+        std::fwrite(LOG_BINARY_MAGIC, sizeof(LOG_BINARY_MAGIC), 1, m_out);
+    }
+    m_thread = std::thread([this] { drain(); });
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        m_stopping = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+    if (m_ownsOut)
+    {
+        std::fclose(m_out);
+    }
+}
+
+void AsyncLogger::stop()
+{
+    flush();
+}
+
+void AsyncLogger::log(const Level level, const char *format, ...)
+{
+    if (!enabled(level))
+    {
+        return;
+    }
+
+    std::va_list arguments;
+    va_start(arguments, format);
+    vlog(level, format, arguments);
+    va_end(arguments);
+}
+
+void AsyncLogger::log_if(bool expression, const Level level,
+                         const char *format, ...)
+{
+    if (!expression || !enabled(level))
+    {
+        return;
+    }
+
+    std::va_list arguments;
+    va_start(arguments, format);
+    vlog(level, format, arguments);
+    va_end(arguments);
+}
+
+bool AsyncLogger::enabled(Level level) const
+{
+    return severity(level) >= m_minSeverity;
+}
+
+void AsyncLogger::vlog(Level level, const char *format,
+                       std::va_list arguments)
+{
+    if (!enabled(level))
+    {
+        return;
+    }
+
+    Ring &ring = localRing();
+    const std::size_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) == RING_CAPACITY)
+    {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    LogRecord &record = ring.records[head & (RING_CAPACITY - 1)];
+    record.timestamp = nowNanoseconds();
+    record.level = level;
+    const int length =
+        std::vsnprintf(record.text, sizeof(record.text), format, arguments);
+    record.length = static_cast<std::uint32_t>(std::min<std::size_t>(
+        std::max(length, 0), sizeof(record.text) - 1));
+    ring.head.store(head + 1, std::memory_order_release);
+
+    if (m_idle.load(std::memory_order_acquire))
+    {
+        m_wake.notify_one();
+    }
+}
+
+void AsyncLogger::flush()
+{
+    std::unique_lock<std::mutex> lock(m_wakeMutex);
+    const std::uint64_t request = ++m_flushRequests;
+    m_wake.notify_one();
+    m_drained.wait(lock, [this, request]
+                   { return m_flushesDone >= request || m_stopping; });
+}
+
+std::uint64_t AsyncLogger::dropped() const
+{
+    std::uint64_t total = 0;
+    std::unique_lock<std::mutex> lock(m_ringsMutex);
+    for (const std::shared_ptr<Ring> &ring : m_rings)
+    {
+        total += ring->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+AsyncLogger::Ring &AsyncLogger::localRing()
+{
+    struct Local
+    {
+        std::uint64_t instance{};
+        std::shared_ptr<Ring> ring;
+    };
+    thread_local Local local;
+    if (local.instance != m_instance)
+    {
+        std::unique_lock<std::mutex> lock(m_ringsMutex);
+        local.ring = std::make_shared<Ring>(
+            static_cast<std::uint32_t>(m_rings.size()));
+        local.instance = m_instance;
+        m_rings.push_back(local.ring);
+    }
+    return *local.ring;
+}
+
+void AsyncLogger::drain()
+{
+    while (true)
+    {
+        const std::uint64_t requests = m_flushRequests.load();
+        bool wrote = false;
+        while (drainOnce())
+        {
+            wrote = true;
+        }
+
+        const std::uint64_t dropped = this->dropped();
+        if (dropped != m_droppedReported)
+        {
+            LogRecord record{};
+            record.timestamp = nowNanoseconds();
+            record.level = WARNING;
+            const int length = std::snprintf(
+                record.text, sizeof(record.text),
+                "%llu log messages dropped",
+                static_cast<unsigned long long>(dropped - m_droppedReported));
+            record.length = static_cast<std::uint32_t>(length);
+            write(record, ~0U);
+            m_droppedReported = dropped;
+            wrote = true;
+        }
+        if (wrote)
+        {
+            std::fflush(m_out);
+        }
+
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        m_flushesDone = requests;
+        m_drained.notify_all();
+        if (m_stopping)
+        {
+            if (!drainOnce())
+            {
+                std::fflush(m_out);
+                return;
+            }
+            continue;
+        }
+        if (m_flushRequests == requests)
+        {
+            m_idle = true;
+            m_wake.wait_for(lock, std::chrono::milliseconds(100));
+            m_idle = false;
+        }
+    }
+}
+
+bool AsyncLogger::drainOnce()
+{
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::unique_lock<std::mutex> lock(m_ringsMutex);
+        rings = m_rings;
+    }
+
+    bool any = false;
+    for (const std::shared_ptr<Ring> &ring : rings)
+    {
+        std::size_t tail = ring->tail.load(std::memory_order_relaxed);
+        const std::size_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail)
+        {
+            write(ring->records[tail & (RING_CAPACITY - 1)], ring->index);
+            ring->tail.store(tail + 1, std::memory_order_release);
+            any = true;
+        }
+    }
+    return any;
+}
+
+void AsyncLogger::write(const LogRecord &record, std::uint32_t thread)
+{
+    if (m_format == LogFormat::BINARY)
+    {
+        LogRecordHeader header{};
+        header.timestamp = record.timestamp;
+        header.level = record.level;
+        header.thread = thread;
+        header.length = record.length;
+        std::fwrite(&header, sizeof(header), 1, m_out);
+        std::fwrite(record.text, 1, record.length, m_out);
+        return;
+    }
+
+    const std::time_t seconds =
+        static_cast<std::time_t>(record.timestamp / 1000000000ULL);
+    std::tm utc{};
+#ifdef _WIN32
+    gmtime_s(&utc, &seconds);
+#else
+    gmtime_r(&seconds, &utc);
+#endif
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    std::fprintf(m_out, "%s.%06uZ [%s] %.*s\n", stamp,
+                 static_cast<unsigned>(record.timestamp % 1000000000ULL / 1000),
+                 logLevelName(record.level), static_cast<int>(record.length),
+                 record.text);
+}
+
+restbed::Logger::Level parseLogLevel(const std::string &text)
+{
+    static const restbed::Logger::Level levels[] = {
+        restbed::Logger::DEBUG,    restbed::Logger::INFO,
+        restbed::Logger::WARNING,  restbed::Logger::SECURITY,
+        restbed::Logger::ERROR,    restbed::Logger::FATAL};
+    for (restbed::Logger::Level level : levels)
+    {
+        if (text == logLevelName(level))
+        {
+            return level;
+        }
+    }
+    throw std::runtime_error("Unknown log level " + text);
+}
+
+const char *logLevelName(restbed::Logger::Level level)
+{
+    switch (level)
+    {
+    case restbed::Logger::DEBUG:
+        return "debug";
+    case restbed::Logger::INFO:
+        return "info";
+    case restbed::Logger::WARNING:
+        return "warning";
+    case restbed::Logger::SECURITY:
+        return "security";
+    case restbed::Logger::ERROR:
+        return "error";
+    case restbed::Logger::FATAL:
+        return "fatal";
+    }
+    return "unknown";
+}
+
+} // namespace comicsdb
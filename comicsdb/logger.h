@@ -0,0 +1,94 @@
+#pragma once
+
+#include <restbed>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace comicsdb
+{
+
+enum class LogFormat
+{
+    TEXT,
+    BINARY
+};
+
+struct LogRecord;
+
+// Logger that never blocks the calling thread on I/O.  Each thread formats
+// its messages into its own single-producer ring buffer; a background thread
+// drains the rings to the output file.  Messages below the minimum level are
+// discarded before any formatting work is done and messages that don't fit in
+// a full ring are counted and dropped.
+//
+// The binary format is a fixed header per record (see LogRecordHeader)
+// followed by the message bytes, preceded once by the LOG_BINARY_MAGIC file
+// signature.
+class AsyncLogger : public restbed::Logger
+{
+  public:
+    AsyncLogger(Level minLevel, LogFormat format, const std::string &path);
+    ~AsyncLogger() override;
+
+    void stop() override;
+    void start(const std::shared_ptr<const restbed::Settings> &) override {}
+    void log(const Level level, const char *format, ...) override;
+    void log_if(bool expression, const Level level, const char *format,
+                ...) override;
+
+    void vlog(Level level, const char *format, std::va_list arguments);
+    bool enabled(Level level) const;
+    void flush();
+    std::uint64_t dropped() const;
+
+  private:
+    struct Ring;
+
+    Ring &localRing();
+    void drain();
+    bool drainOnce();
+    void write(const LogRecord &record, std::uint32_t thread);
+
+    const std::uint64_t m_instance;
+    const int m_minSeverity;
+    const LogFormat m_format;
+    std::FILE *m_out;
+    bool m_ownsOut;
+    mutable std::mutex m_ringsMutex;
+    std::vector<std::shared_ptr<Ring>> m_rings;
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_drained;
+    std::atomic<bool> m_idle{false};
+    std::atomic<bool> m_stopping{false};
+    std::atomic<std::uint64_t> m_flushRequests{0};
+    std::uint64_t m_flushesDone{0};
+    std::uint64_t m_droppedReported{0};
+    std::thread m_thread;
+};
+
+constexpr char LOG_BINARY_MAGIC[8] = {'C', 'D', 'B', 'L', 'O', 'G', '1', '\n'};
+
+// Native-endian record header of the binary log format.
+struct LogRecordHeader
+{
+    std::uint64_t timestamp; // nanoseconds since the Unix epoch
+    std::int32_t level;      // restbed::Logger::Level
+    std::uint32_t thread;    // ring index, stable for the life of a thread
+    std::uint32_t length;    // number of message bytes that follow
+    std::uint32_t reserved;
+};
+
+restbed::Logger::Level parseLogLevel(const std::string &text);
+const char *logLevelName(restbed::Logger::Level level);
+
+} // namespace comicsdb
@@ -0,0 +1,1230 @@
+#include "lsm_store.h"
+
+#include "file_io.h"
+#include "varint.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+constexpr std::size_t BLOCK_SIZE = 4096;
+constexpr std::uint64_t BLOOM_BITS_PER_ID = 10;
+constexpr std::uint32_t BLOOM_HASHES = 7;
+
+// A merge starts once this many runs of similar size have piled up, or
+// with whatever is at hand once there are more than MAX_RUNS.
+constexpr std::size_t COMPACTION_FAN_IN = 4;
+constexpr std::size_t MAX_RUNS = 12;
+
+// Roughly what a memtable entry costs beyond its strings.
+constexpr std::size_t MEMTABLE_ENTRY_OVERHEAD = 128;
+
+constexpr char RUN_MAGIC[8] = {'C', 'D', 'B', 'R', 'U', 'N', '1', '\n'};
+const char *const MANIFEST_HEADER = "comicsdb-lsm 1";
+
+// Where each data block is, in native byte order.
+struct BlockHandle
+{
+    std::uint64_t firstId;
+    std::uint64_t offset;
+    std::uint32_t size;
+    std::uint32_t reserved;
+};
+
+// The last bytes of a run file.  Blocks start at offset 0, followed by the
+// index, the filter and the ids section.  Each block entry is a varint id,
+// a varint of the value length shifted left once with the low bit set for
+// a deletion, and the comic's binary encoding.  The ids section holds, per
+// entry, a varint of the id's distance from the previous one shifted left
+// once with the same deletion bit.
+struct RunFooter
+{
+    std::uint64_t indexOffset;
+    std::uint64_t indexCount;
+    std::uint64_t bloomOffset;
+    std::uint64_t bloomWords;
+    std::uint64_t idsOffset;
+    std::uint64_t idsSize;
+    std::uint64_t count;
+    std::uint64_t minId;
+    std::uint64_t maxId;
+    std::uint32_t bloomHashes;
+    std::uint32_t reserved;
+    char magic[8];
+};
+
+std::uint64_t mix(std::uint64_t id)
+{
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    id *= 0xc4ceb9fe1a85ec53ULL;
+    id ^= id >> 33;
+    return id;
+}
+
+// Bit i of the bloom filter probes for id, by double hashing.
+std::uint64_t bloomBit(std::uint64_t hash, std::uint32_t i, std::uint64_t bits)
+{
+    return (hash + i * ((hash >> 32) | 1)) % bits;
+}
+
+// Writes a run file under a temporary name and renames it into place once
+// it is complete and synced.
+class RunWriter
+{
+  public:
+    explicit RunWriter(const std::string &path) :
+        m_path(path),
+        m_temp(path + ".tmp")
+    {
+        m_out = std::fopen(m_temp.c_str(), "wb");
+        if (m_out == nullptr)
+        {
+            throw std::runtime_error(errorText("Couldn't create", m_temp));
+        }
+        std::setvbuf(m_out, nullptr, _IOFBF, 1 << 20);
+    }
+
+    ~RunWriter()
+    {
+        if (m_out != nullptr)
+        {
+            std::fclose(m_out);
+            std::remove(m_temp.c_str());
+        }
+    }
+
+    RunWriter(const RunWriter &) = delete;
+    RunWriter &operator=(const RunWriter &) = delete;
+
+    // Ids must be added in increasing order.
+    void add(std::size_t id, bool erased, const std::string &value)
+    {
+        if (m_block.empty())
+        {
+            m_blockFirst = id;
+        }
+        appendVarint(id, m_block);
+        appendVarint((value.size() << 1) | (erased ? 1 : 0), m_block);
+        m_block += value;
+        if (m_block.size() >= BLOCK_SIZE)
+        {
+            writeBlock();
+        }
+
+        appendVarint(((id - m_lastId) << 1) | (erased ? 1 : 0), m_ids);
+        m_lastId = id;
+        if (m_count++ == 0)
+        {
+            m_minId = id;
+        }
+    }
+
+    void finish()
+    {
+        writeBlock();
+
+        RunFooter footer{};
+        footer.indexOffset = m_offset;
+        footer.indexCount = m_index.size();
+        write(reinterpret_cast<const char *>(m_index.data()),
+              m_index.size() * sizeof(BlockHandle));
+
+        std::vector<std::uint64_t> bloom(std::max<std::uint64_t>(
+            1, (m_count * BLOOM_BITS_PER_ID + 63) / 64));
+        const std::uint64_t bits = bloom.size() * 64;
+        const char *pos = m_ids.data();
+        const char *const end = pos + m_ids.size();
+        std::uint64_t id = 0;
+        std::uint64_t step = 0;
+        while (readVarint(pos, end, step))
+        {
+            id += step >> 1;
+            const std::uint64_t hash = mix(id);
+            for (std::uint32_t i = 0; i < BLOOM_HASHES; ++i)
+            {
+                const std::uint64_t bit = bloomBit(hash, i, bits);
+                bloom[bit / 64] |= std::uint64_t{1} << (bit % 64);
+            }
+        }
+        footer.bloomOffset = m_offset;
+        footer.bloomWords = bloom.size();
+        footer.bloomHashes = BLOOM_HASHES;
+        write(reinterpret_cast<const char *>(bloom.data()),
+              bloom.size() * sizeof(std::uint64_t));
+
+        footer.idsOffset = m_offset;
+        footer.idsSize = m_ids.size();
+        write(m_ids.data(), m_ids.size());
+
+        footer.count = m_count;
+        footer.minId = m_minId;
+        footer.maxId = m_lastId;
+        std::memcpy(footer.magic, RUN_MAGIC, sizeof(RUN_MAGIC));
+        write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+
+        const bool failed = std::fflush(m_out) != 0 ||
+                            ::fsync(::fileno(m_out)) != 0;
+        std::fclose(m_out);
+        m_out = nullptr;
+        if (failed || std::rename(m_temp.c_str(), m_path.c_str()) != 0)
+        {
+            const std::string error = errorText("Couldn't write", m_path);
+            std::remove(m_temp.c_str());
+            throw std::runtime_error(error);
+        }
+    }
+
+  private:
+    void writeBlock()
+    {
+        if (m_block.empty())
+        {
+            return;
+        }
+        m_index.push_back({m_blockFirst, m_offset,
+                           static_cast<std::uint32_t>(m_block.size()), 0});
+        write(m_block.data(), m_block.size());
+        m_block.clear();
+    }
+
+    void write(const char *data, std::size_t size)
+    {
+        if (size != 0 && std::fwrite(data, 1, size, m_out) != size)
+        {
+            throw std::runtime_error(errorText("Couldn't write", m_temp));
+        }
+        m_offset += size;
+    }
+
+    const std::string m_path;
+    const std::string m_temp;
+    std::FILE *m_out{};
+    std::uint64_t m_offset{};
+    std::string m_block;
+    std::uint64_t m_blockFirst{};
+    std::vector<BlockHandle> m_index;
+    std::string m_ids;
+    std::uint64_t m_count{};
+    std::uint64_t m_minId{};
+    std::uint64_t m_lastId{};
+};
+
+// Decodes the block entry at pos and advances past it.
+bool nextEntry(const char *&pos, const char *end, std::size_t &id,
+               bool &erased, std::string &value)
+{
+    std::uint64_t entryId = 0;
+    std::uint64_t sizeAndFlag = 0;
+    if (pos == end || !readVarint(pos, end, entryId) ||
+        !readVarint(pos, end, sizeAndFlag) ||
+        (sizeAndFlag >> 1) > static_cast<std::uint64_t>(end - pos))
+    {
+        return false;
+    }
+    id = static_cast<std::size_t>(entryId);
+    erased = (sizeAndFlag & 1) != 0;
+    value.assign(pos, static_cast<std::size_t>(sizeAndFlag >> 1));
+    pos += sizeAndFlag >> 1;
+    return true;
+}
+
+} // namespace
+
+// An immutable sorted run file.  The block index and bloom filter are held
+// in memory; blocks are read on demand.
+class LsmStore::Run
+{
+  public:
+    Run(const std::string &path, std::uint64_t number) :
+        m_path(path),
+        m_number(number)
+    {
+        m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (m_fd < 0)
+        {
+            throw std::runtime_error(errorText("Couldn't open", path));
+        }
+        try
+        {
+            load();
+        }
+        catch (...)
+        {
+            ::close(m_fd);
+            throw;
+        }
+    }
+
+    ~Run() { ::close(m_fd); }
+
+    Run(const Run &) = delete;
+    Run &operator=(const Run &) = delete;
+
+    const std::string &path() const { return m_path; }
+    std::uint64_t number() const { return m_number; }
+    std::uint64_t fileSize() const { return m_fileSize; }
+    std::size_t blocks() const { return m_index.size(); }
+
+    // Looks up id, reading at most one block.
+    bool find(std::size_t id, bool &erased, std::string &value) const
+    {
+        if (m_footer.count == 0 || id < m_footer.minId ||
+            id > m_footer.maxId || !mayContain(id))
+        {
+            return false;
+        }
+        auto block = std::upper_bound(
+            m_index.begin(), m_index.end(), std::uint64_t{id},
+            [](std::uint64_t lhs, const BlockHandle &rhs)
+            { return lhs < rhs.firstId; });
+        if (block == m_index.begin())
+        {
+            return false;
+        }
+        const std::string bytes = readBlock(block - m_index.begin() - 1);
+        const char *pos = bytes.data();
+        const char *const end = pos + bytes.size();
+        std::size_t entryId = 0;
+        while (nextEntry(pos, end, entryId, erased, value) && entryId <= id)
+        {
+            if (entryId == id)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string readBlock(std::size_t block) const
+    {
+        const BlockHandle &handle = m_index[block];
+        std::string bytes(handle.size, '\0');
+        readFully(m_fd, &bytes[0], bytes.size(), handle.offset, m_path);
+        return bytes;
+    }
+
+    // Calls visit for every entry's id in order, reading only the ids
+    // section.
+    void ids(const std::function<void(std::size_t id, bool erased)> &visit)
+        const
+    {
+        std::string bytes(m_footer.idsSize, '\0');
+        readFully(m_fd, &bytes[0], bytes.size(), m_footer.idsOffset, m_path);
+        const char *pos = bytes.data();
+        const char *const end = pos + bytes.size();
+        std::uint64_t id = 0;
+        std::uint64_t step = 0;
+        while (pos != end)
+        {
+            if (!readVarint(pos, end, step))
+            {
+                throw std::runtime_error("Corrupt run " + m_path);
+            }
+            id += step >> 1;
+            visit(static_cast<std::size_t>(id), (step & 1) != 0);
+        }
+    }
+
+    std::uint64_t maxId() const { return m_footer.maxId; }
+    std::uint64_t count() const { return m_footer.count; }
+
+  private:
+    void load()
+    {
+        struct stat status{};
+        if (::fstat(m_fd, &status) != 0)
+        {
+            throw std::runtime_error(errorText("Couldn't stat", m_path));
+        }
+        m_fileSize = static_cast<std::uint64_t>(status.st_size);
+        if (m_fileSize < sizeof(RunFooter))
+        {
+            throw std::runtime_error("Corrupt run " + m_path);
+        }
+        readFully(m_fd, reinterpret_cast<char *>(&m_footer), sizeof(m_footer),
+                  m_fileSize - sizeof(RunFooter), m_path);
+        const std::uint64_t body = m_fileSize - sizeof(RunFooter);
+        if (std::memcmp(m_footer.magic, RUN_MAGIC, sizeof(RUN_MAGIC)) != 0 ||
+            m_footer.indexOffset > body ||
+            m_footer.indexCount >
+                (body - m_footer.indexOffset) / sizeof(BlockHandle) ||
+            m_footer.bloomOffset > body || m_footer.bloomWords == 0 ||
+            m_footer.bloomWords >
+                (body - m_footer.bloomOffset) / sizeof(std::uint64_t) ||
+            m_footer.idsOffset > body ||
+            m_footer.idsSize > body - m_footer.idsOffset)
+        {
+            throw std::runtime_error("Corrupt run " + m_path);
+        }
+
+        m_index.resize(m_footer.indexCount);
+        readFully(m_fd, reinterpret_cast<char *>(m_index.data()),
+                  m_index.size() * sizeof(BlockHandle), m_footer.indexOffset,
+                  m_path);
+        m_bloom.resize(m_footer.bloomWords);
+        readFully(m_fd, reinterpret_cast<char *>(m_bloom.data()),
+                  m_bloom.size() * sizeof(std::uint64_t), m_footer.bloomOffset,
+                  m_path);
+    }
+
+    bool mayContain(std::size_t id) const
+    {
+        const std::uint64_t bits = m_bloom.size() * 64;
+        const std::uint64_t hash = mix(id);
+        for (std::uint32_t i = 0; i < m_footer.bloomHashes; ++i)
+        {
+            const std::uint64_t bit = bloomBit(hash, i, bits);
+            if ((m_bloom[bit / 64] & (std::uint64_t{1} << (bit % 64))) == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const std::string m_path;
+    const std::uint64_t m_number;
+    int m_fd{-1};
+    std::uint64_t m_fileSize{};
+    RunFooter m_footer{};
+    std::vector<BlockHandle> m_index;
+    std::vector<std::uint64_t> m_bloom;
+};
+
+// Walks the entries of a memtable or run in id order.  value is the
+// comic's binary encoding, empty for a deletion.
+class LsmStore::Cursor
+{
+  public:
+    virtual ~Cursor() = default;
+    virtual void next() = 0;
+
+    bool valid{};
+    std::size_t id{};
+    bool erased{};
+    std::string value;
+};
+
+class LsmStore::MemtableCursor : public Cursor
+{
+  public:
+    explicit MemtableCursor(std::shared_ptr<const Memtable> memtable) :
+        m_memtable(std::move(memtable)),
+        m_it(m_memtable->begin())
+    {
+        next();
+    }
+
+    void next() override
+    {
+        valid = m_it != m_memtable->end();
+        if (!valid)
+        {
+            return;
+        }
+        id = m_it->first;
+        erased = m_it->second.issue == Comic::DELETED_ISSUE;
+        value = erased ? std::string{} : toBinary(m_it->second);
+        ++m_it;
+    }
+
+  private:
+    std::shared_ptr<const Memtable> m_memtable;
+    Memtable::const_iterator m_it;
+};
+
+class LsmStore::RunCursor : public Cursor
+{
+  public:
+    explicit RunCursor(RunPtr run) : m_run(std::move(run)) { next(); }
+
+    void next() override
+    {
+        while (!nextEntry(m_pos, m_end, id, erased, value))
+        {
+            if (m_block == m_run->blocks())
+            {
+                valid = false;
+                return;
+            }
+            m_bytes = m_run->readBlock(m_block++);
+            m_pos = m_bytes.data();
+            m_end = m_pos + m_bytes.size();
+        }
+        valid = true;
+    }
+
+  private:
+    RunPtr m_run;
+    std::size_t m_block{};
+    std::string m_bytes;
+    const char *m_pos{};
+    const char *m_end{};
+};
+
+LsmStore::LsmStore(const std::string &dir, std::size_t memtableBytes,
+                   LockProfiler &profiler, const Progress &progress) :
+    m_dir(dir),
+    m_memtableBytes(std::max<std::size_t>(memtableBytes, 1 << 20)),
+    m_progress(progress),
+    m_mutex(profiler)
+{
+    recover();
+    m_thread = std::thread([this] { background(); });
+}
+
+LsmStore::~LsmStore()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_workMutex);
+        m_stopping = true;
+    }
+    m_work.notify_one();
+    m_thread.join();
+}
+
+std::string LsmStore::path(std::uint64_t number, const char *suffix) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%06llu%s",
+                  static_cast<unsigned long long>(number), suffix);
+    return (std::filesystem::path{m_dir} / name).string();
+}
+
+void LsmStore::recover()
+{
+    std::error_code error;
+    std::filesystem::create_directories(m_dir, error);
+    if (error)
+    {
+        throw std::runtime_error("Couldn't create " + m_dir + ": " +
+                                 error.message());
+    }
+
+    std::vector<std::uint64_t> runs;
+    std::uint64_t logFloor = 0;
+    std::size_t nextId = 0;
+    const std::string manifest = m_dir + "/MANIFEST";
+    std::ifstream in(manifest);
+    if (in)
+    {
+        std::string line;
+        if (!std::getline(in, line) || line != MANIFEST_HEADER)
+        {
+            throw std::runtime_error(manifest + " isn't an LSM manifest");
+        }
+        std::string key;
+        std::uint64_t value{};
+        while (in >> key >> value)
+        {
+            if (key == "run")
+            {
+                runs.push_back(value);
+            }
+            else if (key == "log-floor")
+            {
+                logFloor = value;
+            }
+            else if (key == "next-id")
+            {
+                nextId = static_cast<std::size_t>(value);
+            }
+        }
+    }
+
+    // Anything the manifest doesn't account for was left by a crash.
+    std::vector<std::uint64_t> logs;
+    std::uint64_t lastFile = 0;
+    for (const auto &entry : std::filesystem::directory_iterator(m_dir))
+    {
+        const std::filesystem::path file = entry.path();
+        if (file.extension() == ".tmp")
+        {
+            std::filesystem::remove(file, error);
+            continue;
+        }
+        const std::string stem = file.stem().string();
+        if (stem.empty() ||
+            stem.find_first_not_of("0123456789") != std::string::npos)
+        {
+            continue;
+        }
+        const std::uint64_t number = std::stoull(stem);
+        lastFile = std::max(lastFile, number);
+        const bool keep =
+            (file.extension() == ".run" &&
+             std::find(runs.begin(), runs.end(), number) != runs.end()) ||
+            (file.extension() == ".wal" && number >= logFloor);
+        if (!keep)
+        {
+            std::filesystem::remove(file, error);
+        }
+        else if (file.extension() == ".wal")
+        {
+            logs.push_back(number);
+        }
+    }
+    m_nextFile = lastFile + 1;
+
+    for (std::uint64_t number : runs)
+    {
+        auto run = std::make_shared<const Run>(path(number, ".run"), number);
+        run->ids(
+            [this](std::size_t id, bool erased)
+            {
+                if (id >= m_live.size())
+                {
+                    m_live.resize(id + 1);
+                }
+                m_live[id] = !erased;
+            });
+        if (run->count() != 0)
+        {
+            nextId = std::max<std::size_t>(nextId, run->maxId() + 1);
+        }
+        m_runs.push_back(std::move(run));
+    }
+
+    // Only the newest log was being appended to when the engine stopped;
+    // the others were synced before it was opened, so a bad record in one of
+    // them is corruption.
+    std::sort(logs.begin(), logs.end());
+    for (std::uint64_t number : logs)
+    {
+        std::vector<RecordLog::Entry> entries;
+        const RecordLog log(path(number, ".wal"),
+                            [&entries](const RecordLog::Entry &entry)
+                            { entries.push_back(entry); },
+                            0, number != logs.back(), m_progress);
+        for (const RecordLog::Entry &entry : entries)
+        {
+            remember(entry.id,
+                     entry.erase ? Comic{} : log.read(entry.location));
+            nextId = std::max(nextId, entry.id + 1);
+        }
+        m_logs.push_back(number);
+    }
+    m_nextId = nextId;
+
+    openLog();
+    writeManifest();
+    if (m_memtableSize >= m_memtableBytes)
+    {
+        rotate();
+    }
+}
+
+void LsmStore::openLog()
+{
+    // Seal the previous log before a newer one exists.
+    if (m_log)
+    {
+        m_log->sync();
+    }
+    const std::uint64_t number = m_nextFile++;
+    m_log = std::make_unique<RecordLog>(path(number, ".wal"),
+                                        [](const RecordLog::Entry &) {});
+    m_logs.push_back(number);
+}
+
+void LsmStore::writeManifest()
+{
+    const std::string manifest = m_dir + "/MANIFEST";
+    const std::string temp = manifest + ".tmp";
+    std::FILE *out = std::fopen(temp.c_str(), "w");
+    if (out == nullptr)
+    {
+        throw std::runtime_error(errorText("Couldn't create", temp));
+    }
+    std::fprintf(out, "%s\nnext-id %llu\nlog-floor %llu\n", MANIFEST_HEADER,
+                 static_cast<unsigned long long>(m_nextId.load()),
+                 static_cast<unsigned long long>(
+                     m_flushingLogs.empty() ? m_logs.front()
+                                            : m_flushingLogs.front()));
+    for (const RunPtr &run : m_runs)
+    {
+        std::fprintf(out, "run %llu\n",
+                     static_cast<unsigned long long>(run->number()));
+    }
+    const bool failed = std::fflush(out) != 0 || ::fsync(::fileno(out)) != 0;
+    std::fclose(out);
+    if (failed || std::rename(temp.c_str(), manifest.c_str()) != 0)
+    {
+        throw std::runtime_error(errorText("Couldn't write", manifest));
+    }
+    syncDirectory(m_dir);
+}
+
+bool LsmStore::live(std::size_t id) const
+{
+    return id < m_live.size() && m_live[id];
+}
+
+bool LsmStore::importing(std::size_t id) const
+{
+    return std::any_of(m_importing.begin(), m_importing.end(),
+                       [id](const std::pair<std::size_t, std::size_t> &ids)
+                       { return ids.first <= id && id < ids.second; });
+}
+
+void LsmStore::remember(std::size_t id, Comic comic)
+{
+    const std::size_t size =
+        MEMTABLE_ENTRY_OVERHEAD + comic.title.size() + comic.writer.size() +
+        comic.penciler.size() + comic.inker.size() + comic.letterer.size() +
+        comic.colorist.size();
+    if (id >= m_live.size())
+    {
+        m_live.resize(id + 1);
+    }
+    m_live[id] = comic.issue != Comic::DELETED_ISSUE;
+
+    auto it = m_memtable.find(id);
+    if (it == m_memtable.end())
+    {
+        m_memtable.emplace(id, std::move(comic));
+    }
+    else
+    {
+        const Comic &old = it->second;
+        m_memtableSize -= MEMTABLE_ENTRY_OVERHEAD + old.title.size() +
+                          old.writer.size() + old.penciler.size() +
+                          old.inker.size() + old.letterer.size() +
+                          old.colorist.size();
+        it->second = std::move(comic);
+    }
+    m_memtableSize += size;
+}
+
+void LsmStore::waitForRoom()
+{
+    if (!m_stalled.load(std::memory_order_acquire) &&
+        !m_failed.load(std::memory_order_acquire))
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m_workMutex);
+    m_room.wait(lock, [this] { return !m_stalled || m_failed; });
+    if (m_failed)
+    {
+        throw std::runtime_error(m_failure);
+    }
+}
+
+void LsmStore::rotateIfFull()
+{
+    if (m_memtableSize < m_memtableBytes)
+    {
+        return;
+    }
+    if (!m_flushing)
+    {
+        rotate();
+        return;
+    }
+    // The previous memtable is still being written; hold off new writers.
+    std::unique_lock<std::mutex> lock(m_workMutex);
+    m_stalled = true;
+}
+
+void LsmStore::rotate()
+{
+    m_flushing = std::make_shared<const Memtable>(std::move(m_memtable));
+    m_memtable = Memtable{};
+    m_memtableSize = 0;
+    m_flushingLogs = std::move(m_logs);
+    m_logs.clear();
+    openLog();
+    {
+        std::unique_lock<std::mutex> lock(m_workMutex);
+        m_flushRequested = true;
+    }
+    m_work.notify_one();
+}
+
+bool LsmStore::get(std::size_t id, Comic &comic, const TracePtr &trace) const
+{
+    std::vector<RunPtr> runs;
+    {
+        ProfiledSharedLock lock(m_mutex, LockSite::READ_COMIC, trace);
+        if (!live(id))
+        {
+            return false;
+        }
+        auto it = m_memtable.find(id);
+        if (it != m_memtable.end() ||
+            (m_flushing && (it = m_flushing->find(id)) != m_flushing->end()))
+        {
+            comic = it->second;
+            return true;
+        }
+        runs = m_runs;
+    }
+
+    // Runs are immutable, so they are read without the lock.
+    TraceSpan span(trace, "read");
+    bool erased = false;
+    std::string value;
+    for (auto run = runs.rbegin(); run != runs.rend(); ++run)
+    {
+        if ((*run)->find(id, erased, value))
+        {
+            if (erased)
+            {
+                return false;
+            }
+            comic = fromBinary(value.data(), value.size());
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LsmStore::contains(std::size_t id) const
+{
+    ProfiledSharedLock lock(m_mutex, LockSite::READ_COMIC);
+    return live(id);
+}
+
+std::size_t LsmStore::create(const Comic &comic, const TracePtr &trace)
+{
+    waitForRoom();
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::CREATE_COMIC, trace);
+    const std::size_t id = m_nextId;
+    m_log->put(id, comic);
+    remember(id, comic);
+    m_nextId = id + 1;
+    rotateIfFull();
+    return id;
+}
+
+bool LsmStore::update(std::size_t id, const Comic &comic,
+                      const TracePtr &trace)
+{
+    waitForRoom();
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::UPDATE_COMIC, trace);
+    if (!live(id))
+    {
+        return false;
+    }
+    m_log->put(id, comic);
+    remember(id, comic);
+    rotateIfFull();
+    return true;
+}
+
+bool LsmStore::erase(std::size_t id, const TracePtr &trace)
+{
+    waitForRoom();
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::DELETE_COMIC, trace);
+    if (!live(id))
+    {
+        return false;
+    }
+    m_log->erase(id);
+    remember(id, Comic{});
+    rotateIfFull();
+    return true;
+}
+
+bool LsmStore::insert(std::size_t id, const Comic &comic,
+                      const TracePtr &trace)
+{
+    waitForRoom();
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::CREATE_COMIC, trace);
+    if (live(id) || importing(id))
+    {
+        return false;
+    }
+    m_log->put(id, comic);
+    remember(id, comic);
+    m_nextId = std::max<std::size_t>(m_nextId, id + 1);
+    rotateIfFull();
+    return true;
+}
+
+void LsmStore::merge(std::vector<std::unique_ptr<Cursor>> &newestFirst,
+                     bool dropErased,
+                     const std::function<void(const Cursor &)> &emit) const
+{
+    while (true)
+    {
+        // On equal ids the newest cursor wins.
+        Cursor *winner = nullptr;
+        for (const std::unique_ptr<Cursor> &cursor : newestFirst)
+        {
+            if (cursor->valid && (winner == nullptr || cursor->id < winner->id))
+            {
+                winner = cursor.get();
+            }
+        }
+        if (winner == nullptr)
+        {
+            return;
+        }
+        if (!dropErased || !winner->erased)
+        {
+            emit(*winner);
+        }
+        const std::size_t id = winner->id;
+        for (const std::unique_ptr<Cursor> &cursor : newestFirst)
+        {
+            if (cursor->valid && cursor->id == id)
+            {
+                cursor->next();
+            }
+        }
+    }
+}
+
+void LsmStore::scan(
+    const std::function<void(std::size_t, const Comic &)> &visit) const
+{
+    std::vector<std::unique_ptr<Cursor>> cursors;
+    {
+        ProfiledSharedLock lock(m_mutex, LockSite::EXPORT_COMICS);
+        cursors.push_back(std::make_unique<MemtableCursor>(
+            std::make_shared<const Memtable>(m_memtable)));
+        if (m_flushing)
+        {
+            cursors.push_back(std::make_unique<MemtableCursor>(m_flushing));
+        }
+        for (auto run = m_runs.rbegin(); run != m_runs.rend(); ++run)
+        {
+            cursors.push_back(std::make_unique<RunCursor>(*run));
+        }
+    }
+    merge(cursors, true,
+          [&visit](const Cursor &cursor)
+          {
+              visit(cursor.id,
+                    fromBinary(cursor.value.data(), cursor.value.size()));
+          });
+}
+
+std::vector<std::pair<std::size_t, Comic>> LsmStore::snapshot() const
+{
+    std::vector<std::pair<std::size_t, Comic>> comics;
+    scan([&comics](std::size_t id, const Comic &comic)
+         { comics.emplace_back(id, comic); });
+    return comics;
+}
+
+std::size_t LsmStore::importBatch(std::vector<Comic> comics)
+{
+    // Imports bypass the memtable and so never wait for room, but mustn't
+    // add runs once background work has stopped.
+    if (m_failed.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(m_workMutex);
+        throw std::runtime_error(m_failure);
+    }
+    std::size_t first{};
+    {
+        ProfiledLock lock(m_mutex, LockSite::IMPORT_COMICS);
+        first = m_nextId;
+        m_nextId = first + comics.size();
+        if (comics.empty())
+        {
+            return first;
+        }
+        m_importing.emplace_back(first, first + comics.size());
+    }
+    const auto release = [this, first]()
+    {
+        m_importing.erase(
+            std::find_if(m_importing.begin(), m_importing.end(),
+                         [first](const std::pair<std::size_t, std::size_t> &ids)
+                         { return ids.first == first; }));
+    };
+
+    // The ids are new and insert() refuses them until the run is installed,
+    // so nothing else can touch them and it doesn't matter where the run
+    // goes among the others.
+    const std::uint64_t number = m_nextFile++;
+    RunPtr run;
+    try
+    {
+        {
+            RunWriter writer(path(number, ".run"));
+            std::string value;
+            for (std::size_t i = 0; i < comics.size(); ++i)
+            {
+                value.clear();
+                appendBinary(comics[i], value);
+                writer.add(first + i, false, value);
+            }
+            writer.finish();
+        }
+        run = std::make_shared<const Run>(path(number, ".run"), number);
+    }
+    catch (...)
+    {
+        ProfiledLock lock(m_mutex, LockSite::IMPORT_COMICS);
+        release();
+        throw;
+    }
+
+    ProfiledLock lock(m_mutex, LockSite::IMPORT_COMICS);
+    release();
+    m_runs.push_back(std::move(run));
+    if (first + comics.size() > m_live.size())
+    {
+        m_live.resize(first + comics.size());
+    }
+    std::fill(m_live.begin() + first, m_live.begin() + first + comics.size(),
+              true);
+    writeManifest();
+    return first;
+}
+
+bool LsmStore::applyTransaction(std::vector<TransactionOp> &ops,
+                                std::size_t &failed, const TracePtr &trace)
+{
+    waitForRoom();
+    ProfiledLock lock(m_mutex, LockSite::TRANSACTION, trace);
+    TraceSpan apply(trace, "apply");
+
+    // Check every step against the state left by the steps before it.
+    std::size_t nextId = m_nextId;
+    std::unordered_map<std::size_t, bool> exists;
+    for (std::size_t i = 0; i < ops.size(); ++i)
+    {
+        TransactionOp &op = ops[i];
+        if (op.kind == TransactionOp::CREATE)
+        {
+            op.id = nextId++;
+            exists[op.id] = true;
+            continue;
+        }
+        auto it = exists.find(op.id);
+        if (it == exists.end())
+        {
+            it = exists.emplace(op.id, live(op.id)).first;
+        }
+        if (!it->second)
+        {
+            failed = i;
+            return false;
+        }
+        it->second = op.kind != TransactionOp::ERASE;
+    }
+
+    RecordLog::Batch batch(m_log->size());
+    for (const TransactionOp &op : ops)
+    {
+        if (op.kind == TransactionOp::ERASE)
+        {
+            batch.erase(op.id);
+        }
+        else
+        {
+            batch.put(op.id, op.comic);
+        }
+    }
+    m_log->append(batch);
+
+    for (TransactionOp &op : ops)
+    {
+        remember(op.id,
+                 op.kind == TransactionOp::ERASE ? Comic{} : op.comic);
+    }
+    m_nextId = nextId;
+    rotateIfFull();
+    return true;
+}
+
+void LsmStore::maintain()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_workMutex);
+        m_compactRequested = true;
+    }
+    m_work.notify_one();
+}
+
+void LsmStore::background()
+{
+    while (true)
+    {
+        bool flushing = false;
+        bool compacting = false;
+        {
+            std::unique_lock<std::mutex> lock(m_workMutex);
+            m_work.wait(lock,
+                        [this]
+                        {
+                            return m_stopping || m_flushRequested ||
+                                   m_compactRequested;
+                        });
+            if (m_stopping)
+            {
+                return;
+            }
+            flushing = std::exchange(m_flushRequested, false);
+            compacting = std::exchange(m_compactRequested, false);
+        }
+
+        try
+        {
+            if (flushing)
+            {
+                flush();
+            }
+            while (compacting && compact())
+            {
+                std::unique_lock<std::mutex> lock(m_workMutex);
+                compacting = !m_stopping && !m_flushRequested;
+            }
+        }
+        catch (const std::exception &bang)
+        {
+            // Writes fail from now on rather than piling up in memory.
+            {
+                std::unique_lock<std::mutex> lock(m_workMutex);
+                m_failure = std::string{"LSM background work failed: "} +
+                            bang.what();
+                m_failed = true;
+            }
+            m_room.notify_all();
+            return;
+        }
+    }
+}
+
+void LsmStore::flush()
+{
+    std::shared_ptr<const Memtable> memtable;
+    {
+        ProfiledSharedLock lock(m_mutex, LockSite::MAINTENANCE);
+        memtable = m_flushing;
+    }
+    if (!memtable)
+    {
+        return;
+    }
+
+    const std::uint64_t number = m_nextFile++;
+    {
+        RunWriter writer(path(number, ".run"));
+        for (MemtableCursor cursor(memtable); cursor.valid; cursor.next())
+        {
+            writer.add(cursor.id, cursor.erased, cursor.value);
+        }
+        writer.finish();
+    }
+    auto run = std::make_shared<const Run>(path(number, ".run"), number);
+
+    std::vector<std::uint64_t> flushed;
+    {
+        ProfiledLock lock(m_mutex, LockSite::MAINTENANCE);
+        m_runs.push_back(std::move(run));
+        m_flushing.reset();
+        flushed.swap(m_flushingLogs);
+        writeManifest();
+        if (m_memtableSize >= m_memtableBytes)
+        {
+            rotate();
+        }
+    }
+    for (std::uint64_t log : flushed)
+    {
+        std::remove(path(log, ".wal").c_str());
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_workMutex);
+        m_stalled = false;
+    }
+    m_room.notify_all();
+}
+
+bool LsmStore::compact()
+{
+    std::vector<RunPtr> runs;
+    {
+        ProfiledSharedLock lock(m_mutex, LockSite::MAINTENANCE);
+        runs = m_runs;
+    }
+
+    // Merge the newest runs while each older one is at most twice the size
+    // of those already picked, so every byte is rewritten a logarithmic
+    // number of times.
+    const std::size_t total = runs.size();
+    if (total < 2)
+    {
+        return false;
+    }
+    std::size_t count = 1;
+    std::uint64_t size = runs[total - 1]->fileSize();
+    while (count < total && runs[total - 1 - count]->fileSize() <= 2 * size)
+    {
+        size += runs[total - 1 - count]->fileSize();
+        ++count;
+    }
+    if (count < COMPACTION_FAN_IN)
+    {
+        if (total <= MAX_RUNS)
+        {
+            return false;
+        }
+        count = std::max<std::size_t>(count, 2);
+    }
+    const std::size_t first = total - count;
+
+    std::vector<std::unique_ptr<Cursor>> cursors;
+    for (std::size_t i = total; i-- > first;)
+    {
+        cursors.push_back(std::make_unique<RunCursor>(runs[i]));
+    }
+    // Deletions only need keeping while an older run may hold the comic.
+    const bool dropErased = first == 0;
+    const std::uint64_t number = m_nextFile++;
+    {
+        RunWriter writer(path(number, ".run"));
+        merge(cursors, dropErased,
+              [&writer](const Cursor &cursor)
+              { writer.add(cursor.id, cursor.erased, cursor.value); });
+        writer.finish();
+    }
+    auto merged = std::make_shared<const Run>(path(number, ".run"), number);
+
+    {
+        // Only this thread removes runs and others only append them, so
+        // the inputs are still adjacent.
+        ProfiledLock lock(m_mutex, LockSite::MAINTENANCE);
+        auto input = std::find(m_runs.begin(), m_runs.end(), runs[first]);
+        input = m_runs.erase(input, input + count);
+        m_runs.insert(input, std::move(merged));
+        writeManifest();
+    }
+    // Readers still holding an input keep its file open.
+    for (std::size_t i = first; i < total; ++i)
+    {
+        std::remove(runs[i]->path().c_str());
+    }
+    return true;
+}
+
+} // namespace comicsdb
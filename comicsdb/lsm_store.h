@@ -0,0 +1,139 @@
+#pragma once
+
+#include "record_log.h"
+#include "storage.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+// Log-structured merge engine for catalogs larger than memory.  Writes go
+// to a write-ahead log and a sorted in-memory memtable; once the memtable
+// holds memtableBytes it is written out by a background thread as an
+// immutable sorted run file and its log is dropped.  Writers only wait if
+// the memtable fills again before that flush finishes.
+//
+// A run is a sequence of 4 KiB data blocks followed by an index of the
+// first id in each block, a bloom filter and the run's ids.  Only the index
+// and filter stay in memory, so a lookup that misses the memtable reads one
+// block from each run whose filter admits the id, usually just one.  A
+// bitmap of live ids, one bit per id, answers contains() and the existence
+// checks of updates and deletes without touching disk.
+//
+// maintain() asks the background thread to merge runs of similar size,
+// dropping versions that were replaced or deleted.  The live runs are
+// listed in a MANIFEST file that is replaced atomically, so a crash during
+// a flush, merge or import leaves the previous state plus the logs.
+class LsmStore : public StorageEngine
+{
+  public:
+    using Progress = std::function<void(const std::string &message)>;
+
+    // Opens or creates the engine in dir, replaying any logs left by a
+    // crash and reporting what recovery cut off.  Throws
+    // std::runtime_error if the files can't be used.
+    LsmStore(const std::string &dir, std::size_t memtableBytes,
+             LockProfiler &profiler, const Progress &progress = nullptr);
+    ~LsmStore() override;
+    LsmStore(const LsmStore &) = delete;
+    LsmStore &operator=(const LsmStore &) = delete;
+
+    const char *name() const override { return "lsm"; }
+
+    bool get(std::size_t id, Comic &comic,
+             const TracePtr &trace = nullptr) const override;
+    bool contains(std::size_t id) const override;
+    std::size_t create(const Comic &comic,
+                       const TracePtr &trace = nullptr) override;
+    bool update(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+    bool erase(std::size_t id, const TracePtr &trace = nullptr) override;
+    bool insert(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+
+    // Merges the memtables and every run as of the call.
+    void scan(const std::function<void(std::size_t, const Comic &)> &visit)
+        const override;
+    std::vector<std::pair<std::size_t, Comic>> snapshot() const override;
+    // Writes the comics straight to a new run instead of the memtable.
+    // insert() refuses the batch's ids while the run is being written.
+    std::size_t importBatch(std::vector<Comic> comics) override;
+    bool applyTransaction(std::vector<TransactionOp> &ops, std::size_t &failed,
+                          const TracePtr &trace = nullptr) override;
+
+    std::size_t nextId() const override { return m_nextId.load(); }
+
+    void maintain() override;
+
+  private:
+    class Run;
+    class Cursor;
+    class MemtableCursor;
+    class RunCursor;
+
+    // A comic with DELETED_ISSUE records a deletion.
+    using Memtable = std::map<std::size_t, Comic>;
+    using RunPtr = std::shared_ptr<const Run>;
+
+    std::string path(std::uint64_t number, const char *suffix) const;
+    void recover();
+    void openLog();
+    void writeManifest();
+
+    bool live(std::size_t id) const;
+    bool importing(std::size_t id) const;
+    void remember(std::size_t id, Comic comic);
+    void waitForRoom();
+    void rotateIfFull();
+    void rotate();
+
+    void background();
+    void flush();
+    bool compact();
+    void merge(std::vector<std::unique_ptr<Cursor>> &newestFirst,
+               bool dropErased,
+               const std::function<void(const Cursor &)> &emit) const;
+
+    const std::string m_dir;
+    const std::size_t m_memtableBytes;
+    const Progress m_progress;
+
+    // Guards everything below but the file counter and the work state.
+    mutable ProfiledMutex m_mutex;
+    Memtable m_memtable;
+    std::size_t m_memtableSize{};
+    std::shared_ptr<const Memtable> m_flushing; // being written to a run
+    std::vector<RunPtr> m_runs;                 // oldest first
+    std::vector<bool> m_live;
+    // The first and end ids of the imports whose runs aren't installed.
+    std::vector<std::pair<std::size_t, std::size_t>> m_importing;
+    std::atomic<std::size_t> m_nextId{0}; // written under m_mutex
+    std::unique_ptr<RecordLog> m_log;
+    std::vector<std::uint64_t> m_logs;         // hold the memtable
+    std::vector<std::uint64_t> m_flushingLogs; // hold m_flushing
+    std::atomic<std::uint64_t> m_nextFile{1};
+
+    std::mutex m_workMutex;
+    std::condition_variable m_work;
+    std::condition_variable m_room;
+    bool m_flushRequested{};
+    bool m_compactRequested{};
+    bool m_stopping{};
+    std::atomic<bool> m_stalled{false}; // written under m_workMutex
+    std::string m_failure;              // why background work stopped
+    std::atomic<bool> m_failed{false};  // written under m_workMutex
+    std::thread m_thread;
+};
+
+} // namespace comicsdb
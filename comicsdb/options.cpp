@@ -0,0 +1,323 @@
+#include "options.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+const char *const USAGE = "Usage: comicsdb [options]\n"
+                          "  --port PORT         listen on PORT (default 80)\n"
+                          "  --workers N         request threads (default 1)\n"
+                          "  --shards N          independently locked store "
+                          "shards (default 16)\n"
+                          "  --engine NAME       memory, log, lsm or shared "
+                          "(default memory)\n"
+                          "  --data-dir DIR      persistent engine data "
+                          "(default comicsdb-data)\n"
+                          "  --memtable-mb N     lsm memtable limit (default "
+                          "64)\n"
+                          "  --shared-mb N       shared engine size, fixed "
+                          "when created (default 1024)\n"
+                          "  --processes N       serve the shared engine from "
+                          "N processes on\n"
+                          "                      consecutive ports (default "
+                          "1)\n"
+                          "  --snapshot-every S  snapshot the memory engine "
+                          "every S seconds\n"
+                          "  --follow HOST:PORT  serve a read-only replica of "
+                          "that leader\n"
+                          "  --replication-buffer N\n"
+                          "                      changes kept for followers "
+                          "(default 1000000)\n"
+                          "  --read-target-ms N  shed reads once requests have "
+                          "queued longer\n"
+                          "                      than N ms for an interval "
+                          "(default 0, never)\n"
+                          "  --write-target-ms N the same for writes\n"
+                          "  --shed-interval-ms N\n"
+                          "                      how long the target may be "
+                          "exceeded (default 100)\n"
+                          "  --rate-limit PREFIX=RATE[:BURST]\n"
+                          "                      limit each client to RATE "
+                          "requests a second\n"
+                          "                      to paths starting with "
+                          "PREFIX, may be repeated\n"
+                          "  --api-keys PATH     X-API-Keys, one a line, that "
+                          "identify clients\n"
+                          "                      instead of their address\n"
+                          "  --max-body-kb N     largest comic or transaction "
+                          "(default 64)\n"
+                          "  --max-import-mb N   largest import (default "
+                          "256)\n"
+                          "  --idempotency-keys N\n"
+                          "                      Idempotency-Keys remembered, "
+                          "0 ignores them\n"
+                          "                      (default 100000)\n"
+                          "  --idempotency-ttl S how long each is remembered "
+                          "(default 86400)\n"
+                          "  --unique-titles     refuse a second comic with "
+                          "the same title and issue\n"
+                          "  --analytics-max-age S\n"
+                          "                      rebuild the analytics "
+                          "snapshot once older (default 60)\n"
+                          "  --preload PATH      load the catalog from a JSON "
+                          "lines file\n"
+                          "  --empty             start without the sample "
+                          "comics\n"
+                          "  --trace-sample N    trace one request in N, 0 "
+                          "disables (default 100)\n"
+                          "  --trace-buffer N    traces kept for /admin/traces "
+                          "(default 1024)\n"
+                          "  --log-level LEVEL   debug, info, warning, "
+                          "security, error or fatal\n"
+                          "  --log-format FORMAT text or binary\n"
+                          "  --log-file PATH     log to PATH instead of "
+                          "stderr\n";
+
+std::string value(int argc, char *argv[], int &i)
+{
+    const std::string option = argv[i];
+    if (i + 1 >= argc)
+    {
+        throw std::runtime_error("Missing value for " + option + "\n" + USAGE);
+    }
+    return argv[++i];
+}
+
+unsigned long number(int argc, char *argv[], int &i, unsigned long max)
+{
+    const std::string option = argv[i];
+    const std::string text = value(argc, argv, i);
+    std::size_t end{};
+    unsigned long result{};
+    try
+    {
+        result = std::stoul(text, &end);
+    }
+    catch (const std::exception &)
+    {
+        end = 0;
+    }
+    if (end != text.size() || result > max)
+    {
+        throw std::runtime_error("Invalid value " + text + " for " + option +
+                                 "\n" + USAGE);
+    }
+    return result;
+}
+
+} // namespace
+
+Options parseCommandLine(int argc, char *argv[])
+{
+    Options options;
+    options.arguments.assign(argv, argv + argc);
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--port")
+        {
+            options.port =
+                static_cast<std::uint16_t>(number(argc, argv, i, 65535));
+        }
+        else if (arg == "--workers")
+        {
+            options.workers =
+                static_cast<unsigned>(std::max(1UL, number(argc, argv, i, 1024)));
+        }
+        else if (arg == "--shards")
+        {
+            options.shards = std::max(1UL, number(argc, argv, i, 65536));
+        }
+        else if (arg == "--engine")
+        {
+            const std::string engine = value(argc, argv, i);
+            try
+            {
+                options.engine = parseEngineKind(engine);
+            }
+            catch (const std::exception &bang)
+            {
+                throw std::runtime_error(bang.what() + std::string{"\n"} +
+                                         USAGE);
+            }
+        }
+        else if (arg == "--data-dir")
+        {
+            options.dataDir = value(argc, argv, i);
+        }
+        else if (arg == "--memtable-mb")
+        {
+            options.memtableMegabytes =
+                std::max(1UL, number(argc, argv, i, 65536));
+        }
+        else if (arg == "--shared-mb")
+        {
+            options.sharedMegabytes =
+                std::max(1UL, number(argc, argv, i, 1UL << 20));
+        }
+        else if (arg == "--processes")
+        {
+            options.processes = static_cast<unsigned>(
+                std::max(1UL, number(argc, argv, i, 256)));
+        }
+        else if (arg == "--process-index")
+        {
+            // Added by the writer when it starts its reader processes.
+            options.processIndex =
+                static_cast<unsigned>(number(argc, argv, i, 255));
+        }
+        else if (arg == "--snapshot-every")
+        {
+            options.snapshotSeconds =
+                static_cast<unsigned>(number(argc, argv, i, 86400 * 7));
+        }
+        else if (arg == "--follow")
+        {
+            options.follow = value(argc, argv, i);
+            const std::size_t colon = options.follow.rfind(':');
+            if (colon == 0 || colon == std::string::npos ||
+                options.follow.find_first_not_of("0123456789", colon + 1) !=
+                    std::string::npos ||
+                colon + 1 == options.follow.size() ||
+                colon + 6 < options.follow.size() ||
+                std::stoul(options.follow.substr(colon + 1)) > 65535)
+            {
+                throw std::runtime_error("Invalid leader " + options.follow +
+                                         ", expected HOST:PORT\n" + USAGE);
+            }
+        }
+        else if (arg == "--replication-buffer")
+        {
+            options.replicationBuffer =
+                std::max(1UL, number(argc, argv, i, 1UL << 30));
+        }
+        else if (arg == "--read-target-ms")
+        {
+            options.readTargetMs =
+                static_cast<unsigned>(number(argc, argv, i, 60000));
+        }
+        else if (arg == "--write-target-ms")
+        {
+            options.writeTargetMs =
+                static_cast<unsigned>(number(argc, argv, i, 60000));
+        }
+        else if (arg == "--shed-interval-ms")
+        {
+            options.shedIntervalMs = static_cast<unsigned>(
+                std::max(1UL, number(argc, argv, i, 60000)));
+        }
+        else if (arg == "--rate-limit")
+        {
+            const std::string limit = value(argc, argv, i);
+            try
+            {
+                options.rateLimits.push_back(parseRateLimit(limit));
+            }
+            catch (const std::runtime_error &bang)
+            {
+                throw std::runtime_error(bang.what() + std::string{"\n"} +
+                                         USAGE);
+            }
+        }
+        else if (arg == "--api-keys")
+        {
+            options.apiKeys = value(argc, argv, i);
+        }
+        else if (arg == "--max-body-kb")
+        {
+            options.maxBodyKilobytes = static_cast<unsigned>(
+                std::max(1UL, number(argc, argv, i, 1UL << 20)));
+        }
+        else if (arg == "--max-import-mb")
+        {
+            options.maxImportMegabytes = static_cast<unsigned>(
+                std::max(1UL, number(argc, argv, i, 1UL << 20)));
+        }
+        else if (arg == "--idempotency-keys")
+        {
+            options.idempotencyKeys = number(argc, argv, i, 1UL << 30);
+        }
+        else if (arg == "--idempotency-ttl")
+        {
+            options.idempotencySeconds = static_cast<unsigned>(
+                std::max(1UL, number(argc, argv, i, 86400 * 30)));
+        }
+        else if (arg == "--unique-titles")
+        {
+            options.uniqueTitles = true;
+        }
+        else if (arg == "--analytics-max-age")
+        {
+            options.analyticsMaxAgeSeconds = static_cast<unsigned>(
+                number(argc, argv, i, 86400 * 30));
+        }
+        else if (arg == "--preload")
+        {
+            options.preload = value(argc, argv, i);
+        }
+        else if (arg == "--empty")
+        {
+            options.empty = true;
+        }
+        else if (arg == "--trace-sample")
+        {
+            options.traceSampleEvery = static_cast<unsigned>(
+                number(argc, argv, i, std::numeric_limits<unsigned>::max()));
+        }
+        else if (arg == "--trace-buffer")
+        {
+            options.traceCapacity = number(argc, argv, i, 1000000);
+        }
+        else if (arg == "--log-level")
+        {
+            options.logLevel = parseLogLevel(value(argc, argv, i));
+        }
+        else if (arg == "--log-format")
+        {
+            const std::string format = value(argc, argv, i);
+            if (format == "text")
+            {
+                options.logFormat = LogFormat::TEXT;
+            }
+            else if (format == "binary")
+            {
+                options.logFormat = LogFormat::BINARY;
+            }
+            else
+            {
+                throw std::runtime_error("Unknown log format " + format +
+                                         "\n" + USAGE);
+            }
+        }
+        else if (arg == "--log-file")
+        {
+            options.logFile = value(argc, argv, i);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg + "\n" + USAGE);
+        }
+    }
+    if (options.processes > 1 && options.engine != EngineKind::SHARED)
+    {
+        throw std::runtime_error("--processes needs the shared engine\n" +
+                                 std::string{USAGE});
+    }
+    if (options.port + options.processes - 1 > 65535)
+    {
+        throw std::runtime_error("Not enough ports above " +
+                                 std::to_string(options.port) + " for " +
+                                 std::to_string(options.processes) +
+                                 " processes");
+    }
+    return options;
+}
+
+} // namespace comicsdb
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "logger.h"
+#include "rate_limit.h"
+#include "storage.h"
+
+#include <restbed>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace comicsdb
+{
+
+struct Options
+{
+    std::uint16_t port{80};
+    unsigned workers{1};
+    std::size_t shards{16};
+    EngineKind engine{EngineKind::MEMORY};
+    std::string dataDir{"comicsdb-data"};
+    std::size_t memtableMegabytes{64};
+    std::size_t sharedMegabytes{1024};
+    unsigned processes{1};
+    unsigned processIndex{}; // set for the reader processes, 0 is the writer
+    unsigned snapshotSeconds{}; // 0 disables scheduled snapshots
+    std::string follow;         // HOST:PORT of the leader to replicate
+    std::size_t replicationBuffer{1000000};
+    unsigned readTargetMs{};  // 0 never sheds reads
+    unsigned writeTargetMs{}; // 0 never sheds writes
+    unsigned shedIntervalMs{100};
+    std::vector<RateLimit> rateLimits;
+    std::string apiKeys; // file of the X-API-Keys that identify clients
+    unsigned maxBodyKilobytes{64};       // of a comic or a transaction
+    unsigned maxImportMegabytes{256};    // of an import
+    std::size_t idempotencyKeys{100000}; // 0 ignores Idempotency-Key
+    unsigned idempotencySeconds{86400};
+    bool uniqueTitles{};
+    unsigned analyticsMaxAgeSeconds{60}; // of the columnar snapshot
+    std::string preload;
+    bool empty{}; // start without the sample comics
+    unsigned traceSampleEvery{100};
+    std::size_t traceCapacity{1024};
+    restbed::Logger::Level logLevel{restbed::Logger::INFO};
+    LogFormat logFormat{LogFormat::TEXT};
+    std::string logFile;
+    std::vector<std::string> arguments; // the command line, to start readers
+};
+
+Options parseCommandLine(int argc, char *argv[]);
+
+} // namespace comicsdb
@@ -0,0 +1,122 @@
+#include "process_group.h"
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <stdexcept>
+
+namespace comicsdb
+{
+
+ProcessGroup::ProcessGroup(const std::vector<std::string> &arguments,
+                           unsigned readers, AsyncLogger &logger) :
+    m_arguments(arguments),
+    m_logger(logger)
+{
+    try
+    {
+        for (unsigned index = 1; index <= readers; ++index)
+        {
+            m_pids.push_back(spawn(index));
+        }
+    }
+    catch (...)
+    {
+        stop();
+        throw;
+    }
+}
+
+ProcessGroup::~ProcessGroup()
+{
+    stop();
+}
+
+void ProcessGroup::stop()
+{
+    for (pid_t &pid : m_pids)
+    {
+        if (pid > 0)
+        {
+            ::kill(pid, SIGTERM);
+        }
+    }
+    for (pid_t &pid : m_pids)
+    {
+        if (pid > 0)
+        {
+            ::waitpid(pid, nullptr, 0);
+            pid = 0;
+        }
+    }
+}
+
+pid_t ProcessGroup::spawn(unsigned index)
+{
+    // Everything the child needs is built first; between fork and exec a
+    // child of a threaded process may only make system calls.
+    std::vector<std::string> arguments = m_arguments;
+    arguments.push_back("--process-index");
+    arguments.push_back(std::to_string(index));
+    std::vector<char *> argv;
+    for (std::string &argument : arguments)
+    {
+        argv.push_back(&argument[0]);
+    }
+    argv.push_back(nullptr);
+    const pid_t parent = ::getpid();
+
+    const pid_t child = ::fork();
+    if (child < 0)
+    {
+        throw std::runtime_error(std::string{"Couldn't fork: "} +
+                                 std::strerror(errno));
+    }
+    if (child == 0)
+    {
+        ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (::getppid() != parent)
+        {
+            ::_exit(1);
+        }
+        ::execv("/proc/self/exe", argv.data());
+        ::_exit(127);
+    }
+    return child;
+}
+
+void ProcessGroup::poll()
+{
+    for (std::size_t i = 0; i < m_pids.size(); ++i)
+    {
+        int status = 0;
+        if (m_pids[i] > 0)
+        {
+            if (::waitpid(m_pids[i], &status, WNOHANG) <= 0)
+            {
+                continue;
+            }
+            m_logger.log(restbed::Logger::ERROR,
+                         "Reader process %zu exited with status %d, "
+                         "restarting",
+                         i + 1,
+                         WIFEXITED(status) ? WEXITSTATUS(status)
+                                           : 128 + WTERMSIG(status));
+        }
+        try
+        {
+            m_pids[i] = spawn(static_cast<unsigned>(i + 1));
+        }
+        catch (const std::exception &bang)
+        {
+            m_pids[i] = 0; // tried again on the next poll
+            m_logger.log(restbed::Logger::ERROR, "%s", bang.what());
+        }
+    }
+}
+
+} // namespace comicsdb
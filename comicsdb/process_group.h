@@ -0,0 +1,39 @@
+#pragma once
+
+#include "logger.h"
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+namespace comicsdb
+{
+
+// The reader processes of --processes: copies of this program started with
+// --process-index 1, 2 and so on, restarted when they exit and stopped when
+// the group is destroyed.  Each is sent SIGTERM if the writer dies.
+class ProcessGroup
+{
+  public:
+    // arguments is the writer's command line, program name first.  Throws
+    // std::runtime_error if a process can't be started.
+    ProcessGroup(const std::vector<std::string> &arguments, unsigned readers,
+                 AsyncLogger &logger);
+    ~ProcessGroup();
+    ProcessGroup(const ProcessGroup &) = delete;
+    ProcessGroup &operator=(const ProcessGroup &) = delete;
+
+    // Restarts any reader that has exited.
+    void poll();
+
+  private:
+    pid_t spawn(unsigned index);
+    void stop();
+
+    const std::vector<std::string> m_arguments;
+    AsyncLogger &m_logger;
+    std::vector<pid_t> m_pids; // [i] has process index i + 1, 0 if down
+};
+
+} // namespace comicsdb
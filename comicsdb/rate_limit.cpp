@@ -0,0 +1,201 @@
+#include "rate_limit.h"
+
+#include "hash.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+double positive(const std::string &text, const std::string &limit)
+{
+    std::size_t end{};
+    double result{};
+    try
+    {
+        result = std::stod(text, &end);
+    }
+    catch (const std::exception &)
+    {
+        end = 0;
+    }
+    if (end == 0 || end != text.size() || !(result > 0) || result > 1e9)
+    {
+        throw std::runtime_error("Invalid rate limit " + limit +
+                                 ", expected PREFIX=RATE[:BURST]");
+    }
+    return result;
+}
+
+} // namespace
+
+RateLimit parseRateLimit(const std::string &text)
+{
+    const std::size_t equals = text.rfind('=');
+    if (equals == std::string::npos || text[0] != '/')
+    {
+        throw std::runtime_error("Invalid rate limit " + text +
+                                 ", expected PREFIX=RATE[:BURST]");
+    }
+    RateLimit limit;
+    limit.prefix = text.substr(0, equals);
+    const std::string value = text.substr(equals + 1);
+    const std::size_t colon = value.find(':');
+    limit.rate = positive(value.substr(0, colon), text);
+    limit.burst = colon == std::string::npos
+                      ? limit.rate
+                      : positive(value.substr(colon + 1), text);
+    // A bucket that can't hold one token would refuse everything.
+    limit.burst = std::max(limit.burst, 1.0);
+    return limit;
+}
+
+RateLimiter::RateLimiter(std::vector<RateLimit> limits) :
+    m_start(std::chrono::steady_clock::now()),
+    m_limits(std::move(limits))
+{
+    std::stable_sort(m_limits.begin(), m_limits.end(),
+                     [](const RateLimit &lhs, const RateLimit &rhs)
+                     { return lhs.prefix.size() > rhs.prefix.size(); });
+}
+
+std::int64_t RateLimiter::now() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - m_start)
+        .count();
+}
+
+RateLimiter::Decision RateLimiter::take(const std::string &path,
+                                        const std::string &client)
+{
+    Decision decision;
+    std::size_t index = 0;
+    while (index < m_limits.size() &&
+           path.compare(0, m_limits[index].prefix.size(),
+                        m_limits[index].prefix) != 0)
+    {
+        ++index;
+    }
+    if (index == m_limits.size())
+    {
+        return decision;
+    }
+    const RateLimit &limit = m_limits[index];
+    // Seeded with the limit so each limit has buckets of its own.
+    const std::uint64_t key = mix64(fnv1a(client, index));
+    const std::int64_t at = now();
+    double tokens{};
+    {
+        Shard &shard = m_shards[key % SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.buckets.find(key);
+        if (it == shard.buckets.end())
+        {
+            it = shard.buckets.emplace(key, Bucket{limit.burst, at}).first;
+        }
+        Bucket &bucket = it->second;
+        bucket.tokens =
+            std::min(limit.burst,
+                     bucket.tokens + limit.rate * (at - bucket.updated) / 1e9);
+        bucket.updated = at;
+        decision.allowed = bucket.tokens >= 1;
+        if (decision.allowed)
+        {
+            bucket.tokens -= 1;
+        }
+        tokens = bucket.tokens;
+    }
+    decision.limited = true;
+    decision.limit = static_cast<unsigned>(limit.burst);
+    decision.remaining = static_cast<unsigned>(tokens);
+    if (!decision.allowed)
+    {
+        decision.resetSeconds =
+            static_cast<unsigned>(std::ceil((1 - tokens) / limit.rate));
+        decision.resetSeconds = std::max(decision.resetSeconds, 1U);
+        ++m_rejected;
+    }
+    else
+    {
+        ++m_allowed;
+    }
+    return decision;
+}
+
+void RateLimiter::sweep()
+{
+    // The burst of the most generous limit bounds every bucket, and its
+    // slowest rate bounds how long any takes to refill.
+    double slowest = 0;
+    double largest = 0;
+    for (const RateLimit &limit : m_limits)
+    {
+        slowest = slowest == 0 ? limit.rate : std::min(slowest, limit.rate);
+        largest = std::max(largest, limit.burst);
+    }
+    const std::int64_t at = now();
+    for (Shard &shard : m_shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto it = shard.buckets.begin(); it != shard.buckets.end();)
+        {
+            const Bucket &bucket = it->second;
+            if (bucket.tokens + slowest * (at - bucket.updated) / 1e9 >=
+                largest)
+            {
+                it = shard.buckets.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+}
+
+std::string RateLimiter::toJson() const
+{
+    std::size_t buckets = 0;
+    for (const Shard &shard : m_shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        buckets += shard.buckets.size();
+    }
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("limits");
+    writer.StartArray();
+    for (const RateLimit &limit : m_limits)
+    {
+        writer.StartObject();
+        writer.Key("prefix");
+        writer.String(limit.prefix.c_str());
+        writer.Key("rate");
+        writer.Double(limit.rate);
+        writer.Key("burst");
+        writer.Double(limit.burst);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.Key("buckets");
+    writer.Uint64(buckets);
+    writer.Key("allowed");
+    writer.Uint64(m_allowed.load());
+    writer.Key("rejected");
+    writer.Uint64(m_rejected.load());
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+} // namespace comicsdb
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace comicsdb
+{
+
+// A limit on the requests each client may make to the paths starting with
+// prefix: rate a second on average, and bursts of up to burst at once.
+struct RateLimit
+{
+    std::string prefix;
+    double rate{};
+    double burst{};
+};
+
+// Parses PREFIX=RATE[:BURST], the burst defaulting to the rate.  Throws
+// std::runtime_error if it's malformed.
+RateLimit parseRateLimit(const std::string &text);
+
+// A token bucket per client and limit.  A request takes a token from its
+// client's bucket for the limit with the longest prefix of its path, and
+// the bucket refills at the limit's rate up to its burst.  The buckets are
+// spread over independently locked shards by a hash of the client and
+// limit, so requests from different clients rarely wait on each other, and
+// those on paths no limit covers touch nothing at all.
+class RateLimiter
+{
+  public:
+    struct Decision
+    {
+        bool allowed{true};
+        bool limited{};          // false if no limit covers the path
+        unsigned limit{};        // the burst
+        unsigned remaining{};    // whole tokens left
+        unsigned resetSeconds{}; // until the next token if not allowed
+    };
+
+    explicit RateLimiter(std::vector<RateLimit> limits);
+
+    bool enabled() const { return !m_limits.empty(); }
+    // client is an API key or an address.
+    Decision take(const std::string &path, const std::string &client);
+    // Forgets the buckets that have refilled, which behave like new ones.
+    void sweep();
+
+    std::string toJson() const;
+
+  private:
+    struct Bucket
+    {
+        double tokens{};
+        std::int64_t updated{}; // nanoseconds
+    };
+
+    struct alignas(64) Shard
+    {
+        mutable std::mutex mutex;
+        std::unordered_map<std::uint64_t, Bucket> buckets;
+    };
+
+    static constexpr std::size_t SHARDS = 64;
+
+    std::int64_t now() const;
+
+    const std::chrono::steady_clock::time_point m_start;
+    std::vector<RateLimit> m_limits; // longest prefix first
+    std::array<Shard, SHARDS> m_shards;
+    std::atomic<std::uint64_t> m_allowed{0};
+    std::atomic<std::uint64_t> m_rejected{0};
+};
+
+} // namespace comicsdb
@@ -0,0 +1,437 @@
+#include "record_log.h"
+
+#include "checksum.h"
+#include "file_io.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+constexpr char LOG_MAGIC[8] = {'C', 'D', 'B', 'L', 'O', 'G', '2', '\n'};
+
+// Ids beyond this can only come from a corrupt log.
+constexpr std::uint64_t MAX_ID = std::uint64_t{1} << 40;
+
+enum RecordKind : std::uint32_t
+{
+    PUT_RECORD = 1,
+    ERASE_RECORD = 2,
+    // Nested records of the other kinds, applied all together.
+    BATCH_RECORD = 3
+};
+
+// Precedes each record's payload, in native byte order.  A put's payload
+// is the comic's binary encoding and an erase has none; a batch's payload
+// is its nested records, and its id field is how many there are.  The
+// checksum is the CRC-32C of the header, with the checksum zero, and the
+// payload, so a batch's covers its nested records too.
+struct RecordHeader
+{
+    std::uint32_t kind;
+    std::uint32_t checksum;
+    std::uint64_t id;
+    std::uint64_t length;
+};
+
+// How much of the file replay reads at a time.
+constexpr std::size_t REPLAY_WINDOW = 1 << 20;
+
+std::uint32_t checksum(const char *record)
+{
+    RecordHeader header;
+    std::memcpy(&header, record, sizeof(header));
+    header.checksum = 0;
+    return crc32c(record + sizeof(header), header.length,
+                  crc32c(&header, sizeof(header)));
+}
+
+// Fills in the checksum of the record at start in out.
+void seal(std::string &out, std::size_t start)
+{
+    const std::uint32_t crc = checksum(&out[start]);
+    std::memcpy(&out[start] + offsetof(RecordHeader, checksum), &crc,
+                sizeof(crc));
+}
+
+bool intact(const char *record)
+{
+    std::uint32_t stored;
+    std::memcpy(&stored, record + offsetof(RecordHeader, checksum),
+                sizeof(stored));
+    return checksum(record) == stored;
+}
+
+// Reads a file front to back through a window large enough to hold the
+// current record.
+class Scanner
+{
+  public:
+    Scanner(int fd, std::uint64_t size, const std::string &path) :
+        m_fd(fd),
+        m_size(size),
+        m_path(path)
+    {
+    }
+
+    // The length bytes at offset, which must be within the file.
+    const char *at(std::uint64_t offset, std::uint64_t length)
+    {
+        if (offset < m_start || offset + length > m_start + m_window.size())
+        {
+            m_start = offset;
+            m_window.resize(static_cast<std::size_t>(std::min<std::uint64_t>(
+                std::max<std::uint64_t>(length, REPLAY_WINDOW),
+                m_size - offset)));
+            readFully(m_fd, &m_window[0], m_window.size(), offset, m_path);
+        }
+        return m_window.data() + (offset - m_start);
+    }
+
+  private:
+    const int m_fd;
+    const std::uint64_t m_size;
+    const std::string &m_path;
+    std::string m_window;
+    std::uint64_t m_start{};
+};
+
+// Appends a put record to out, which starts at base in the log, and
+// returns where its comic will be.
+RecordLog::Location appendPut(std::string &out, std::uint64_t base,
+                              std::size_t id, const Comic &comic)
+{
+    const std::size_t start = out.size();
+    out.resize(start + sizeof(RecordHeader));
+    appendBinary(comic, out);
+    const RecordHeader header{PUT_RECORD, 0, id,
+                              out.size() - start - sizeof(RecordHeader)};
+    std::memcpy(&out[start], &header, sizeof(header));
+    seal(out, start);
+    return {base + start + sizeof(header),
+            static_cast<std::uint32_t>(header.length)};
+}
+
+void appendErase(std::string &out, std::size_t id)
+{
+    const std::size_t start = out.size();
+    const RecordHeader header{ERASE_RECORD, 0, id, 0};
+    out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    seal(out, start);
+}
+
+} // namespace
+
+RecordLog::Batch::Batch(std::uint64_t base) :
+    m_base(base),
+    m_bytes(sizeof(RecordHeader), '\0')
+{
+}
+
+RecordLog::Location RecordLog::Batch::put(std::size_t id, const Comic &comic)
+{
+    ++m_count;
+    return appendPut(m_bytes, m_base, id, comic);
+}
+
+void RecordLog::Batch::erase(std::size_t id)
+{
+    ++m_count;
+    appendErase(m_bytes, id);
+}
+
+RecordLog::RecordLog(const std::string &path,
+                     const std::function<void(const Entry &entry)> &replay,
+                     std::uint64_t from, bool sealed,
+                     const Report &report) :
+    m_path(path)
+{
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+    {
+        throw std::runtime_error(errorText("Couldn't open", path));
+    }
+    struct stat status{};
+    if (::fstat(m_fd, &status) != 0)
+    {
+        const std::string error = errorText("Couldn't stat", path);
+        ::close(m_fd);
+        throw std::runtime_error(error);
+    }
+    m_size = static_cast<std::uint64_t>(status.st_size);
+
+    try
+    {
+        if (m_size == 0)
+        {
+            write(std::string{LOG_MAGIC, sizeof(LOG_MAGIC)});
+        }
+        else
+        {
+            this->replay(replay, from, sealed, report);
+        }
+    }
+    catch (...)
+    {
+        ::close(m_fd);
+        throw;
+    }
+}
+
+RecordLog::~RecordLog()
+{
+    ::fsync(m_fd);
+    ::close(m_fd);
+}
+
+void RecordLog::replay(const std::function<void(const Entry &entry)> &apply,
+                       std::uint64_t from, bool sealed, const Report &report)
+{
+    char magic[sizeof(LOG_MAGIC)];
+    if (m_size < sizeof(magic))
+    {
+        throw std::runtime_error(m_path + " isn't a comics log");
+    }
+    readFully(m_fd, magic, sizeof(magic), 0, m_path);
+    if (std::memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0)
+    {
+        throw std::runtime_error(m_path + " isn't a comics log");
+    }
+    if (!apply)
+    {
+        return;
+    }
+
+    const auto corrupt = [this](std::uint64_t offset)
+    {
+        return std::runtime_error("Corrupt comics log " + m_path +
+                                  " at offset " + std::to_string(offset));
+    };
+    const auto applyRecord = [&](const RecordHeader &header,
+                                 std::uint64_t offset)
+    {
+        if (header.id >= MAX_ID ||
+            (header.kind == PUT_RECORD && header.length > UINT32_MAX) ||
+            (header.kind == ERASE_RECORD && header.length != 0) ||
+            (header.kind != PUT_RECORD && header.kind != ERASE_RECORD))
+        {
+            throw corrupt(offset);
+        }
+        apply({static_cast<std::size_t>(header.id),
+               header.kind == ERASE_RECORD,
+               {offset + sizeof(header),
+                static_cast<std::uint32_t>(header.length)}});
+    };
+
+    Scanner scanner(m_fd, m_size, m_path);
+    // The complete record at offset, or nullptr if it doesn't fit in the
+    // file or fails its checksum.
+    const auto record = [&](std::uint64_t offset, RecordHeader &header)
+        -> const char *
+    {
+        if (offset + sizeof(header) > m_size)
+        {
+            return nullptr;
+        }
+        std::memcpy(&header, scanner.at(offset, sizeof(header)),
+                    sizeof(header));
+        if (header.length > m_size - offset - sizeof(header))
+        {
+            return nullptr;
+        }
+        const char *bytes = scanner.at(offset, sizeof(header) + header.length);
+        return intact(bytes) ? bytes : nullptr;
+    };
+    // Whether an intact record starts anywhere after a bad one at offset.
+    const auto followed = [&](std::uint64_t offset)
+    {
+        if (offset + sizeof(RecordHeader) > m_size)
+        {
+            return false;
+        }
+        RecordHeader bad{};
+        std::memcpy(&bad, scanner.at(offset, sizeof(bad)), sizeof(bad));
+        RecordHeader next{};
+        std::uint64_t at = offset + 1;
+        if (bad.kind == BATCH_RECORD)
+        {
+            // The records of a batch are sealed one by one, so those
+            // written before a tear are intact; skip them.
+            at = offset + sizeof(bad);
+            for (std::uint64_t i = 0;
+                 i < bad.id && record(at, next) != nullptr; ++i)
+            {
+                at += sizeof(next) + next.length;
+            }
+        }
+        for (; at + sizeof(next) <= m_size; ++at)
+        {
+            // Check the cheap fields before the checksum.
+            std::memcpy(&next, scanner.at(at, sizeof(next)), sizeof(next));
+            if ((next.kind == PUT_RECORD || next.kind == ERASE_RECORD ||
+                 next.kind == BATCH_RECORD) &&
+                next.id < MAX_ID &&
+                next.length <= m_size - at - sizeof(next) &&
+                record(at, next) != nullptr)
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // A bad record with no intact one anywhere after it was torn by a
+    // crash while it was being appended, so the log ends before it.
+    std::uint64_t offset = std::max<std::uint64_t>(from, sizeof(LOG_MAGIC));
+    RecordHeader header{};
+    while (offset < m_size)
+    {
+        const char *bytes = record(offset, header);
+        if (bytes == nullptr)
+        {
+            if (sealed || followed(offset))
+            {
+                throw corrupt(offset);
+            }
+            break;
+        }
+        const std::uint64_t end = offset + sizeof(header) + header.length;
+        if (header.kind != BATCH_RECORD)
+        {
+            applyRecord(header, offset);
+            offset = end;
+            continue;
+        }
+
+        std::uint64_t nested = offset + sizeof(header);
+        for (std::uint64_t i = 0; i < header.id; ++i)
+        {
+            RecordHeader op{};
+            if (nested + sizeof(op) > end)
+            {
+                throw corrupt(nested);
+            }
+            std::memcpy(&op, bytes + (nested - offset), sizeof(op));
+            if (op.length > end - nested - sizeof(op))
+            {
+                throw corrupt(nested);
+            }
+            applyRecord(op, nested);
+            nested += sizeof(op) + op.length;
+        }
+        if (nested != end)
+        {
+            throw corrupt(nested);
+        }
+        offset = end;
+    }
+
+    if (offset != m_size)
+    {
+        if (::ftruncate(m_fd, static_cast<off_t>(offset)) != 0)
+        {
+            throw std::runtime_error(errorText("Couldn't truncate", m_path));
+        }
+        if (report)
+        {
+            report("Cut off " + std::to_string(m_size - offset) +
+                   " bytes of a torn append at offset " +
+                   std::to_string(offset) + " of " + m_path);
+        }
+        m_size = offset;
+    }
+}
+
+RecordLog::Location RecordLog::put(std::size_t id, const Comic &comic)
+{
+    std::string record;
+    const Location location = appendPut(record, m_size, id, comic);
+    write(record);
+    return location;
+}
+
+void RecordLog::erase(std::size_t id)
+{
+    std::string record;
+    appendErase(record, id);
+    write(record);
+}
+
+void RecordLog::append(Batch &batch)
+{
+    if (batch.m_base != m_size)
+    {
+        throw std::logic_error("Batch started at another log size");
+    }
+    const RecordHeader header{BATCH_RECORD, 0, batch.m_count,
+                              batch.m_bytes.size() - sizeof(RecordHeader)};
+    std::memcpy(&batch.m_bytes[0], &header, sizeof(header));
+    seal(batch.m_bytes, 0);
+    write(batch.m_bytes);
+}
+
+void RecordLog::sync()
+{
+    if (::fsync(m_fd) != 0)
+    {
+        throw std::runtime_error(errorText("Couldn't sync", m_path));
+    }
+}
+
+void RecordLog::write(const std::string &bytes)
+{
+    std::size_t written = 0;
+    while (written < bytes.size())
+    {
+        const ssize_t count =
+            ::pwrite(m_fd, bytes.data() + written, bytes.size() - written,
+                     static_cast<off_t>(m_size + written));
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // Cut off the partial record so the log stays replayable.
+            const int error = errno;
+            const bool truncated =
+                ::ftruncate(m_fd, static_cast<off_t>(m_size)) == 0;
+            errno = error;
+            throw std::runtime_error(errorText(
+                truncated ? "Couldn't write" : "Couldn't write or truncate",
+                m_path));
+        }
+        written += static_cast<std::size_t>(count);
+    }
+    m_size += bytes.size();
+}
+
+Comic RecordLog::read(const Location &location) const
+{
+    // Read the put's header along with the comic to check its checksum.
+    std::string bytes(sizeof(RecordHeader) + location.size, '\0');
+    const std::uint64_t offset = location.offset - sizeof(RecordHeader);
+    readFully(m_fd, &bytes[0], bytes.size(), offset, m_path);
+    RecordHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    if (header.kind != PUT_RECORD || header.length != location.size ||
+        !intact(bytes.data()))
+    {
+        throw std::runtime_error("Corrupt comics log " + m_path +
+                                 " at offset " + std::to_string(offset));
+    }
+    return fromBinary(bytes.data() + sizeof(header), location.size);
+}
+
+} // namespace comicsdb
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "comic.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace comicsdb
+{
+
+// An append-only file of put and erase records, shared by the persistent
+// engines.  Changes that must be applied together are appended as one
+// batch, so replay sees all of them or none, and a record torn by a crash
+// is cut off when the file is next opened.  Every record carries a
+// CRC-32C that replay and reads verify, so damage elsewhere in the file is
+// reported rather than returned: a bad record is only taken for a torn
+// append if no intact record starts anywhere after it.
+//
+// Appends must be serialized by the caller; reads are safe from any thread
+// since records are never rewritten.
+class RecordLog
+{
+  public:
+    // Where a put's encoded comic is in the file.
+    struct Location
+    {
+        std::uint64_t offset{};
+        std::uint32_t size{};
+    };
+
+    struct Entry
+    {
+        std::size_t id;
+        bool erase;
+        Location location; // of the comic, for a put
+    };
+
+    // Records to append together.  Locations assume the batch is appended
+    // at base, the log's size when the batch was started.
+    class Batch
+    {
+      public:
+        explicit Batch(std::uint64_t base);
+
+        Location put(std::size_t id, const Comic &comic);
+        void erase(std::size_t id);
+
+      private:
+        friend class RecordLog;
+
+        std::uint64_t m_base;
+        std::uint64_t m_count{};
+        std::string m_bytes;
+    };
+
+    using Report = std::function<void(const std::string &message)>;
+
+    // Opens or creates the log at path, calling replay for every record
+    // from offset from on in the order they were appended; an empty
+    // replay skips reading the records altogether.  A sealed log is one
+    // that was synced and never appended to again, so a bad record at its
+    // end is corruption rather than a torn append.  report is told how
+    // much a torn append cut off.  Throws std::runtime_error if the log
+    // can't be opened, isn't a comics log or is corrupt.
+    RecordLog(const std::string &path,
+              const std::function<void(const Entry &entry)> &replay,
+              std::uint64_t from = 0, bool sealed = false,
+              const Report &report = nullptr);
+    ~RecordLog();
+    RecordLog(const RecordLog &) = delete;
+    RecordLog &operator=(const RecordLog &) = delete;
+
+    const std::string &path() const { return m_path; }
+    std::uint64_t size() const { return m_size; }
+
+    Location put(std::size_t id, const Comic &comic);
+    void erase(std::size_t id);
+    void append(Batch &batch);
+    // Flushes the appended records to disk.
+    void sync();
+
+    Comic read(const Location &location) const;
+
+  private:
+    void replay(const std::function<void(const Entry &entry)> &apply,
+                std::uint64_t from, bool sealed, const Report &report);
+    void write(const std::string &bytes);
+
+    const std::string m_path;
+    int m_fd{-1};
+    std::uint64_t m_size{};
+};
+
+} // namespace comicsdb
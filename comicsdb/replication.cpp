@@ -0,0 +1,485 @@
+#include "replication.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <restbed>
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+// Changes a follower asks for at a time, each applied atomically.
+constexpr std::size_t CHANGE_BATCH = 10000;
+// How often a follower that has caught up polls the leader.
+constexpr std::chrono::milliseconds POLL_INTERVAL{100};
+// How long a follower waits before retrying after an error.
+constexpr std::chrono::seconds RETRY_INTERVAL{1};
+
+const char *const STATE_NAMES[] = {"connecting", "copying", "following"};
+
+std::uint64_t randomEpoch()
+{
+    std::random_device device;
+    return (std::uint64_t{device()} << 32 | device()) | 1;
+}
+
+std::uint64_t numberHeader(
+    const std::multimap<std::string, std::string> &headers, const char *name)
+{
+    const auto it = headers.find(name);
+    if (it == headers.end())
+    {
+        throw std::runtime_error(std::string{"Leader response missing "} +
+                                 name);
+    }
+    return std::stoull(it->second);
+}
+
+} // namespace
+
+ChangeFeed::ChangeFeed(std::size_t capacity) :
+    m_capacity(std::max<std::size_t>(capacity, 1)),
+    m_epoch(randomEpoch())
+{
+}
+
+std::uint64_t ChangeFeed::last() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_first + m_ids.size() - 1;
+}
+
+void ChangeFeed::changed(std::size_t id)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_ids.push_back(id);
+    trim();
+}
+
+void ChangeFeed::changed(std::size_t first, std::size_t count)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // Only the newest capacity ids could be kept anyway.
+    const std::size_t skip = count > m_capacity ? count - m_capacity : 0;
+    if (skip != 0)
+    {
+        m_first += m_ids.size() + skip;
+        m_ids.clear();
+    }
+    for (std::size_t i = skip; i < count; ++i)
+    {
+        m_ids.push_back(first + i);
+    }
+    trim();
+}
+
+void ChangeFeed::trim()
+{
+    while (m_ids.size() > m_capacity)
+    {
+        m_ids.pop_front();
+        ++m_first;
+    }
+}
+
+bool ChangeFeed::since(std::uint64_t after, std::size_t limit,
+                       std::vector<std::size_t> &ids,
+                       std::uint64_t &through) const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const std::uint64_t last = m_first + m_ids.size() - 1;
+    if (after + 1 < m_first || after > last)
+    {
+        return false;
+    }
+    std::unordered_set<std::size_t> seen;
+    through = after;
+    for (std::size_t i = after + 1 - m_first;
+         i < m_ids.size() && seen.size() < limit; ++i, ++through)
+    {
+        if (seen.insert(m_ids[i]).second)
+        {
+            ids.push_back(m_ids[i]);
+        }
+    }
+    return true;
+}
+
+ReplicatedStore::ReplicatedStore(StorageEngine &engine, ChangeFeed &feed) :
+    m_engine(engine),
+    m_feed(feed)
+{
+}
+
+bool ReplicatedStore::get(std::size_t id, Comic &comic,
+                          const TracePtr &trace) const
+{
+    return m_engine.get(id, comic, trace);
+}
+
+bool ReplicatedStore::contains(std::size_t id) const
+{
+    return m_engine.contains(id);
+}
+
+std::size_t ReplicatedStore::create(const Comic &comic, const TracePtr &trace)
+{
+    const std::size_t id = m_engine.create(comic, trace);
+    m_feed.changed(id);
+    return id;
+}
+
+bool ReplicatedStore::update(std::size_t id, const Comic &comic,
+                             const TracePtr &trace)
+{
+    if (!m_engine.update(id, comic, trace))
+    {
+        return false;
+    }
+    m_feed.changed(id);
+    return true;
+}
+
+bool ReplicatedStore::erase(std::size_t id, const TracePtr &trace)
+{
+    if (!m_engine.erase(id, trace))
+    {
+        return false;
+    }
+    m_feed.changed(id);
+    return true;
+}
+
+bool ReplicatedStore::insert(std::size_t id, const Comic &comic,
+                             const TracePtr &trace)
+{
+    if (!m_engine.insert(id, comic, trace))
+    {
+        return false;
+    }
+    m_feed.changed(id);
+    return true;
+}
+
+void ReplicatedStore::scan(
+    const std::function<void(std::size_t, const Comic &)> &visit) const
+{
+    m_engine.scan(visit);
+}
+
+std::vector<std::pair<std::size_t, Comic>> ReplicatedStore::snapshot() const
+{
+    return m_engine.snapshot();
+}
+
+std::size_t ReplicatedStore::importBatch(std::vector<Comic> comics)
+{
+    const std::size_t count = comics.size();
+    const std::size_t first = m_engine.importBatch(std::move(comics));
+    m_feed.changed(first, count);
+    return first;
+}
+
+bool ReplicatedStore::applyTransaction(std::vector<TransactionOp> &ops,
+                                       std::size_t &failed,
+                                       const TracePtr &trace)
+{
+    if (!m_engine.applyTransaction(ops, failed, trace))
+    {
+        return false;
+    }
+    for (const TransactionOp &op : ops)
+    {
+        m_feed.changed(op.id);
+    }
+    return true;
+}
+
+Follower::Follower(ShardedStore &replica, IndexedStore &index,
+                   const std::string &leader, AsyncLogger &logger) :
+    m_replica(replica),
+    m_index(index),
+    m_host(leader.substr(0, leader.rfind(':'))),
+    m_port(static_cast<std::uint16_t>(
+        std::stoul(leader.substr(leader.rfind(':') + 1)))),
+    m_logger(logger),
+    m_current(Clock::now())
+{
+    m_thread = std::thread([this] { run(); });
+}
+
+Follower::~Follower()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+}
+
+double Follower::lagSeconds() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_state == FOLLOWING && m_applied == m_head && m_lastError.empty())
+    {
+        return 0.0;
+    }
+    return std::chrono::duration<double>(Clock::now() - m_current).count();
+}
+
+std::string Follower::toJson() const
+{
+    const double lag = lagSeconds();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("role");
+    writer.String("follower");
+    writer.Key("leader");
+    writer.String((m_host + ':' + std::to_string(m_port)).c_str());
+    writer.Key("state");
+    writer.String(STATE_NAMES[m_state]);
+    writer.Key("applied");
+    writer.Uint64(m_applied);
+    writer.Key("head");
+    writer.Uint64(m_head);
+    writer.Key("behind");
+    writer.Uint64(m_head - m_applied);
+    writer.Key("lag_seconds");
+    writer.Double(lag);
+    writer.Key("copies");
+    writer.Uint64(m_copies);
+    writer.Key("errors");
+    writer.Uint64(m_errors);
+    writer.Key("last_error");
+    writer.String(m_lastError.c_str());
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+void Follower::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping)
+    {
+        std::chrono::milliseconds wait = POLL_INTERVAL;
+        const bool copying = m_state != FOLLOWING;
+        lock.unlock();
+        try
+        {
+            if (copying)
+            {
+                copy();
+            }
+            wait = poll() ? std::chrono::milliseconds::zero() : POLL_INTERVAL;
+            lock.lock();
+            if (!m_lastError.empty())
+            {
+                m_logger.log(restbed::Logger::INFO,
+                             "Following leader %s:%u again", m_host.c_str(),
+                             m_port);
+                m_lastError.clear();
+            }
+        }
+        catch (const std::exception &bang)
+        {
+            wait = RETRY_INTERVAL;
+            lock.lock();
+            ++m_errors;
+            if (m_lastError != bang.what())
+            {
+                m_logger.log(restbed::Logger::WARNING,
+                             "Replication from %s:%u failed: %s",
+                             m_host.c_str(), m_port, bang.what());
+                m_lastError = bang.what();
+            }
+        }
+        m_wake.wait_for(lock, wait, [this] { return m_stopping; });
+    }
+}
+
+std::string Follower::fetch(const std::string &path,
+                            std::multimap<std::string, std::string> &headers,
+                            int &status)
+{
+    auto request = std::make_shared<restbed::Request>(restbed::Uri(
+        "http://" + m_host + ':' + std::to_string(m_port) + path));
+    request->set_method("GET");
+    request->set_header("Host", m_host);
+    request->set_header("Accept", "application/x-ndjson");
+    std::string body;
+    try
+    {
+        const auto response = restbed::Http::sync(request);
+        const std::size_t length =
+            response->get_header("Content-Length", std::size_t{0});
+        if (length > 0)
+        {
+            restbed::Http::fetch(length, response);
+        }
+        status = response->get_status_code();
+        headers = response->get_headers();
+        const restbed::Bytes &bytes = response->get_body();
+        body.assign(bytes.begin(), bytes.end());
+    }
+    catch (...)
+    {
+        restbed::Http::close(request);
+        throw;
+    }
+    restbed::Http::close(request);
+    return body;
+}
+
+void Follower::copy()
+{
+    setState(COPYING);
+    std::multimap<std::string, std::string> headers;
+    int status{};
+    const std::string body = fetch("/replication/snapshot", headers, status);
+    if (status != restbed::OK)
+    {
+        throw std::runtime_error("Leader answered " + std::to_string(status) +
+                                 " to the snapshot request");
+    }
+    const std::uint64_t epoch = numberHeader(headers, "X-Replication-Epoch");
+    const std::uint64_t sequence =
+        numberHeader(headers, "X-Replication-Sequence");
+    apply(body, numberHeader(headers, "X-Replication-Next-Id"), true);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_epoch = epoch;
+    m_applied = sequence;
+    m_head = sequence;
+    ++m_copies;
+    m_state = FOLLOWING;
+    m_logger.log(restbed::Logger::INFO,
+                 "Copied the catalog from leader %s:%u at change %llu",
+                 m_host.c_str(), m_port,
+                 static_cast<unsigned long long>(sequence));
+}
+
+bool Follower::poll()
+{
+    std::uint64_t applied{};
+    std::uint64_t epoch{};
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        applied = m_applied;
+        epoch = m_epoch;
+    }
+    std::multimap<std::string, std::string> headers;
+    int status{};
+    const std::string body =
+        fetch("/replication/changes?after=" + std::to_string(applied) +
+                  "&epoch=" + std::to_string(epoch) +
+                  "&limit=" + std::to_string(CHANGE_BATCH),
+              headers, status);
+    if (status == restbed::GONE)
+    {
+        m_logger.log(restbed::Logger::WARNING,
+                     "Leader %s:%u no longer has the changes after %llu, "
+                     "copying the catalog again",
+                     m_host.c_str(), m_port,
+                     static_cast<unsigned long long>(applied));
+        setState(COPYING);
+        return true;
+    }
+    if (status != restbed::OK)
+    {
+        throw std::runtime_error("Leader answered " + std::to_string(status) +
+                                 " to the changes request");
+    }
+    const std::uint64_t through =
+        numberHeader(headers, "X-Replication-Sequence");
+    const std::uint64_t head = numberHeader(headers, "X-Replication-Head");
+    apply(body, numberHeader(headers, "X-Replication-Next-Id"), false);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_applied = through;
+    m_head = std::max(head, through);
+    if (m_applied == m_head)
+    {
+        m_current = Clock::now();
+    }
+    return m_applied != m_head;
+}
+
+void Follower::apply(const std::string &body, std::size_t nextId,
+                     bool replace)
+{
+    // Each line is a comic as exported, or its id and "deleted":true.
+    std::vector<std::pair<std::size_t, Comic>> comics;
+    std::size_t begin = 0;
+    while (begin < body.size())
+    {
+        std::size_t end = body.find('\n', begin);
+        if (end == std::string::npos)
+        {
+            end = body.size();
+        }
+        rapidjson::Document doc;
+        doc.Parse(body.data() + begin, end - begin);
+        begin = end + 1;
+        if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("id") ||
+            !doc["id"].IsUint64())
+        {
+            throw std::runtime_error("Invalid change from the leader");
+        }
+        const std::size_t id = doc["id"].GetUint64();
+        comics.emplace_back(id, doc.HasMember("deleted") ? Comic{}
+                                                         : fromJson(doc));
+    }
+
+    // A copy replaces the catalog, so anything the leader didn't send is
+    // deleted.
+    if (replace)
+    {
+        std::vector<bool> sent;
+        for (const std::pair<std::size_t, Comic> &entry : comics)
+        {
+            if (entry.first >= sent.size())
+            {
+                sent.resize(entry.first + 1);
+            }
+            sent[entry.first] = true;
+        }
+        std::vector<std::size_t> stale;
+        m_replica.scan(
+            [&sent, &stale](std::size_t id, const Comic &)
+            {
+                if (id >= sent.size() || !sent[id])
+                {
+                    stale.push_back(id);
+                }
+            });
+        for (std::size_t id : stale)
+        {
+            comics.emplace_back(id, Comic{});
+        }
+    }
+    m_replica.restore(comics, nextId);
+    for (const std::pair<std::size_t, Comic> &entry : comics)
+    {
+        m_index.reindex(entry.first, entry.second);
+    }
+}
+
+void Follower::setState(State state)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_state = state;
+}
+
+} // namespace comicsdb
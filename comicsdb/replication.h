@@ -0,0 +1,152 @@
+#pragma once
+
+#include "indexed_store.h"
+#include "logger.h"
+#include "storage.h"
+#include "store.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace comicsdb
+{
+
+// The ids of the comics changed on a leader, numbered from 1 in the order
+// the changes committed.  Followers ask for the ids after the last number
+// they applied and fetch the comics' current state, so ids are all the
+// feed keeps; the oldest are dropped beyond capacity, and a follower that
+// falls that far behind copies the whole catalog again.
+class ChangeFeed
+{
+  public:
+    explicit ChangeFeed(std::size_t capacity);
+
+    // Tells this run of the server from earlier ones, whose numbers mean
+    // nothing now.
+    std::uint64_t epoch() const { return m_epoch; }
+    std::uint64_t last() const;
+
+    void changed(std::size_t id);
+    void changed(std::size_t first, std::size_t count);
+    // Appends up to limit distinct ids changed after number after to ids
+    // and sets through to the number of the last one.  False if after is
+    // no longer, or not yet, in the feed.
+    bool since(std::uint64_t after, std::size_t limit,
+               std::vector<std::size_t> &ids, std::uint64_t &through) const;
+
+  private:
+    void trim();
+
+    const std::size_t m_capacity;
+    const std::uint64_t m_epoch;
+    mutable std::mutex m_mutex;
+    std::deque<std::size_t> m_ids;
+    std::uint64_t m_first{1}; // the number of m_ids.front()
+};
+
+// Forwards to an engine and records every successful change in a feed.
+class ReplicatedStore : public StorageEngine
+{
+  public:
+    ReplicatedStore(StorageEngine &engine, ChangeFeed &feed);
+
+    const char *name() const override { return m_engine.name(); }
+
+    bool get(std::size_t id, Comic &comic,
+             const TracePtr &trace = nullptr) const override;
+    bool contains(std::size_t id) const override;
+    std::size_t create(const Comic &comic,
+                       const TracePtr &trace = nullptr) override;
+    bool update(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+    bool erase(std::size_t id, const TracePtr &trace = nullptr) override;
+    bool insert(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+
+    void scan(const std::function<void(std::size_t, const Comic &)> &visit)
+        const override;
+    std::vector<std::pair<std::size_t, Comic>> snapshot() const override;
+    std::size_t importBatch(std::vector<Comic> comics) override;
+    bool applyTransaction(std::vector<TransactionOp> &ops, std::size_t &failed,
+                          const TracePtr &trace = nullptr) override;
+
+    std::size_t nextId() const override { return m_engine.nextId(); }
+    void maintain() override { m_engine.maintain(); }
+    pid_t saveInBackground(const std::string &path) const override
+    {
+        return m_engine.saveInBackground(path);
+    }
+
+  private:
+    StorageEngine &m_engine;
+    ChangeFeed &m_feed;
+};
+
+// Keeps a replica of a leader's catalog up to date from a thread of its
+// own: it copies the catalog from GET /replication/snapshot, then polls
+// GET /replication/changes, applying each batch of changes atomically.
+class Follower
+{
+  public:
+    // leader is HOST:PORT.  index is kept up to date with the replica.
+    Follower(ShardedStore &replica, IndexedStore &index,
+             const std::string &leader, AsyncLogger &logger);
+    ~Follower();
+    Follower(const Follower &) = delete;
+    Follower &operator=(const Follower &) = delete;
+
+    // Seconds since the replica last had every change the leader had.
+    double lagSeconds() const;
+    std::string toJson() const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    enum State
+    {
+        CONNECTING,
+        COPYING,
+        FOLLOWING
+    };
+
+    void run();
+    void copy();
+    bool poll();
+    std::string fetch(const std::string &path,
+                      std::multimap<std::string, std::string> &headers,
+                      int &status);
+    void apply(const std::string &body, std::size_t nextId, bool replace);
+    void setState(State state);
+
+    ShardedStore &m_replica;
+    IndexedStore &m_index;
+    const std::string m_host;
+    const std::uint16_t m_port;
+    AsyncLogger &m_logger;
+
+    mutable std::mutex m_mutex;
+    State m_state{CONNECTING};
+    std::uint64_t m_epoch{};
+    std::uint64_t m_applied{};
+    std::uint64_t m_head{};
+    Clock::time_point m_current; // when the replica last caught up
+    std::uint64_t m_copies{};
+    std::uint64_t m_errors{};
+    std::string m_lastError;
+
+    std::condition_variable m_wake;
+    bool m_stopping{};
+    std::thread m_thread;
+};
+
+} // namespace comicsdb
@@ -0,0 +1,200 @@
+#include "series.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <tuple>
+
+namespace comicsdb
+{
+
+bool SeriesCatalog::before(const Issue &lhs, const Issue &rhs)
+{
+    return std::tie(lhs.issue, lhs.id) < std::tie(rhs.issue, rhs.id);
+}
+
+SeriesCatalog::SeriesCatalog(const StorageEngine &engine) :
+    m_engine(engine)
+{
+    m_engine.scan(
+        [this](std::size_t id, const Comic &comic)
+        {
+            Run &series = m_series[normalizeTitle(comic.title)];
+            if (series.issues.empty())
+            {
+                series.title = comic.title;
+            }
+            series.issues.push_back({comic.issue, id});
+            m_seriesOf[id] = &series;
+        });
+    // Sorting each series once is cheaper than inserting in order.
+    for (auto &entry : m_series)
+    {
+        std::vector<Issue> &issues = entry.second.issues;
+        std::sort(issues.begin(), issues.end(), before);
+    }
+}
+
+void SeriesCatalog::place(std::size_t id, const Comic *comic)
+{
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    const auto it = m_seriesOf.find(id);
+    if (it != m_seriesOf.end())
+    {
+        std::vector<Issue> &issues = it->second->issues;
+        issues.erase(std::find_if(issues.begin(), issues.end(),
+                                  [id](const Issue &issue)
+                                  { return issue.id == id; }));
+        if (issues.empty())
+        {
+            m_series.erase(normalizeTitle(it->second->title));
+        }
+        m_seriesOf.erase(it);
+    }
+    if (comic == nullptr)
+    {
+        return;
+    }
+    Run &series = m_series[normalizeTitle(comic->title)];
+    if (series.issues.empty())
+    {
+        series.title = comic->title;
+    }
+    const Issue issue{comic->issue, id};
+    series.issues.insert(std::upper_bound(series.issues.begin(),
+                                          series.issues.end(), issue, before),
+                         issue);
+    m_seriesOf[id] = &series;
+}
+
+bool SeriesCatalog::find(const std::string &title, Series &series) const
+{
+    const std::string key = normalizeTitle(title);
+    std::vector<Issue> issues;
+    {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        const auto it = m_series.find(key);
+        if (it == m_series.end())
+        {
+            return false;
+        }
+        series.title = it->second.title;
+        issues = it->second.issues;
+    }
+    // Read outside the lock so writers aren't held up by the engine;
+    // comics moved out of the series meanwhile are left out.
+    series.comics.clear();
+    series.comics.reserve(issues.size());
+    Comic comic;
+    for (const Issue &issue : issues)
+    {
+        if (m_engine.get(issue.id, comic) &&
+            comic.issue != Comic::DELETED_ISSUE &&
+            normalizeTitle(comic.title) == key)
+        {
+            series.comics.emplace_back(issue.id, comic);
+        }
+    }
+    return true;
+}
+
+std::vector<SeriesCatalog::Summary> SeriesCatalog::list() const
+{
+    std::vector<std::tuple<std::string, std::string, std::size_t>> sorted;
+    {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        sorted.reserve(m_series.size());
+        for (const auto &entry : m_series)
+        {
+            sorted.emplace_back(entry.first, entry.second.title,
+                                entry.second.issues.size());
+        }
+    }
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<Summary> result(sorted.size());
+    for (std::size_t i = 0; i < sorted.size(); ++i)
+    {
+        result[i].title = std::move(std::get<1>(sorted[i]));
+        result[i].issues = std::get<2>(sorted[i]);
+    }
+    return result;
+}
+
+std::size_t SeriesCatalog::count(const std::string &title) const
+{
+    const std::string key = normalizeTitle(title);
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    const auto it = m_series.find(key);
+    return it == m_series.end() ? 0 : it->second.issues.size();
+}
+
+std::size_t SeriesCatalog::size() const
+{
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    return m_series.size();
+}
+
+std::size_t SeriesCatalog::comics() const
+{
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    return m_seriesOf.size();
+}
+
+std::string toJson(const SeriesCatalog::Series &series)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    auto addMember = [&writer](const char *key, const std::string &value)
+    {
+        writer.Key(key);
+        writer.String(value.c_str(),
+                      static_cast<rapidjson::SizeType>(value.size()));
+    };
+    writer.StartObject();
+    addMember("title", series.title);
+    writer.Key("issues");
+    writer.StartArray();
+    for (const auto &entry : series.comics)
+    {
+        const Comic &comic = entry.second;
+        writer.StartObject();
+        writer.Key("id");
+        writer.Uint64(entry.first);
+        writer.Key("issue");
+        writer.Int(comic.issue);
+        addMember("writer", comic.writer);
+        addMember("penciler", comic.penciler);
+        addMember("inker", comic.inker);
+        addMember("letterer", comic.letterer);
+        addMember("colorist", comic.colorist);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+std::string toJson(const std::vector<SeriesCatalog::Summary> &list)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("series");
+    writer.StartArray();
+    for (const SeriesCatalog::Summary &series : list)
+    {
+        writer.StartObject();
+        writer.Key("title");
+        writer.String(series.title.c_str(),
+                      static_cast<rapidjson::SizeType>(series.title.size()));
+        writer.Key("issues");
+        writer.Uint64(series.issues);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+} // namespace comicsdb
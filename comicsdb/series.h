@@ -0,0 +1,86 @@
+#pragma once
+
+#include "storage.h"
+
+#include <cstddef>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+// The comics grouped into series by title, as readers browse them.  Each
+// series keeps its title once and the issue and id of its comics in one
+// contiguous array sorted by issue, so a run is found in one pass and its
+// comics read from the engine in order.  That's a few words of memory per
+// comic however large the comics are, which the log-structured engine,
+// keeping most comics on disk, relies on.
+//
+// The engine stays the source of truth: after each write the store reads
+// the comics it wrote back from the engine and places them.
+class SeriesCatalog
+{
+  public:
+    struct Series
+    {
+        std::string title; // as one of its comics spells it
+        // By issue, then id.
+        std::vector<std::pair<std::size_t, Comic>> comics;
+    };
+
+    struct Summary
+    {
+        std::string title;
+        std::size_t issues{};
+    };
+
+    // Groups everything in engine, which must outlive the catalog.
+    explicit SeriesCatalog(const StorageEngine &engine);
+
+    // Moves comic id to the series of comic, or drops it if comic is null.
+    // Calls for one id must not overlap.
+    void place(std::size_t id, const Comic *comic);
+
+    // The series with this title, compared as normalizeTitle() does, with
+    // its comics as the engine has them; false if there is none.
+    bool find(const std::string &title, Series &series) const;
+    // Every series, ordered by title.
+    std::vector<Summary> list() const;
+    // How many comics the series with this title has, 0 if there's none.
+    std::size_t count(const std::string &title) const;
+    // How many series and comics there are.
+    std::size_t size() const;
+    std::size_t comics() const;
+
+  private:
+    struct Issue
+    {
+        int issue{};
+        std::size_t id{};
+    };
+
+    struct Run
+    {
+        std::string title;
+        std::vector<Issue> issues; // by issue, then id
+    };
+
+    static bool before(const Issue &lhs, const Issue &rhs);
+
+    const StorageEngine &m_engine;
+    mutable std::shared_mutex m_mutex;
+    // By normalized title.
+    std::unordered_map<std::string, Run> m_series;
+    // The series each comic is in.
+    std::unordered_map<std::size_t, Run *> m_seriesOf;
+};
+
+// {"title":T,"issues":[{"id":N,"issue":N,"writer":W,...}]}
+std::string toJson(const SeriesCatalog::Series &series);
+// {"series":[{"title":T,"issues":N}]}
+std::string toJson(const std::vector<SeriesCatalog::Summary> &list);
+
+} // namespace comicsdb
@@ -0,0 +1,522 @@
+#include "shared_store.h"
+
+#include "file_io.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+constexpr char MAGIC[8] = {'C', 'D', 'B', 'S', 'H', 'M', '1', '\0'};
+constexpr unsigned SIZE_BITS = 24;
+constexpr std::uint64_t MAX_RECORD = (std::uint64_t{1} << SIZE_BITS) - 1;
+constexpr std::uint64_t MAX_ARENA = std::uint64_t{1} << (64 - SIZE_BITS);
+// Arena bytes per slot; records average well over this.
+constexpr std::size_t BYTES_PER_SLOT = 64;
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "shared atomics must not hide a lock in one process");
+
+std::size_t roundUp(std::size_t size)
+{
+    return (size + 63) / 64 * 64;
+}
+
+} // namespace
+
+// The start of the file, followed by the slots and then the arena.
+struct SharedStore::Header
+{
+    char magic[8];
+    std::uint64_t slots;
+    std::uint64_t capacity;         // arena bytes
+    std::atomic<std::uint64_t> nextId;
+    std::atomic<std::uint64_t> used; // arena bytes, from 8 so 0 means none
+    std::atomic<std::uint64_t> sequence;
+};
+
+class SharedStore::WriteScope
+{
+  public:
+    explicit WriteScope(Header &header) : m_header(header)
+    {
+        m_header.sequence.fetch_add(1, std::memory_order_acq_rel);
+    }
+    ~WriteScope()
+    {
+        m_header.sequence.fetch_add(1, std::memory_order_release);
+    }
+    WriteScope(const WriteScope &) = delete;
+    WriteScope &operator=(const WriteScope &) = delete;
+
+  private:
+    Header &m_header;
+};
+
+SharedStore::SharedStore(const std::string &path, std::size_t capacity,
+                         bool writable, LockProfiler &profiler,
+                         const Progress &progress) :
+    m_path(path),
+    m_writable(writable),
+    m_progress(progress),
+    m_mutex(profiler)
+{
+    m_fd = ::open(path.c_str(),
+                  (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+    {
+        throw std::runtime_error(errorText("Couldn't open", path));
+    }
+    if (writable && ::flock(m_fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        ::close(m_fd);
+        throw std::runtime_error("Another process is writing " + path);
+    }
+    struct stat status;
+    if (::fstat(m_fd, &status) != 0)
+    {
+        ::close(m_fd);
+        throw std::runtime_error(errorText("Couldn't stat", path));
+    }
+
+    const bool created = status.st_size == 0;
+    std::uint64_t slots = std::max<std::size_t>(capacity / BYTES_PER_SLOT, 1);
+    if (created)
+    {
+        if (!writable || capacity > MAX_ARENA)
+        {
+            ::close(m_fd);
+            throw std::runtime_error("Invalid shared store " + path);
+        }
+        m_mapSize = roundUp(sizeof(Header)) + roundUp(slots * sizeof(Slot)) +
+                    capacity;
+        // The file is sparse, so pages are only allocated once written.
+        if (::ftruncate(m_fd, static_cast<off_t>(m_mapSize)) != 0)
+        {
+            ::close(m_fd);
+            throw std::runtime_error(errorText("Couldn't size", path));
+        }
+    }
+    else
+    {
+        m_mapSize = static_cast<std::size_t>(status.st_size);
+    }
+
+    m_map = ::mmap(nullptr, m_mapSize,
+                   writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                   m_fd, 0);
+    if (m_map == MAP_FAILED)
+    {
+        ::close(m_fd);
+        throw std::runtime_error(errorText("Couldn't map", path));
+    }
+    m_header = static_cast<Header *>(m_map);
+    if (created)
+    {
+        // The zeroed file is a valid empty store once the sizes and magic
+        // are in place.
+        new (m_header) Header{};
+        m_header->slots = slots;
+        m_header->capacity = capacity;
+        m_header->used = 8;
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(m_header->magic, MAGIC, sizeof(MAGIC));
+    }
+    else
+    {
+        if (m_mapSize < sizeof(Header) ||
+            std::memcmp(m_header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            m_mapSize != roundUp(sizeof(Header)) +
+                             roundUp(m_header->slots * sizeof(Slot)) +
+                             m_header->capacity)
+        {
+            ::munmap(m_map, m_mapSize);
+            ::close(m_fd);
+            throw std::runtime_error(path + " isn't a shared comics store");
+        }
+        slots = m_header->slots;
+        if (writable && (m_header->sequence.load() & 1) != 0)
+        {
+            // A writer died mid-change; its records are complete or unused.
+            m_header->sequence.fetch_add(1);
+        }
+    }
+    m_slots = reinterpret_cast<Slot *>(static_cast<char *>(m_map) +
+                                       roundUp(sizeof(Header)));
+    m_arena = static_cast<char *>(m_map) + roundUp(sizeof(Header)) +
+              roundUp(slots * sizeof(Slot));
+}
+
+SharedStore::~SharedStore()
+{
+    ::munmap(m_map, m_mapSize);
+    ::close(m_fd);
+}
+
+void SharedStore::requireWritable() const
+{
+    if (!m_writable)
+    {
+        throw std::runtime_error("The shared store is read-only in this "
+                                 "process");
+    }
+}
+
+bool SharedStore::live(std::size_t id) const
+{
+    return id < m_header->slots &&
+           m_slots[id].load(std::memory_order_acquire) != 0;
+}
+
+Comic SharedStore::read(std::uint64_t slot) const
+{
+    return fromBinary(m_arena + (slot >> SIZE_BITS), slot & MAX_RECORD);
+}
+
+void SharedStore::reserve(std::size_t ids, std::uint64_t bytes) const
+{
+    if (ids > m_header->slots)
+    {
+        throw std::runtime_error("The shared store " + m_path +
+                                 " has no slot for id " +
+                                 std::to_string(ids - 1));
+    }
+    if (bytes > m_header->capacity - m_header->used.load())
+    {
+        throw std::runtime_error("The shared store " + m_path + " is full");
+    }
+}
+
+void SharedStore::store(std::size_t id, const std::string &record)
+{
+    if (record.size() > MAX_RECORD)
+    {
+        throw std::runtime_error("Comic too large for the shared store");
+    }
+    const std::uint64_t offset = m_header->used.load();
+    std::memcpy(m_arena + offset, record.data(), record.size());
+    m_header->used.store(offset + record.size(), std::memory_order_release);
+    m_slots[id].store(offset << SIZE_BITS | record.size(),
+                      std::memory_order_release);
+
+    const std::uint64_t full =
+        std::max((offset + record.size()) * 100 / m_header->capacity,
+                 std::uint64_t{id + 1} * 100 / m_header->slots);
+    if (full >= m_warnAt)
+    {
+        m_warnAt = full >= 90 ? 101 : 90;
+        if (m_progress)
+        {
+            m_progress("The shared store " + m_path + " is " +
+                       std::to_string(full) +
+                       "% full; restart the writer to reclaim replaced "
+                       "versions, with a larger --shared-mb if it stays "
+                       "full");
+        }
+    }
+}
+
+bool SharedStore::get(std::size_t id, Comic &comic,
+                      const TracePtr &trace) const
+{
+    TraceSpan span(trace, "read");
+    if (id >= m_header->slots)
+    {
+        return false;
+    }
+    // Records are never rewritten, so one load of the slot is enough.
+    const std::uint64_t slot = m_slots[id].load(std::memory_order_acquire);
+    if (slot == 0)
+    {
+        return false;
+    }
+    comic = read(slot);
+    return true;
+}
+
+bool SharedStore::contains(std::size_t id) const
+{
+    return live(id);
+}
+
+std::size_t SharedStore::create(const Comic &comic, const TracePtr &trace)
+{
+    requireWritable();
+    const std::string record = toBinary(comic);
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::CREATE_COMIC, trace);
+    const std::size_t id = m_header->nextId.load();
+    reserve(id + 1, record.size());
+    WriteScope scope(*m_header);
+    store(id, record);
+    m_header->nextId.store(id + 1, std::memory_order_release);
+    return id;
+}
+
+bool SharedStore::update(std::size_t id, const Comic &comic,
+                         const TracePtr &trace)
+{
+    requireWritable();
+    const std::string record = toBinary(comic);
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::UPDATE_COMIC, trace);
+    if (!live(id))
+    {
+        return false;
+    }
+    reserve(id + 1, record.size());
+    WriteScope scope(*m_header);
+    store(id, record);
+    return true;
+}
+
+bool SharedStore::erase(std::size_t id, const TracePtr &trace)
+{
+    requireWritable();
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::DELETE_COMIC, trace);
+    if (!live(id))
+    {
+        return false;
+    }
+    WriteScope scope(*m_header);
+    m_slots[id].store(0, std::memory_order_release);
+    return true;
+}
+
+bool SharedStore::insert(std::size_t id, const Comic &comic,
+                         const TracePtr &trace)
+{
+    requireWritable();
+    const std::string record = toBinary(comic);
+    TraceSpan span(trace, "commit");
+    ProfiledLock lock(m_mutex, LockSite::CREATE_COMIC, trace);
+    if (live(id))
+    {
+        return false;
+    }
+    reserve(id + 1, record.size());
+    WriteScope scope(*m_header);
+    store(id, record);
+    if (id >= m_header->nextId.load())
+    {
+        m_header->nextId.store(id + 1, std::memory_order_release);
+    }
+    return true;
+}
+
+void SharedStore::scan(
+    const std::function<void(std::size_t, const Comic &)> &visit) const
+{
+    const std::size_t end = nextId();
+    for (std::size_t id = 0; id < end; ++id)
+    {
+        const std::uint64_t slot = m_slots[id].load(std::memory_order_acquire);
+        if (slot != 0)
+        {
+            visit(id, read(slot));
+        }
+    }
+}
+
+std::vector<std::pair<std::size_t, Comic>> SharedStore::snapshot() const
+{
+    // Copy the slots, then check no write started or finished meanwhile;
+    // the records they point at never change.
+    std::vector<std::uint64_t> slots;
+    while (true)
+    {
+        const std::uint64_t before =
+            m_header->sequence.load(std::memory_order_acquire);
+        if ((before & 1) != 0)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        const std::size_t end = nextId();
+        slots.resize(end);
+        for (std::size_t id = 0; id < end; ++id)
+        {
+            slots[id] = m_slots[id].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_header->sequence.load(std::memory_order_relaxed) == before)
+        {
+            break;
+        }
+    }
+
+    std::vector<std::pair<std::size_t, Comic>> comics;
+    for (std::size_t id = 0; id < slots.size(); ++id)
+    {
+        if (slots[id] != 0)
+        {
+            comics.emplace_back(id, read(slots[id]));
+        }
+    }
+    return comics;
+}
+
+std::size_t SharedStore::importBatch(std::vector<Comic> comics)
+{
+    requireWritable();
+    std::vector<std::string> records;
+    records.reserve(comics.size());
+    std::uint64_t bytes = 0;
+    for (const Comic &comic : comics)
+    {
+        records.push_back(toBinary(comic));
+        bytes += records.back().size();
+    }
+    ProfiledLock lock(m_mutex, LockSite::IMPORT_COMICS);
+    const std::size_t first = m_header->nextId.load();
+    reserve(first + records.size(), bytes);
+    WriteScope scope(*m_header);
+    for (std::size_t i = 0; i < records.size(); ++i)
+    {
+        store(first + i, records[i]);
+    }
+    m_header->nextId.store(first + records.size(), std::memory_order_release);
+    return first;
+}
+
+bool SharedStore::applyTransaction(std::vector<TransactionOp> &ops,
+                                   std::size_t &failed, const TracePtr &trace)
+{
+    requireWritable();
+    ProfiledLock lock(m_mutex, LockSite::TRANSACTION, trace);
+    TraceSpan apply(trace, "apply");
+
+    // Check every step against the state left by the steps before it, and
+    // that everything fits, before changing anything.
+    std::size_t nextId = m_header->nextId.load();
+    std::size_t ids = nextId;
+    std::uint64_t bytes = 0;
+    std::vector<std::string> records(ops.size());
+    std::unordered_map<std::size_t, bool> exists;
+    for (std::size_t i = 0; i < ops.size(); ++i)
+    {
+        TransactionOp &op = ops[i];
+        if (op.kind != TransactionOp::ERASE)
+        {
+            records[i] = toBinary(op.comic);
+            bytes += records[i].size();
+        }
+        if (op.kind == TransactionOp::CREATE)
+        {
+            op.id = nextId++;
+            exists[op.id] = true;
+            continue;
+        }
+        auto it = exists.find(op.id);
+        if (it == exists.end())
+        {
+            it = exists.emplace(op.id, live(op.id)).first;
+        }
+        if (!it->second)
+        {
+            failed = i;
+            return false;
+        }
+        it->second = op.kind != TransactionOp::ERASE;
+        ids = std::max(ids, op.id + 1);
+    }
+    reserve(std::max(ids, nextId), bytes);
+
+    WriteScope scope(*m_header);
+    for (std::size_t i = 0; i < ops.size(); ++i)
+    {
+        if (ops[i].kind == TransactionOp::ERASE)
+        {
+            m_slots[ops[i].id].store(0, std::memory_order_release);
+        }
+        else
+        {
+            store(ops[i].id, records[i]);
+        }
+    }
+    m_header->nextId.store(nextId, std::memory_order_release);
+    return true;
+}
+
+std::size_t SharedStore::nextId() const
+{
+    return m_header->nextId.load(std::memory_order_acquire);
+}
+
+std::vector<std::pair<const char *, std::uint64_t>> SharedStore::usage() const
+{
+    return {{"used", m_header->used.load(std::memory_order_acquire)},
+            {"capacity", m_header->capacity},
+            {"slots", m_header->slots}};
+}
+
+void SharedStore::compact(const std::string &path, std::size_t capacity,
+                          LockProfiler &profiler, const Progress &progress)
+{
+    struct stat status;
+    if (::stat(path.c_str(), &status) != 0 || status.st_size == 0)
+    {
+        return;
+    }
+    // Holding the old file writable keeps other writers out until the new
+    // one has replaced it.
+    SharedStore old(path, capacity, true, profiler);
+    const std::size_t end = old.nextId();
+    std::uint64_t live = 0;
+    for (std::size_t id = 0; id < end; ++id)
+    {
+        live += old.m_slots[id].load() & MAX_RECORD;
+    }
+    const std::uint64_t used = old.m_header->used.load();
+    const std::uint64_t oldCapacity = old.m_header->capacity;
+    const std::uint64_t newCapacity = std::max<std::uint64_t>(capacity,
+                                                              oldCapacity);
+    if (newCapacity == oldCapacity && (used - 8 - live) * 4 < oldCapacity)
+    {
+        return;
+    }
+
+    const std::string temp = path + ".compact";
+    ::unlink(temp.c_str());
+    {
+        SharedStore fresh(temp, newCapacity, true, profiler);
+        for (std::size_t id = 0; id < end; ++id)
+        {
+            const std::uint64_t slot = old.m_slots[id].load();
+            if (slot != 0)
+            {
+                fresh.store(id, std::string(old.m_arena + (slot >> SIZE_BITS),
+                                            slot & MAX_RECORD));
+            }
+        }
+        fresh.m_header->nextId.store(end);
+    }
+    if (::rename(temp.c_str(), path.c_str()) != 0)
+    {
+        throw std::runtime_error(errorText("Couldn't replace", path));
+    }
+    if (progress)
+    {
+        progress("Compacted " + path + " from " + std::to_string(used - 8) +
+                 " to " + std::to_string(live) + " bytes of records in a " +
+                 std::to_string(newCapacity) + " byte arena");
+    }
+}
+
+} // namespace comicsdb
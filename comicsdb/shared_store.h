@@ -0,0 +1,109 @@
+#pragma once
+
+#include "storage.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+// Comics in a memory-mapped file that several server processes map at
+// once: one writer process changes it and any number of reader processes
+// serve from it directly, so N processes hold a single copy of the catalog.
+//
+// The file holds a slot per id and an arena of binary comic records.  The
+// writer appends each new version to the arena and then publishes it by
+// storing the id's slot atomically, so readers take no locks and never see
+// a partial record.  Replaced versions aren't reclaimed while the file is
+// in use, and the number of slots and the arena size are fixed when it is
+// created; compact() rewrites it offline to reclaim them.  A sequence
+// number the writer makes odd while it changes anything lets readers take
+// consistent snapshots.  The file outlives the processes, so the catalog
+// survives restarts, but nothing is synced to disk.
+class SharedStore : public StorageEngine
+{
+  public:
+    using Progress = std::function<void(const std::string &message)>;
+
+    // Opens path, creating it with an arena of capacity bytes if it doesn't
+    // exist.  Only one process may open it writable; a read-only store
+    // throws std::runtime_error on writes.  A writable store reports when
+    // it is 75% and 90% full.  Throws std::runtime_error if the file can't
+    // be mapped or isn't a shared store.
+    SharedStore(const std::string &path, std::size_t capacity, bool writable,
+                LockProfiler &profiler, const Progress &progress = nullptr);
+    ~SharedStore() override;
+    SharedStore(const SharedStore &) = delete;
+    SharedStore &operator=(const SharedStore &) = delete;
+
+    const char *name() const override { return "shared"; }
+
+    bool get(std::size_t id, Comic &comic,
+             const TracePtr &trace = nullptr) const override;
+    bool contains(std::size_t id) const override;
+    std::size_t create(const Comic &comic,
+                       const TracePtr &trace = nullptr) override;
+    bool update(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+    bool erase(std::size_t id, const TracePtr &trace = nullptr) override;
+    bool insert(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+
+    void scan(const std::function<void(std::size_t, const Comic &)> &visit)
+        const override;
+    // Retries until no write overlapped the copy.
+    std::vector<std::pair<std::size_t, Comic>> snapshot() const override;
+    std::size_t importBatch(std::vector<Comic> comics) override;
+    bool applyTransaction(std::vector<TransactionOp> &ops, std::size_t &failed,
+                          const TracePtr &trace = nullptr) override;
+
+    std::size_t nextId() const override;
+    // The arena bytes used and available and the number of slots.
+    std::vector<std::pair<const char *, std::uint64_t>>
+    usage() const override;
+
+    // Rewrites the store at path, if there is one, with only its live
+    // comics and an arena of at least capacity bytes when that frees a
+    // quarter of the arena or grows it, and reports what it did.  No other
+    // process may have path open.  Throws std::runtime_error as the
+    // constructor does.
+    static void compact(const std::string &path, std::size_t capacity,
+                        LockProfiler &profiler, const Progress &progress);
+
+  private:
+    struct Header;
+    // A record's arena offset shifted left 24 bits plus its size; 0 for an
+    // id with no comic.
+    using Slot = std::atomic<std::uint64_t>;
+
+    // Makes readers' snapshots retry while it lives.
+    class WriteScope;
+
+    void requireWritable() const;
+    bool live(std::size_t id) const;
+    Comic read(std::uint64_t slot) const;
+    // Checks that records of these sizes fit, throwing if they don't.
+    void reserve(std::size_t ids, std::uint64_t bytes) const;
+    void store(std::size_t id, const std::string &record);
+
+    const std::string m_path;
+    const bool m_writable;
+    const Progress m_progress;
+    int m_fd{-1};
+    void *m_map{};
+    std::size_t m_mapSize{};
+    Header *m_header{};
+    Slot *m_slots{};
+    char *m_arena{};
+
+    // Serializes the writer process's threads.
+    mutable ProfiledMutex m_mutex;
+    unsigned m_warnAt{75}; // the percent full to report next
+};
+
+} // namespace comicsdb
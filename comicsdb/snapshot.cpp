@@ -0,0 +1,289 @@
+#include "snapshot.h"
+
+#include "file_io.h"
+#include "varint.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+// A snapshot is SNAPSHOT_MAGIC and the next id, then per comic a varint
+// id, a varint length and the comic's binary encoding, then the count of
+// comics and SNAPSHOT_END.  Integers outside varints are in native byte
+// order.
+constexpr char SNAPSHOT_MAGIC[8] = {'C', 'D', 'B', 'S', 'N', 'A', 'P', '1'};
+constexpr char SNAPSHOT_END[8] = {'C', 'D', 'B', 'S', 'E', 'N', 'D', '1'};
+constexpr std::size_t HEADER_SIZE = 16;
+constexpr std::size_t TRAILER_SIZE = 16;
+
+bool readVarint(std::FILE *in, std::uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        const int byte = std::fgetc(in);
+        if (byte == EOF)
+        {
+            return false;
+        }
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+SnapshotWriter::SnapshotWriter(const std::string &path, std::size_t nextId) :
+    m_path(path),
+    m_temp(path + ".tmp")
+{
+    m_out = std::fopen(m_temp.c_str(), "wb");
+    if (m_out == nullptr)
+    {
+        throw std::runtime_error(errorText("Couldn't create", m_temp));
+    }
+    std::setvbuf(m_out, nullptr, _IOFBF, 1 << 20);
+    const std::uint64_t next = nextId;
+    std::string header{SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)};
+    header.append(reinterpret_cast<const char *>(&next), sizeof(next));
+    write(header);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (m_out != nullptr)
+    {
+        std::fclose(m_out);
+        std::remove(m_temp.c_str());
+    }
+}
+
+void SnapshotWriter::add(std::size_t id, const Comic &comic)
+{
+    m_buffer.clear();
+    appendVarint(id, m_buffer);
+    const std::size_t prefix = m_buffer.size();
+    appendBinary(comic, m_buffer);
+    std::string size;
+    appendVarint(m_buffer.size() - prefix, size);
+    m_buffer.insert(prefix, size);
+    write(m_buffer);
+    ++m_count;
+}
+
+void SnapshotWriter::finish()
+{
+    std::string trailer{reinterpret_cast<const char *>(&m_count),
+                        sizeof(m_count)};
+    trailer.append(SNAPSHOT_END, sizeof(SNAPSHOT_END));
+    write(trailer);
+
+    const bool failed =
+        std::fflush(m_out) != 0 || ::fsync(::fileno(m_out)) != 0;
+    std::fclose(m_out);
+    m_out = nullptr;
+    if (failed || std::rename(m_temp.c_str(), m_path.c_str()) != 0)
+    {
+        const std::string error = errorText("Couldn't write", m_path);
+        std::remove(m_temp.c_str());
+        throw std::runtime_error(error);
+    }
+}
+
+void SnapshotWriter::write(const std::string &bytes)
+{
+    if (std::fwrite(bytes.data(), 1, bytes.size(), m_out) != bytes.size())
+    {
+        throw std::runtime_error(errorText("Couldn't write", m_temp));
+    }
+}
+
+Snapshot readSnapshot(const std::string &path)
+{
+    std::unique_ptr<std::FILE, int (*)(std::FILE *)> in(
+        std::fopen(path.c_str(), "rb"), &std::fclose);
+    if (!in)
+    {
+        throw std::runtime_error(errorText("Couldn't open", path));
+    }
+    const auto corrupt = [&path]
+    { return std::runtime_error(path + " isn't a complete snapshot"); };
+
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    std::uint64_t nextId{};
+    std::uint64_t count{};
+    char end[sizeof(SNAPSHOT_END)];
+    if (std::fread(magic, sizeof(magic), 1, in.get()) != 1 ||
+        std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+        std::fread(&nextId, sizeof(nextId), 1, in.get()) != 1 ||
+        ::fseeko(in.get(), -static_cast<off_t>(TRAILER_SIZE), SEEK_END) != 0 ||
+        std::fread(&count, sizeof(count), 1, in.get()) != 1 ||
+        std::fread(end, sizeof(end), 1, in.get()) != 1 ||
+        std::memcmp(end, SNAPSHOT_END, sizeof(end)) != 0)
+    {
+        throw corrupt();
+    }
+    const off_t body = ::ftello(in.get()) - static_cast<off_t>(TRAILER_SIZE);
+    ::fseeko(in.get(), HEADER_SIZE, SEEK_SET);
+
+    Snapshot snapshot;
+    snapshot.nextId = static_cast<std::size_t>(nextId);
+    snapshot.comics.reserve(count);
+    std::string bytes;
+    for (std::uint64_t i = 0; i < count; ++i)
+    {
+        std::uint64_t id{};
+        std::uint64_t size{};
+        if (!readVarint(in.get(), id) || !readVarint(in.get(), size) ||
+            id >= nextId ||
+            size > static_cast<std::uint64_t>(body - ::ftello(in.get())))
+        {
+            throw corrupt();
+        }
+        bytes.resize(size);
+        if (size != 0 && std::fread(&bytes[0], size, 1, in.get()) != 1)
+        {
+            throw corrupt();
+        }
+        snapshot.comics.emplace_back(id, fromBinary(bytes.data(), size));
+    }
+    if (::ftello(in.get()) != body)
+    {
+        throw corrupt();
+    }
+    return snapshot;
+}
+
+BackgroundSaver::BackgroundSaver(const StorageEngine &engine,
+                                 const std::string &path,
+                                 AsyncLogger &logger) :
+    m_engine(engine),
+    m_path(path),
+    m_logger(logger)
+{
+}
+
+BackgroundSaver::~BackgroundSaver()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_child > 0)
+    {
+        int status = 0;
+        while (::waitpid(m_child, &status, 0) < 0 && errno == EINTR)
+        {
+        }
+        finished(status);
+    }
+}
+
+bool BackgroundSaver::start()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_child != 0)
+    {
+        return false;
+    }
+    const std::filesystem::path dir =
+        std::filesystem::path{m_path}.parent_path();
+    std::error_code error;
+    if (!dir.empty())
+    {
+        std::filesystem::create_directories(dir, error);
+    }
+    if (error)
+    {
+        throw std::runtime_error("Couldn't create " + dir.string() + ": " +
+                                 error.message());
+    }
+    m_started = Clock::now();
+    m_child = m_engine.saveInBackground(m_path);
+    if (m_child == 0)
+    {
+        return false;
+    }
+    m_logger.log(restbed::Logger::INFO, "Snapshot started by process %d",
+                 static_cast<int>(m_child));
+    return true;
+}
+
+void BackgroundSaver::poll()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    int status = 0;
+    if (m_child > 0 && ::waitpid(m_child, &status, WNOHANG) == m_child)
+    {
+        finished(status);
+    }
+}
+
+void BackgroundSaver::finished(int status)
+{
+    const std::chrono::duration<double> elapsed = Clock::now() - m_started;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        ++m_saves;
+        m_lastSeconds = elapsed.count();
+        m_lastSaved = std::chrono::system_clock::now();
+        m_logger.log(restbed::Logger::INFO, "Snapshot saved to %s in %.1fs",
+                     m_path.c_str(), m_lastSeconds);
+    }
+    else
+    {
+        ++m_failures;
+        m_logger.log(restbed::Logger::ERROR,
+                     "Snapshot to %s failed after %.1fs", m_path.c_str(),
+                     elapsed.count());
+    }
+    m_child = 0;
+}
+
+std::string BackgroundSaver::toJson() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("path");
+    writer.String(m_path.c_str());
+    writer.Key("running");
+    writer.Bool(m_child != 0);
+    writer.Key("saves");
+    writer.Uint64(m_saves);
+    writer.Key("failures");
+    writer.Uint64(m_failures);
+    writer.Key("last_seconds");
+    writer.Double(m_lastSeconds);
+    writer.Key("last_saved");
+    if (m_saves == 0)
+    {
+        writer.Null();
+    }
+    else
+    {
+        writer.Int64(std::chrono::duration_cast<std::chrono::seconds>(
+                         m_lastSaved.time_since_epoch())
+                         .count());
+    }
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+} // namespace comicsdb
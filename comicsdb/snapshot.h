@@ -0,0 +1,96 @@
+#pragma once
+
+#include "comic.h"
+#include "logger.h"
+#include "storage.h"
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+// Writes a snapshot file: every comic with its id, then a trailer holding
+// the count.  The file is written under a temporary name and renamed into
+// place by finish(), so a snapshot at path is always complete.
+class SnapshotWriter
+{
+  public:
+    SnapshotWriter(const std::string &path, std::size_t nextId);
+    ~SnapshotWriter();
+    SnapshotWriter(const SnapshotWriter &) = delete;
+    SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+    void add(std::size_t id, const Comic &comic);
+    void finish();
+
+  private:
+    void write(const std::string &bytes);
+
+    const std::string m_path;
+    const std::string m_temp;
+    std::FILE *m_out{};
+    std::uint64_t m_count{};
+    std::string m_buffer;
+};
+
+// The memory engine's snapshot in --data-dir, restored on startup.
+constexpr const char *SNAPSHOT_FILE = "snapshot.cdb";
+
+struct Snapshot
+{
+    std::size_t nextId{};
+    std::vector<std::pair<std::size_t, Comic>> comics;
+};
+
+// Throws std::runtime_error if path isn't a complete snapshot.
+Snapshot readSnapshot(const std::string &path);
+
+// BGSAVE-style snapshots of an engine that doesn't persist itself.  Each
+// save forks a child process that writes the copy-on-write image of the
+// engine to path while the parent keeps serving; only writers wait, and
+// only for the fork itself.  Saves are started by start() and finished
+// children are reaped by poll(), both called from the service's scheduler
+// or request handlers.
+class BackgroundSaver
+{
+  public:
+    BackgroundSaver(const StorageEngine &engine, const std::string &path,
+                    AsyncLogger &logger);
+    // Waits for a running save to finish.
+    ~BackgroundSaver();
+    BackgroundSaver(const BackgroundSaver &) = delete;
+    BackgroundSaver &operator=(const BackgroundSaver &) = delete;
+
+    // Returns false without starting anything if a save is running or the
+    // engine can't be saved this way.  Throws std::runtime_error if the
+    // child can't be started.
+    bool start();
+    void poll();
+    std::string toJson() const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    void finished(int status);
+
+    const StorageEngine &m_engine;
+    const std::string m_path;
+    AsyncLogger &m_logger;
+    mutable std::mutex m_mutex;
+    pid_t m_child{};
+    Clock::time_point m_started;
+    std::uint64_t m_saves{};
+    std::uint64_t m_failures{};
+    double m_lastSeconds{};
+    std::chrono::system_clock::time_point m_lastSaved;
+};
+
+} // namespace comicsdb
@@ -0,0 +1,213 @@
+#include "stats.h"
+
+#include "series.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <chrono>
+#include <map>
+#include <vector>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+// Differences listed in a verification report.
+constexpr std::size_t MAX_DIFFERENCES = 100;
+
+using Writer = rapidjson::Writer<rapidjson::StringBuffer>;
+
+void writeStats(Writer &writer, const CatalogStats &stats)
+{
+    writer.StartObject();
+    writer.Key("comics");
+    writer.Uint64(stats.comics);
+    writer.Key("series");
+    writer.Uint64(stats.series);
+    writer.Key("creators");
+    writer.Uint64(stats.creators);
+    writer.Key("credits");
+    writer.StartObject();
+    for (int r = 0; r < CreatorCatalog::ROLES; ++r)
+    {
+        writer.Key(
+            CreatorCatalog::roleName(static_cast<CreatorCatalog::Role>(r)));
+        writer.Uint64(stats.credits[r]);
+    }
+    writer.EndObject();
+    writer.EndObject();
+}
+
+CatalogStats countStats(const SeriesCatalog &series,
+                        const CreatorCatalog &creators)
+{
+    CatalogStats stats;
+    stats.comics = series.comics();
+    stats.series = series.size();
+    stats.creators = creators.size();
+    stats.credits = creators.credits();
+    return stats;
+}
+
+// Collects what differs between the running and rebuilt counts.
+class Differences
+{
+  public:
+    void compare(const std::string &what, std::size_t running,
+                 std::size_t rebuilt)
+    {
+        if (running == rebuilt)
+        {
+            return;
+        }
+        ++m_count;
+        if (m_found.size() < MAX_DIFFERENCES)
+        {
+            m_found.push_back(what + ": " + std::to_string(running) +
+                              " counted, " + std::to_string(rebuilt) +
+                              " rebuilt");
+        }
+    }
+
+    std::size_t count() const { return m_count; }
+    const std::vector<std::string> &found() const { return m_found; }
+
+  private:
+    std::size_t m_count{};
+    std::vector<std::string> m_found;
+};
+
+} // namespace
+
+CatalogStats currentStats(const IndexedStore &index)
+{
+    return countStats(index.series(), index.creators());
+}
+
+std::string toJson(const CatalogStats &stats)
+{
+    rapidjson::StringBuffer buffer;
+    Writer writer(buffer);
+    writeStats(writer, stats);
+    return buffer.GetString();
+}
+
+bool seriesStats(const IndexedStore &index, const std::string &title,
+                 std::string &json)
+{
+    const std::size_t comics = index.series().count(title);
+    if (comics == 0)
+    {
+        return false;
+    }
+    rapidjson::StringBuffer buffer;
+    Writer writer(buffer);
+    writer.StartObject();
+    writer.Key("title");
+    writer.String(title.c_str(),
+                  static_cast<rapidjson::SizeType>(title.size()));
+    writer.Key("comics");
+    writer.Uint64(comics);
+    writer.EndObject();
+    json = buffer.GetString();
+    return true;
+}
+
+std::string verifyStats(const IndexedStore &index)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const SeriesCatalog series(index);
+    const CreatorCatalog creators(index);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const CatalogStats running = currentStats(index);
+    const CatalogStats rebuilt = countStats(series, creators);
+
+    Differences differences;
+    differences.compare("comics", running.comics, rebuilt.comics);
+    differences.compare("series", running.series, rebuilt.series);
+    differences.compare("creators", running.creators, rebuilt.creators);
+    for (int r = 0; r < CreatorCatalog::ROLES; ++r)
+    {
+        differences.compare(
+            std::string{"credits as "} +
+                CreatorCatalog::roleName(static_cast<CreatorCatalog::Role>(r)),
+            running.credits[r], rebuilt.credits[r]);
+    }
+
+    // Each series by normalized title, since the catalogs may spell it as
+    // different comics do, and each creator by id, in both catalogs.
+    std::map<std::string, std::pair<std::size_t, std::size_t>> runs;
+    std::map<std::string, std::string> titles;
+    for (const SeriesCatalog::Summary &entry : index.series().list())
+    {
+        const std::string key = normalizeTitle(entry.title);
+        runs[key].first = entry.issues;
+        titles.emplace(key, entry.title);
+    }
+    for (const SeriesCatalog::Summary &entry : series.list())
+    {
+        const std::string key = normalizeTitle(entry.title);
+        runs[key].second = entry.issues;
+        titles.emplace(key, entry.title);
+    }
+    for (const auto &entry : runs)
+    {
+        differences.compare("series " + titles[entry.first],
+                            entry.second.first, entry.second.second);
+    }
+    using Credits = std::array<std::size_t, CreatorCatalog::ROLES>;
+    std::map<std::uint64_t, std::pair<Credits, Credits>> credited;
+    std::map<std::uint64_t, std::string> names;
+    for (const CreatorCatalog::Summary &entry : index.creators().list())
+    {
+        credited[entry.id].first = entry.credits;
+        names[entry.id] = entry.name;
+    }
+    for (const CreatorCatalog::Summary &entry : creators.list())
+    {
+        credited[entry.id].second = entry.credits;
+        names[entry.id] = entry.name;
+    }
+    for (const auto &entry : credited)
+    {
+        for (int r = 0; r < CreatorCatalog::ROLES; ++r)
+        {
+            differences.compare(
+                "creator " + names[entry.first] + " as " +
+                    CreatorCatalog::roleName(
+                        static_cast<CreatorCatalog::Role>(r)),
+                entry.second.first[r], entry.second.second[r]);
+        }
+    }
+
+    rapidjson::StringBuffer buffer;
+    Writer writer(buffer);
+    writer.StartObject();
+    writer.Key("consistent");
+    writer.Bool(differences.count() == 0);
+    writer.Key("rebuild_ms");
+    writer.Uint64(static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(elapsed)
+            .count()));
+    writer.Key("running");
+    writeStats(writer, running);
+    writer.Key("rebuilt");
+    writeStats(writer, rebuilt);
+    writer.Key("difference_count");
+    writer.Uint64(differences.count());
+    writer.Key("differences");
+    writer.StartArray();
+    for (const std::string &difference : differences.found())
+    {
+        writer.String(difference.c_str(),
+                      static_cast<rapidjson::SizeType>(difference.size()));
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+} // namespace comicsdb
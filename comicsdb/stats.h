@@ -0,0 +1,39 @@
+#pragma once
+
+#include "creators.h"
+#include "indexed_store.h"
+
+#include <array>
+#include <cstddef>
+#include <string>
+
+namespace comicsdb
+{
+
+// Counts over the whole catalog for dashboards.
+struct CatalogStats
+{
+    std::size_t comics{};
+    std::size_t series{};
+    std::size_t creators{};
+    std::array<std::size_t, CreatorCatalog::ROLES> credits{}; // per role
+};
+
+// Read from the running counts the catalogs keep as comics are written,
+// so it takes the same time however many comics there are.
+CatalogStats currentStats(const IndexedStore &index);
+// {"comics":N,"series":N,"creators":N,"credits":{"writer":N,...}}
+std::string toJson(const CatalogStats &stats);
+
+// {"title":T,"comics":N} for the series with this title; false if there
+// is none.
+bool seriesStats(const IndexedStore &index, const std::string &title,
+                 std::string &json);
+
+// Rebuilds the series and creator catalogs from a scan of index and
+// compares their counts, totals and each series' and creator's, with the
+// running ones.  Returns a report listing the first differences; writes
+// made during the scan may show up as differences too.
+std::string verifyStats(const IndexedStore &index);
+
+} // namespace comicsdb
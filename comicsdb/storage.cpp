@@ -0,0 +1,96 @@
+#include "storage.h"
+
+#include "log_store.h"
+#include "lsm_store.h"
+#include "shared_store.h"
+#include "snapshot.h"
+#include "store.h"
+
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+
+namespace comicsdb
+{
+
+EngineKind parseEngineKind(const std::string &text)
+{
+    for (EngineKind kind :
+         {EngineKind::MEMORY, EngineKind::LOG, EngineKind::LSM,
+          EngineKind::SHARED})
+    {
+        if (text == engineKindName(kind))
+        {
+            return kind;
+        }
+    }
+    throw std::runtime_error("Unknown storage engine " + text);
+}
+
+const char *engineKindName(EngineKind kind)
+{
+    switch (kind)
+    {
+    case EngineKind::MEMORY:
+        return "memory";
+    case EngineKind::LOG:
+        return "log";
+    case EngineKind::LSM:
+        return "lsm";
+    case EngineKind::SHARED:
+        return "shared";
+    }
+    return "unknown";
+}
+
+std::unique_ptr<StorageEngine> openStorageEngine(const EngineConfig &config,
+                                                 LockProfiler &profiler)
+{
+    if (config.kind == EngineKind::MEMORY)
+    {
+        auto store = std::make_unique<ShardedStore>(config.shards, profiler);
+        const std::filesystem::path snapshot =
+            std::filesystem::path{config.dataDir} / SNAPSHOT_FILE;
+        if (!config.dataDir.empty() && std::filesystem::exists(snapshot))
+        {
+            Snapshot saved = readSnapshot(snapshot.string());
+            store->restore(std::move(saved.comics), saved.nextId);
+        }
+        return store;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(config.dataDir, error);
+    if (error)
+    {
+        throw std::runtime_error("Couldn't create " + config.dataDir + ": " +
+                                 error.message());
+    }
+    const std::filesystem::path dir{config.dataDir};
+    switch (config.kind)
+    {
+    case EngineKind::MEMORY:
+        break;
+    case EngineKind::LOG:
+        return std::make_unique<LogStore>((dir / "log").string(), profiler,
+                                          config.progress);
+    case EngineKind::LSM:
+        return std::make_unique<LsmStore>((dir / "lsm").string(),
+                                          config.memtableBytes, profiler,
+                                          config.progress);
+    case EngineKind::SHARED:
+        // Only the writer may rewrite the file, before starting its readers.
+        if (!config.readOnly)
+        {
+            SharedStore::compact((dir / "shared.cdb").string(),
+                                 config.sharedBytes, profiler, config.progress);
+        }
+        return std::make_unique<SharedStore>((dir / "shared.cdb").string(),
+                                             config.sharedBytes,
+                                             !config.readOnly, profiler,
+                                             config.progress);
+    }
+    throw std::runtime_error("Unknown storage engine");
+}
+
+} // namespace comicsdb
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "comic.h"
+#include "lock_profile.h"
+#include "trace.h"
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+// One step of an atomic multi-operation transaction.
+struct TransactionOp
+{
+    enum Kind
+    {
+        CREATE,
+        UPDATE,
+        ERASE
+    };
+
+    Kind kind{CREATE};
+    std::size_t id{}; // assigned by applyTransaction for creates
+    Comic comic;
+};
+
+// Where and how comics are kept.  The request handlers only talk to this
+// interface, so engines can be chosen per deployment with --engine and
+// benchmarked against each other.  Every method is safe to call from any
+// number of request threads.
+class StorageEngine
+{
+  public:
+    virtual ~StorageEngine() = default;
+
+    virtual const char *name() const = 0;
+
+    virtual bool get(std::size_t id, Comic &comic,
+                     const TracePtr &trace = nullptr) const = 0;
+    virtual bool contains(std::size_t id) const = 0;
+    // Stores a new comic under the next id and returns the id.
+    virtual std::size_t create(const Comic &comic,
+                               const TracePtr &trace = nullptr) = 0;
+    // Replaces an existing comic; false if there is none.
+    virtual bool update(std::size_t id, const Comic &comic,
+                        const TracePtr &trace = nullptr) = 0;
+    virtual bool erase(std::size_t id, const TracePtr &trace = nullptr) = 0;
+    // Stores a new comic under an id chosen by the caller, as a router
+    // handing out ids for several servers does; false if the id is taken.
+    // Later creates get higher ids.
+    virtual bool insert(std::size_t id, const Comic &comic,
+                        const TracePtr &trace = nullptr) = 0;
+
+    // Calls visit for every live comic, in no particular order and without
+    // stopping writers, so concurrent changes may or may not be seen.
+    // visit must not write to the engine.
+    virtual void
+    scan(const std::function<void(std::size_t, const Comic &)> &visit)
+        const = 0;
+    // A consistent copy of every live comic, ordered by id.
+    virtual std::vector<std::pair<std::size_t, Comic>> snapshot() const = 0;
+
+    // Adds all the comics at once under consecutive ids and returns the
+    // first id.
+    virtual std::size_t importBatch(std::vector<Comic> comics) = 0;
+    // Applies the operations in order, or none of them if an update or
+    // delete names a comic that doesn't exist at that point; failed is then
+    // the index of the offending operation.
+    virtual bool applyTransaction(std::vector<TransactionOp> &ops,
+                                  std::size_t &failed,
+                                  const TracePtr &trace = nullptr) = 0;
+
+    // The id the next create will get.
+    virtual std::size_t nextId() const = 0;
+    // Named counts of how full an engine with fixed limits is, reported
+    // by GET /admin/storage.  The others return none.
+    virtual std::vector<std::pair<const char *, std::uint64_t>> usage() const
+    {
+        return {};
+    }
+
+    // Background upkeep such as merging files, called every second from
+    // the service's scheduler.  It must return quickly.
+    virtual void maintain() {}
+
+    // Starts writing a point-in-time snapshot to path from a forked child
+    // process and returns its pid, for engines that don't persist their
+    // data themselves.  The others return 0.  Throws std::runtime_error if
+    // the process can't be forked.
+    virtual pid_t saveInBackground(const std::string & /*path*/) const
+    {
+        return 0;
+    }
+};
+
+enum class EngineKind
+{
+    MEMORY,
+    LOG,
+    LSM,
+    SHARED
+};
+
+// Throws std::runtime_error for an unknown engine name.
+EngineKind parseEngineKind(const std::string &text);
+const char *engineKindName(EngineKind kind);
+
+struct EngineConfig
+{
+    EngineKind kind{EngineKind::MEMORY};
+    std::size_t shards{16};
+    std::string dataDir;
+    std::size_t memtableBytes{64 << 20};
+    // Called with recovery progress messages and warnings, possibly from
+    // other threads.
+    std::function<void(const std::string &message)> progress;
+    std::size_t sharedBytes{std::size_t{1} << 30};
+    // Opens the shared engine for reading only, as reader processes do.
+    bool readOnly{};
+};
+
+// Creates the engine, recovering any data the persistent engines find in
+// config.dataDir, or the memory engine's last snapshot there.  Throws
+// std::runtime_error if the data can't be opened.
+std::unique_ptr<StorageEngine> openStorageEngine(const EngineConfig &config,
+                                                 LockProfiler &profiler);
+
+} // namespace comicsdb
@@ -0,0 +1,520 @@
+#include "store.h"
+
+#include "snapshot.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+// How many times a queued writer yields, waiting for the combiner to apply
+// its mutation, before blocking on the shard lock itself.
+constexpr int SPIN_LIMIT = 64;
+
+// Passes over the queue a combiner makes before releasing the lock, so a
+// steady stream of writers can't keep one thread combining forever.
+constexpr int COMBINE_PASSES = 4;
+
+} // namespace
+
+// A write queued on a shard.  It lives on the requesting thread's stack; the
+// combiner must not touch it after setting done.
+struct ShardedStore::Mutation
+{
+    enum Kind
+    {
+        CREATE,
+        INSERT,
+        UPDATE,
+        ERASE
+    };
+
+    Mutation(Kind kind, std::size_t id, const Comic *comic) :
+        kind(kind),
+        id(id),
+        comic(comic)
+    {
+    }
+
+    const Kind kind;
+    const std::size_t id;
+    const Comic *const comic;
+    LockSite site() const
+    {
+        return kind == CREATE || kind == INSERT ? LockSite::CREATE_COMIC
+               : kind == UPDATE                 ? LockSite::UPDATE_COMIC
+                                                : LockSite::DELETE_COMIC;
+    }
+
+    Mutation *next{};
+    bool result{};
+    std::exception_ptr error;
+    std::atomic<bool> done{false};
+};
+
+ShardedStore::ShardedStore(std::size_t shards, LockProfiler &profiler) :
+    m_profiler(profiler)
+{
+    m_shards.reserve(std::max<std::size_t>(shards, 1));
+    for (std::size_t i = 0; i < std::max<std::size_t>(shards, 1); ++i)
+    {
+        m_shards.push_back(std::make_unique<Shard>(profiler));
+    }
+}
+
+const Comic *ShardedStore::Shard::find(std::size_t slot) const
+{
+    if (slot < comics.size())
+    {
+        return comics[slot].issue == Comic::DELETED_ISSUE ? nullptr
+                                                          : &comics[slot];
+    }
+    const auto it = sparse.find(slot);
+    return it == sparse.end() || it->second.issue == Comic::DELETED_ISSUE
+               ? nullptr
+               : &it->second;
+}
+
+Comic &ShardedStore::Shard::place(std::size_t slot)
+{
+    if (slot < comics.size())
+    {
+        return comics[slot];
+    }
+    if (slot > comics.size())
+    {
+        return sparse[slot];
+    }
+    comics.emplace_back();
+    for (auto it = sparse.find(comics.size()); it != sparse.end();
+         it = sparse.find(comics.size()))
+    {
+        comics.push_back(std::move(it->second));
+        sparse.erase(it);
+    }
+    return comics[slot];
+}
+
+void ShardedStore::Shard::drop(std::size_t slot)
+{
+    if (slot < comics.size())
+    {
+        comics[slot] = Comic{};
+    }
+    else
+    {
+        sparse.erase(slot);
+    }
+}
+
+ShardedStore::Shard &ShardedStore::shard(std::size_t id) const
+{
+    return *m_shards[id % m_shards.size()];
+}
+
+void ShardedStore::visitShard(
+    std::size_t s,
+    const std::function<void(std::size_t, const Comic &)> &visit) const
+{
+    const std::size_t count = m_shards.size();
+    const Shard &owner = *m_shards[s];
+    for (std::size_t index = 0; index < owner.comics.size(); ++index)
+    {
+        if (owner.comics[index].issue != Comic::DELETED_ISSUE)
+        {
+            visit(index * count + s, owner.comics[index]);
+        }
+    }
+    for (const auto &entry : owner.sparse)
+    {
+        if (entry.second.issue != Comic::DELETED_ISSUE)
+        {
+            visit(entry.first * count + s, entry.second);
+        }
+    }
+}
+
+bool ShardedStore::get(std::size_t id, Comic &comic,
+                       const TracePtr &trace) const
+{
+    const Shard &owner = shard(id);
+    ProfiledSharedLock lock(owner.mutex, LockSite::READ_COMIC, trace);
+    const Comic *found = owner.find(slot(id));
+    if (found == nullptr)
+    {
+        return false;
+    }
+    comic = *found;
+    return true;
+}
+
+bool ShardedStore::contains(std::size_t id) const
+{
+    const Shard &owner = shard(id);
+    ProfiledSharedLock lock(owner.mutex, LockSite::READ_COMIC);
+    return owner.find(slot(id)) != nullptr;
+}
+
+std::size_t ShardedStore::create(const Comic &comic, const TracePtr &trace)
+{
+    Mutation mutation(Mutation::CREATE, m_nextId++, &comic);
+    commit(mutation, trace);
+    return mutation.id;
+}
+
+bool ShardedStore::update(std::size_t id, const Comic &comic,
+                          const TracePtr &trace)
+{
+    Mutation mutation(Mutation::UPDATE, id, &comic);
+    return commit(mutation, trace);
+}
+
+bool ShardedStore::erase(std::size_t id, const TracePtr &trace)
+{
+    Mutation mutation(Mutation::ERASE, id, nullptr);
+    return commit(mutation, trace);
+}
+
+bool ShardedStore::insert(std::size_t id, const Comic &comic,
+                          const TracePtr &trace)
+{
+    std::size_t next = m_nextId.load();
+    while (next <= id && !m_nextId.compare_exchange_weak(next, id + 1))
+    {
+    }
+    Mutation mutation(Mutation::INSERT, id, &comic);
+    return commit(mutation, trace);
+}
+
+bool ShardedStore::commit(Mutation &mutation, const TracePtr &trace)
+{
+    TraceSpan span(trace, "commit");
+    Shard &owner = shard(mutation.id);
+    mutation.next = owner.pending.load(std::memory_order_relaxed);
+    while (!owner.pending.compare_exchange_weak(mutation.next, &mutation,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed))
+    {
+    }
+
+    {
+        ProfiledLock lock(owner.mutex, mutation.site(), std::try_to_lock);
+        if (lock.owns_lock())
+        {
+            combine(owner);
+        }
+    }
+    for (int spin = 0;
+         spin < SPIN_LIMIT && !mutation.done.load(std::memory_order_acquire);
+         ++spin)
+    {
+        std::this_thread::yield();
+    }
+    if (!mutation.done.load(std::memory_order_acquire))
+    {
+        // Whoever holds the lock has either applied our mutation already or
+        // hasn't taken it from the queue yet, so after we get the lock it's
+        // done or ours to apply.
+        ProfiledLock lock(owner.mutex, mutation.site(), trace);
+        combine(owner);
+    }
+
+    if (mutation.error)
+    {
+        std::rethrow_exception(mutation.error);
+    }
+    return mutation.result;
+}
+
+void ShardedStore::combine(Shard &owner)
+{
+    for (int pass = 0; pass < COMBINE_PASSES; ++pass)
+    {
+        Mutation *queued =
+            owner.pending.exchange(nullptr, std::memory_order_acquire);
+        if (queued == nullptr)
+        {
+            return;
+        }
+
+        // The queue is a stack; apply in arrival order.
+        Mutation *batch = nullptr;
+        std::size_t count = 0;
+        while (queued != nullptr)
+        {
+            Mutation *next = queued->next;
+            queued->next = batch;
+            batch = queued;
+            queued = next;
+            ++count;
+        }
+
+        while (batch != nullptr)
+        {
+            Mutation *next = batch->next;
+            try
+            {
+                batch->result = apply(owner, *batch);
+            }
+            catch (...)
+            {
+                batch->error = std::current_exception();
+            }
+            batch->done.store(true, std::memory_order_release);
+            batch = next;
+        }
+        if (count > 1)
+        {
+            m_profiler.recordBatch(count);
+        }
+    }
+}
+
+bool ShardedStore::apply(Shard &owner, const Mutation &mutation)
+{
+    const std::size_t index = slot(mutation.id);
+    if (mutation.kind == Mutation::CREATE)
+    {
+        // A later id in this shard may have been placed first.
+        owner.place(index) = *mutation.comic;
+        return true;
+    }
+    const bool live = owner.find(index) != nullptr;
+    if (mutation.kind == Mutation::INSERT)
+    {
+        if (live)
+        {
+            return false;
+        }
+        owner.place(index) = *mutation.comic;
+        return true;
+    }
+
+    if (!live)
+    {
+        return false;
+    }
+    if (mutation.kind == Mutation::UPDATE)
+    {
+        owner.place(index) = *mutation.comic;
+    }
+    else
+    {
+        owner.drop(index);
+    }
+    return true;
+}
+
+void ShardedStore::scan(
+    const std::function<void(std::size_t, const Comic &)> &visit) const
+{
+    for (std::size_t s = 0; s < m_shards.size(); ++s)
+    {
+        ProfiledSharedLock lock(m_shards[s]->mutex, LockSite::EXPORT_COMICS);
+        visitShard(s, visit);
+    }
+}
+
+std::vector<std::pair<std::size_t, Comic>> ShardedStore::snapshot() const
+{
+    std::vector<std::unique_ptr<ProfiledSharedLock>> locks;
+    locks.reserve(m_shards.size());
+    for (const std::unique_ptr<Shard> &owner : m_shards)
+    {
+        locks.push_back(std::make_unique<ProfiledSharedLock>(
+            owner->mutex, LockSite::EXPORT_COMICS));
+    }
+
+    std::vector<std::pair<std::size_t, Comic>> comics;
+    for (std::size_t s = 0; s < m_shards.size(); ++s)
+    {
+        visitShard(s, [&comics](std::size_t id, const Comic &comic)
+              { comics.emplace_back(id, comic); });
+    }
+    locks.clear();
+
+    std::sort(comics.begin(), comics.end(),
+              [](const std::pair<std::size_t, Comic> &lhs,
+                 const std::pair<std::size_t, Comic> &rhs)
+              { return lhs.first < rhs.first; });
+    return comics;
+}
+
+std::size_t ShardedStore::importBatch(std::vector<Comic> comics)
+{
+    std::vector<std::unique_ptr<ProfiledLock>> locks;
+    locks.reserve(m_shards.size());
+    for (const std::unique_ptr<Shard> &owner : m_shards)
+    {
+        locks.push_back(std::make_unique<ProfiledLock>(
+            owner->mutex, LockSite::IMPORT_COMICS));
+    }
+
+    const std::size_t first = m_nextId.fetch_add(comics.size());
+    if (!comics.empty())
+    {
+        // Only shards the batch extends without a gap grow their arrays.
+        const std::size_t last = first + comics.size() - 1;
+        for (const std::unique_ptr<Shard> &owner : m_shards)
+        {
+            if (slot(first) <= owner->comics.size())
+            {
+                owner->comics.reserve(slot(last) + 1);
+            }
+        }
+    }
+    for (std::size_t i = 0; i < comics.size(); ++i)
+    {
+        const std::size_t id = first + i;
+        shard(id).place(slot(id)) = std::move(comics[i]);
+    }
+    return first;
+}
+
+void ShardedStore::restore(std::vector<std::pair<std::size_t, Comic>> comics,
+                           std::size_t nextId)
+{
+    std::vector<std::unique_ptr<ProfiledLock>> locks;
+    locks.reserve(m_shards.size());
+    for (const std::unique_ptr<Shard> &owner : m_shards)
+    {
+        locks.push_back(std::make_unique<ProfiledLock>(
+            owner->mutex, LockSite::IMPORT_COMICS));
+    }
+
+    if (nextId > m_nextId.load())
+    {
+        m_nextId = nextId;
+    }
+    for (std::pair<std::size_t, Comic> &entry : comics)
+    {
+        shard(entry.first).place(slot(entry.first)) = std::move(entry.second);
+    }
+}
+
+pid_t ShardedStore::saveInBackground(const std::string &path) const
+{
+    std::vector<std::unique_ptr<ProfiledSharedLock>> locks;
+    locks.reserve(m_shards.size());
+    for (const std::unique_ptr<Shard> &owner : m_shards)
+    {
+        locks.push_back(std::make_unique<ProfiledSharedLock>(
+            owner->mutex, LockSite::EXPORT_COMICS));
+    }
+    const std::size_t nextId = m_nextId.load();
+    const pid_t child = ::fork();
+    if (child != 0)
+    {
+        if (child < 0)
+        {
+            throw std::runtime_error(std::string{"Couldn't fork: "} +
+                                     std::strerror(errno));
+        }
+        return child;
+    }
+
+    // Only this thread exists in the child and nothing writes to its copy
+    // of the shards, so they're read without the locks.  The server waits
+    // for the child when Ctrl-C stops it, so the child ignores that but
+    // can still be killed with SIGTERM; restbed's handlers would swallow
+    // both.
+    std::signal(SIGINT, SIG_IGN);
+    std::signal(SIGTERM, SIG_DFL);
+    try
+    {
+        SnapshotWriter writer(path, nextId);
+        for (std::size_t s = 0; s < m_shards.size(); ++s)
+        {
+            visitShard(s, [&writer](std::size_t id, const Comic &comic)
+                  { writer.add(id, comic); });
+        }
+        writer.finish();
+    }
+    catch (...)
+    {
+        ::_exit(1);
+    }
+    ::_exit(0);
+}
+
+bool ShardedStore::applyTransaction(std::vector<TransactionOp> &ops,
+                                    std::size_t &failed,
+                                    const TracePtr &trace)
+{
+    for (TransactionOp &op : ops)
+    {
+        if (op.kind == TransactionOp::CREATE)
+        {
+            op.id = m_nextId++;
+        }
+    }
+
+    std::vector<std::size_t> touched;
+    for (const TransactionOp &op : ops)
+    {
+        touched.push_back(op.id % m_shards.size());
+    }
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+
+    std::vector<std::unique_ptr<ProfiledLock>> locks;
+    locks.reserve(touched.size());
+    for (std::size_t index : touched)
+    {
+        locks.push_back(std::make_unique<ProfiledLock>(
+            m_shards[index]->mutex, LockSite::TRANSACTION, trace));
+    }
+    TraceSpan apply(trace, "apply");
+
+    // Check every step against the state left by the steps before it.
+    std::unordered_map<std::size_t, bool> exists;
+    for (std::size_t i = 0; i < ops.size(); ++i)
+    {
+        const TransactionOp &op = ops[i];
+        if (op.kind == TransactionOp::CREATE)
+        {
+            exists[op.id] = true;
+            continue;
+        }
+        auto it = exists.find(op.id);
+        if (it == exists.end())
+        {
+            const bool live = shard(op.id).find(slot(op.id)) != nullptr;
+            it = exists.emplace(op.id, live).first;
+        }
+        if (!it->second)
+        {
+            failed = i;
+            return false;
+        }
+        it->second = op.kind != TransactionOp::ERASE;
+    }
+
+    for (TransactionOp &op : ops)
+    {
+        Shard &owner = shard(op.id);
+        if (op.kind == TransactionOp::ERASE)
+        {
+            owner.drop(slot(op.id));
+        }
+        else
+        {
+            owner.place(slot(op.id)) = std::move(op.comic);
+        }
+    }
+    return true;
+}
+
+} // namespace comicsdb
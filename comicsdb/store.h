@@ -0,0 +1,106 @@
+#pragma once
+
+#include "storage.h"
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace comicsdb
+{
+
+// In-memory comics split into independently locked shards.  Id i lives in
+// shard i % N at slot i / N, and ids are handed out in order, so consecutive
+// creates land in different shards and writers to different shards never
+// wait on each other.  Operations spanning the whole store take every shard
+// lock in shard order, so they see or apply a consistent state.
+//
+// Each shard keeps its slots in an array up to the first gap and any comic
+// placed beyond the gap in a hash map, so ids inserted from elsewhere, such
+// as a router's that spread the cluster's ids over its backends, cost
+// memory only for the comics this store holds.
+//
+// Writes to a shard are flat combined: each writer queues its mutation on
+// the shard, and whichever thread holds the shard lock applies every queued
+// mutation in one pass while the others wait for theirs to be marked done,
+// instead of each taking the lock in turn.
+class ShardedStore : public StorageEngine
+{
+  public:
+    ShardedStore(std::size_t shards, LockProfiler &profiler);
+
+    const char *name() const override { return "memory"; }
+
+    bool get(std::size_t id, Comic &comic,
+             const TracePtr &trace = nullptr) const override;
+    bool contains(std::size_t id) const override;
+    std::size_t create(const Comic &comic,
+                       const TracePtr &trace = nullptr) override;
+    bool update(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+    bool erase(std::size_t id, const TracePtr &trace = nullptr) override;
+    bool insert(std::size_t id, const Comic &comic,
+                const TracePtr &trace = nullptr) override;
+
+    // Visits one shard at a time under its shared lock.
+    void scan(const std::function<void(std::size_t, const Comic &)> &visit)
+        const override;
+    // Takes every shard lock, so the copy is consistent.
+    std::vector<std::pair<std::size_t, Comic>> snapshot() const override;
+    std::size_t importBatch(std::vector<Comic> comics) override;
+    // Puts back the comics of a snapshot under their own ids.
+    void restore(std::vector<std::pair<std::size_t, Comic>> comics,
+                 std::size_t nextId);
+
+    // Takes every shard lock the operations touch once, in shard order.
+    bool applyTransaction(std::vector<TransactionOp> &ops, std::size_t &failed,
+                          const TracePtr &trace = nullptr) override;
+
+    std::size_t shardCount() const { return m_shards.size(); }
+    std::size_t nextId() const override { return m_nextId.load(); }
+
+    // Forks while holding every shard lock shared, so writers pause only
+    // for the fork itself; the child writes its copy-on-write image.
+    pid_t saveInBackground(const std::string &path) const override;
+
+  private:
+    struct Mutation;
+
+    struct alignas(64) Shard
+    {
+        explicit Shard(LockProfiler &profiler) : mutex(profiler) {}
+
+        // The live comic in slot, or null.
+        const Comic *find(std::size_t slot) const;
+        // Where to put the comic for slot, moving comics from sparse into
+        // comics once it closes the gap before them.
+        Comic &place(std::size_t slot);
+        void drop(std::size_t slot);
+
+        mutable ProfiledMutex mutex;
+        std::atomic<Mutation *> pending{nullptr};
+        std::vector<Comic> comics; // by slot, deleted ones left in place
+        // By slot, every one past the end of comics.
+        std::unordered_map<std::size_t, Comic> sparse;
+    };
+
+    Shard &shard(std::size_t id) const;
+    // Visits the live comics of shard s with their ids, in no order.
+    void visitShard(
+        std::size_t s,
+        const std::function<void(std::size_t, const Comic &)> &visit) const;
+    bool commit(Mutation &mutation, const TracePtr &trace);
+    void combine(Shard &owner);
+    bool apply(Shard &owner, const Mutation &mutation);
+    std::size_t slot(std::size_t id) const { return id / m_shards.size(); }
+
+    LockProfiler &m_profiler;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    std::atomic<std::size_t> m_nextId{0};
+};
+
+} // namespace comicsdb
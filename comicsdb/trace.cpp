@@ -0,0 +1,161 @@
+#include "trace.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+
+namespace comicsdb
+{
+
+Trace::Trace(Tracer &tracer, const char *operation, std::uint64_t id) :
+    m_tracer(tracer),
+    m_operation(operation),
+    m_id(id),
+    m_start(tracer.now())
+{
+    m_spans.reserve(8);
+}
+
+Trace::~Trace()
+{
+    m_tracer.complete(*this);
+}
+
+void Trace::add(const char *stage, std::uint64_t start, std::uint64_t end)
+{
+    m_spans.push_back({stage, start, end - start});
+}
+
+void Trace::add(const char *stage, std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end)
+{
+    add(stage, m_tracer.since(start), m_tracer.since(end));
+}
+
+TraceSpan::TraceSpan(const TracePtr &trace, const char *stage) :
+    m_trace(trace.get()),
+    m_stage(stage)
+{
+    if (m_trace != nullptr)
+    {
+        m_start = m_trace->m_tracer.now();
+    }
+}
+
+TraceSpan::~TraceSpan()
+{
+    end();
+}
+
+void TraceSpan::end()
+{
+    if (m_trace != nullptr)
+    {
+        m_trace->add(m_stage, m_start, m_trace->m_tracer.now());
+        m_trace = nullptr;
+    }
+}
+
+Tracer::Tracer(unsigned sampleEvery, std::size_t capacity) :
+    m_sampleEvery(sampleEvery),
+    m_capacity(capacity),
+    m_epoch(std::chrono::steady_clock::now())
+{
+    m_ring.reserve(capacity);
+}
+
+TracePtr Tracer::start(const char *operation)
+{
+    if (m_sampleEvery == 0 || m_capacity == 0)
+    {
+        return nullptr;
+    }
+    const std::uint64_t request =
+        m_requests.fetch_add(1, std::memory_order_relaxed);
+    if (request % m_sampleEvery != 0)
+    {
+        return nullptr;
+    }
+    return std::make_shared<Trace>(*this, operation, request);
+}
+
+std::uint64_t Tracer::now() const
+{
+    return since(std::chrono::steady_clock::now());
+}
+
+std::uint64_t Tracer::since(std::chrono::steady_clock::time_point time) const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time - m_epoch)
+        .count();
+}
+
+void Tracer::complete(Trace &trace)
+{
+    Record record{trace.m_operation, trace.m_id, trace.m_start, now(),
+                  std::move(trace.m_spans)};
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_ring.size() < m_capacity)
+    {
+        m_ring.push_back(std::move(record));
+    }
+    else
+    {
+        m_ring[m_next] = std::move(record);
+    }
+    m_next = (m_next + 1) % m_capacity;
+}
+
+std::string Tracer::chromeTrace() const
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    auto event = [&writer](const char *name, const char *category,
+                           std::uint64_t tid, std::uint64_t start,
+                           std::uint64_t duration)
+    {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(name);
+        writer.Key("cat");
+        writer.String(category);
+        writer.Key("ph");
+        writer.String("X");
+        writer.Key("pid");
+        writer.Uint(1);
+        writer.Key("tid");
+        writer.Uint64(tid);
+        writer.Key("ts");
+        writer.Double(start / 1000.0);
+        writer.Key("dur");
+        writer.Double(duration / 1000.0);
+        writer.EndObject();
+    };
+
+    writer.StartObject();
+    writer.Key("displayTimeUnit");
+    writer.String("ns");
+    writer.Key("traceEvents");
+    writer.StartArray();
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // Each request gets its own row, so stages that continue on another
+        // thread after an asynchronous fetch still nest under the request.
+        for (const Record &record : m_ring)
+        {
+            event(record.operation, "request", record.id, record.start,
+                  record.end - record.start);
+            for (const Span &span : record.spans)
+            {
+                event(span.stage, "stage", record.id, span.start,
+                      span.duration);
+            }
+        }
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+} // namespace comicsdb
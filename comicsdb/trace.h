@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace comicsdb
+{
+
+class Tracer;
+
+// One timed stage of a traced request.
+struct Span
+{
+    const char *stage;
+    std::uint64_t start; // nanoseconds since the tracer was created
+    std::uint64_t duration;
+};
+
+// Stage timings for one sampled request.  A trace is handed to the tracer's
+// ring buffer when the last reference to it goes away, so it can be captured
+// by asynchronous callbacks such as Session::fetch.
+class Trace
+{
+  public:
+    Trace(Tracer &tracer, const char *operation, std::uint64_t id);
+    Trace(const Trace &) = delete;
+    Trace &operator=(const Trace &) = delete;
+    ~Trace();
+
+    void add(const char *stage, std::uint64_t start, std::uint64_t end);
+    void add(const char *stage, std::chrono::steady_clock::time_point start,
+             std::chrono::steady_clock::time_point end);
+
+  private:
+    friend class Tracer;
+    friend class TraceSpan;
+
+    Tracer &m_tracer;
+    const char *m_operation;
+    std::uint64_t m_id;
+    std::uint64_t m_start;
+    std::vector<Span> m_spans;
+};
+
+using TracePtr = std::shared_ptr<Trace>;
+
+// Times a stage from construction until end() or destruction.  Does nothing
+// for requests that weren't sampled.
+class TraceSpan
+{
+  public:
+    TraceSpan(const TracePtr &trace, const char *stage);
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+    ~TraceSpan();
+
+    void end();
+
+  private:
+    Trace *m_trace;
+    const char *m_stage;
+    std::uint64_t m_start{};
+};
+
+// Samples one request in every N and keeps the most recent completed traces
+// in a fixed size ring.
+class Tracer
+{
+  public:
+    Tracer(unsigned sampleEvery, std::size_t capacity);
+
+    // Returns null when this request isn't sampled.
+    TracePtr start(const char *operation);
+    std::uint64_t now() const;
+    std::uint64_t since(std::chrono::steady_clock::time_point time) const;
+
+    // All buffered traces in Chrome trace-event JSON format.
+    std::string chromeTrace() const;
+
+  private:
+    friend class Trace;
+
+    struct Record
+    {
+        const char *operation;
+        std::uint64_t id;
+        std::uint64_t start;
+        std::uint64_t end;
+        std::vector<Span> spans;
+    };
+
+    void complete(Trace &trace);
+
+    const unsigned m_sampleEvery;
+    const std::size_t m_capacity;
+    const std::chrono::steady_clock::time_point m_epoch;
+    std::atomic<std::uint64_t> m_requests{0};
+    mutable std::mutex m_mutex;
+    std::vector<Record> m_ring;
+    std::size_t m_next{};
+};
+
+} // namespace comicsdb
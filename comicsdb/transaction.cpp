@@ -0,0 +1,112 @@
+#include "transaction.h"
+
+#include <rapidjson/document.h>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+constexpr std::size_t MAX_OPERATIONS = 10000;
+
+TransactionOp parseOperation(const rapidjson::Value &value)
+{
+    if (!value.IsObject())
+    {
+        throw std::runtime_error("isn't an object");
+    }
+    const auto op = value.FindMember("op");
+    if (op == value.MemberEnd() || !op->value.IsString())
+    {
+        throw std::runtime_error("missing op");
+    }
+
+    TransactionOp result;
+    const char *kind = op->value.GetString();
+    if (std::strcmp(kind, "create") == 0)
+    {
+        result.kind = TransactionOp::CREATE;
+    }
+    else if (std::strcmp(kind, "update") == 0)
+    {
+        result.kind = TransactionOp::UPDATE;
+    }
+    else if (std::strcmp(kind, "delete") == 0)
+    {
+        result.kind = TransactionOp::ERASE;
+    }
+    else
+    {
+        throw std::runtime_error(std::string{"unknown op "} + kind);
+    }
+
+    if (result.kind != TransactionOp::CREATE)
+    {
+        const auto id = value.FindMember("id");
+        if (id == value.MemberEnd() || !id->value.IsUint64())
+        {
+            throw std::runtime_error("missing id");
+        }
+        result.id = static_cast<std::size_t>(id->value.GetUint64());
+    }
+    if (result.kind != TransactionOp::ERASE)
+    {
+        const auto comic = value.FindMember("comic");
+        if (comic == value.MemberEnd())
+        {
+            throw std::runtime_error("missing comic");
+        }
+        result.comic = fromJson(comic->value);
+        if (!isValid(result.comic))
+        {
+            throw std::runtime_error("invalid comic");
+        }
+    }
+    return result;
+}
+
+} // namespace
+
+std::vector<TransactionOp> parseTransaction(const std::string &json)
+{
+    rapidjson::Document doc;
+    doc.Parse(json.c_str(), json.size());
+    if (doc.HasParseError() || !doc.IsObject())
+    {
+        throw std::runtime_error("invalid JSON");
+    }
+    const auto operations = doc.FindMember("operations");
+    if (operations == doc.MemberEnd() || !operations->value.IsArray() ||
+        operations->value.Empty())
+    {
+        throw std::runtime_error("missing operations");
+    }
+    if (operations->value.Size() > MAX_OPERATIONS)
+    {
+        throw std::runtime_error("more than " +
+                                 std::to_string(MAX_OPERATIONS) +
+                                 " operations");
+    }
+
+    std::vector<TransactionOp> ops;
+    ops.reserve(operations->value.Size());
+    for (rapidjson::SizeType i = 0; i < operations->value.Size(); ++i)
+    {
+        try
+        {
+            ops.push_back(parseOperation(operations->value[i]));
+        }
+        catch (const std::exception &bang)
+        {
+            throw std::runtime_error("operation " + std::to_string(i) + ": " +
+                                     bang.what());
+        }
+    }
+    return ops;
+}
+
+} // namespace comicsdb
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "storage.h"
+
+#include <string>
+#include <vector>
+
+namespace comicsdb
+{
+
+// Parses and validates a POST /transactions body:
+//
+// {"operations":[{"op":"create","comic":{...}},
+//                {"op":"update","id":3,"comic":{...}},
+//                {"op":"delete","id":5}]}
+//
+// Throws std::runtime_error describing the first invalid operation.
+std::vector<TransactionOp> parseTransaction(const std::string &json);
+
+} // namespace comicsdb
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace comicsdb
+{
+
+// LEB128 variable-length integers: seven bits per byte, least significant
+// first, with the high bit set on every byte but the last.
+inline void appendVarint(std::uint64_t value, std::string &out)
+{
+    while (value >= 0x80)
+    {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+// Reads a varint at pos and advances past it.  Returns false if the bytes
+// run out or encode more than 64 bits.
+inline bool readVarint(const char *&pos, const char *end, std::uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && pos != end; shift += 7)
+    {
+        const auto byte = static_cast<unsigned char>(*pos++);
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace comicsdb
@@ -0,0 +1,541 @@
+// Load generator for comicsdb.
+//
+// Drives a weighted mix of GET/PUT/POST/DELETE requests against a running
+// comicsdb from many concurrent keep-alive connections and prints a JSON
+// report of throughput and latency percentiles, overall and per operation.
+//
+// By default each connection sends its next request as soon as the last
+// one is answered.  Such a closed loop sends less while the server stalls,
+// so the stall delays few requests and the percentiles understate it
+// (coordinated omission).  With --rate the requests are sent on a fixed
+// schedule instead and each latency is measured from when its request was
+// due to be sent, so time spent waiting behind a stall counts.
+#include "backend.h"
+#include "comic.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace comicsdb
+{
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+enum Operation
+{
+    OP_GET,
+    OP_PUT,
+    OP_POST,
+    OP_DELETE,
+    NUM_OPERATIONS
+};
+
+const char *const OPERATION_NAMES[NUM_OPERATIONS] = {"get", "put", "post",
+                                                     "delete"};
+
+const char *const USAGE =
+    "Usage: comicsdb_bench [options]\n"
+    "  --host HOST          server address (default 127.0.0.1)\n"
+    "  --port PORT          server port (default 80)\n"
+    "  --connections N      concurrent connections (default 16)\n"
+    "  --duration SECONDS   measured run time (default 10)\n"
+    "  --warmup SECONDS     unmeasured run time first (default 2)\n"
+    "  --rate N             send N requests a second in all on a schedule,\n"
+    "                       0 sends each once the last is answered "
+    "(default 0)\n"
+    "  --mix WEIGHTS        e.g. get=80,put=10,post=5,delete=5\n"
+    "  --ids N              ids addressed by GET/PUT/DELETE (default 2)\n"
+    "  --seed N             random seed (default 1)\n"
+    "  --output PATH        write the JSON report to PATH instead of stdout\n";
+
+struct Config
+{
+    std::string host{"127.0.0.1"};
+    std::uint16_t port{80};
+    unsigned connections{16};
+    double duration{10.0};
+    double warmup{2.0};
+    double rate{}; // requests a second, 0 for a closed loop
+    std::array<double, NUM_OPERATIONS> mix{80.0, 10.0, 5.0, 5.0};
+    std::size_t ids{2};
+    std::uint64_t seed{1};
+    std::string output;
+};
+
+struct StatusCounts
+{
+    std::uint64_t success{}; // 2xx
+    std::uint64_t client{};  // 4xx
+    std::uint64_t server{};  // 5xx
+    std::uint64_t other{};
+    std::uint64_t errors{}; // connection failures
+};
+
+struct WorkerResult
+{
+    std::array<std::vector<std::uint64_t>, NUM_OPERATIONS> latencies;
+    std::array<StatusCounts, NUM_OPERATIONS> status;
+    // Requests due in the measured time but never sent because the
+    // connection was still behind schedule when it ended.
+    std::uint64_t unsent{};
+};
+
+// A request to send.
+struct Call
+{
+    std::string method;
+    std::string path;
+    std::string body;
+};
+
+std::string value(int argc, char *argv[], int &i)
+{
+    if (i + 1 >= argc)
+    {
+        throw std::runtime_error(std::string{"Missing value for "} + argv[i] +
+                                 "\n" + USAGE);
+    }
+    return argv[++i];
+}
+
+std::array<double, NUM_OPERATIONS> parseMix(const std::string &text)
+{
+    std::array<double, NUM_OPERATIONS> mix{};
+    std::istringstream str(text);
+    std::string item;
+    while (std::getline(str, item, ','))
+    {
+        const std::size_t equals = item.find('=');
+        const std::string name = item.substr(0, equals);
+        const auto op = std::find(std::begin(OPERATION_NAMES),
+                                  std::end(OPERATION_NAMES), name);
+        if (equals == std::string::npos || op == std::end(OPERATION_NAMES))
+        {
+            throw std::runtime_error("Invalid mix entry " + item + "\n" +
+                                     USAGE);
+        }
+        mix[op - std::begin(OPERATION_NAMES)] =
+            std::stod(item.substr(equals + 1));
+    }
+    if (std::all_of(mix.begin(), mix.end(), [](double w) { return w <= 0.0; }))
+    {
+        throw std::runtime_error("Mix " + text + " has no positive weights");
+    }
+    return mix;
+}
+
+Config parseCommandLine(int argc, char *argv[])
+{
+    Config config;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--host")
+        {
+            config.host = value(argc, argv, i);
+        }
+        else if (arg == "--port")
+        {
+            config.port =
+                static_cast<std::uint16_t>(std::stoul(value(argc, argv, i)));
+        }
+        else if (arg == "--connections")
+        {
+            config.connections = std::max(
+                1UL, std::stoul(value(argc, argv, i)));
+        }
+        else if (arg == "--duration")
+        {
+            config.duration = std::stod(value(argc, argv, i));
+        }
+        else if (arg == "--warmup")
+        {
+            config.warmup = std::stod(value(argc, argv, i));
+        }
+        else if (arg == "--rate")
+        {
+            config.rate = std::max(0.0, std::stod(value(argc, argv, i)));
+        }
+        else if (arg == "--mix")
+        {
+            config.mix = parseMix(value(argc, argv, i));
+        }
+        else if (arg == "--ids")
+        {
+            config.ids = std::max(1UL, std::stoul(value(argc, argv, i)));
+        }
+        else if (arg == "--seed")
+        {
+            config.seed = std::stoull(value(argc, argv, i));
+        }
+        else if (arg == "--output")
+        {
+            config.output = value(argc, argv, i);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg + "\n" + USAGE);
+        }
+    }
+    return config;
+}
+
+Comic randomComic(std::mt19937_64 &random)
+{
+    Comic comic;
+    comic.title = "Benchmark Tales";
+    comic.issue = static_cast<int>(random() % 1000 + 1);
+    comic.writer = "Stan Lee";
+    comic.penciler = "Jack Kirby";
+    comic.inker = "Joe Sinnott";
+    comic.letterer = "Artie Simek";
+    comic.colorist = "Stan Goldberg";
+    return comic;
+}
+
+Call makeCall(const Config &config, Operation op, std::mt19937_64 &random)
+{
+    const std::string id = std::to_string(random() % config.ids);
+    Call call;
+    switch (op)
+    {
+    case OP_GET:
+        call.method = "GET";
+        call.path = "/comic/" + id;
+        break;
+    case OP_PUT:
+        call.method = "PUT";
+        call.path = "/comic/" + id;
+        call.body = toJson(randomComic(random));
+        break;
+    case OP_POST:
+        call.method = "POST";
+        call.path = "/comic";
+        call.body = toJson(randomComic(random));
+        break;
+    case OP_DELETE:
+    case NUM_OPERATIONS:
+        call.method = "DELETE";
+        call.path = "/comic/" + id;
+        break;
+    }
+    return call;
+}
+
+void count(StatusCounts &counts, int status)
+{
+    if (status >= 200 && status < 300)
+    {
+        ++counts.success;
+    }
+    else if (status >= 400 && status < 500)
+    {
+        ++counts.client;
+    }
+    else if (status >= 500 && status < 600)
+    {
+        ++counts.server;
+    }
+    else
+    {
+        ++counts.other;
+    }
+}
+
+Clock::duration seconds(double value)
+{
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(value));
+}
+
+void runWorker(const Config &config, unsigned index, Clock::time_point start,
+               Clock::time_point end, WorkerResult &result)
+{
+    std::mt19937_64 random(config.seed * 7919 + index);
+    std::discrete_distribution<int> pick(config.mix.begin(), config.mix.end());
+    const Clock::time_point measureFrom = start + seconds(config.warmup);
+    // One keep-alive connection, reopened only if the server closes it.
+    Backend server(config.host + ':' + std::to_string(config.port), 1);
+
+    // With a rate, this connection's share of the schedule, staggered
+    // against the other connections'.
+    const bool scheduled = config.rate > 0.0;
+    const Clock::duration step =
+        seconds(scheduled ? config.connections / config.rate : 0.0);
+    Clock::time_point due = start + step * index / config.connections;
+
+    while (true)
+    {
+        const Clock::time_point now = Clock::now();
+        if (now >= end || (scheduled && due >= end))
+        {
+            break;
+        }
+        // Latency counts from when the request was due, however late the
+        // previous one made it.
+        Clock::time_point sent = now;
+        if (scheduled)
+        {
+            std::this_thread::sleep_until(due);
+            sent = due;
+            due += step;
+        }
+
+        const auto op = static_cast<Operation>(pick(random));
+        const Call call = makeCall(config, op, random);
+        Backend::Headers headers{{"Accept", "application/json"}};
+        if (!call.body.empty())
+        {
+            headers.emplace("Content-Type", "application/json");
+        }
+        int status = -1;
+        try
+        {
+            status = server.exchange(call.method, call.path, call.body,
+                                     headers)
+                         .status;
+        }
+        catch (const std::exception &)
+        {
+        }
+
+        if (sent < measureFrom)
+        {
+            continue;
+        }
+        const Clock::time_point done = Clock::now();
+        result.latencies[op].push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(done - sent)
+                .count());
+        if (status < 0)
+        {
+            ++result.status[op].errors;
+        }
+        else
+        {
+            count(result.status[op], status);
+        }
+    }
+    for (; scheduled && due < end; due += step)
+    {
+        result.unsent += due >= measureFrom ? 1 : 0;
+    }
+}
+
+double percentile(const std::vector<std::uint64_t> &sorted, double fraction)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+    const auto rank = static_cast<std::size_t>(
+        std::ceil(fraction * static_cast<double>(sorted.size())));
+    return static_cast<double>(sorted[std::min(rank, sorted.size()) - 1]) /
+           1000.0;
+}
+
+using JsonWriter = rapidjson::Writer<rapidjson::StringBuffer>;
+
+void writeLatencies(JsonWriter &writer, std::vector<std::uint64_t> &latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0.0;
+    for (std::uint64_t latency : latencies)
+    {
+        sum += static_cast<double>(latency);
+    }
+
+    writer.Key("latency_us");
+    writer.StartObject();
+    writer.Key("mean");
+    writer.Double(latencies.empty() ? 0.0 : sum / latencies.size() / 1000.0);
+    writer.Key("p50");
+    writer.Double(percentile(latencies, 0.50));
+    writer.Key("p99");
+    writer.Double(percentile(latencies, 0.99));
+    writer.Key("p999");
+    writer.Double(percentile(latencies, 0.999));
+    writer.Key("max");
+    writer.Double(latencies.empty() ? 0.0 : latencies.back() / 1000.0);
+    writer.EndObject();
+}
+
+void writeStatus(JsonWriter &writer, const StatusCounts &counts)
+{
+    writer.Key("status");
+    writer.StartObject();
+    writer.Key("2xx");
+    writer.Uint64(counts.success);
+    writer.Key("4xx");
+    writer.Uint64(counts.client);
+    writer.Key("5xx");
+    writer.Uint64(counts.server);
+    writer.Key("other");
+    writer.Uint64(counts.other);
+    writer.Key("errors");
+    writer.Uint64(counts.errors);
+    writer.EndObject();
+}
+
+std::string report(const Config &config, std::vector<WorkerResult> &results)
+{
+    rapidjson::StringBuffer buffer;
+    JsonWriter writer(buffer);
+    writer.StartObject();
+
+    writer.Key("config");
+    writer.StartObject();
+    writer.Key("host");
+    writer.String(config.host.c_str());
+    writer.Key("port");
+    writer.Uint(config.port);
+    writer.Key("connections");
+    writer.Uint(config.connections);
+    writer.Key("duration_s");
+    writer.Double(config.duration);
+    writer.Key("warmup_s");
+    writer.Double(config.warmup);
+    // Closed-loop latencies understate stalls; see the top of this file.
+    writer.Key("schedule");
+    writer.String(config.rate > 0.0 ? "open" : "closed");
+    writer.Key("rate_rps");
+    writer.Double(config.rate);
+    writer.Key("ids");
+    writer.Uint64(config.ids);
+    writer.Key("mix");
+    writer.StartObject();
+    for (int op = 0; op < NUM_OPERATIONS; ++op)
+    {
+        writer.Key(OPERATION_NAMES[op]);
+        writer.Double(config.mix[op]);
+    }
+    writer.EndObject();
+    writer.EndObject();
+
+    std::vector<std::uint64_t> all;
+    StatusCounts total;
+    writer.Key("operations");
+    writer.StartObject();
+    for (int op = 0; op < NUM_OPERATIONS; ++op)
+    {
+        std::vector<std::uint64_t> latencies;
+        StatusCounts counts;
+        for (WorkerResult &result : results)
+        {
+            latencies.insert(latencies.end(), result.latencies[op].begin(),
+                             result.latencies[op].end());
+            const StatusCounts &status = result.status[op];
+            counts.success += status.success;
+            counts.client += status.client;
+            counts.server += status.server;
+            counts.other += status.other;
+            counts.errors += status.errors;
+        }
+        all.insert(all.end(), latencies.begin(), latencies.end());
+        total.success += counts.success;
+        total.client += counts.client;
+        total.server += counts.server;
+        total.other += counts.other;
+        total.errors += counts.errors;
+
+        writer.Key(OPERATION_NAMES[op]);
+        writer.StartObject();
+        writer.Key("requests");
+        writer.Uint64(latencies.size());
+        writer.Key("throughput_rps");
+        writer.Double(latencies.size() / config.duration);
+        writeStatus(writer, counts);
+        writeLatencies(writer, latencies);
+        writer.EndObject();
+    }
+    writer.EndObject();
+
+    std::uint64_t unsent = 0;
+    for (const WorkerResult &result : results)
+    {
+        unsent += result.unsent;
+    }
+    writer.Key("requests");
+    writer.Uint64(all.size());
+    writer.Key("unsent");
+    writer.Uint64(unsent);
+    writer.Key("throughput_rps");
+    writer.Double(all.size() / config.duration);
+    writeStatus(writer, total);
+    writeLatencies(writer, all);
+
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+void run(const Config &config)
+{
+    std::vector<WorkerResult> results(config.connections);
+    std::vector<std::thread> workers;
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point end =
+        start + seconds(config.warmup + config.duration);
+    for (unsigned i = 0; i < config.connections; ++i)
+    {
+        workers.emplace_back(
+            [&, i] { runWorker(config, i, start, end, results[i]); });
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    const std::string json = report(config, results);
+    if (config.output.empty())
+    {
+        std::cout << json << '\n';
+        return;
+    }
+    std::FILE *out = std::fopen(config.output.c_str(), "w");
+    if (out == nullptr)
+    {
+        throw std::runtime_error("Couldn't open " + config.output);
+    }
+    std::fprintf(out, "%s\n", json.c_str());
+    std::fclose(out);
+}
+
+} // namespace
+} // namespace comicsdb
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        comicsdb::run(comicsdb::parseCommandLine(argc, argv));
+    }
+    catch (const std::exception &bang)
+    {
+        std::cerr << bang.what() << '\n';
+        return 1;
+    }
+    catch (...)
+    {
+        return 1;
+    }
+
+    return 0;
+}
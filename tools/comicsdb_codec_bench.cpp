@@ -0,0 +1,389 @@
+// Microbenchmarks for Comic serialization, parsing and validation.
+//
+// Every codec is timed over each synthetic dataset and reported as JSON with
+// ns/op, allocations/op and allocated bytes/op.  Given --baseline, the run is
+// compared against an earlier report and exits with status 1 when any
+// benchmark got slower than the tolerance allows, allocates more or is missing
+// from the baseline, so it can gate CI.
+#include "comic.h"
+#include "synthetic.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+// The benchmark is single threaded, so plain counters suffice.
+std::uint64_t g_allocations{};
+std::uint64_t g_allocatedBytes{};
+
+} // namespace
+
+void *operator new(std::size_t size)
+{
+    ++g_allocations;
+    g_allocatedBytes += size;
+    if (void *block = std::malloc(size == 0 ? 1 : size))
+    {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *block) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void *block, std::size_t) noexcept
+{
+    std::free(block);
+}
+
+namespace comicsdb
+{
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+const char *const USAGE =
+    "Usage: comicsdb_codec_bench [options]\n"
+    "  --records N        records per dataset (default 1000)\n"
+    "  --min-time SECONDS minimum time per repetition (default 0.2)\n"
+    "  --repetitions N    repetitions per benchmark, median reported "
+    "(default 5)\n"
+    "  --filter TEXT      only run benchmarks whose name contains TEXT\n"
+    "  --output PATH      write the JSON report to PATH instead of stdout\n"
+    "  --baseline PATH    compare against an earlier report\n"
+    "  --tolerance F      allowed ns/op slowdown vs. baseline (default 0.10)\n";
+
+struct Config
+{
+    std::size_t records{1000};
+    double minTime{0.2};
+    int repetitions{5};
+    std::string filter;
+    std::string output;
+    std::string baseline;
+    double tolerance{0.10};
+};
+
+struct Fixture
+{
+    std::vector<Comic> comics;
+    std::vector<std::string> json;
+    std::vector<std::string> binary;
+};
+
+struct Codec
+{
+    const char *name;
+    std::function<std::size_t(const Fixture &fixture, std::size_t i)> run;
+};
+
+struct Result
+{
+    std::string name;
+    std::uint64_t iterations;
+    double nsPerOp;
+    double allocsPerOp;
+    double bytesPerOp;
+};
+
+const std::vector<Codec> &codecs()
+{
+    static const std::vector<Codec> all{
+        {"toJson",
+         [](const Fixture &fixture, std::size_t i)
+         { return toJson(fixture.comics[i]).size(); }},
+        {"fromJson",
+         [](const Fixture &fixture, std::size_t i)
+         { return fromJson(fixture.json[i]).title.size(); }},
+        {"toBinary",
+         [](const Fixture &fixture, std::size_t i)
+         { return toBinary(fixture.comics[i]).size(); }},
+        {"fromBinary",
+         [](const Fixture &fixture, std::size_t i)
+         {
+             const std::string &bytes = fixture.binary[i];
+             return fromBinary(bytes.data(), bytes.size()).title.size();
+         }},
+        {"isValid",
+         [](const Fixture &fixture, std::size_t i)
+         { return static_cast<std::size_t>(isValid(fixture.comics[i])); }},
+    };
+    return all;
+}
+
+std::string value(int argc, char *argv[], int &i)
+{
+    if (i + 1 >= argc)
+    {
+        throw std::runtime_error(std::string{"Missing value for "} + argv[i] +
+                                 "\n" + USAGE);
+    }
+    return argv[++i];
+}
+
+Config parseCommandLine(int argc, char *argv[])
+{
+    Config config;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--records")
+        {
+            config.records = std::max(1UL, std::stoul(value(argc, argv, i)));
+        }
+        else if (arg == "--min-time")
+        {
+            config.minTime = std::stod(value(argc, argv, i));
+        }
+        else if (arg == "--repetitions")
+        {
+            config.repetitions = std::max(1, std::stoi(value(argc, argv, i)));
+        }
+        else if (arg == "--filter")
+        {
+            config.filter = value(argc, argv, i);
+        }
+        else if (arg == "--output")
+        {
+            config.output = value(argc, argv, i);
+        }
+        else if (arg == "--baseline")
+        {
+            config.baseline = value(argc, argv, i);
+        }
+        else if (arg == "--tolerance")
+        {
+            config.tolerance = std::stod(value(argc, argv, i));
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg + "\n" + USAGE);
+        }
+    }
+    return config;
+}
+
+volatile std::size_t g_sink;
+
+Result measure(const std::string &name, const Codec &codec,
+               const Fixture &fixture, const Config &config)
+{
+    const std::size_t count = fixture.comics.size();
+    const auto minTime = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(config.minTime));
+
+    // warm caches and any lazily initialized state
+    std::size_t sink = 0;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        sink += codec.run(fixture, i);
+    }
+
+    std::vector<Result> repetitions;
+    for (int rep = 0; rep < config.repetitions; ++rep)
+    {
+        const std::uint64_t allocations = g_allocations;
+        const std::uint64_t bytes = g_allocatedBytes;
+        std::uint64_t iterations = 0;
+        const Clock::time_point start = Clock::now();
+        Clock::time_point now = start;
+        while (now - start < minTime)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                sink += codec.run(fixture, i);
+            }
+            iterations += count;
+            now = Clock::now();
+        }
+        const double ns = static_cast<double>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - start)
+                .count());
+        repetitions.push_back(
+            {name, iterations, ns / iterations,
+             static_cast<double>(g_allocations - allocations) / iterations,
+             static_cast<double>(g_allocatedBytes - bytes) / iterations});
+    }
+    g_sink = sink;
+
+    std::sort(repetitions.begin(), repetitions.end(),
+              [](const Result &lhs, const Result &rhs)
+              { return lhs.nsPerOp < rhs.nsPerOp; });
+    return repetitions[repetitions.size() / 2];
+}
+
+std::string report(const Config &config, const std::vector<Result> &results)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("records");
+    writer.Uint64(config.records);
+    writer.Key("benchmarks");
+    writer.StartArray();
+    for (const Result &result : results)
+    {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(result.name.c_str());
+        writer.Key("iterations");
+        writer.Uint64(result.iterations);
+        writer.Key("ns_per_op");
+        writer.Double(result.nsPerOp);
+        writer.Key("allocs_per_op");
+        writer.Double(result.allocsPerOp);
+        writer.Key("bytes_per_op");
+        writer.Double(result.bytesPerOp);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return buffer.GetString();
+}
+
+bool compareToBaseline(const Config &config,
+                       const std::vector<Result> &results)
+{
+    std::ifstream in(config.baseline);
+    if (!in)
+    {
+        throw std::runtime_error("Couldn't open baseline " + config.baseline);
+    }
+    const std::string text{std::istreambuf_iterator<char>(in),
+                           std::istreambuf_iterator<char>()};
+    rapidjson::Document baseline;
+    baseline.Parse(text.c_str());
+    if (baseline.HasParseError() || !baseline.IsObject() ||
+        !baseline.HasMember("benchmarks") || !baseline["benchmarks"].IsArray())
+    {
+        throw std::runtime_error("Invalid baseline " + config.baseline);
+    }
+
+    // ns/op and allocs/op by benchmark name.
+    std::map<std::string, std::pair<double, double>> expected;
+    const rapidjson::Value &benchmarks = baseline["benchmarks"];
+    for (rapidjson::SizeType i = 0; i < benchmarks.Size(); ++i)
+    {
+        const rapidjson::Value &entry = benchmarks[i];
+        if (!entry.IsObject() || !entry.HasMember("name") ||
+            !entry["name"].IsString() || !entry.HasMember("ns_per_op") ||
+            !entry["ns_per_op"].IsNumber() ||
+            !entry.HasMember("allocs_per_op") ||
+            !entry["allocs_per_op"].IsNumber())
+        {
+            throw std::runtime_error("Invalid benchmark " +
+                                     std::to_string(i) + " in baseline " +
+                                     config.baseline);
+        }
+        expected[entry["name"].GetString()] = {
+            entry["ns_per_op"].GetDouble(), entry["allocs_per_op"].GetDouble()};
+    }
+
+    bool passed = true;
+    for (const Result &result : results)
+    {
+        const auto it = expected.find(result.name);
+        if (it == expected.end())
+        {
+            // A benchmark that isn't in the baseline can't be shown not to
+            // have regressed.
+            std::fprintf(stderr, "%-24s %10.1f ns/op  MISSING FROM BASELINE\n",
+                         result.name.c_str(), result.nsPerOp);
+            passed = false;
+            continue;
+        }
+        const double ns = it->second.first;
+        const double allocs = it->second.second;
+        const bool slower = result.nsPerOp > ns * (1.0 + config.tolerance);
+        const bool allocates = result.allocsPerOp > allocs + 0.01;
+        std::fprintf(stderr, "%-24s %10.1f ns/op (baseline %10.1f) "
+                             "%6.2f allocs/op (baseline %6.2f)%s\n",
+                     result.name.c_str(), result.nsPerOp, ns,
+                     result.allocsPerOp, allocs,
+                     slower || allocates ? "  REGRESSION" : "");
+        passed = passed && !slower && !allocates;
+    }
+    return passed;
+}
+
+bool run(const Config &config)
+{
+    const Dataset datasets[] = {Dataset::SHORT, Dataset::LONG,
+                                Dataset::UNICODE, Dataset::ESCAPES};
+    std::vector<Result> results;
+    for (Dataset dataset : datasets)
+    {
+        Fixture fixture;
+        fixture.comics = makeDataset(dataset, config.records, 1);
+        for (const Comic &comic : fixture.comics)
+        {
+            fixture.json.push_back(toJson(comic));
+            fixture.binary.push_back(toBinary(comic));
+        }
+
+        for (const Codec &codec : codecs())
+        {
+            const std::string name =
+                std::string{codec.name} + '/' + datasetName(dataset);
+            if (name.find(config.filter) == std::string::npos)
+            {
+                continue;
+            }
+            results.push_back(measure(name, codec, fixture, config));
+        }
+    }
+
+    const std::string json = report(config, results);
+    if (config.output.empty())
+    {
+        std::cout << json << '\n';
+    }
+    else
+    {
+        std::ofstream(config.output) << json << '\n';
+    }
+
+    return config.baseline.empty() || compareToBaseline(config, results);
+}
+
+} // namespace
+} // namespace comicsdb
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        return comicsdb::run(comicsdb::parseCommandLine(argc, argv)) ? 0 : 1;
+    }
+    catch (const std::exception &bang)
+    {
+        std::cerr << bang.what() << '\n';
+        return 1;
+    }
+    catch (...)
+    {
+        return 1;
+    }
+}
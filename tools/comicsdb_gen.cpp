@@ -0,0 +1,145 @@
+// Synthetic catalog generator.
+//
+// Writes realistic comic records in the server's JSON lines import format,
+// one toJson object per line, suitable for comicsdb --preload.
+#include "comic.h"
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace comicsdb
+{
+namespace
+{
+
+const char *const USAGE =
+    "Usage: comicsdb_gen [options]\n"
+    "  --records N     number of records (default 1000000)\n"
+    "  --creators N    size of the creator pool (default 100000)\n"
+    "  --skew S        Zipf exponent of creator popularity (default 1.1)\n"
+    "  --max-run N     longest series run (default 900)\n"
+    "  --seed N        random seed (default 1)\n"
+    "  --output PATH   write to PATH instead of stdout\n";
+
+struct Config
+{
+    std::uint64_t records{1000000};
+    CatalogConfig catalog;
+    std::uint64_t seed{1};
+    std::string output;
+};
+
+std::string value(int argc, char *argv[], int &i)
+{
+    if (i + 1 >= argc)
+    {
+        throw std::runtime_error(std::string{"Missing value for "} + argv[i] +
+                                 "\n" + USAGE);
+    }
+    return argv[++i];
+}
+
+Config parseCommandLine(int argc, char *argv[])
+{
+    Config config;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--records")
+        {
+            config.records = std::stoull(value(argc, argv, i));
+        }
+        else if (arg == "--creators")
+        {
+            config.catalog.creators =
+                std::max(1UL, std::stoul(value(argc, argv, i)));
+        }
+        else if (arg == "--skew")
+        {
+            config.catalog.creatorSkew = std::stod(value(argc, argv, i));
+        }
+        else if (arg == "--max-run")
+        {
+            config.catalog.maxSeriesLength =
+                std::max(1UL, std::stoul(value(argc, argv, i)));
+        }
+        else if (arg == "--seed")
+        {
+            config.seed = std::stoull(value(argc, argv, i));
+        }
+        else if (arg == "--output")
+        {
+            config.output = value(argc, argv, i);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + arg + "\n" + USAGE);
+        }
+    }
+    return config;
+}
+
+void run(const Config &config)
+{
+    std::FILE *out = stdout;
+    if (!config.output.empty())
+    {
+        out = std::fopen(config.output.c_str(), "w");
+        if (out == nullptr)
+        {
+            throw std::runtime_error("Couldn't open " + config.output);
+        }
+    }
+    static char buffer[1 << 20];
+    std::setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+
+    CatalogGenerator generator(config.catalog, config.seed);
+    for (std::uint64_t i = 0; i < config.records; ++i)
+    {
+        const std::string json = toJson(generator.next());
+        std::fwrite(json.data(), 1, json.size(), out);
+        std::fputc('\n', out);
+        if ((i + 1) % 1000000 == 0)
+        {
+            std::fprintf(stderr, "%llu records\n",
+                         static_cast<unsigned long long>(i + 1));
+        }
+    }
+
+    const bool failed = std::fflush(out) != 0 || std::ferror(out) != 0;
+    if (out != stdout)
+    {
+        std::fclose(out);
+    }
+    if (failed)
+    {
+        throw std::runtime_error("Error writing catalog");
+    }
+}
+
+} // namespace
+} // namespace comicsdb
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        comicsdb::run(comicsdb::parseCommandLine(argc, argv));
+    }
+    catch (const std::exception &bang)
+    {
+        std::cerr << bang.what() << '\n';
+        return 1;
+    }
+    catch (...)
+    {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,280 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace comicsdb
+{
+
+namespace
+{
+
+const char *const FIRST_NAMES[] = {"Stan",  "Jack",  "Steve", "John",
+                                   "Sol",   "Joe",   "Artie", "Gene",
+                                   "Frank", "Chris", "Walt",  "Roy"};
+const char *const LAST_NAMES[] = {"Lee",     "Kirby",   "Ditko",  "Romita",
+                                  "Brodsky", "Sinnott", "Simek",  "Colan",
+                                  "Miller",  "Claremont", "Simonson", "Thomas"};
+const char *const UNICODE_NAMES[] = {
+    "Jean Giraud Mœbius", "Hergé",        "手塚 治虫",     "鳥山 明",
+    "Milo Manara",        "Śnieżka Żółć", "Ümit Özdemir", "Ολυμπία",
+    "Кирилл Ерёмин",      "🦸 Hero 🦹",   "محمد",         "김 동화"};
+const char *const ESCAPE_NAMES[] = {
+    "\"Smilin'\" Stan",     "Back\\slash",       "Tab\tSeparated",
+    "Line\nBreak",          "Bell\x07Ringer",    "Quote \"\" Twice",
+    "C:\\comics\\inks",     "Carriage\rReturn", "Form\fFeed",
+    "Null\x01" "Byte Adjacent", "Mixed \"\\\n\t\"", "Solidus / Slash"};
+
+const char *const CREATOR_FIRST[] = {
+    "Stan",   "Jack",   "Steve",   "John",    "Sol",     "Joe",
+    "Artie",  "Gene",   "Frank",   "Chris",   "Walt",    "Roy",
+    "Jim",    "Neal",   "Bernie",  "Marv",    "Len",     "Denny",
+    "Alan",   "Dave",   "Grant",   "Gail",    "Louise",  "Ann",
+    "Marie",  "Ramona", "Jo",      "Trina",   "Fiona",   "Kelly",
+    "Bill",   "Carmine", "Wally",  "Dick",    "Murphy",  "Archie",
+    "Bartholomew", "Maximilian", "Christopher", "Alexandra"};
+const char *const CREATOR_LAST[] = {
+    "Lee",      "Kirby",    "Ditko",     "Romita",   "Brodsky",
+    "Sinnott",  "Simek",    "Colan",     "Miller",   "Claremont",
+    "Simonson", "Thomas",   "Buscema",   "Adams",    "Wrightson",
+    "Wolfman",  "Wein",     "O'Neil",    "Moore",    "Gibbons",
+    "Morrison", "Simone",   "Nocenti",   "Robbins",  "Severin",
+    "Fornes",   "Duffy",    "Staples",   "Thompson", "Infantino",
+    "Wood",     "Giordano", "Anderson",  "Goodwin",  "Sienkiewicz",
+    "Windsor-Smith", "Dell'Otto", "Mignola", "Campbell", "Quesada"};
+const char *const TITLE_PREFIX[] = {
+    "The Amazing", "The Uncanny",   "The Mighty",     "Incredible",
+    "Astonishing", "Tales of the",  "Adventures of",  "The Savage",
+    "Strange",     "Secret",        "The Spectacular", "Marvelous",
+    "Weird",       "Untold Tales of", "All-New",      "The Brave and"};
+const char *const TITLE_NOUN[] = {
+    "Spider-Man", "X-Men",       "Thor",     "Hulk",       "Avengers",
+    "Fantastic Four", "Daredevil", "Defenders", "Titans",  "Detective",
+    "Swamp Thing", "Sandman",    "Watchmen", "Doom Patrol", "Legion",
+    "Guardians",  "Inhumans",    "Eternals", "Champions",  "Invaders",
+    "Shadow",     "Phantom",     "Vision",   "Ghost Rider", "Nova",
+    "Hellblazer", "Starman",     "Flash",    "Lantern",    "Atom"};
+const char *const TITLE_SUFFIX[] = {"",
+                                    " Annual",
+                                    " Unlimited",
+                                    " Team-Up",
+                                    " Presents",
+                                    " and the Legion of Super-Heroes",
+                                    " Adventures",
+                                    " Special"};
+
+template <typename T, std::size_t N>
+const char *pick(T (&names)[N], std::mt19937_64 &random)
+{
+    return names[random() % N];
+}
+
+std::string shortName(std::mt19937_64 &random)
+{
+    return std::string{pick(FIRST_NAMES, random)} + ' ' +
+           pick(LAST_NAMES, random);
+}
+
+std::string longName(std::mt19937_64 &random)
+{
+    std::string name;
+    const std::size_t length = 200 + random() % 2800;
+    while (name.size() < length)
+    {
+        name += shortName(random);
+        name += ", ";
+    }
+    name.resize(length);
+    return name;
+}
+
+std::string name(Dataset dataset, std::mt19937_64 &random)
+{
+    switch (dataset)
+    {
+    case Dataset::SHORT:
+        return shortName(random);
+    case Dataset::LONG:
+        return longName(random);
+    case Dataset::UNICODE:
+        return pick(UNICODE_NAMES, random);
+    case Dataset::ESCAPES:
+        return pick(ESCAPE_NAMES, random);
+    }
+    return {};
+}
+
+template <typename T, std::size_t N>
+constexpr std::size_t count(T (&)[N])
+{
+    return N;
+}
+
+} // namespace
+
+const char *datasetName(Dataset dataset)
+{
+    switch (dataset)
+    {
+    case Dataset::SHORT:
+        return "short";
+    case Dataset::LONG:
+        return "long";
+    case Dataset::UNICODE:
+        return "unicode";
+    case Dataset::ESCAPES:
+        return "escapes";
+    }
+    return "unknown";
+}
+
+std::vector<Comic> makeDataset(Dataset dataset, std::size_t count,
+                               std::uint64_t seed)
+{
+    std::mt19937_64 random(seed);
+    std::vector<Comic> comics;
+    comics.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        Comic comic;
+        comic.title = name(dataset, random) + " Comics";
+        comic.issue = static_cast<int>(random() % 700 + 1);
+        comic.writer = name(dataset, random);
+        comic.penciler = name(dataset, random);
+        comic.inker = name(dataset, random);
+        comic.letterer = name(dataset, random);
+        comic.colorist = name(dataset, random);
+        comics.push_back(std::move(comic));
+    }
+    return comics;
+}
+
+ZipfDistribution::ZipfDistribution(std::size_t n, double exponent)
+{
+    m_cdf.reserve(n);
+    double sum = 0.0;
+    for (std::size_t rank = 1; rank <= n; ++rank)
+    {
+        sum += 1.0 / std::pow(static_cast<double>(rank), exponent);
+        m_cdf.push_back(sum);
+    }
+    for (double &p : m_cdf)
+    {
+        p /= sum;
+    }
+}
+
+std::size_t ZipfDistribution::operator()(std::mt19937_64 &random) const
+{
+    const double u = std::generate_canonical<double, 53>(random);
+    const auto it = std::lower_bound(m_cdf.begin(), m_cdf.end(), u);
+    return std::min<std::size_t>(it - m_cdf.begin(), m_cdf.size() - 1);
+}
+
+std::string creatorName(std::size_t rank)
+{
+    const std::size_t firsts = count(CREATOR_FIRST);
+    const std::size_t lasts = count(CREATOR_LAST);
+    const std::size_t first = rank % firsts;
+    rank /= firsts;
+    // skew the last name by the first so popular ranks don't share one
+    const std::size_t last = (rank + first * 7) % lasts;
+    rank /= lasts;
+    std::string name = CREATOR_FIRST[first];
+    if (rank > 0)
+    {
+        name += ' ';
+        name += static_cast<char>('A' + (rank - 1) % 26);
+        name += '.';
+        rank = (rank - 1) / 26;
+    }
+    name += ' ';
+    name += CREATOR_LAST[last];
+    if (rank > 0)
+    {
+        name += ' ' + std::to_string(rank + 1);
+    }
+    return name;
+}
+
+std::string seriesTitle(std::size_t series)
+{
+    const std::size_t prefixes = count(TITLE_PREFIX);
+    const std::size_t nouns = count(TITLE_NOUN);
+    const std::size_t suffixes = count(TITLE_SUFFIX);
+    std::string title = TITLE_PREFIX[series % prefixes];
+    series /= prefixes;
+    title += ' ';
+    title += TITLE_NOUN[series % nouns];
+    series /= nouns;
+    title += TITLE_SUFFIX[series % suffixes];
+    series /= suffixes;
+    if (series > 0)
+    {
+        title += " Vol. " + std::to_string(series + 1);
+    }
+    return title;
+}
+
+CatalogGenerator::CatalogGenerator(const CatalogConfig &config,
+                                   std::uint64_t seed) :
+    m_config(config),
+    m_random(seed),
+    m_creators(config.creators, config.creatorSkew)
+{
+}
+
+std::string CatalogGenerator::creator()
+{
+    return creatorName(m_creators(m_random));
+}
+
+void CatalogGenerator::startSeries()
+{
+    // Pareto distributed run length with shape 0.7: half the series are
+    // minis of two or three issues, one in a hundred runs for 700 or more.
+    const double u = 1.0 - std::generate_canonical<double, 53>(m_random);
+    const double length = std::ceil(std::pow(u, -1.0 / 0.7));
+    m_remaining = static_cast<std::size_t>(
+        std::min(length, static_cast<double>(m_config.maxSeriesLength)));
+    m_team.title = seriesTitle(m_series++);
+    m_team.issue = 0;
+    m_team.writer = creator();
+    m_team.penciler = creator();
+    m_team.inker = creator();
+    m_team.letterer = creator();
+    m_team.colorist = creator();
+}
+
+Comic CatalogGenerator::next()
+{
+    if (m_remaining == 0)
+    {
+        startSeries();
+    }
+    --m_remaining;
+    ++m_team.issue;
+
+    // Each role turns over every 30 issues or so.
+    std::string *const roles[] = {&m_team.writer, &m_team.penciler,
+                                  &m_team.inker, &m_team.letterer,
+                                  &m_team.colorist};
+    for (std::string *role : roles)
+    {
+        if (m_random() % 30 == 0)
+        {
+            *role = creator();
+        }
+    }
+
+    // One issue in twenty has a fill-in artist.
+    Comic comic = m_team;
+    if (m_random() % 20 == 0)
+    {
+        comic.penciler = creator();
+        comic.inker = creator();
+    }
+    return comic;
+}
+
+} // namespace comicsdb
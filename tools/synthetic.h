@@ -0,0 +1,75 @@
+#pragma once
+
+#include "comic.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace comicsdb
+{
+
+// Shapes of synthetic records used to exercise the codecs.
+enum class Dataset
+{
+    SHORT,   // short ASCII names, as in the sample catalog
+    LONG,    // fields of several hundred to a few thousand characters
+    UNICODE, // multi-byte UTF-8 names
+    ESCAPES  // quotes, backslashes and control characters needing escapes
+};
+
+const char *datasetName(Dataset dataset);
+std::vector<Comic> makeDataset(Dataset dataset, std::size_t count,
+                               std::uint64_t seed);
+
+// Samples ranks 0..n-1 with probability proportional to 1/(rank+1)^exponent.
+class ZipfDistribution
+{
+  public:
+    ZipfDistribution(std::size_t n, double exponent);
+
+    std::size_t operator()(std::mt19937_64 &random) const;
+
+  private:
+    std::vector<double> m_cdf;
+};
+
+struct CatalogConfig
+{
+    std::size_t creators{100000};
+    double creatorSkew{1.1};
+    std::size_t maxSeriesLength{900};
+};
+
+// Unique, deterministic creator name for a popularity rank.
+std::string creatorName(std::size_t rank);
+
+// Unique, deterministic series title for a series number.
+std::string seriesTitle(std::size_t series);
+
+// Produces an endless stream of realistic catalog records, series by series.
+// Issues of a series are numbered consecutively and share a creative team,
+// drawn from a Zipf distribution over creators, which changes every few dozen
+// issues.  Series lengths are heavy tailed: mostly short runs with a few
+// series running for hundreds of issues.
+class CatalogGenerator
+{
+  public:
+    CatalogGenerator(const CatalogConfig &config, std::uint64_t seed);
+
+    Comic next();
+
+  private:
+    void startSeries();
+    std::string creator();
+
+    CatalogConfig m_config;
+    std::mt19937_64 m_random;
+    ZipfDistribution m_creators;
+    std::size_t m_series{};
+    std::size_t m_remaining{};
+    Comic m_team;
+};
+
+} // namespace comicsdb